@@ -1,12 +1,13 @@
 #include <lwk/types.h>
 #include <lwk/print.h>
+#include <lwk/memops.h>
 
 extern void
 serial_num(unsigned long long num);
 
 extern bool _can_print;
 
-void *memcpy(void *dest, const void *src, size_t count)
+void *memcpy_bytes(void *dest, const void *src, size_t count)
 {
 	char *tmp = dest;
 	const char *s = src;
@@ -15,3 +16,56 @@ void *memcpy(void *dest, const void *src, size_t count)
 		*tmp++ = *s++;
 	return dest;
 }
+
+/*
+ * 32 bytes per iteration through general purpose registers, once both
+ * pointers are 8-byte aligned. Pointers that can't both be aligned are
+ * copied bytewise, so this is safe on memory without unaligned access.
+ */
+void *memcpy_words(void *dest, const void *src, size_t count)
+{
+	char *tmp = dest;
+	const char *s = src;
+	u64 *d8;
+	const u64 *s8;
+
+	if (((unsigned long)tmp ^ (unsigned long)s) & 7)
+		return memcpy_bytes(dest, src, count);
+
+	while (((unsigned long)tmp & 7) && count) {
+		*tmp++ = *s++;
+		count--;
+	}
+
+	d8 = (u64 *)tmp;
+	s8 = (const u64 *)s;
+	while (count >= 32) {
+		u64 a = s8[0], b = s8[1], c = s8[2], e = s8[3];
+
+		d8[0] = a;
+		d8[1] = b;
+		d8[2] = c;
+		d8[3] = e;
+		d8 += 4;
+		s8 += 4;
+		count -= 32;
+	}
+
+	while (count >= 8) {
+		*d8++ = *s8++;
+		count -= 8;
+	}
+
+	memcpy_bytes(d8, s8, count);
+	return dest;
+}
+
+/* memops_init() picks the variant for each size class, see memops.c */
+void *(*memcpy_class[MEMCPY_CLASSES])(void *, const void *, size_t) = {
+	[0 ... MEMCPY_CLASSES - 1] = memcpy_bytes,
+};
+
+void *memcpy(void *dest, const void *src, size_t count)
+{
+	return memcpy_class[memcpy_size_class(count)](dest, src, count);
+}
@@ -0,0 +1,25 @@
+/*
+ * arm64 memcpy() and checksum variants for memops_init() to choose from.
+ *
+ * There is no kernel-mode NEON yet (nothing saves the task's FP/SIMD state
+ * around kernel use of the vector registers), so these are general
+ * purpose register variants only.
+ */
+#include <lwk/kernel.h>
+#include <lwk/memops.h>
+
+extern void *memcpy_bytes(void *dst, const void *src, size_t len);
+extern void *memcpy_words(void *dst, const void *src, size_t len);
+
+const struct memcpy_impl arch_memcpy_impls[] = {
+	{ "bytes",	memcpy_bytes,	NULL,	0 },
+	{ "words",	memcpy_words,	NULL,	0 },
+};
+
+const unsigned int arch_memcpy_nr = ARRAY_SIZE(arch_memcpy_impls);
+
+const struct csum_impl arch_csum_impls[] = {
+	{ "generic",	csum_generic,	NULL,	0 },
+};
+
+const unsigned int arch_csum_nr = ARRAY_SIZE(arch_csum_impls);
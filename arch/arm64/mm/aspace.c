@@ -564,7 +564,8 @@ arch_aspace_unsmartmap(struct aspace *src, struct aspace *dst,
 extern bool _can_print;
 
 int
-arch_aspace_virt_to_phys(struct aspace *aspace, vaddr_t vaddr, paddr_t *paddr)
+arch_aspace_lookup_page(struct aspace *aspace, vaddr_t vaddr,
+                        paddr_t *paddr, vmpagesize_t *pagesz)
 {
 	xpte_t *pgd = NULL;	/* Page Global Directory: level 0 (root of tree) */
 	xpte_t *pud = NULL;	/* Page Upper Directory:  level 1 */
@@ -577,6 +578,7 @@ arch_aspace_virt_to_phys(struct aspace *aspace, vaddr_t vaddr, paddr_t *paddr)
 	xpte_t *pte;	/* Page Table Directory Entry */
 
 	paddr_t result; /* The result of the translation */
+	vmpagesize_t size = VM_PAGE_4KB; /* Size of the page mapping vaddr */
 
 	/* Calculate indices into above directories based on vaddr specified */
 	unsigned int pgd_index = (vaddr >> 39) & 0x1FF;
@@ -638,6 +640,7 @@ arch_aspace_virt_to_phys(struct aspace *aspace, vaddr_t vaddr, paddr_t *paddr)
 		if (!pue->type) {
 			result = ((uint64_t)(((xpte_1GB_t *)pue)->base_paddr << 30))
 		        				 | (vaddr & 0x3FFFFFFFull);
+			size   = VM_PAGE_1GB;
 			goto out;
 		}
 		pmd = __va(pue->base_paddr << 12);
@@ -651,6 +654,7 @@ arch_aspace_virt_to_phys(struct aspace *aspace, vaddr_t vaddr, paddr_t *paddr)
 		if (!pme->type) {
 			result = ((uint64_t)(((xpte_2MB_t *)pme)->base_paddr) << 21)
 		        						 | (vaddr & 0x1FFFFFull);
+			size   = VM_PAGE_2MB;
 			goto out;
 		}
 	}
@@ -666,9 +670,17 @@ arch_aspace_virt_to_phys(struct aspace *aspace, vaddr_t vaddr, paddr_t *paddr)
 	out:
 	if (paddr)
 		*paddr = result;
+	if (pagesz)
+		*pagesz = size;
 	return 0;
 }
 
+int
+arch_aspace_virt_to_phys(struct aspace *aspace, vaddr_t vaddr, paddr_t *paddr)
+{
+	return arch_aspace_lookup_page(aspace, vaddr, paddr, NULL);
+}
+
 
 /**
  * This maps a region of physical memory into the kernel virtual address space.
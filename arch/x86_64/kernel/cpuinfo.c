@@ -465,6 +465,13 @@ early_identify_cpu(struct cpuinfo *c)
 		&a->x86_capability[0]  /* cpu features */
 	);
 
+	/* Structured extended features (AVX2, ERMS, ...) */
+	if (a->cpuid_level >= 7) {
+		unsigned int eax, ecx, edx;
+
+		cpuid_count(7, 0, &eax, &a->x86_capability[9], &ecx, &edx);
+	}
+
 	/* Determine the CPU family */
 	a->x86_family = (tfms >> 8) & 0xf;
 	if (a->x86_family == 0xf)
@@ -770,7 +777,7 @@ print_arch_cpuinfo(struct cpuinfo *c)
 
 	/* CPU Features */
 	buf[0] = '\0';
-	for (i = 0; i < 32*NCAPINTS; i++) {
+	for (i = 0; i < ARRAY_SIZE(x86_cap_flags); i++) {
 		if (cpu_has(c, i) && x86_cap_flags[i] != NULL) {
 			strcat(buf, x86_cap_flags[i]);
 			strcat(buf, " ");
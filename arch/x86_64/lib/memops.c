@@ -0,0 +1,97 @@
+/*
+ * x86_64 memcpy() and checksum variants for memops_init() to choose from.
+ *
+ * The vector variants save the current task's FPU state around their use
+ * of the SIMD registers, which costs a few hundred cycles, so they are only
+ * offered for the larger classes and the benchmark decides whether they
+ * pay off there. The state save is FXSAVE, which does not cover the upper
+ * halves of the YMM registers; those are caller-saved across function
+ * calls, system calls included, so only interrupt context has to stay
+ * off them. There the variants fall back to the string instructions.
+ */
+#include <lwk/kernel.h>
+#include <lwk/interrupt.h>
+#include <lwk/memops.h>
+#include <lwk/cpuinfo.h>
+#include <arch/cpufeature.h>
+#include <arch/i387.h>
+
+extern void *memcpy_unrolled(void *dst, const void *src, size_t len);
+extern void *memcpy_movsq(void *dst, const void *src, size_t len);
+extern void *memcpy_erms(void *dst, const void *src, size_t len);
+extern void *__memcpy_avx2_nt(void *dst, const void *src, size_t len);
+extern u64 __csum_avx2_blocks(const void *buf, unsigned long nblocks);
+
+
+static bool
+has_rep_good(void)
+{
+	return boot_cpu_has(X86_FEATURE_REP_GOOD);
+}
+
+static bool
+has_erms(void)
+{
+	return boot_cpu_has(X86_FEATURE_ERMS);
+}
+
+/* fpu_init() enables the YMM state whenever the CPU has AVX */
+static bool
+has_avx2(void)
+{
+	return boot_cpu_has(X86_FEATURE_AVX) &&
+	       boot_cpu_has(X86_FEATURE_AVX2);
+}
+
+
+static void *
+memcpy_avx2(void *dst, const void *src, size_t len)
+{
+	if (in_interrupt() || len < 128)
+		return memcpy_movsq(dst, src, len);
+
+	kernel_fpu_begin();
+	__memcpy_avx2_nt(dst, src, len);
+	kernel_fpu_end();
+
+	return dst;
+}
+
+const struct memcpy_impl arch_memcpy_impls[] = {
+	{ "unrolled",	memcpy_unrolled,	NULL,		0 },
+	{ "movsq",	memcpy_movsq,		has_rep_good,	0 },
+	{ "erms",	memcpy_erms,		has_erms,	0 },
+	{ "avx2-nt",	memcpy_avx2,		has_avx2,	2 },
+};
+
+const unsigned int arch_memcpy_nr = ARRAY_SIZE(arch_memcpy_impls);
+
+
+/*
+ * The blocks are summed relative to buf, whatever its alignment, so the
+ * (even length) block sum and the sum of the tail just add up.
+ */
+static u16
+csum_avx2(const void *buf, int len)
+{
+	int blocks = len / 32;
+	u64 sum;
+
+	if (in_interrupt() || len < CSUM_CLASS1)
+		return csum_generic(buf, len);
+
+	kernel_fpu_begin();
+	sum = __csum_avx2_blocks(buf, blocks);
+	kernel_fpu_end();
+
+	sum += csum_generic((const u8 *)buf + blocks * 32, len - blocks * 32);
+
+	return csum_fold64(sum);
+}
+
+const struct csum_impl arch_csum_impls[] = {
+	{ "generic",	csum_generic,		NULL,		0 },
+	{ "avx2",	csum_avx2,		has_avx2,	1 },
+};
+
+const unsigned int arch_csum_nr = ARRAY_SIZE(arch_csum_impls);
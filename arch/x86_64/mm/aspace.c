@@ -466,7 +466,8 @@ arch_aspace_unsmartmap(struct aspace *src, struct aspace *dst,
 }
 
 int
-arch_aspace_virt_to_phys(struct aspace *aspace, vaddr_t vaddr, paddr_t *paddr)
+arch_aspace_lookup_page(struct aspace *aspace, vaddr_t vaddr,
+                        paddr_t *paddr, vmpagesize_t *pagesz)
 {
 	xpte_t *pgd;	/* Page Global Directory: level 0 (root of tree) */
 	xpte_t *pud;	/* Page Upper Directory:  level 1 */
@@ -479,6 +480,7 @@ arch_aspace_virt_to_phys(struct aspace *aspace, vaddr_t vaddr, paddr_t *paddr)
 	xpte_t *pte;	/* Page Table Directory Entry */
 
 	paddr_t result; /* The result of the translation */
+	vmpagesize_t size; /* Size of the page mapping vaddr */
 
 	/* Calculate indices into above directories based on vaddr specified */
 	const unsigned int pgd_index = (vaddr >> 39) & 0x1FF;
@@ -499,6 +501,7 @@ arch_aspace_virt_to_phys(struct aspace *aspace, vaddr_t vaddr, paddr_t *paddr)
 		return -ENOENT;
 	if (pue->pagesize) {
 		result = xpte_1GB_paddr((xpte_1GB_t *)pue) | (vaddr & 0x3FFFFFFF);
+		size   = VM_PAGE_1GB;
 		goto out;
 	}
 
@@ -509,6 +512,7 @@ arch_aspace_virt_to_phys(struct aspace *aspace, vaddr_t vaddr, paddr_t *paddr)
 		return -ENOENT;
 	if (pme->pagesize) {
 		result = xpte_2MB_paddr((xpte_2MB_t *)pme) | (vaddr & 0x1FFFFF);
+		size   = VM_PAGE_2MB;
 		goto out;
 	}
 
@@ -518,13 +522,22 @@ arch_aspace_virt_to_phys(struct aspace *aspace, vaddr_t vaddr, paddr_t *paddr)
 	if (!pte->present)
 		return -ENOENT;
 	result = xpte_4KB_paddr((xpte_4KB_t *)pte) | (vaddr & 0xFFF);
+	size   = VM_PAGE_4KB;
 
 out:
 	if (paddr)
 		*paddr = result;
+	if (pagesz)
+		*pagesz = size;
 	return 0;
 }
 
+int
+arch_aspace_virt_to_phys(struct aspace *aspace, vaddr_t vaddr, paddr_t *paddr)
+{
+	return arch_aspace_lookup_page(aspace, vaddr, paddr, NULL);
+}
+
 
 /**
  * This maps a region of physical memory into the kernel virtual address space.
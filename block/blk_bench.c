@@ -0,0 +1,232 @@
+/*
+ * Block layer microbenchmark
+ *
+ * Reads 4KB blocks at random offsets from one block device at boot,
+ * keeping 1, 2, 4, ... up to the device's queue depth requests in flight,
+ * and reports IOPS for each depth. A last round reads sequentially
+ * through a plug to show what request merging buys.
+ *
+ * Only reads are issued, the device contents are left alone.
+ */
+
+#include <lwk/kernel.h>
+#include <lwk/driver.h>
+#include <lwk/kthread.h>
+#include <lwk/sched.h>
+#include <lwk/params.h>
+#include <lwk/time.h>
+#include <lwk/blkdev.h>
+
+#define BENCH_MAX_DEPTH		128
+#define BENCH_BLOCK_SIZE	PAGE_SIZE
+#define BENCH_IOS		20000	/* per round */
+#define BENCH_SPAN		(1024ULL * 1024 * 1024)	/* random offsets below this */
+
+static char bench_dev[32] = "sata-0";
+param_string(blk_bench_dev, bench_dev, sizeof(bench_dev));
+
+struct bench_slot {
+	blk_req_t	req;
+	blk_dma_desc_t	desc;
+	void *		buf;
+	volatile int	busy;
+};
+
+static struct bench_slot slots[BENCH_MAX_DEPTH];
+static blkdev_handle_t	 bench_blkdev;
+static u64		 bench_nr_blocks;
+
+
+static inline u32
+xorshift(u32 * seed)
+{
+	u32 x = *seed;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+
+	return (*seed = x);
+}
+
+/* Interrupt context */
+static void
+bench_end_io(blk_req_t * req, int status)
+{
+	struct bench_slot * slot = req->end_io_data;
+
+	slot->busy = 0;
+}
+
+static void
+bench_prep(struct bench_slot * slot, u64 offset)
+{
+	memset(&(slot->req), 0, sizeof(blk_req_t));
+
+	slot->desc.buf_paddr	= __pa(slot->buf);
+	slot->desc.length	= BENCH_BLOCK_SIZE;
+
+	slot->req.total_len	= BENCH_BLOCK_SIZE;
+	slot->req.offset	= offset;
+	slot->req.desc_cnt	= 1;
+	slot->req.dma_descs	= &(slot->desc);
+	slot->req.end_io	= bench_end_io;
+	slot->req.end_io_data	= slot;
+
+	slot->busy = 1;
+}
+
+static void
+bench_report(const char * name, int depth, u64 ios, int errors, ktime_t elapsed)
+{
+	printk(KERN_INFO "BLK bench: %s %-10s depth %3d, %llu IOs in %llu us, %llu IOPS, %llu KB/s, %d errors\n",
+	       bench_dev, name, depth,
+	       (unsigned long long)ios,
+	       (unsigned long long)(elapsed / 1000),
+	       (unsigned long long)((elapsed) ? (ios * NSEC_PER_SEC) / elapsed : 0),
+	       (unsigned long long)((elapsed) ? (ios * (BENCH_BLOCK_SIZE / 1024) * NSEC_PER_SEC) / elapsed : 0),
+	       errors);
+}
+
+static void
+bench_random_round(int depth)
+{
+	u32 seed	 = 2463534242u;
+	u64 issued	 = 0;
+	u64 done	 = 0;
+	int errors	 = 0;
+	int started[BENCH_MAX_DEPTH] = {0};
+	ktime_t start;
+	int i;
+
+	start = get_time();
+
+	while (done < BENCH_IOS) {
+		for (i = 0; i < depth; i++) {
+			if (slots[i].busy)
+				continue;
+
+			if (started[i]) {
+				if (slots[i].req.status != 0)
+					errors++;
+				started[i] = 0;
+				done++;
+			}
+
+			if (issued == BENCH_IOS)
+				continue;
+
+			bench_prep(&slots[i], (xorshift(&seed) % bench_nr_blocks) * BENCH_BLOCK_SIZE);
+
+			if (blkdev_submit(bench_blkdev, &(slots[i].req), NULL) != 0) {
+				slots[i].busy = 0;
+				errors++;
+				done++;
+			} else {
+				started[i] = 1;
+			}
+			issued++;
+		}
+
+		schedule();
+	}
+
+	bench_report("random", depth, BENCH_IOS, errors, get_time() - start);
+}
+
+/* Sequential 4KB reads, submitted BENCH_MAX_DEPTH at a time under a plug */
+static void
+bench_plugged_round(void)
+{
+	struct blk_plug plug;
+	u64 offset = 0;
+	u64 done   = 0;
+	int errors = 0;
+	ktime_t start;
+	int i;
+
+	start = get_time();
+
+	while (done < BENCH_IOS) {
+		blk_start_plug(&plug, bench_blkdev);
+
+		for (i = 0; i < BENCH_MAX_DEPTH; i++) {
+			bench_prep(&slots[i], offset);
+			offset = (offset + BENCH_BLOCK_SIZE) % (bench_nr_blocks * BENCH_BLOCK_SIZE);
+
+			if (blkdev_submit(bench_blkdev, &(slots[i].req), &plug) != 0) {
+				slots[i].busy = 0;
+				errors++;
+			}
+		}
+
+		blk_finish_plug(&plug);
+
+		for (i = 0; i < BENCH_MAX_DEPTH; i++) {
+			while (slots[i].busy)
+				schedule();
+
+			if (slots[i].req.status != 0)
+				errors++;
+		}
+
+		done += BENCH_MAX_DEPTH;
+	}
+
+	bench_report("plugged", BENCH_MAX_DEPTH, done, errors, get_time() - start);
+}
+
+static int
+bench_main(void * arg)
+{
+	int max_depth;
+	int depth;
+	int i;
+
+	bench_blkdev = get_blkdev(bench_dev);
+	if (bench_blkdev == NULL) {
+		printk(KERN_ERR "BLK bench: no block device '%s'\n", bench_dev);
+		return -ENODEV;
+	}
+
+	bench_nr_blocks = min_t(u64, blkdev_get_capacity(bench_blkdev), BENCH_SPAN) / BENCH_BLOCK_SIZE;
+	if (bench_nr_blocks < BENCH_MAX_DEPTH) {
+		printk(KERN_ERR "BLK bench: device '%s' is too small\n", bench_dev);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < BENCH_MAX_DEPTH; i++) {
+		slots[i].buf = kmem_get_pages(get_order(BENCH_BLOCK_SIZE));
+		if (slots[i].buf == NULL) {
+			printk(KERN_ERR "BLK bench: could not allocate buffers\n");
+			goto out;
+		}
+	}
+
+	max_depth = min_t(int, blkdev_get_queue_depth(bench_blkdev), BENCH_MAX_DEPTH);
+
+	for (depth = 1; depth <= max_depth; depth <<= 1)
+		bench_random_round(depth);
+
+	bench_plugged_round();
+
+out:
+	for (i = 0; i < BENCH_MAX_DEPTH; i++) {
+		if (slots[i].buf)
+			kmem_free_pages(slots[i].buf, get_order(BENCH_BLOCK_SIZE));
+	}
+
+	return 0;
+}
+
+static int
+blk_bench_init(void)
+{
+	/* The sweep issues thousands of reads; don't make init wait on it */
+	if (kthread_create(bench_main, NULL, "blk_bench") == NULL)
+		return -ENOMEM;
+
+	return 0;
+}
+
+DRIVER_INIT("late", blk_bench_init);
@@ -184,7 +184,11 @@ alloc_cmd_table(sata_req_t * sata_req) {
 	u32 num_pages    = (table_len / PAGE_SIZE) + ((table_len % PAGE_SIZE) != 0);
 	void * cmd_table = NULL;
 
-	cmd_table = kmem_get_pages(get_order(num_pages));
+	cmd_table = kmem_get_pages(get_order(num_pages * PAGE_SIZE));
+	if (cmd_table == NULL) {
+		return NULL;
+	}
+
 	memset(cmd_table, 0, PAGE_SIZE * num_pages);
 
 	return cmd_table;
@@ -196,7 +200,7 @@ free_cmd_table(sata_req_t * sata_req, sata_cmd_tbl_t * cmd_table) {
 	u32 table_len  = 0x80 + (sata_req->num_prdts * sizeof(sata_prd_tbl_t));
 	u32 num_pages  = (table_len / PAGE_SIZE) + ((table_len % PAGE_SIZE) != 0);
 
-	kmem_free_pages(cmd_table, get_order(num_pages));
+	kmem_free_pages(cmd_table, get_order(num_pages * PAGE_SIZE));
 }
 
 
@@ -499,18 +503,12 @@ ahci_port_init(sata_port_t * sata_port) {
 
 static int sata_handle_blkreq_slot(blk_req_t * blk_req, void * priv_data, int slot);
 
-static int
-ahci_port_handle_fatal_error(sata_port_t * sata_port) {
+/* Hard resets a port that stopped on an error and starts it again */
+static void
+ahci_port_restart(sata_port_t * sata_port) {
     unsigned long flags  = 0;
-    int i = 0;
 	int port_num = sata_port->port_num;
 
-    printk("AHCI Error: Dumping state...\n");
-    sata_dump_state(sata_port);
-
-    printk("AHCI: Hard resetting port %d, reissuing outstanding requests...\n", port_num);
-    printk("  Last issued cmd slot: %d\n", last_issued_slot); 
-
     spin_lock_irqsave(&(sata_port->port_lock), flags);
 
     ahci_port_reset(port_num);
@@ -529,6 +527,20 @@ ahci_port_handle_fatal_error(sata_port_t * sata_port) {
              mmio_read32(HBA_PORT_REG_PXCMD(sata_port->port_num)) | 0x1);
 
     spin_unlock_irqrestore(&(sata_port->port_lock), flags);
+}
+
+static int
+ahci_port_handle_fatal_error(sata_port_t * sata_port) {
+    int i = 0;
+	int port_num = sata_port->port_num;
+
+    printk("AHCI Error: Dumping state...\n");
+    sata_dump_state(sata_port);
+
+    printk("AHCI: Hard resetting port %d, reissuing outstanding requests...\n", port_num);
+    printk("  Last issued cmd slot: %d\n", last_issued_slot); 
+
+    ahci_port_restart(sata_port);
 
     printk("AHCI: Pending cmds: %x\n", sata_port->pending_cmds);
 
@@ -547,6 +559,40 @@ ahci_port_handle_fatal_error(sata_port_t * sata_port) {
     return 0;
 }
 
+/*
+ * Finishes the commands in slots with status. Synchronous requesters are
+ * polling on active and pick up the error themselves.
+ */
+static void
+ahci_port_complete(sata_port_t * sata_port, u32 slots, int status) {
+	int i = 0;
+
+	for (i = 0; i < ahci_dev.num_cmd_slots; i++) {
+		if (slots & (0x1 << i)) {
+			sata_req_t * sata_req = &(sata_port->sata_reqs[i]);
+			// Finish Cmd i
+
+			sata_req->error  = status;
+			__asm__ __volatile__ ("":::"memory");
+			sata_req->active = 0;
+
+			// Free Command table
+			{
+				free_cmd_table(sata_req, __va(sata_port->cmd_list[i].ctba));
+				sata_port->cmd_list[i].ctba = (u64)NULL;
+			}
+
+			/* Free the slot first, completing refills it */
+			if (sata_req->async) {
+				blk_req_t * blk_req = sata_req->blk_req;
+
+				release_cmd_slot(sata_port, i);
+				blk_req_complete(blk_req, status);
+			}
+		}
+	}
+}
+
 static int 
 ahci_port_handle_irq(sata_port_t * sata_port) {
 	int port_num     = sata_port->port_num;
@@ -554,6 +600,7 @@ ahci_port_handle_irq(sata_port_t * sata_port) {
 	u32 error        = 0;
 	u32 status       = 0;
 	int hba_error    = 0;
+	int reissued     = 0;
 
 	//  printk("AHCI: SATA PORT IRQ STATUS=%x\n", port_irq_sts);
 	//	printk("AHCI: SATA PORT CI=%x\n",         mmio_read32(HBA_PORT_REG_PXCI(port_num)));
@@ -600,10 +647,12 @@ ahci_port_handle_irq(sata_port_t * sata_port) {
 			/* Fatal Error detected on interface */
 			printk("Interface Fatal Error \n");
             ahci_port_handle_fatal_error(sata_port);
+			reissued = 1;
 		} else {
 			// Unknown ERROR
 	        printk("AHCI Unknown error: SATA PORT IRQ STATUS=%x\n", port_irq_sts);
             ahci_port_handle_fatal_error(sata_port);
+			reissued = 1;
 		}
 
 		hba_error = 1;
@@ -629,7 +678,6 @@ ahci_port_handle_irq(sata_port_t * sata_port) {
 	     ((status & ATA_STS_RDY) != 0)) {
 		u32 cmds_complete    = 0;
 		unsigned long flags  = 0;
-		int i = 0;
 		// Success
 
 		spin_lock_irqsave(&(sata_port->port_lock), flags);
@@ -639,29 +687,33 @@ ahci_port_handle_irq(sata_port_t * sata_port) {
 		}
 		spin_unlock_irqrestore(&(sata_port->port_lock), flags);
 
-		// Check which cmd completed
-		for (i = 0; i < ahci_dev.num_cmd_slots; i++) {
-			if (cmds_complete & (0x1 << i)) {
-				sata_req_t * sata_req = &(sata_port->sata_reqs[i]);
-				// Finish Cmd i
-				
-				sata_req->active = 0;
+		ahci_port_complete(sata_port, cmds_complete, 0);
 
-				// Free Command table
-				{
-					free_cmd_table(sata_req, __va(sata_port->cmd_list[i].ctba));
-					sata_port->cmd_list[i].ctba = (u64)NULL;
-				}
-		
-				if (sata_req->async) {
-					blk_req_complete(sata_req->blk_req, 0);
-					release_cmd_slot(sata_port, i);
-				} 
-			}
+	} else if (!reissued) {
+		u32 cmds_complete    = 0;
+		u32 cmds_failed      = 0;
+		unsigned long flags  = 0;
+
+		/* 
+		 * The port stops on an error with the failed command still
+		 * issued. Whatever left PxCI finished fine; fail the rest and
+		 * restart the port, nothing would complete them otherwise.
+		 */
+		spin_lock_irqsave(&(sata_port->port_lock), flags);
+		{
+			cmds_failed   = sata_port->pending_cmds & mmio_read32(HBA_PORT_REG_PXCI(port_num));
+			cmds_complete = sata_port->pending_cmds & ~cmds_failed;
+			sata_port->pending_cmds = 0;
 		}
+		spin_unlock_irqrestore(&(sata_port->port_lock), flags);
 
-	} else {
-        /* SIGNAL ERRORS to ALL outstanding REQUESTS */
+		printk(KERN_ERR "AHCI: Port %d error (status=%x, error=%x), failing cmds %x\n",
+		       port_num, status, error, cmds_failed);
+
+		ahci_port_restart(sata_port);
+
+		ahci_port_complete(sata_port, cmds_complete, 0);
+		ahci_port_complete(sata_port, cmds_failed, -EIO);
 	} 
 
 	return 0;
@@ -800,8 +852,8 @@ static int
 sata_handle_blkreq(blk_req_t * blk_req, void * priv_data) 
 {
 	sata_port_t    * sata_port = (sata_port_t *)priv_data;
-	int              cmd_slot  = get_free_cmd_slot(sata_port);
-	sata_req_t     * sata_req  = &(sata_port->sata_reqs[cmd_slot]);
+	int              cmd_slot  = -1;
+	sata_req_t     * sata_req  = NULL;
 	sata_cmd_tbl_t * cmd_table = NULL;
 	fis_reg_h2d_t  * data_fis  = NULL;
 	sata_cmd_hdr_t * cmd_hdr   = NULL;
@@ -809,12 +861,6 @@ sata_handle_blkreq(blk_req_t * blk_req, void * priv_data)
 	u64              sect_len  = 0;
 	int i = 0;
 	
-	if (cmd_slot == -1) {
-		printk(KERN_ERR "AHCI: Could not find free SATA CMD Slot on port %d\n", 
-		       sata_port->port_num);
-		return -EAGAIN;
-	}
-
 	if (blk_req->offset % sata_port->sector_size) {
 		printk(KERN_ERR "AHCI: Block Request offset is misaligned.\n");
 		printk(KERN_ERR "AHCI: \tByte Offset=%llu, sector_size=%u\n", 
@@ -829,6 +875,15 @@ sata_handle_blkreq(blk_req_t * blk_req, void * priv_data)
 		return -EINVAL;
 	}
 
+	/* All slots busy is normal, the block layer retries on the next completion */
+	cmd_slot = get_free_cmd_slot(sata_port);
+
+	if (cmd_slot == -1) {
+		return -EAGAIN;
+	}
+
+	sata_req = &(sata_port->sata_reqs[cmd_slot]);
+
 	/* Convert Byte Offset to Sector Offset */
 	sect_off = blk_req->offset / sata_port->sector_size;
 
@@ -850,6 +905,12 @@ sata_handle_blkreq(blk_req_t * blk_req, void * priv_data)
 
 	/* Allocate Command Table */
 	cmd_table     = alloc_cmd_table(sata_req);
+
+	if (cmd_table == NULL) {
+		release_cmd_slot(sata_port, cmd_slot);
+		return -ENOMEM;
+	}
+
 	cmd_hdr->ctba = __pa(cmd_table);
 
 	data_fis = (fis_reg_h2d_t *)cmd_table->cfis;
@@ -0,0 +1,582 @@
+/* Virtio Block Driver
+ *
+ * Drives modern (virtio 1.0) PCI block devices, e.g. QEMU's
+ * virtio-blk-pci, through the block layer. Requests go to the virtqueue
+ * of the CPU that dispatches them, and with MSI-X each queue completes
+ * on its own CPU. With indirect descriptors every request takes one ring
+ * slot however many DMA descriptors it has, so the queue depth is the
+ * ring size.
+ */
+
+#include <lwk/driver.h>
+#include <lwk/pci/pci.h>
+#include <lwk/interrupt.h>
+#include <lwk/blkdev.h>
+#include <lwk/spinlock.h>
+#include <lwk/smp.h>
+#include <lwk/cpumask.h>
+#include <lwk/virtio.h>
+#include <arch/page.h>
+#include <arch/io_apic.h>
+
+
+/* Default descriptors per virtqueue, ring= overrides. The device may offer fewer. */
+#define VBLK_RING_SIZE      256
+
+/* Most virtqueues driven, one per CPU up to this */
+#define VBLK_MAX_QUEUES     16
+
+/* DMA descriptors per request; with the header and status an indirect table is 2KB */
+#define VBLK_MAX_SEGS       126
+#define VBLK_INDIR_DESCS    (VBLK_MAX_SEGS + 2)
+
+/* Requests completed per pass of the interrupt handler */
+#define VBLK_COMPLETE_BATCH 32
+
+/* Device feature bits */
+#define VIRTIO_BLK_F_SEG_MAX    2   /* seg_max is valid */
+#define VIRTIO_BLK_F_RO         5   /* read only */
+#define VIRTIO_BLK_F_BLK_SIZE   6   /* blk_size is valid */
+#define VIRTIO_BLK_F_MQ         12  /* num_queues is valid */
+
+/* Device configuration layout */
+#define VIRTIO_BLK_CFG_CAPACITY   0   /* u64, in 512 byte sectors */
+#define VIRTIO_BLK_CFG_SEG_MAX    12
+#define VIRTIO_BLK_CFG_BLK_SIZE   20
+#define VIRTIO_BLK_CFG_NUM_QUEUES 34
+
+/* Request types and status */
+#define VIRTIO_BLK_T_IN         0
+#define VIRTIO_BLK_T_OUT        1
+#define VIRTIO_BLK_S_OK         0
+
+/* Request addresses are always in 512 byte units */
+#define VIRTIO_BLK_SECTOR_SIZE  512
+
+
+struct virtio_blk_outhdr {
+	u32 type;
+	u32 ioprio;
+	u64 sector;
+} __attribute__((packed));
+
+
+typedef struct vblk_slot {
+	struct virtio_blk_outhdr hdr;
+	u8                       status;     /* Written by the device */
+
+	blk_req_t              * blk_req;
+	struct vring_desc      * indir;      /* NULL without indirect descriptors */
+	int                      next_free;
+} vblk_slot_t;
+
+
+typedef struct vblk_queue {
+	struct virtqueue * vq;
+	u32                cpu;              /* Completions interrupt here */
+	int                vector;           /* -1 if sharing INTx */
+
+	spinlock_t         lock;
+	vblk_slot_t      * slots;            /* One per ring descriptor */
+	int                free_slot;        /* -1 if none */
+
+	/* Scratch for building a request, used with lock held */
+	struct virtio_buf  bufs[VBLK_INDIR_DESCS];
+
+	u64                reqs;
+	u64                busy;             /* Refused with -EAGAIN */
+} vblk_queue_t;
+
+
+typedef struct vblk_dev {
+	pci_dev_t        * pci_dev;
+	struct virtio_dev  vdev;
+
+	u32                ring_size;        /* Requested per virtqueue */
+	u32                max_queues;       /* queues=, 0 for one per CPU */
+
+	u32                num_queues;
+	vblk_queue_t       queues[VBLK_MAX_QUEUES];
+	u8                 cpu_queue[NR_CPUS];
+
+	u32                sector_size;
+	u64                num_sectors;      /* Of sector_size */
+	u32                max_segs;
+	u8                 read_only;
+	u8                 msix;
+} vblk_dev_t;
+
+
+static vblk_dev_t vblk_dev = {
+	.ring_size = VBLK_RING_SIZE,
+};
+
+
+static vblk_slot_t *
+vblk_slot_get(vblk_queue_t * q)
+{
+	vblk_slot_t * slot = NULL;
+
+	if (q->free_slot < 0) {
+		return NULL;
+	}
+
+	slot         = &(q->slots[q->free_slot]);
+	q->free_slot = slot->next_free;
+
+	return slot;
+}
+
+static void
+vblk_slot_put(vblk_queue_t * q,
+	      vblk_slot_t  * slot)
+{
+	slot->blk_req   = NULL;
+	slot->next_free = q->free_slot;
+	q->free_slot    = slot - q->slots;
+}
+
+
+static int
+vblk_handle_blkreq(blk_req_t * blk_req,
+		   void      * priv_data)
+{
+	vblk_dev_t    * dev  = priv_data;
+	vblk_queue_t  * q    = &(dev->queues[dev->cpu_queue[this_cpu]]);
+	vblk_slot_t   * slot = NULL;
+	unsigned long   irqstate;
+	u32 n   = 0;
+	u32 i   = 0;
+	int ret = 0;
+
+	if (blk_req->write && dev->read_only) {
+		return -EROFS;
+	}
+
+	if (blk_req->desc_cnt == 0 || blk_req->desc_cnt > dev->max_segs) {
+		printk(KERN_ERR "VBLK: Request has %u DMA descriptors, max=%u\n",
+		       blk_req->desc_cnt, dev->max_segs);
+		return -EINVAL;
+	}
+
+	if ((blk_req->offset    % dev->sector_size) ||
+	    (blk_req->total_len % dev->sector_size)) {
+		printk(KERN_ERR "VBLK: Request is misaligned\n");
+		printk(KERN_ERR "VBLK: \tByte Offset=%llu, Length=%llu, sector_size=%u\n",
+		       blk_req->offset, blk_req->total_len, dev->sector_size);
+		return -EINVAL;
+	}
+
+	if ((blk_req->offset    / dev->sector_size > dev->num_sectors) ||
+	    (blk_req->total_len / dev->sector_size >
+	     dev->num_sectors - blk_req->offset / dev->sector_size)) {
+		printk(KERN_ERR "VBLK: Request runs past the end of the device\n");
+		printk(KERN_ERR "VBLK: \tByte Offset=%llu, Length=%llu, num_sectors=%llu\n",
+		       blk_req->offset, blk_req->total_len, dev->num_sectors);
+		return -EINVAL;
+	}
+
+	spin_lock_irqsave(&(q->lock), irqstate);
+
+	/* All slots busy is normal, the block layer retries on the next completion */
+	if ((q->vq->indirect == 0) &&
+	    (vq_num_free(q->vq) < blk_req->desc_cnt + 2)) {
+		slot = NULL;
+	} else {
+		slot = vblk_slot_get(q);
+	}
+
+	if (slot == NULL) {
+		q->busy++;
+		spin_unlock_irqrestore(&(q->lock), irqstate);
+		return -EAGAIN;
+	}
+
+	slot->hdr.type   = (blk_req->write) ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+	slot->hdr.ioprio = 0;
+	slot->hdr.sector = blk_req->offset / VIRTIO_BLK_SECTOR_SIZE;
+	slot->status     = 0xff;
+	slot->blk_req    = blk_req;
+
+	q->bufs[n].addr  = __pa(&(slot->hdr));
+	q->bufs[n].len   = sizeof(slot->hdr);
+	n++;
+
+	for (i = 0; i < blk_req->desc_cnt; i++) {
+		q->bufs[n].addr = blk_req->dma_descs[i].buf_paddr;
+		q->bufs[n].len  = blk_req->dma_descs[i].length;
+		n++;
+	}
+
+	q->bufs[n].addr  = __pa(&(slot->status));
+	q->bufs[n].len   = sizeof(slot->status);
+	n++;
+
+	/* Writes hand the device the data, reads have it fill the buffers */
+	if (blk_req->write) {
+		ret = vq_add_indirect(q->vq, slot->indir, q->bufs, n - 1, 1, slot);
+	} else {
+		ret = vq_add_indirect(q->vq, slot->indir, q->bufs, 1, n - 1, slot);
+	}
+
+	if (ret != 0) {
+		vblk_slot_put(q, slot);
+		q->busy++;
+		spin_unlock_irqrestore(&(q->lock), irqstate);
+		return -EAGAIN;
+	}
+
+	q->reqs++;
+	vq_kick(q->vq);
+
+	spin_unlock_irqrestore(&(q->lock), irqstate);
+
+	return 0;
+}
+
+
+/*
+ * Completes everything the device has finished on q. Slots are returned
+ * before the block layer hears about the requests, since completing one
+ * dispatches the next straight away.
+ */
+static void
+vblk_complete(vblk_queue_t * q)
+{
+	blk_req_t     * done[VBLK_COMPLETE_BATCH];
+	int             status[VBLK_COMPLETE_BATCH];
+	vblk_slot_t   * slot = NULL;
+	unsigned long   irqstate;
+	int more = 0;
+	int cnt  = 0;
+	int i    = 0;
+
+	do {
+		cnt = 0;
+
+		spin_lock_irqsave(&(q->lock), irqstate);
+		{
+			while ((cnt < VBLK_COMPLETE_BATCH) &&
+			       ((slot = vq_get(q->vq, NULL)) != NULL)) {
+				done[cnt]   = slot->blk_req;
+				status[cnt] = (slot->status == VIRTIO_BLK_S_OK) ? 0 : -EIO;
+				vblk_slot_put(q, slot);
+				cnt++;
+			}
+
+			/* Ask for the next interrupt, unless there is more already */
+			more = (cnt == VBLK_COMPLETE_BATCH) || !vq_enable_cb(q->vq);
+		}
+		spin_unlock_irqrestore(&(q->lock), irqstate);
+
+		for (i = 0; i < cnt; i++) {
+			blk_req_complete(done[i], status[i]);
+		}
+	} while (more);
+}
+
+static irqreturn_t
+vblk_msix_handler(int    vector,
+		  void * priv)
+{
+	vblk_complete(priv);
+
+	return IRQ_HANDLED;
+}
+
+static irqreturn_t
+vblk_intx_handler(int    vector,
+		  void * priv)
+{
+	vblk_dev_t * dev = priv;
+
+	if (!(virtio_isr_read(&(dev->vdev)) & 1)) {
+		return IRQ_NONE;
+	}
+
+	vblk_complete(&(dev->queues[0]));
+
+	return IRQ_HANDLED;
+}
+
+
+static int
+vblk_dump_state(void * priv_data)
+{
+	vblk_dev_t * dev = priv_data;
+	u32 i = 0;
+
+	for (i = 0; i < dev->num_queues; i++) {
+		vblk_queue_t * q = &(dev->queues[i]);
+
+		printk("VBLK queue %u: cpu=%u, free descs=%u, reqs=%llu, busy=%llu, kicks=%llu (%llu saved)\n",
+		       i, q->cpu, vq_num_free(q->vq), q->reqs, q->busy,
+		       q->vq->kicks, q->vq->kicks_saved);
+	}
+
+	return 0;
+}
+
+
+static blkdev_ops_t vblk_blk_ops = {
+	.handle_blkreq = vblk_handle_blkreq,
+	.dump_state    = vblk_dump_state
+};
+
+
+/*
+ * Gives every queue its own MSI-X vector aimed at its CPU. Falls back to
+ * the INTx line, and a single queue, if that doesn't work out.
+ */
+static int
+vblk_irq_init(vblk_dev_t * dev)
+{
+	struct msix_entry entries[VBLK_MAX_QUEUES];
+	int irq_vec = 0;
+	u32 i       = 0;
+
+	for (i = 0; i < dev->num_queues; i++) {
+		vblk_queue_t * q = &(dev->queues[i]);
+
+		q->vector = irq_request_free_vector(vblk_msix_handler, 0, "virtio-blk", q);
+
+		if (q->vector < 0) {
+			break;
+		}
+
+		entries[i].vector = q->vector;
+		entries[i].entry  = i;
+		entries[i].cpu    = q->cpu;
+	}
+
+	if ((i == dev->num_queues) &&
+	    (pci_msix_setup(dev->pci_dev, entries, i) == 0)) {
+		dev->msix = 1;
+		return 0;
+	}
+
+	while (i--) {
+		irq_free(dev->queues[i].vector, &(dev->queues[i]));
+		dev->queues[i].vector = -1;
+	}
+
+	dev->num_queues       = 1;
+	dev->queues[0].cpu    = 0;
+	dev->queues[0].vector = -1;
+	memset(dev->cpu_queue, 0, sizeof(dev->cpu_queue));
+
+	irq_vec = ioapic_pcidev_vector(dev->pci_dev->cfg.bus, dev->pci_dev->cfg.slot, 0);
+
+	if (irq_vec == -1) {
+		printk(KERN_ERR "VBLK: Failed to find interrupt vector.\n");
+		return -1;
+	}
+
+	irq_request(irq_vec, &vblk_intx_handler, 0, "virtio-blk", dev);
+
+	return 0;
+}
+
+
+static int
+vblk_queue_init(vblk_dev_t * dev,
+		u32          index)
+{
+	vblk_queue_t * q      = &(dev->queues[index]);
+	u8           * indir  = NULL;
+	u32 i = 0;
+
+	spin_lock_init(&(q->lock));
+
+	q->vq = virtio_vq_setup(&(dev->vdev), index, dev->ring_size,
+				(dev->msix) ? index : VIRTIO_MSI_NO_VECTOR);
+
+	if (q->vq == NULL) {
+		return -1;
+	}
+
+	q->slots = kmem_alloc(sizeof(vblk_slot_t) * q->vq->num);
+
+	if (q->slots == NULL) {
+		return -1;
+	}
+
+	if (q->vq->indirect) {
+		indir = kmem_get_pages(get_order(q->vq->num * VBLK_INDIR_DESCS * sizeof(struct vring_desc)));
+
+		if (indir == NULL) {
+			return -1;
+		}
+	}
+
+	q->free_slot = -1;
+
+	for (i = 0; i < q->vq->num; i++) {
+		if (indir) {
+			q->slots[i].indir = (struct vring_desc *)(indir + (i * VBLK_INDIR_DESCS * sizeof(struct vring_desc)));
+		}
+
+		vblk_slot_put(q, &(q->slots[i]));
+	}
+
+	return 0;
+}
+
+
+static int
+vblk_probe(pci_dev_t          * pci_dev,
+	   const pci_dev_id_t * id)
+{
+	vblk_dev_t * dev           = &vblk_dev;
+	u64          wanted        = 0;
+	u32          queues        = 1;
+	u32          request_slots = 0;
+	u32          cpu           = 0;
+	u32          i             = 0;
+
+	dev->pci_dev = pci_dev;
+
+	if (virtio_pci_init(&(dev->vdev), pci_dev) != 0) {
+		printk(KERN_ERR "VBLK: Not a modern virtio device\n");
+		return -1;
+	}
+
+	wanted = (VIRTIO_FEATURE(VIRTIO_F_VERSION_1)     |
+		  VIRTIO_FEATURE(VIRTIO_F_EVENT_IDX)     |
+		  VIRTIO_FEATURE(VIRTIO_F_INDIRECT_DESC) |
+		  VIRTIO_FEATURE(VIRTIO_BLK_F_SEG_MAX)   |
+		  VIRTIO_FEATURE(VIRTIO_BLK_F_RO)        |
+		  VIRTIO_FEATURE(VIRTIO_BLK_F_BLK_SIZE)  |
+		  VIRTIO_FEATURE(VIRTIO_BLK_F_MQ));
+
+	if (virtio_negotiate(&(dev->vdev), wanted) != 0) {
+		printk(KERN_ERR "VBLK: Feature negotiation failed\n");
+		return -1;
+	}
+
+	/* Geometry */
+	dev->sector_size = VIRTIO_BLK_SECTOR_SIZE;
+
+	if (virtio_has_feature(&(dev->vdev), VIRTIO_BLK_F_BLK_SIZE)) {
+		dev->sector_size = virtio_cfg_read32(&(dev->vdev), VIRTIO_BLK_CFG_BLK_SIZE);
+
+		if ((dev->sector_size < VIRTIO_BLK_SECTOR_SIZE) ||
+		    (dev->sector_size & (dev->sector_size - 1))) {
+			dev->sector_size = VIRTIO_BLK_SECTOR_SIZE;
+		}
+	}
+
+	dev->num_sectors  = virtio_cfg_read32(&(dev->vdev), VIRTIO_BLK_CFG_CAPACITY);
+	dev->num_sectors |= (u64)virtio_cfg_read32(&(dev->vdev), VIRTIO_BLK_CFG_CAPACITY + 4) << 32;
+	dev->num_sectors /= (dev->sector_size / VIRTIO_BLK_SECTOR_SIZE);
+
+	dev->read_only = virtio_has_feature(&(dev->vdev), VIRTIO_BLK_F_RO);
+
+	dev->max_segs = VBLK_MAX_SEGS;
+
+	if (virtio_has_feature(&(dev->vdev), VIRTIO_BLK_F_SEG_MAX)) {
+		u32 seg_max = virtio_cfg_read32(&(dev->vdev), VIRTIO_BLK_CFG_SEG_MAX);
+
+		if (seg_max) {
+			dev->max_segs = min(dev->max_segs, seg_max);
+		}
+	}
+
+	/* One queue per online CPU, as many as the device and queues= allow */
+	if (virtio_has_feature(&(dev->vdev), VIRTIO_BLK_F_MQ)) {
+		queues = virtio_cfg_read16(&(dev->vdev), VIRTIO_BLK_CFG_NUM_QUEUES);
+	}
+
+	queues = min(queues, (u32)num_online_cpus());
+	queues = min(queues, (u32)VBLK_MAX_QUEUES);
+
+	if (dev->max_queues) {
+		queues = min(queues, dev->max_queues);
+	}
+
+	dev->num_queues = max(queues, 1U);
+	dev->ring_size  = max(dev->ring_size, 4U);
+
+	i = 0;
+	for_each_cpu_mask(cpu, cpu_online_map) {
+		if (i < dev->num_queues) {
+			dev->queues[i].cpu = cpu;
+		}
+
+		dev->cpu_queue[cpu] = i % dev->num_queues;
+		i++;
+	}
+
+	if (vblk_irq_init(dev) != 0) {
+		virtio_reset(&(dev->vdev));
+		return -1;
+	}
+
+	for (i = 0; i < dev->num_queues; i++) {
+		if (vblk_queue_init(dev, i) != 0) {
+			printk(KERN_ERR "VBLK: Failed to set up queue %u\n", i);
+			virtio_reset(&(dev->vdev));
+			return -1;
+		}
+
+		/* Without indirect descriptors a request takes desc_cnt + 2 of the ring */
+		if (dev->queues[i].vq->indirect) {
+			request_slots += dev->queues[i].vq->num;
+		} else {
+			dev->max_segs  = min(dev->max_segs, dev->queues[i].vq->num - 2);
+			request_slots += dev->queues[i].vq->num / 3;
+		}
+	}
+
+	if (dev->msix) {
+		virtio_config_vector(&(dev->vdev), VIRTIO_MSI_NO_VECTOR);
+	}
+
+	virtio_driver_ok(&(dev->vdev));
+
+	printk("VBLK: %u queue(s), %u descriptors, %s%s%s%s, max %u segments\n",
+	       dev->num_queues, dev->queues[0].vq->num,
+	       (dev->msix) ? "MSI-X" : "INTx",
+	       virtio_has_feature(&(dev->vdev), VIRTIO_F_INDIRECT_DESC) ? ", indirect" : "",
+	       virtio_has_feature(&(dev->vdev), VIRTIO_F_EVENT_IDX)     ? ", event idx" : "",
+	       (dev->read_only) ? ", read only" : "",
+	       dev->max_segs);
+
+	blkdev_register("vblk-0", &vblk_blk_ops,
+			dev->sector_size, dev->num_sectors,
+			dev->max_segs, request_slots,
+			dev);
+
+	return 0;
+}
+
+
+/* Modern virtio-blk only, legacy and transitional devices (0x1001) are not driven. */
+static const pci_dev_id_t vblk_id_table[] = {
+        { VIRTIO_PCI_VENDOR, VIRTIO_PCI_DEVICE(VIRTIO_ID_BLOCK), 0, 0, 0, 0 },
+        { 0, }
+};
+
+static pci_driver_t vblk_driver = {
+	.name     = "virtio_blk",
+	.id_table = vblk_id_table,
+	.probe    = vblk_probe,
+};
+
+
+static int
+vblk_init(void)
+{
+	if (pci_register_driver(&vblk_driver) != 0) {
+		printk(KERN_WARNING "Failed to register virtio-blk PCI driver.\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+
+DRIVER_INIT("block", vblk_init);
+
+DRIVER_PARAM_NAMED(ring, vblk_dev.ring_size, uint);
+DRIVER_PARAM_NAMED(queues, vblk_dev.max_queues, uint);
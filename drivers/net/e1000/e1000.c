@@ -18,11 +18,15 @@
 #include <lwk/netdev.h>
 #include <lwk/interrupt.h>
 #include <lwk/delay.h>
+#include <lwk/spinlock.h>
+#include <lwk/params.h>
 #include <lwk/pci/pci.h>
 #include <lwip/netif.h>
 #include <lwip/tcpip.h>
 #include <lwip/etharp.h>
 #include <lwip/inet.h>
+#include <lwip/inet_chksum.h>
+#include <lwip/ip.h>
 #include <arch/page.h>
 #include <arch/proto.h>
 #include <arch/io.h>
@@ -36,9 +40,27 @@
 #define mmio_write32(offset, value) *((volatile uint32_t *)(dev->mmio_vaddr + (offset))) = (value)
 
 
-// Number of read/write descriptors
-#define NUM_RX_DESCRIPTORS	64
-#define NUM_TX_DESCRIPTORS	64
+// Default number of read/write descriptors, rx_ring= and tx_ring= override.
+// Rings are a multiple of 8 descriptors (RDLEN/TDLEN are in 128 byte units).
+#define NUM_RX_DESCRIPTORS	256
+#define NUM_TX_DESCRIPTORS	256
+#define MAX_DESCRIPTORS		4096
+
+
+// Receive buffer size, each one holds a whole frame
+#define E1000_RX_BUF_SIZE	2048
+
+
+// Default frames handled per RX poll before yielding to the rest of the stack
+#define E1000_RX_BUDGET		64
+
+
+// Default interrupt rate limit (interrupts/s), itr=0 removes it
+#define E1000_ITR		20000
+
+
+// Most descriptors a single frame may use before it is copied into one
+#define E1000_TX_MAX_SEGS	16
 
 
 // E1000 Ethernet Controller Register Offsets
@@ -55,17 +77,20 @@
 #define E1000_REG_RDLEN    0x02808	// Receive Descriptor Length
 #define E1000_REG_RDH      0x02810	// Receive Descriptor Head
 #define E1000_REG_RDT      0x02818	// Receive Descriptor Tail
+#define E1000_REG_RXCSUM   0x05000	// Receive Checksum Control
 #define E1000_REG_TCTL     0x00400	// Transmit Control
 #define E1000_REG_TDBAL    0x03800	// Transmit Descriptor Base Low
 #define E1000_REG_TDBAH    0x03804	// Transmit Descriptor Base High
 #define E1000_REG_TDLEN    0x03808	// Transmit Descriptor Length
 #define E1000_REG_TDH      0x03810	// Transmit Descriptor Head
 #define E1000_REG_TDT      0x03818	// Transmit Descriptor Tail
+#define E1000_REG_TIDV     0x03820	// Transmit Interrupt Delay Value
 #define E1000_REG_MTA      0x05200	// Multicast Table Array (n)
 #define E1000_REG_ICR      0x000C0	// Interrupt Cause Read
 #define E1000_REG_IMS      0x000D0	// Interrupt Mask Set/Read
 #define E1000_REG_IMC      0x000D8	// Interrupt Mask Clear
 #define E1000_REG_ICS      0x000C8	// Interrupt Cause Set
+#define E1000_REG_ITR      0x000C4	// Interrupt Throttling Rate
 #define E1000_REG_RAL      0x05400	// Receive Address Low
 #define E1000_REG_RAH      0x05404	// Receive Address High
 #define E1000_REG_TXCW     0x00178	// Transmit Configuration Word
@@ -105,6 +130,27 @@ typedef struct __attribute__((packed)) e1000_rx_desc_s
 } e1000_rx_desc_t;
 
 
+// E1000 Transmit (TX) descriptor cmd and sta bits
+#define TXD_CMD_EOP		(1 << 0)	// End of packet
+#define TXD_CMD_IFCS		(1 << 1)	// Insert FCS
+#define TXD_CMD_RS		(1 << 3)	// Report status
+#define TXD_CMD_DEXT		(1 << 5)	// Extended (context or data) descriptor
+#define TXD_CMD_IDE		(1 << 7)	// Delay the TX interrupt by TIDV
+#define TXD_STA_DD		(1 << 0)	// Descriptor done
+
+
+// Extended data descriptors reuse the legacy layout: the cso byte holds the
+// descriptor type, the css byte the checksum options (POPTS)
+#define TXD_DTYP_D		(1 << 4)	// Data descriptor
+#define TXD_POPTS_IXSM		(1 << 0)	// Insert IP checksum
+#define TXD_POPTS_TXSM		(1 << 1)	// Insert TCP/UDP checksum
+
+
+// TUCMD bits of a context descriptor
+#define TXD_TUCMD_TCP		(1 << 0)	// TCP, not UDP
+#define TXD_TUCMD_IP		(1 << 1)	// IPv4, not IPv6
+
+
 // E1000 Transmit (TX) descriptor structure
 typedef struct __attribute__((packed)) e1000_tx_desc_s 
 {
@@ -118,6 +164,33 @@ typedef struct __attribute__((packed)) e1000_tx_desc_s
 } e1000_tx_desc_t;
 
 
+// E1000 Transmit (TX) context descriptor, tells the NIC where the checksums
+// of the data descriptors that follow are. Takes a slot in the TX ring.
+typedef struct __attribute__((packed)) e1000_tx_ctx_desc_s
+{
+	volatile uint8_t	ipcss;		// IP header start
+	volatile uint8_t	ipcso;		// IP checksum offset
+	volatile uint16_t	ipcse;		// IP header end (inclusive)
+	volatile uint8_t	tucss;		// TCP/UDP header start
+	volatile uint8_t	tucso;		// TCP/UDP checksum offset
+	volatile uint16_t	tucse;		// 0, to the end of the frame
+	volatile uint32_t	cmd_and_length;	// TUCMD << 24, type 0
+	volatile uint8_t	sta;
+	volatile uint8_t	hdrlen;
+	volatile uint16_t	mss;
+} e1000_tx_ctx_desc_t;
+
+
+// Checksum offsets of a frame, as loaded into the NIC by a context descriptor
+typedef struct e1000_tx_ctx_s
+{
+	uint8_t			ipcse;
+	uint8_t			tucss;
+	uint8_t			tucso;
+	uint8_t			tucmd;
+} e1000_tx_ctx_t;
+
+
 // Device-specific structure
 typedef struct e1000_device_s
 {
@@ -138,13 +211,46 @@ typedef struct e1000_device_s
 	vaddr_t				mmio_vaddr;
 	uint32_t			io_base;
 	
+	unsigned int			itr;		// interrupts/s limit, 0 for none
+	uint32_t			irq_mask;	// causes enabled while not polling
+	spinlock_t			irq_lock;
+
 	volatile uint8_t		*rx_desc_base;
-	volatile e1000_rx_desc_t	*rx_desc[NUM_RX_DESCRIPTORS];	// receive descriptor buffer
-	volatile uint16_t		rx_cur;
+	volatile e1000_rx_desc_t	**rx_desc;	// receive descriptor buffer
+	struct pbuf			**rx_pbuf;	// pbuf each descriptor receives into
+	unsigned int			rx_count;	// descriptors in the ring
+	unsigned int			rx_budget;	// frames per poll
+	uint16_t			rx_cur;		// next descriptor to check
+	uint16_t			rx_tail;	// next descriptor to refill
+	bool				rx_polling;	// RX interrupts off, poll queued
+	struct tcpip_callback_msg	*rx_poll_msg;
+#if LWIP_NETCORE
+	struct tcpip_poller		poller;		// with net_core=, no RX/TX irqs
+#endif
+
+	uint64_t			rx_frames;
+	uint64_t			rx_dropped;
+	uint64_t			rx_polls;
+	uint64_t			rx_csum_err;	// bad checksums, left to lwIP
 	
 	volatile uint8_t		*tx_desc_base;
-	volatile e1000_tx_desc_t	*tx_desc[NUM_TX_DESCRIPTORS];	// transmit descriptor buffer
-	volatile uint16_t		tx_tail;
+	volatile e1000_tx_desc_t	**tx_desc;	// transmit descriptor buffer
+	struct pbuf			**tx_pbuf;	// frame starting at each descriptor
+	uint16_t			*tx_eop;	// ... and its last descriptor
+	unsigned int			tx_count;	// descriptors in the ring
+	uint16_t			tx_tail;	// next descriptor to fill
+	uint16_t			tx_clean;	// oldest descriptor still owned by the NIC
+	spinlock_t			tx_lock;
+	e1000_tx_ctx_t			tx_ctx;		// context the NIC has loaded
+	bool				tx_ctx_valid;
+
+	bool				csum_offload;	// NIC inserts and checks IPv4 checksums
+
+	uint64_t			tx_frames;
+	uint64_t			tx_copied;	// frames sent from a private copy
+	uint64_t			tx_busy;	// frames refused with the ring full
+	uint64_t			tx_csum;	// frames checksummed by the NIC
+	uint64_t			tx_ctx_loads;	// context descriptors queued
 	
 } e1000_device_t;
 
@@ -157,7 +263,13 @@ static struct netif e1000_netif;
 // E1000 specific state info.
 // E1000_netif->state points to this.
 // Only one E1000 instance is supported, so this is a global.
-static e1000_device_t e1000_state;
+static e1000_device_t e1000_state = {
+	.rx_count	= NUM_RX_DESCRIPTORS,
+	.tx_count	= NUM_TX_DESCRIPTORS,
+	.rx_budget	= E1000_RX_BUDGET,
+	.itr		= E1000_ITR,
+	.csum_offload	= true,
+};
 
 
 // Reads an E1000 register using I/O space accesses
@@ -270,6 +382,10 @@ e1000_phy_write( e1000_device_t *dev, int MDIC_REGADD, uint16_t MDIC_DATA )
 #define RCTL_SECRC			(1 << 26)
 
 
+#define RXCSUM_IPOFL			(1 << 8)	// IP checksum offload
+#define RXCSUM_TUOFL			(1 << 9)	// TCP/UDP checksum offload
+
+
 static void e1000_rx_enable(struct netif *netif)
 {
 	e1000_device_t *dev = netif->state;
@@ -277,37 +393,90 @@ static void e1000_rx_enable(struct netif *netif)
 }
 
 
+// Clamps a requested ring size to what the hardware takes
+static unsigned int e1000_ring_size(unsigned int count)
+{
+	count = max(count, 8U);
+	count = min(count, (unsigned int)MAX_DESCRIPTORS);
+	return count & ~7U;
+}
+
+
+// Posts fresh receive pbufs on every free descriptor behind the NIC and
+// tells it about all of them with one tail write. A failed allocation just
+// leaves the rest for the next poll.
+static void e1000_rx_refill(e1000_device_t *dev)
+{
+	unsigned int avail = (dev->rx_cur + dev->rx_count - dev->rx_tail - 1) % dev->rx_count;
+	uint16_t tail = dev->rx_tail;
+
+	while (avail--) {
+		struct pbuf *p = pbuf_alloc(PBUF_RAW, E1000_RX_BUF_SIZE, PBUF_RAM);
+
+		if (!p)
+			break;
+
+		dev->rx_pbuf[tail] = p;
+		dev->rx_desc[tail]->address = (uint64_t)__pa(p->payload);
+		dev->rx_desc[tail]->status = 0;
+		tail = (tail + 1) % dev->rx_count;
+	}
+
+	if (tail == dev->rx_tail)
+		return;
+
+	dev->rx_tail = tail;
+
+	// Descriptors have to be visible before the NIC is told about them
+	wmb();
+	mmio_write32(E1000_REG_RDT, tail);
+}
+
+
 static int e1000_rx_init(struct netif *netif)
 {
 	int i;
 	e1000_device_t *dev = netif->state;
+
+	dev->rx_count  = e1000_ring_size(dev->rx_count);
+	dev->rx_desc   = kmem_alloc(dev->rx_count * sizeof(*dev->rx_desc));
+	dev->rx_pbuf   = kmem_alloc(dev->rx_count * sizeof(*dev->rx_pbuf));
+	if (!dev->rx_budget)
+		dev->rx_budget = E1000_RX_BUDGET;
 	
 	// unaligned base address
-	uint64_t tmpbase = (uint64_t)kmem_alloc((sizeof(e1000_rx_desc_t) * NUM_RX_DESCRIPTORS) + 16);
+	uint64_t tmpbase = (uint64_t)kmem_alloc((sizeof(e1000_rx_desc_t) * dev->rx_count) + 16);
 	// aligned base address
 	dev->rx_desc_base = (tmpbase % 16) ? (uint8_t *)((tmpbase) + 16 - (tmpbase % 16)) : (uint8_t *)tmpbase;
 	
-	for (i = 0; i < NUM_RX_DESCRIPTORS; i++) {
+	for (i = 0; i < dev->rx_count; i++)
 		dev->rx_desc[i] = (e1000_rx_desc_t *)(dev->rx_desc_base + (i * 16));
-		dev->rx_desc[i]->address = (uint64_t)__pa(kmem_alloc(8192+16)); // packet buffer size (8K)
-		dev->rx_desc[i]->status = 0;
-	}
 	
 	// setup the receive descriptor ring buffer (TODO: >32-bits may be broken in this code)
 	mmio_write32( E1000_REG_RDBAH, (uint32_t)((uint64_t)__pa(dev->rx_desc_base) >> 32) );
 	mmio_write32( E1000_REG_RDBAL, (uint32_t)((uint64_t)__pa(dev->rx_desc_base) & 0xFFFFFFFF) );
 	
-	// receive buffer length; NUM_RX_DESCRIPTORS 16-byte descriptors
-	mmio_write32( E1000_REG_RDLEN, (uint32_t)(NUM_RX_DESCRIPTORS * 16) );
+	// receive buffer length; rx_count 16-byte descriptors
+	mmio_write32( E1000_REG_RDLEN, (uint32_t)(dev->rx_count * 16) );
 	
-	// setup head and tail pointers
+	// setup head and tail pointers, then hand the NIC its buffers
 	mmio_write32( E1000_REG_RDH, 0 );
-	mmio_write32( E1000_REG_RDT, NUM_RX_DESCRIPTORS - 1);
+	mmio_write32( E1000_REG_RDT, 0 );
 	dev->rx_cur = 0;
+	dev->rx_tail = 0;
+	e1000_rx_refill(dev);
+
+	// Interrupt moderation, ITR is the minimum gap in 256 ns units
+	if (dev->itr)
+		mmio_write32( E1000_REG_ITR, 1000000000 / (dev->itr * 256) );
 	
-	// set the receieve control register (promisc ON, 8K pkt size)
+	// check IP, TCP and UDP checksums, see e1000_rx_csum()
+	if (dev->csum_offload)
+		mmio_write32( E1000_REG_RXCSUM, RXCSUM_IPOFL | RXCSUM_TUOFL );
+
+	// set the receieve control register (promisc ON, 2K buffers)
 	mmio_write32( E1000_REG_RCTL, (RCTL_SBP | RDMTS_HALF |
-	                               RCTL_LPE | RCTL_BAM | RCTL_BSIZE_8192) );
+	                               RCTL_BAM | RCTL_BSIZE_2048) );
 	return 0;
 }
 
@@ -322,10 +491,15 @@ static int e1000_tx_init(struct netif *netif)
 	e1000_device_t *dev = netif->state;
 
 	
-	uint64_t tmpbase = (uint64_t)kmem_alloc((sizeof(e1000_tx_desc_t) * NUM_TX_DESCRIPTORS) + 16);
+	dev->tx_count = e1000_ring_size(dev->tx_count);
+	dev->tx_desc  = kmem_alloc(dev->tx_count * sizeof(*dev->tx_desc));
+	dev->tx_pbuf  = kmem_alloc(dev->tx_count * sizeof(*dev->tx_pbuf));
+	dev->tx_eop   = kmem_alloc(dev->tx_count * sizeof(*dev->tx_eop));
+
+	uint64_t tmpbase = (uint64_t)kmem_alloc((sizeof(e1000_tx_desc_t) * dev->tx_count) + 16);
 	dev->tx_desc_base = (tmpbase % 16) ? (uint8_t *)((tmpbase) + 16 - (tmpbase % 16)) : (uint8_t *)tmpbase;
 
-	for (i = 0; i < NUM_TX_DESCRIPTORS; i++) {
+	for (i = 0; i < dev->tx_count; i++) {
 		dev->tx_desc[i] = (e1000_tx_desc_t *)(dev->tx_desc_base + (i * 16));
 		dev->tx_desc[i]->address = 0;
 		dev->tx_desc[i]->cmd = 0;
@@ -335,111 +509,327 @@ static int e1000_tx_init(struct netif *netif)
 	mmio_write32( E1000_REG_TDBAH, (uint32_t)((uint64_t)__pa(dev->tx_desc_base) >> 32) );
 	mmio_write32( E1000_REG_TDBAL, (uint32_t)((uint64_t)__pa(dev->tx_desc_base) & 0xFFFFFFFF) );
 	
-	// transmit buffer length; NUM_TX_DESCRIPTORS 16-byte descriptors
-	mmio_write32( E1000_REG_TDLEN, (uint32_t)(NUM_TX_DESCRIPTORS * 16) );
+	// transmit buffer length; tx_count 16-byte descriptors
+	mmio_write32( E1000_REG_TDLEN, (uint32_t)(dev->tx_count * 16) );
 	
 	// setup head and tail pointers
 	mmio_write32( E1000_REG_TDH, 0 );
 	mmio_write32( E1000_REG_TDT, 0 );
 	dev->tx_tail = 0;
+	dev->tx_clean = 0;
+	dev->tx_ctx_valid = false;
+	spin_lock_init(&dev->tx_lock);
+
+	// coalesce completion interrupts a little (units of 1.024 us)
+	mmio_write32( E1000_REG_TIDV, 8 );
 	
 	// set the transmit control register (padshortpackets)
 	mmio_write32( E1000_REG_TCTL, (TCTL_EN | TCTL_PSP) );
 	return 0;
 }
 
-static err_t e1000_tx_send(struct netif *netif, char * buf, int len) {
-	e1000_device_t *dev = netif->state;
+// Number of descriptors that can be filled without catching up to the NIC.
+// One is always left empty, TDT == TDH means the ring is idle.
+static inline unsigned int
+e1000_tx_avail(e1000_device_t *dev)
+{
+	return (dev->tx_clean + dev->tx_count - dev->tx_tail - 1) % dev->tx_count;
+}
 
-	dev->tx_desc[dev->tx_tail]->address = (uint64_t) __pa(buf);
-	dev->tx_desc[dev->tx_tail]->length = len;
-	dev->tx_desc[dev->tx_tail]->cmd = ((1 << 3) | (3));
-	
-	// Update the tail so the hardware knows it's ready
-	int oldtail = dev->tx_tail;
-	dev->tx_tail = (dev->tx_tail + 1) % NUM_TX_DESCRIPTORS;
-	mmio_write32(E1000_REG_TDT, dev->tx_tail);
 
-	// Busy poll until the transmit is done
-	while (!(dev->tx_desc[oldtail]->sta & 0xF)) { }
-	
-	// printk("E1000: TX DONE: transmit status = 0x%01x\n", (dev->tx_desc[oldtail]->sta & 0xF));
-	return 0;
+// Releases the pbufs of every frame the NIC has finished with.
+// Frames complete in order, and only their last descriptor reports status.
+// Called with tx_lock held.
+static void
+e1000_tx_reclaim(e1000_device_t *dev)
+{
+	while (dev->tx_clean != dev->tx_tail) {
+		uint16_t eop = dev->tx_eop[dev->tx_clean];
+
+		if (!(dev->tx_desc[eop]->sta & TXD_STA_DD))
+			break;
+
+		pbuf_free(dev->tx_pbuf[dev->tx_clean]);
+		dev->tx_pbuf[dev->tx_clean] = NULL;
+		dev->tx_clean = (eop + 1) % dev->tx_count;
+	}
 }
 
-// BJK: assemble a single buffer from the queues in pkt
-static err_t e1000_tx_poll(struct netif *netif, struct pbuf *pkt) {
-	int off;
-	char buf[pkt->tot_len];
-	struct pbuf * q;
-
-	// Count the number of entries in the pbuf
-	off = 0;
-	for (q = pkt; q != NULL ; q = q->next) {
-		memcpy(buf + off, q->payload, q->len);
-		off += q->len;
+
+#define E1000_ETH_HLEN		14
+#define E1000_ETHTYPE_IP	0x0800
+
+
+// Readies an IPv4 frame for checksum offload: zeroes the IP header checksum
+// and seeds the TCP or UDP one with the pseudo header sum, to which the NIC
+// adds the sum over the segment. Fills in the offsets the NIC needs and
+// returns the POPTS bits to request, 0 if the frame is not IPv4, or -1 if
+// the headers are not all in the first pbuf. lwIP leaves the checksums of
+// this netif's frames to us, so every IPv4 frame needs one.
+static int
+e1000_tx_csum_prep(struct pbuf *p, e1000_tx_ctx_t *ctx)
+{
+	uint8_t *ip = (uint8_t *)p->payload + E1000_ETH_HLEN;
+	unsigned int ihl, l4off, csum_off;
+	ip_addr_t src, dst;
+	uint16_t csum;
+
+	if (p->len < E1000_ETH_HLEN + IP_HLEN)
+		return -1;
+
+	if (((ip[-2] << 8) | ip[-1]) != E1000_ETHTYPE_IP || (ip[0] >> 4) != 4)
+		return 0;
+
+	ihl = (ip[0] & 0x0f) * 4;
+	if (ihl < IP_HLEN)
+		return 0;
+	if (p->len < E1000_ETH_HLEN + ihl)
+		return -1;
+
+	l4off = E1000_ETH_HLEN + ihl;
+	ctx->ipcse = l4off - 1;
+	ctx->tucss = l4off;
+	ctx->tucso = l4off;
+	ctx->tucmd = TXD_TUCMD_IP;
+	ip[10] = ip[11] = 0;
+
+	// The NIC would sum a fragment's payload only, IP sums those in software
+	if ((ip[6] & 0x3f) || ip[7])
+		return TXD_POPTS_IXSM;
+
+	switch (ip[9]) {
+	case IP_PROTO_TCP:
+		csum_off = 16;
+		ctx->tucmd |= TXD_TUCMD_TCP;
+		break;
+	case IP_PROTO_UDP:
+		csum_off = 6;
+		break;
+	default:
+		return TXD_POPTS_IXSM;
 	}
 
-	return e1000_tx_send(netif, buf, pkt->tot_len);
+	if (p->len < l4off + csum_off + 2)
+		return -1;
+
+	memcpy(&src, ip + 12, sizeof(src));
+	memcpy(&dst, ip + 16, sizeof(dst));
+	csum = inet_chksum_pseudo_hdr(ip[9], ((ip[2] << 8) | ip[3]) - ihl, &src, &dst);
+	memcpy(ip + ihl + csum_off, &csum, sizeof(csum));
+
+	ctx->tucso = l4off + csum_off;
+	return TXD_POPTS_IXSM | TXD_POPTS_TXSM;
 }
 
 
-// This can be used stand-alone or from an interrupt handler
-static void e1000_rx_poll(struct netif *netif)
+// Fills in the checksums of an IPv4 frame in software. Used for the odd
+// frame the offload context can't describe, e.g. one shorter than its
+// headers claim; lwIP left its checksums to us as well. p is a single
+// pbuf of our own.
+static void
+e1000_tx_csum_sw(struct pbuf *p)
+{
+	uint8_t *ip = (uint8_t *)p->payload + E1000_ETH_HLEN;
+	unsigned int ihl, ip_len, l4off, csum_off;
+	ip_addr_t src, dst;
+	uint16_t csum;
+
+	if (p->len < E1000_ETH_HLEN + IP_HLEN)
+		return;
+
+	if (((ip[-2] << 8) | ip[-1]) != E1000_ETHTYPE_IP || (ip[0] >> 4) != 4)
+		return;
+
+	ihl    = (ip[0] & 0x0f) * 4;
+	ip_len = (ip[2] << 8) | ip[3];
+	if (ihl < IP_HLEN || p->len < E1000_ETH_HLEN + ihl)
+		return;
+
+	ip[10] = ip[11] = 0;
+	csum = inet_chksum(ip, ihl);
+	memcpy(ip + 10, &csum, sizeof(csum));
+
+	// Fragments are summed by IP before they get here
+	if ((ip[6] & 0x3f) || ip[7])
+		return;
+
+	switch (ip[9]) {
+	case IP_PROTO_TCP:
+		csum_off = 16;
+		break;
+	case IP_PROTO_UDP:
+		csum_off = 6;
+		break;
+	default:
+		return;
+	}
+
+	l4off = E1000_ETH_HLEN + ihl;
+	if (ip_len < ihl + csum_off + 2 || p->len < E1000_ETH_HLEN + ip_len)
+		return;
+
+	memcpy(&src, ip + 12, sizeof(src));
+	memcpy(&dst, ip + 16, sizeof(dst));
+	ip[ihl + csum_off] = ip[ihl + csum_off + 1] = 0;
+
+	pbuf_header(p, -(s16_t)l4off);
+	csum = inet_chksum_pseudo_partial(p, ip[9], ip_len - ihl, ip_len - ihl,
+					  &src, &dst);
+	pbuf_header(p, (s16_t)l4off);
+
+	if (ip[9] == IP_PROTO_UDP && csum == 0)
+		csum = 0xffff;
+	memcpy(ip + ihl + csum_off, &csum, sizeof(csum));
+}
+
+
+// Loads ctx into the NIC through the descriptor at i, unless it already has
+// it. The NIC keeps the last context it was given and processes the ring in
+// order, so this only costs a slot when the header layout changes.
+// Called with tx_lock held. Returns the index of the next free descriptor.
+static uint16_t
+e1000_tx_ctx_load(e1000_device_t *dev, uint16_t i, const e1000_tx_ctx_t *ctx)
+{
+	volatile e1000_tx_ctx_desc_t *cd;
+
+	if (dev->tx_ctx_valid && !memcmp(&dev->tx_ctx, ctx, sizeof(*ctx)))
+		return i;
+
+	cd = (volatile e1000_tx_ctx_desc_t *)dev->tx_desc[i];
+	cd->ipcss          = E1000_ETH_HLEN;
+	cd->ipcso          = E1000_ETH_HLEN + 10;
+	cd->ipcse          = ctx->ipcse;
+	cd->tucss          = ctx->tucss;
+	cd->tucso          = ctx->tucso;
+	cd->tucse          = 0;
+	cd->cmd_and_length = (uint32_t)(TXD_CMD_DEXT | ctx->tucmd) << 24;
+	cd->sta            = 0;
+	cd->hdrlen         = 0;
+	cd->mss            = 0;
+
+	dev->tx_ctx       = *ctx;
+	dev->tx_ctx_valid = true;
+	dev->tx_ctx_loads++;
+
+	return (i + 1) % dev->tx_count;
+}
+
+
+// Queues a frame on the TX ring, one descriptor per pbuf in the chain, and
+// returns without waiting for the wire. The chain is held with pbuf_ref()
+// until the NIC reports it done. PBUF_REF payloads belong to the caller and
+// may change once we return, so those frames (and very fragmented ones) are
+// copied into a single pbuf first, as are frames whose headers need
+// checksums filled in but are split across pbufs. So are chains someone
+// else also holds, such as a TCP segment still on the ring from its last
+// transmission; we can't fill in checksums under them. When the ring is full
+// the frame is refused with ERR_MEM; TCP retransmits it and UDP senders see
+// the error.
+static err_t
+e1000_tx_queue(struct netif *netif, struct pbuf *pkt)
 {
-	struct pbuf *p;
 	e1000_device_t *dev = netif->state;
+	struct pbuf *q;
+	unsigned int segs = 0;
+	bool copy = false;
+	e1000_tx_ctx_t ctx;
+	int popts = 0;
+	unsigned long flags;
+	uint16_t first, last = 0, i;
+
+	for (q = pkt; q != NULL; q = q->next) {
+		if (q->len)
+			segs++;
+		if ((q->type == PBUF_REF) || (q->ref != 1))
+			copy = true;
+	}
 
-	// printk("E1000: packet received! [h=%d, t=%d]\n", mmio_read32(E1000_REG_RDH),
-	mmio_read32(E1000_REG_RDT);
+	if (segs == 0)
+		return ERR_OK;
 
-	while ((dev->rx_desc[dev->rx_cur]->status & (1 << 0))) {
-		// raw packet and packet length (excluding CRC)
-		uint8_t *pkt = __va((void *)dev->rx_desc[dev->rx_cur]->address);
-		uint16_t pktlen = dev->rx_desc[dev->rx_cur]->length;
-		bool dropflag = false;
+	if (dev->csum_offload && !copy && segs <= E1000_TX_MAX_SEGS) {
+		popts = e1000_tx_csum_prep(pkt, &ctx);
+		if (popts < 0)
+			copy = true;
+	}
 
-		if (pktlen < 60) {
-			printk(KERN_WARNING "E1000: short packet (%u bytes)\n", pktlen);
-			dropflag = true;
+	if (copy || segs > E1000_TX_MAX_SEGS) {
+		q = pbuf_alloc(PBUF_RAW, pkt->tot_len, PBUF_RAM);
+		if (!q)
+			return ERR_MEM;
+		pbuf_copy(q, pkt);
+		pkt = q;
+		segs = 1;
+		copy = true;
+
+		if (dev->csum_offload) {
+			popts = e1000_tx_csum_prep(pkt, &ctx);
+			if (popts < 0) {
+				e1000_tx_csum_sw(pkt);
+				popts = 0;
+			}
 		}
+	} else {
+		pbuf_ref(pkt);
+	}
 
-		// while not technically an error, there is no support in this driver
-		if (!(dev->rx_desc[dev->rx_cur]->status & (1 << 1))) {
-			printk(KERN_WARNING "E1000: no EOP set! (len=%u, 0x%x 0x%x 0x%x)\n", 
-				pktlen, pkt[0], pkt[1], pkt[2]);
-			dropflag = true;
-		}
-		
-		if (dev->rx_desc[dev->rx_cur]->errors) {
-			printk(KERN_WARNING "E1000: rx errors (0x%x)\n", dev->rx_desc[dev->rx_cur]->errors);
-			dropflag = true;
-		}
+	spin_lock_irqsave(&dev->tx_lock, flags);
 
-		if (!dropflag) {
-			p = pbuf_alloc(PBUF_RAW, pktlen, PBUF_POOL);
-			if (!p) {
-				printk(KERN_WARNING "Unable to allocate pbuf! dropping packet\n");
-			} else {
-				memcpy(p->payload, pkt, pktlen);
-				p->len = p->tot_len = pktlen;
-				p->next = 0x0;
-
-				// send the packet to higher layers for parsing
-				if (netif->input(p, netif) != ERR_OK) {
-					printk(KERN_ERR "Packet receive failed!\n");
-					pbuf_free(p);
-				}
-			}
+	e1000_tx_reclaim(dev);
+
+	// One more for the context descriptor, in case it is needed
+	if (e1000_tx_avail(dev) < segs + (popts ? 1 : 0)) {
+		dev->tx_busy++;
+		spin_unlock_irqrestore(&dev->tx_lock, flags);
+		pbuf_free(pkt);
+		return ERR_MEM;
+	}
+
+	first = i = dev->tx_tail;
+	if (popts) {
+		i = e1000_tx_ctx_load(dev, i, &ctx);
+		dev->tx_csum++;
+	}
+
+	for (q = pkt; q != NULL; q = q->next) {
+		volatile e1000_tx_desc_t *desc = dev->tx_desc[i];
+
+		if (!q->len)
+			continue;
+
+		desc->address = (uint64_t) __pa(q->payload);
+		desc->length  = q->len;
+		desc->special = 0;
+		desc->sta     = 0;
+		if (popts) {
+			desc->cso = TXD_DTYP_D;
+			desc->css = popts;
+			desc->cmd = TXD_CMD_IFCS | TXD_CMD_DEXT;
+		} else {
+			desc->cso = 0;
+			desc->css = 0;
+			desc->cmd = TXD_CMD_IFCS;
 		}
-		
-		// update RX cur pointer
-		dev->rx_desc[dev->rx_cur]->status = (uint16_t)(0);
-		dev->rx_cur = (dev->rx_cur + 1) % NUM_RX_DESCRIPTORS;
-		
-		// write the tail to the device
-		mmio_write32(E1000_REG_RDT, (mmio_read32(E1000_REG_RDT) + 1) % NUM_RX_DESCRIPTORS);
+
+		last = i;
+		i = (i + 1) % dev->tx_count;
 	}
+	dev->tx_desc[last]->cmd |= (TXD_CMD_EOP | TXD_CMD_RS | TXD_CMD_IDE);
+
+	dev->tx_pbuf[first] = pkt;
+	dev->tx_eop[first]  = last;
+	dev->tx_tail        = i;
+	dev->tx_frames++;
+	if (copy)
+		dev->tx_copied++;
+
+	// Descriptors have to be visible before the NIC is told about them
+	wmb();
+	mmio_write32(E1000_REG_TDT, dev->tx_tail);
+
+	spin_unlock_irqrestore(&dev->tx_lock, flags);
+
+	return ERR_OK;
 }
 
 
@@ -459,6 +849,177 @@ static void e1000_rx_poll(struct netif *netif)
 #define E1000_ICR_SRPD      0x00010000  // Small receive packet detected
 
 
+// RX causes, masked while a poll is queued
+#define E1000_RX_INTS	(E1000_ICR_RXT0 | E1000_ICR_RXDMT0 | E1000_ICR_RXO)
+
+
+// RX descriptor status bits
+#define RXD_STA_DD	(1 << 0)	// Descriptor done
+#define RXD_STA_EOP	(1 << 1)	// End of packet
+#define RXD_STA_IXSM	(1 << 2)	// Ignore the checksum bits
+#define RXD_STA_TCPCS	(1 << 5)	// TCP/UDP checksum checked
+#define RXD_STA_IPCS	(1 << 6)	// IP checksum checked
+
+
+// RX descriptor error bits
+#define RXD_ERR_TCPE	(1 << 5)	// TCP/UDP checksum error
+#define RXD_ERR_IPE	(1 << 6)	// IP checksum error
+
+
+// Tells lwIP which checksums of a received frame the NIC has verified, so
+// it doesn't sum them again. A frame with a bad one goes up unmarked and is
+// dropped (and counted) by the stack like any other.
+static void e1000_rx_csum(e1000_device_t *dev, struct pbuf *p,
+                          uint8_t status, uint8_t errors)
+{
+	if (!dev->csum_offload || (status & RXD_STA_IXSM))
+		return;
+
+	if (errors & (RXD_ERR_IPE | RXD_ERR_TCPE))
+		dev->rx_csum_err++;
+
+	if ((status & RXD_STA_IPCS) && !(errors & RXD_ERR_IPE))
+		p->flags |= PBUF_FLAG_IP_CHKSUM_OK;
+
+	if ((status & RXD_STA_TCPCS) && !(errors & RXD_ERR_TCPE))
+		p->flags |= PBUF_FLAG_L4_CHKSUM_OK;
+}
+
+
+// Hands up to budget received frames to the stack and refills the ring.
+// The pbuf a frame was received into goes up as it is, no copy is made.
+// Runs in the tcpip thread, so frames skip tcpip_input()'s mailbox.
+// Returns the number of descriptors consumed.
+static unsigned int e1000_rx_clean(struct netif *netif, unsigned int budget)
+{
+	e1000_device_t *dev = netif->state;
+	unsigned int done = 0;
+
+	while (done < budget && (dev->rx_desc[dev->rx_cur]->status & RXD_STA_DD)) {
+		volatile e1000_rx_desc_t *desc = dev->rx_desc[dev->rx_cur];
+		struct pbuf *p = dev->rx_pbuf[dev->rx_cur];
+		uint8_t *pkt = p->payload;
+		uint16_t pktlen = desc->length;
+		uint8_t status = desc->status;
+		uint8_t errors = desc->errors;
+		bool dropflag = false;
+
+		if (pktlen < 60) {
+			printk(KERN_WARNING "E1000: short packet (%u bytes)\n", pktlen);
+			dropflag = true;
+		}
+
+		// while not technically an error, there is no support in this driver
+		if (!(status & RXD_STA_EOP)) {
+			printk(KERN_WARNING "E1000: no EOP set! (len=%u, 0x%x 0x%x 0x%x)\n", 
+				pktlen, pkt[0], pkt[1], pkt[2]);
+			dropflag = true;
+		}
+		
+		// checksum errors are the stack's to deal with
+		if (errors & ~(RXD_ERR_IPE | RXD_ERR_TCPE)) {
+			printk(KERN_WARNING "E1000: rx errors (0x%x)\n", errors);
+			dropflag = true;
+		}
+
+		dev->rx_pbuf[dev->rx_cur] = NULL;
+		desc->status = 0;
+		dev->rx_cur = (dev->rx_cur + 1) % dev->rx_count;
+		done++;
+
+		if (dropflag) {
+			dev->rx_dropped++;
+			pbuf_free(p);
+			continue;
+		}
+
+		pbuf_realloc(p, pktlen);
+		e1000_rx_csum(dev, p, status, errors);
+		dev->rx_frames++;
+
+		// send the packet to higher layers for parsing
+		if (ethernet_input(p, netif) != ERR_OK) {
+			printk(KERN_ERR "Packet receive failed!\n");
+			pbuf_free(p);
+		}
+	}
+
+	e1000_rx_refill(dev);
+
+	return done;
+}
+
+
+// Queued by the interrupt handler with RX interrupts masked. Works through
+// the ring rx_budget frames at a time, requeueing itself between batches so
+// other mailbox traffic gets in, and unmasks RX interrupts once the ring is
+// empty. Under load the NIC is serviced by polling alone.
+static void e1000_rx_poll(void *arg)
+{
+	struct netif *netif = arg;
+	e1000_device_t *dev = netif->state;
+	unsigned long flags;
+
+	for (;;) {
+		dev->rx_polls++;
+
+		if (e1000_rx_clean(netif, dev->rx_budget) == dev->rx_budget) {
+			if (tcpip_trycallback(dev->rx_poll_msg) == ERR_OK)
+				return;
+			continue;
+		}
+
+		spin_lock_irqsave(&dev->irq_lock, flags);
+
+		// A frame that landed after the last check is ours, not the IRQ's
+		if (dev->rx_desc[dev->rx_cur]->status & RXD_STA_DD) {
+			spin_unlock_irqrestore(&dev->irq_lock, flags);
+			continue;
+		}
+
+		dev->rx_polling = false;
+		mmio_write32(E1000_REG_IMS, E1000_RX_INTS);
+		spin_unlock_irqrestore(&dev->irq_lock, flags);
+		return;
+	}
+}
+
+
+#if LWIP_NETCORE
+// Called by the tcpip thread on every pass of its loop when it has a core
+// to itself. RX and TX interrupts stay masked, so this reclaims finished
+// frames as well as handing up received ones.
+static unsigned int e1000_netcore_poll(void *arg, unsigned int budget)
+{
+	struct netif *netif = arg;
+	e1000_device_t *dev = netif->state;
+	unsigned long flags;
+
+	if (dev->tx_clean != dev->tx_tail) {
+		spin_lock_irqsave(&dev->tx_lock, flags);
+		e1000_tx_reclaim(dev);
+		spin_unlock_irqrestore(&dev->tx_lock, flags);
+	}
+
+	return e1000_rx_clean(netif, min(budget, dev->rx_budget));
+}
+#endif
+
+
+// Queues the RX poll, called from the interrupt handler with irq_lock held.
+// The handler leaves RX interrupts masked while rx_polling is set. If the
+// tcpip mailbox is full they stay enabled and the next interrupt retries.
+static void e1000_rx_schedule(e1000_device_t *dev)
+{
+	if (dev->rx_polling)
+		return;
+
+	dev->rx_polling = true;
+	if (tcpip_trycallback(dev->rx_poll_msg) != ERR_OK)
+		dev->rx_polling = false;
+}
+
+
 static irqreturn_t
 e1000_interrupt_handler(int vector, void *priv)
 {
@@ -478,11 +1039,17 @@ e1000_interrupt_handler(int vector, void *priv)
 	}
 
 	// Disable interrupts
+	spin_lock(&dev->irq_lock);
 	mmio_write32(E1000_REG_IMC, ~0);
 
-	// tx success stuff
-	// This clears the TX interrupts
-	icr &= ~(E1000_ICR_TXCW | E1000_ICR_TXQE);
+	// TX completions, hand the sent frames back to lwIP
+	if (icr & (E1000_ICR_TXCW | E1000_ICR_TXQE)) {
+		icr &= ~(E1000_ICR_TXCW | E1000_ICR_TXQE);
+
+		spin_lock(&dev->tx_lock);
+		e1000_tx_reclaim(dev);
+		spin_unlock(&dev->tx_lock);
+	}
 
 	// LINK STATUS CHANGE
 	if (icr & (E1000_ICR_LSC)) {
@@ -501,26 +1068,10 @@ e1000_interrupt_handler(int vector, void *priv)
 		printk(KERN_INFO "E1000: PHY EPSTATUS = 0x%04x\n", e1000_phy_read(dev, E1000_PHYREG_EPSTATUS));
 	}
 	
-	// RX underrun / min threshold
-	if (icr & (E1000_ICR_RXO) || icr & (E1000_ICR_RXDMT0)) {
-		icr &= ~((E1000_ICR_RXO) | (E1000_ICR_RXDMT0));
-		//printk(" underrun (rx_head = %u, rx_cur = %u)\n", mmio_read32(E1000_REG_RDH), dev->rx_cur);
-		//printk(" overrun (rx head = %u, rx tail = %u)\n", mmio_read32(E1000_REG_RDH),
-		mmio_read32(E1000_REG_RDT);
-		
-		//volatile int i;
-		//for (i = 0; i < NUM_RX_DESCRIPTORS; i++) {
-		//	if (dev->rx_desc[i]->status)
-		//		printk(" pending descriptor (i=%u, status=0x%x)\n", i, dev->rx_desc[i]->status );
-		//}
-		
-		e1000_rx_poll(netif);
-	}
-
-	// packet is pending
-	if (icr & (E1000_ICR_RXT0)) {
-		icr &= ~(E1000_ICR_RXT0);
-		e1000_rx_poll(netif);
+	// RX frames, underrun or min threshold, poll them from the tcpip thread
+	if (icr & E1000_RX_INTS) {
+		icr &= ~E1000_RX_INTS;
+		e1000_rx_schedule(dev);
 	}
 	
 	if (icr)
@@ -529,8 +1080,9 @@ e1000_interrupt_handler(int vector, void *priv)
 	// clearing the pending interrupts
 	mmio_read32(E1000_REG_ICR);
 
-	// Enable interrupts
-	mmio_write32(E1000_REG_IMS, 0xFFFFFFFF);
+	// Enable interrupts, except RX while a poll is queued
+	mmio_write32(E1000_REG_IMS, dev->rx_polling ? dev->irq_mask & ~E1000_RX_INTS : dev->irq_mask);
+	spin_unlock(&dev->irq_lock);
 
 	return IRQ_HANDLED;
 }
@@ -582,9 +1134,16 @@ e1000_hw_init(struct netif *netif)
 	// Initialize the rest of the Lightweight IP netif structure
 	netif->mtu        = 1500;
 	netif->flags      = (NETIF_FLAG_LINK_UP | NETIF_FLAG_ETHARP);
-	netif->linkoutput = e1000_tx_poll;
+	netif->linkoutput = e1000_tx_queue;
 	netif->output     = etharp_output;
 
+	// The NIC inserts the IPv4, TCP and UDP checksums, see e1000_tx_csum_prep()
+	if (dev->csum_offload)
+		NETIF_SET_CHECKSUM_CTRL(netif, NETIF_CHECKSUM_ENABLE_ALL &
+		                        ~(NETIF_CHECKSUM_GEN_IP |
+		                          NETIF_CHECKSUM_GEN_UDP |
+		                          NETIF_CHECKSUM_GEN_TCP));
+
 	// Set the E1000 LINK UP
 	mmio_write32(E1000_REG_CTRL, (mmio_read32(E1000_REG_CTRL) | CTRL_SLU));
 	
@@ -599,6 +1158,12 @@ e1000_hw_init(struct netif *netif)
 	cmd |= PCIM_CMD_BUSMASTEREN;
 	pci_write(dev->pci_dev, PCIR_COMMAND, 2, cmd);
 			
+	// RX frames are polled from the tcpip thread, see e1000_rx_poll()
+	spin_lock_init(&dev->irq_lock);
+	dev->rx_poll_msg = tcpip_callbackmsg_new(e1000_rx_poll, netif);
+	if (!dev->rx_poll_msg)
+		return ERR_MEM;
+
 	// Initialize the E1000 transmit and receive state
 	e1000_rx_init(netif);
 	e1000_tx_init(netif);
@@ -614,7 +1179,19 @@ e1000_hw_init(struct netif *netif)
 	irq_request(vector, &e1000_interrupt_handler, 0, "e1000", netif);
 
 	// enable all interrupts (and clear existing pending ones)
-	mmio_write32(E1000_REG_IMS, 0x1F6DC);
+	dev->irq_mask = 0x1F6DC | E1000_ICR_TXCW;
+
+#if LWIP_NETCORE
+	// The network core polls the rings, only link changes interrupt
+	if (tcpip_polling()) {
+		dev->irq_mask &= ~(E1000_RX_INTS | E1000_ICR_TXCW | E1000_ICR_TXQE);
+		dev->poller.poll = e1000_netcore_poll;
+		dev->poller.arg = netif;
+		tcpip_poller_add(&dev->poller);
+	}
+#endif
+
+	mmio_write32(E1000_REG_IMS, dev->irq_mask);
 	mmio_read32(E1000_REG_ICR);
 	
 	return 0;
@@ -696,3 +1273,8 @@ DRIVER_INIT("net", e1000_init);
 DRIVER_PARAM_STRING(ip, e1000_state.ip_str, sizeof(e1000_state.ip_str));
 DRIVER_PARAM_STRING(nm, e1000_state.nm_str, sizeof(e1000_state.nm_str));
 DRIVER_PARAM_STRING(gw, e1000_state.gw_str, sizeof(e1000_state.gw_str));
+DRIVER_PARAM_NAMED(rx_ring, e1000_state.rx_count, uint);
+DRIVER_PARAM_NAMED(tx_ring, e1000_state.tx_count, uint);
+DRIVER_PARAM_NAMED(rx_budget, e1000_state.rx_budget, uint);
+DRIVER_PARAM_NAMED(itr, e1000_state.itr, uint);
+DRIVER_PARAM_NAMED(csum_offload, e1000_state.csum_offload, bool);
@@ -12,6 +12,8 @@
 #include <lwk/driver.h>
 #include <lwk/netdev.h>
 #include <lwk/interrupt.h>
+#include <lwk/spinlock.h>
+#include <lwk/params.h>
 #include <lwk/pci/pci.h>
 #include <lwip/netif.h>
 #include <lwip/inet.h>
@@ -30,8 +32,8 @@
 #define TX_RING_SIZE 1024
 #define RX_BUF_SIZE 1536
 #define TX_BUF_SIZE 1536
+#define RX_BUDGET 64	/* frames per poll, see r8169_rx_poll() */
 
-typedef uint8_t r8169_rx_buf_t[RX_RING_SIZE*RX_BUF_SIZE] __attribute__((aligned(8)));
 typedef uint8_t r8169_tx_buf_t[TX_RING_SIZE*TX_BUF_SIZE] __attribute__((aligned(8)));
 typedef struct Desc r8169_rx_ring_t[RX_RING_SIZE] __attribute__((aligned(256)));
 typedef struct Desc r8169_tx_ring_t[TX_RING_SIZE] __attribute__((aligned(256)));
@@ -40,10 +42,24 @@ typedef struct Desc r8169_tx_ring_t[TX_RING_SIZE] __attribute__((aligned(256)));
 typedef struct r8169_device_s {
 	pci_dev_t *pci_dev;
 
-	uint32_t cur_rx;
+	uint32_t cur_rx;	/* next descriptor to check */
+	uint32_t dirty_rx;	/* next descriptor to refill */
 	uint32_t cur_tx;
 
-	r8169_rx_buf_t rx_buf;
+	/* RX descriptors point straight at pbufs that go up to lwIP */
+	struct pbuf *rx_pbuf[RX_RING_SIZE];
+	unsigned int rx_count;	/* descriptors in use, rx_ring= */
+	unsigned int rx_budget;
+	bool rx_polling;	/* RX interrupts masked, poll queued */
+	struct tcpip_callback_msg *rx_poll_msg;
+	uint16_t intr_mask;	/* causes enabled while not polling */
+#if LWIP_NETCORE
+	struct tcpip_poller poller;	/* with net_core=, no RX/TX interrupts */
+#endif
+
+	uint16_t intr_mitigate;	/* IntrMitigate register, intr_mitigate= */
+	spinlock_t irq_lock;
+
 	r8169_tx_buf_t tx_buf;
 	r8169_tx_buf_t tx_hi_buf;
 
@@ -67,7 +83,10 @@ typedef struct r8169_device_s {
 
 static struct netif r8169_netif;
 
-static r8169_device_t r8169_state;
+static r8169_device_t r8169_state = {
+	.rx_count  = RX_RING_SIZE,
+	.rx_budget = RX_BUDGET,
+};
 
 static const int r8169_debug = 0;
 
@@ -75,6 +94,10 @@ static const uint32_t r8169_intr_mask =
 	SYSErr | TxDescUnavail | RxFIFOOver | LinkChg | RxOverflow | 
 	TxErr | TxOK | RxErr | RxOK;
 
+/* RX causes, masked while a poll is queued */
+static const uint16_t r8169_rx_intr_mask =
+	RxFIFOOver | RxOverflow | RxErr | RxOK;
+
 static err_t r8169_tx( struct netif * const netif, struct pbuf * const p ) {
 	r8169_device_t *dev = netif->state;
 
@@ -125,63 +148,155 @@ static err_t r8169_tx( struct netif * const netif, struct pbuf * const p ) {
 	return ERR_OK;
 }
 
-static void r8169_rx( struct netif * const netif ) {
-	r8169_device_t *dev = netif->state;
+/*
+ * Gives every empty descriptor behind cur_rx a fresh pbuf and hands it back
+ * to the NIC. A failed allocation leaves the rest for the next poll; the
+ * NIC stops at the first descriptor it doesn't own and raises RxOverflow.
+ */
+static void r8169_rx_refill( r8169_device_t *dev ) {
+	while( dev->rx_pbuf[dev->dirty_rx] == NULL ) {
+		unsigned int entry = dev->dirty_rx;
+		struct Desc *rx_desc = dev->rx_ring + entry;
+		struct pbuf *p = pbuf_alloc( PBUF_RAW, RX_BUF_SIZE, PBUF_RAM );
+		uint64_t paddr;
+
+		if( !p )
+			break;
 
-	if( r8169_debug ) {
-		printk("Packet Received\n");  
+		paddr = __pa(p->payload);
+		dev->rx_pbuf[entry] = p;
+		rx_desc->addr_lo = paddr & 0xfffffffful;
+		rx_desc->addr_hi = paddr >> 32;
+		rx_desc->opts2 = 0;
+
+		/* The address has to be in place before the NIC owns it */
+		wmb();
+		rx_desc->opts1 = DescOwn | ((entry == dev->rx_count-1) ? RingEnd : 0) | RX_BUF_SIZE;
+
+		dev->dirty_rx = (entry + 1) % dev->rx_count;
 	}
+}
+
+/*
+ * Hands up to budget received frames to lwIP, each in the pbuf the NIC
+ * received it into, then refills the ring. Runs in the tcpip thread, so
+ * frames skip tcpip_input()'s mailbox. Returns the descriptors consumed.
+ */
+static unsigned int r8169_rx_clean( struct netif * const netif, unsigned int budget ) {
+	r8169_device_t *dev = netif->state;
+	unsigned int done = 0;
 
-	while( (inb(IOADDR(dev, R8169_CR)) & RxBufEmpty) == 0 ) {
-		unsigned int rx_entry = dev->cur_rx % RX_RING_SIZE;
-		struct Desc *rx_desc = dev->rx_ring + rx_entry;
-		int32_t pkt_len = (rx_desc->opts1 & 0x00001fff);
-		uint64_t paddr = (uint64_t)rx_desc->addr_hi << 32 | rx_desc->addr_lo;
-		uint8_t *pkt_data = (uint8_t *)(__va(paddr));
+	/* Ack first, a frame arriving from here on raises the bits again */
+	outw(RxAckBits | RxErr, IOADDR(dev, R8169_ISR));
 
-		if( rx_desc->opts1 & DescOwn ) {
+	while( done < budget ) {
+		struct Desc *rx_desc = dev->rx_ring + dev->cur_rx;
+		struct pbuf *p = dev->rx_pbuf[dev->cur_rx];
+		uint32_t status = ACCESS_ONCE(rx_desc->opts1);
+		int32_t pkt_len = (status & 0x00001fff);
+
+		if( !p || (status & DescOwn) ) {
 			if( r8169_debug ) {
 				printk("RX processing finished\n");
 			}
 			break;
 		}
 
+		/* Read the rest of the descriptor and frame after the status */
+		rmb();
+
+		dev->rx_pbuf[dev->cur_rx] = NULL;
+		dev->cur_rx = (dev->cur_rx + 1) % dev->rx_count;
+		done++;
+
+		if( status & RxRES ) {
+			printk( KERN_WARNING "%s: RX error (0x%x), dropping\n", __func__, status);
+			pbuf_free( p );
+			continue;
+		}
+
 		if( r8169_debug ) {
 			printk("Packet RX Size = %u\n", pkt_len);
 			uint16_t i;
 			for (i = 0; i < pkt_len; i++){
-				printk(" %x ", *((uint8_t *)(pkt_data + i)));
+				printk(" %x ", ((uint8_t *)p->payload)[i]);
 			}
 			printk("\n");
 		}
 
-		struct pbuf * p = pbuf_alloc( PBUF_RAW, pkt_len, PBUF_POOL );
-		if( !p ) {
-			printk( KERN_ERR "%s: Unable to allocate pbuf! dropping\n", __func__);
-			return;
-		}
-    
-		memcpy(p->payload, pkt_data, pkt_len);
-		p->tot_len = pkt_len;
-		p->next = 0x0;
-   
-		rx_desc->opts1 |= DescOwn;
-		outw(RxAckBits, IOADDR(dev, R8169_ISR));
-
-		dev->cur_rx++;
+		pbuf_realloc( p, pkt_len );
 
-		if( netif->input( p, netif ) != ERR_OK ) {
+		if( ethernet_input( p, netif ) != ERR_OK ) {
 			printk( KERN_ERR "%s: Packet receive failed!\n", __func__);
 			pbuf_free( p );
-			return;
 		}
+	}
 
-		if( r8169_debug ) {
-			printk("Packet Processed.  cur_rx = %d\n", dev->cur_rx);
+	r8169_rx_refill(dev);
+
+	return done;
+}
+
+/*
+ * Queued by the interrupt handler with RX interrupts masked. Works through
+ * the ring rx_budget frames at a time, requeueing itself between batches
+ * so other mailbox traffic gets in, and unmasks RX interrupts once the
+ * ring is empty.
+ */
+static void r8169_rx_poll( void *arg ) {
+	struct netif *netif = arg;
+	r8169_device_t *dev = netif->state;
+	unsigned long flags;
+
+	for (;;) {
+		if( r8169_rx_clean(netif, dev->rx_budget) == dev->rx_budget ) {
+			if( tcpip_trycallback(dev->rx_poll_msg) == ERR_OK )
+				return;
+			continue;
+		}
+
+		spin_lock_irqsave(&dev->irq_lock, flags);
+
+		/* A frame that landed after the last check is ours, not the IRQ's */
+		if( dev->rx_pbuf[dev->cur_rx] &&
+		    !(ACCESS_ONCE(dev->rx_ring[dev->cur_rx].opts1) & DescOwn) ) {
+			spin_unlock_irqrestore(&dev->irq_lock, flags);
+			continue;
 		}
+
+		dev->rx_polling = false;
+		outw(dev->intr_mask, IOADDR(dev, R8169_IMR));
+		spin_unlock_irqrestore(&dev->irq_lock, flags);
+		return;
 	}
 }
 
+#if LWIP_NETCORE
+/*
+ * Called by the tcpip thread on every pass of its loop when it has a core
+ * to itself, with RX interrupts left masked.
+ */
+static unsigned int r8169_netcore_poll( void *arg, unsigned int budget ) {
+	struct netif *netif = arg;
+	r8169_device_t *dev = netif->state;
+
+	return r8169_rx_clean(netif, min(budget, dev->rx_budget));
+}
+#endif
+
+/*
+ * Queues the RX poll, called from the interrupt handler with irq_lock held.
+ * If the tcpip mailbox is full RX interrupts stay on and the next one retries.
+ */
+static void r8169_rx_schedule( r8169_device_t *dev ) {
+	if( dev->rx_polling )
+		return;
+
+	dev->rx_polling = true;
+	if( tcpip_trycallback(dev->rx_poll_msg) != ERR_OK )
+		dev->rx_polling = false;
+}
+
 static void r8169_clear_irq( r8169_device_t *dev, uint32_t interrupts ) {
 
 	outw(interrupts, IOADDR(dev, R8169_ISR));
@@ -206,16 +321,11 @@ static irqreturn_t r8169_interrupt( int vector, void *priv ) {
 		if( status & RX_FEMP ) printk("Receive FIFO Empty\n");
 	}
 
-	if( status & PKT_RX ) {
-		r8169_clear_irq(dev, status);
-		r8169_rx(&r8169_netif );
-		if( r8169_debug ) {
-			if( inb(IOADDR(dev, R8169_CR)) & RxBufEmpty ) {
-				printk("Receive Buffer Empty\n");
-			} else {
-				printk("Packet present in RX buffer\n");
-			}
-		}
+	spin_lock(&dev->irq_lock);
+
+	/* Received frames are taken off the ring from the tcpip thread */
+	if( status & r8169_rx_intr_mask ) {
+		r8169_rx_schedule(dev);
 	}
 
 	if( status & TX_OK ) {
@@ -230,6 +340,11 @@ static irqreturn_t r8169_interrupt( int vector, void *priv ) {
 	}
 
 	r8169_clear_irq(dev, status);
+
+	outw(dev->rx_polling ? (dev->intr_mask & ~r8169_rx_intr_mask) : dev->intr_mask,
+	     IOADDR(dev, R8169_IMR));
+	spin_unlock(&dev->irq_lock);
+
 	return IRQ_HANDLED;
 }
 
@@ -257,6 +372,17 @@ static err_t r8169_hw_init( struct netif * const netif ) {
 
 	dev->cur_tx = 0;
 	dev->cur_rx = 0;
+	dev->dirty_rx = 0;
+
+	if( dev->rx_count < 2 || dev->rx_count > RX_RING_SIZE )
+		dev->rx_count = RX_RING_SIZE;
+	if( dev->rx_budget == 0 )
+		dev->rx_budget = RX_BUDGET;
+
+	spin_lock_init(&dev->irq_lock);
+	dev->rx_poll_msg = tcpip_callbackmsg_new(r8169_rx_poll, netif);
+	if( !dev->rx_poll_msg )
+		return ERR_MEM;
 
 	outw(0x0000, IOADDR(dev, R8169_IMR));
 
@@ -273,19 +399,13 @@ static err_t r8169_hw_init( struct netif * const netif ) {
 	outb(R9346CR_EEM_CONFIG, IOADDR(dev, R8169_9346CR));
   
 	outw(CPLUS_MULRW, IOADDR(dev, R8169_CPLUSCR));
-	outb(0x00, IOADDR(dev, R8169_INTRMIT));
+	outw(dev->intr_mitigate, IOADDR(dev, R8169_INTRMIT));
 
 	/* Enable Tx/Rx before setting transfer thresholds */
 	outb(CmdRxEnb | CmdTxEnb, IOADDR(dev, R8169_CR));
  
 	/* Allocate Rx Buffers */
-	for( unsigned int i = 0; i < RX_RING_SIZE; i++ ) {
-		paddr = __pa(dev->rx_buf + (i * RX_BUF_SIZE));
-		dev->rx_ring[i].addr_lo = paddr & 0xfffffffful;
-		dev->rx_ring[i].addr_hi = paddr >> 32;
-		dev->rx_ring[i].opts1 = (1 << 31) | ((i==RX_RING_SIZE-1) ? (1 << 30) : 0) | RX_BUF_SIZE; 
-		dev->rx_ring[i].opts2 = 0; 
-	}
+	r8169_rx_refill(dev);
 
 	/* Initialize Rx */
 	outw(RX_BUF_SIZE, IOADDR(dev, R8169_RMS));
@@ -369,7 +489,19 @@ static err_t r8169_hw_init( struct netif * const netif ) {
 	irq_request(R8169_IDTVEC, &r8169_interrupt, 0, "r8169", NULL);
 
 	/* Enable all known interrupts by setting the interrupt mask. */
-	outw(r8169_intr_mask, IOADDR(dev, R8169_IMR));
+	dev->intr_mask = r8169_intr_mask;
+
+#if LWIP_NETCORE
+	/* The network core polls the RX ring, TX needs no completions */
+	if( tcpip_polling() ) {
+		dev->intr_mask &= ~(r8169_rx_intr_mask | TxOK | TxErr | TxDescUnavail);
+		dev->poller.poll = r8169_netcore_poll;
+		dev->poller.arg = netif;
+		tcpip_poller_add(&dev->poller);
+	}
+#endif
+
+	outw(dev->intr_mask, IOADDR(dev, R8169_IMR));
 
 	netif->mtu		= R8169_MTU;
 	netif->flags		= 0
@@ -433,3 +565,6 @@ DRIVER_INIT("net", r8169_init);
 DRIVER_PARAM_STRING(ip, r8169_state.ip_str, sizeof(r8169_state.ip_str));
 DRIVER_PARAM_STRING(nm, r8169_state.nm_str, sizeof(r8169_state.nm_str));
 DRIVER_PARAM_STRING(gw, r8169_state.gw_str, sizeof(r8169_state.gw_str));
+DRIVER_PARAM_NAMED(rx_ring, r8169_state.rx_count, uint);
+DRIVER_PARAM_NAMED(rx_budget, r8169_state.rx_budget, uint);
+DRIVER_PARAM_NAMED(intr_mitigate, r8169_state.intr_mitigate, ushort);
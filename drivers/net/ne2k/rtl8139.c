@@ -12,6 +12,8 @@
 #include <lwk/driver.h>
 #include <lwk/netdev.h>
 #include <lwk/interrupt.h>
+#include <lwk/spinlock.h>
+#include <lwk/params.h>
 #include <lwk/pci/pci.h>
 #include <lwip/netif.h>
 #include <lwip/inet.h>
@@ -28,6 +30,7 @@
 #define RX_BUF_SIZE (32 * 1024)
 #define TX_BUF_SIZE 1536
 #define TX_FIFO_THRESH 256
+#define RX_BUDGET 64	/* frames per poll, see rtl8139_rx_poll() */
 
 typedef uint8_t rtl8139_rx_buf_t[RX_BUF_SIZE + 1500];
 typedef uint8_t rtl8139_tx_buf_t[4][TX_BUF_SIZE] __attribute__((aligned(4)));
@@ -41,6 +44,15 @@ typedef struct rtl8139_device_s {
 	uint32_t cur_rx;
 	uint32_t cur_tx;
 
+	unsigned int rx_budget;	/* rx_budget= */
+	bool rx_polling;	/* RX interrupts masked, poll queued */
+	struct tcpip_callback_msg *rx_poll_msg;
+	uint16_t intr_mask;	/* causes enabled while not polling */
+#if LWIP_NETCORE
+	struct tcpip_poller poller;	/* with net_core=, no RX/TX interrupts */
+#endif
+	spinlock_t irq_lock;
+
 	rtl8139_rx_buf_t rx_buf;
 	rtl8139_tx_buf_t tx_buf;
 
@@ -60,9 +72,11 @@ typedef struct rtl8139_device_s {
 
 static struct netif rtl8139_netif;
 
-static rtl8139_device_t rtl8139_state;
+static rtl8139_device_t rtl8139_state = {
+	.rx_budget = RX_BUDGET,
+};
 
-static const int rtl8139_debug = 1;
+static const int rtl8139_debug = 0;
 
 static uint32_t tx_flag = (TX_FIFO_THRESH << 11) & 0x003f0000;
 
@@ -70,6 +84,10 @@ static const uint32_t rtl8139_intr_mask =
 	PCIErr | PCSTimeout | RxUnderrun | RxOverflow | RxFIFOOver | 
 	TxErr | TxOK | RxErr | RxOK;
 
+/* RX causes, masked while a poll is queued */
+static const uint32_t rtl8139_rx_intr_mask =
+	RxUnderrun | RxOverflow | RxFIFOOver | RxErr | RxOK;
+
 
 static err_t rtl8139_tx(struct netif * const netif, struct pbuf * const p) {
 	rtl8139_device_t *dev = netif->state;
@@ -119,14 +137,25 @@ static __inline__ void wrap_copy(uint8_t * dst, const unsigned char * ring,
 	memcpy(dst, ring + offset, size);
 }
 
-static void rtl8139_rx(struct netif * const netif) {
+/*
+ * Copies up to budget frames out of the receive ring and hands them to
+ * lwIP. The 8139 receives into one contiguous ring rather than per-frame
+ * buffers, so a copy is unavoidable here; what polling saves is the
+ * interrupt and the tcpip_input() mailbox trip per frame, since this runs
+ * in the tcpip thread. Returns the number of frames taken.
+ */
+static unsigned int rtl8139_rx_clean(struct netif * const netif, unsigned int budget) {
 	rtl8139_device_t *dev = netif->state;
+	unsigned int done = 0;
 
 	if (rtl8139_debug) {
 		printk("Packet Received\n");  
 	}
 
-	while( (inb(IOADDR(dev, RTL8139_CR)) & RxBufEmpty) == 0){
+	/* Ack first, a frame arriving from here on raises the bits again */
+	outw(RxAckBits, IOADDR(dev, RTL8139_ISR));
+
+	while( done < budget && (inb(IOADDR(dev, RTL8139_CR)) & RxBufEmpty) == 0){
 		uint16_t ring_offset = dev->cur_rx % RX_BUF_SIZE;
 		uint8_t * buf_ptr = (dev->rx_buf + ring_offset);
 
@@ -176,20 +205,18 @@ static void rtl8139_rx(struct netif * const netif) {
 					"%s: Unable to allocate pbuf! dropping\n",
 					__func__
 					);
-				return;
 			}
-    
-		//p->payload = data;
-		//p->tot_len = len;
-    
-		// Copy the memory into the pbuf payload
-		struct pbuf * q = p;
-		uint32_t offset = 0;
-		for( q = p ; q != NULL ; q = q->next )
+		else
 			{
-				// This is ugly...
-				wrap_copy( q->payload, dev->rx_buf, (ring_offset + 4 + offset) , q->len );
-				offset += q->len;
+				// Copy the memory into the pbuf payload
+				struct pbuf * q = p;
+				uint32_t offset = 0;
+				for( q = p ; q != NULL ; q = q->next )
+					{
+						// This is ugly...
+						wrap_copy( q->payload, dev->rx_buf, (ring_offset + 4 + offset) , q->len );
+						offset += q->len;
+					}
 			}
     
 		dev->cur_rx = ((dev->cur_rx + rx_size + 4 + 3) % RX_BUF_SIZE) & ~3;
@@ -202,20 +229,21 @@ static void rtl8139_rx(struct netif * const netif) {
 			printk("Packet counter at %d\n", dev->pkt_cntr);
 		}
 
-		// clear ISR
-		outw(RxAckBits, IOADDR(dev, RTL8139_ISR));
+		done++;
+
+		if( !p )
+			continue;
 
 		// Receive the packet
 		// We have to figure out if its arp or not... 
 
-		if( netif->input( p, netif ) != ERR_OK )
+		if( ethernet_input( p, netif ) != ERR_OK )
 			{
 				printk( KERN_ERR
 					"%s: Packet receive failed!\n",
 					__func__
 					);
 				pbuf_free( p );
-				return;
 			}
 
 
@@ -225,6 +253,66 @@ static void rtl8139_rx(struct netif * const netif) {
 			printk("Packet Processed\n");
 		}
 	}
+
+	return done;
+}
+
+/*
+ * Queued by the interrupt handler with RX interrupts masked. Empties the
+ * ring rx_budget frames at a time, requeueing itself between batches so
+ * other mailbox traffic gets in, and unmasks RX interrupts when done.
+ */
+static void rtl8139_rx_poll(void *arg) {
+	struct netif *netif = arg;
+	rtl8139_device_t *dev = netif->state;
+	unsigned long flags;
+
+	for (;;) {
+		if (rtl8139_rx_clean(netif, dev->rx_budget) == dev->rx_budget) {
+			if (tcpip_trycallback(dev->rx_poll_msg) == ERR_OK)
+				return;
+			continue;
+		}
+
+		spin_lock_irqsave(&dev->irq_lock, flags);
+
+		/* A frame that landed after the last check is ours, not the IRQ's */
+		if ((inb(IOADDR(dev, RTL8139_CR)) & RxBufEmpty) == 0) {
+			spin_unlock_irqrestore(&dev->irq_lock, flags);
+			continue;
+		}
+
+		dev->rx_polling = false;
+		outw(dev->intr_mask, IOADDR(dev, RTL8139_IMR));
+		spin_unlock_irqrestore(&dev->irq_lock, flags);
+		return;
+	}
+}
+
+#if LWIP_NETCORE
+/*
+ * Called by the tcpip thread on every pass of its loop when it has a core
+ * to itself, with RX interrupts left masked.
+ */
+static unsigned int rtl8139_netcore_poll(void *arg, unsigned int budget) {
+	struct netif *netif = arg;
+	rtl8139_device_t *dev = netif->state;
+
+	return rtl8139_rx_clean(netif, min(budget, dev->rx_budget));
+}
+#endif
+
+/*
+ * Queues the RX poll, called from the interrupt handler with irq_lock held.
+ * If the tcpip mailbox is full RX interrupts stay on and the next one retries.
+ */
+static void rtl8139_rx_schedule(rtl8139_device_t *dev) {
+	if (dev->rx_polling)
+		return;
+
+	dev->rx_polling = true;
+	if (tcpip_trycallback(dev->rx_poll_msg) != ERR_OK)
+		dev->rx_polling = false;
 }
 
 static void rtl8139_clear_irq( rtl8139_device_t *dev, uint32_t interrupts ) {
@@ -245,17 +333,12 @@ rtl8139_interrupt(
 		printk("Interrupt Received: 0x%x\n", status);
 	}
 
-	if( status & PKT_RX ) {
-		rtl8139_clear_irq(dev, status);
-		rtl8139_rx(&rtl8139_netif );
-		
-		if (rtl8139_debug) {
-			if (inb(IOADDR(dev, RTL8139_CR)) & RxBufEmpty) {
-				printk("Receive Buffer Empty\n");
-			} else {
-				printk("Packet present in RX buffer\n");
-			}
-		}
+	spin_lock(&dev->irq_lock);
+
+	/* Received frames are taken off the ring from the tcpip thread */
+	if( status & rtl8139_rx_intr_mask ) {
+		rtl8139_clear_irq(dev, status & rtl8139_rx_intr_mask);
+		rtl8139_rx_schedule(dev);
 	}
 
 	if (status & TX_OK) {
@@ -264,7 +347,10 @@ rtl8139_interrupt(
 		}
 		rtl8139_clear_irq(dev, TX_OK);
 	}
-	
+
+	outw(dev->rx_polling ? (dev->intr_mask & ~rtl8139_rx_intr_mask) : dev->intr_mask,
+	     IOADDR(dev, RTL8139_IMR));
+	spin_unlock(&dev->irq_lock);
 
 	return IRQ_HANDLED;
 }
@@ -293,6 +379,14 @@ static err_t rtl8139_hw_init(struct netif * const netif) {
 	dev->pkt_cntr = 0;
 	dev->cur_tx = 0;
 	dev->cur_rx = 0;
+
+	if (dev->rx_budget == 0)
+		dev->rx_budget = RX_BUDGET;
+
+	spin_lock_init(&dev->irq_lock);
+	dev->rx_poll_msg = tcpip_callbackmsg_new(rtl8139_rx_poll, netif);
+	if (!dev->rx_poll_msg)
+		return ERR_MEM;
   
 	/* Reset the chip */
 	outb(CmdReset, IOADDR(dev, RTL8139_CR));
@@ -368,7 +462,19 @@ static err_t rtl8139_hw_init(struct netif * const netif) {
 	irq_request( RTL8139_IDTVEC, &rtl8139_interrupt, 0,  "rtl8139", NULL );
 
 	/* Enable all known interrupts by setting the interrupt mask. */
-	outw(rtl8139_intr_mask, IOADDR(dev, RTL8139_IMR));
+	dev->intr_mask = rtl8139_intr_mask;
+
+#if LWIP_NETCORE
+	/* The network core polls the RX ring, TX needs no completions */
+	if (tcpip_polling()) {
+		dev->intr_mask &= ~(rtl8139_rx_intr_mask | TxOK | TxErr);
+		dev->poller.poll = rtl8139_netcore_poll;
+		dev->poller.arg = netif;
+		tcpip_poller_add(&dev->poller);
+	}
+#endif
+
+	outw(dev->intr_mask, IOADDR(dev, RTL8139_IMR));
   
 	netif->mtu		= RTL8139_MTU;
 	netif->flags		= 0
@@ -433,3 +539,4 @@ DRIVER_INIT("net", rtl8139_init);
 DRIVER_PARAM_STRING(ip, rtl8139_state.ip_str, sizeof(rtl8139_state.ip_str));
 DRIVER_PARAM_STRING(nm, rtl8139_state.nm_str, sizeof(rtl8139_state.nm_str));
 DRIVER_PARAM_STRING(gw, rtl8139_state.gw_str, sizeof(rtl8139_state.gw_str));
+DRIVER_PARAM_NAMED(rx_budget, rtl8139_state.rx_budget, uint);
@@ -0,0 +1,906 @@
+/*
+ * Virtio network device driver (virtio 1.0, modern PCI).
+ *
+ * Each queue pair is a receive and a transmit virtqueue. With MSI-X every
+ * pair gets its own vector, aimed at its own CPU, and receive interrupts
+ * are turned off while the tcpip thread polls the pair's ring, the way
+ * e1000 does it. Transmit completions don't interrupt at all; finished
+ * frames are reclaimed when the next one is queued and on every poll.
+ *
+ * Both sides of each ring use event indexes when the device offers them,
+ * so the device is only notified when it is waiting for buffers and only
+ * interrupts when we asked to hear about a used one. Frames sent while a
+ * poll is running are notified in one go when it ends.
+ */
+
+#include <lwk/driver.h>
+#include <lwk/netdev.h>
+#include <lwk/interrupt.h>
+#include <lwk/delay.h>
+#include <lwk/spinlock.h>
+#include <lwk/params.h>
+#include <lwk/smp.h>
+#include <lwk/cpumask.h>
+#include <lwk/pci/pci.h>
+#include <lwk/virtio.h>
+#include <lwip/netif.h>
+#include <lwip/tcpip.h>
+#include <lwip/etharp.h>
+#include <lwip/inet.h>
+#include <lwip/inet_chksum.h>
+#include <lwip/ip.h>
+#include <arch/page.h>
+#include <arch/io_apic.h>
+
+
+// Default descriptors per virtqueue, ring= overrides. The device may
+// offer fewer.
+#define VNET_RING_SIZE		256
+
+
+// Receive buffer size, a whole frame plus the header fits in one
+#define VNET_RX_BUF_SIZE	2048
+
+
+// Default frames handled per RX poll before yielding to the rest of the stack
+#define VNET_RX_BUDGET		64
+
+
+// Most buffers a single frame may use before it is copied into one
+#define VNET_TX_MAX_SEGS	16
+
+
+// Most queue pairs driven, one per CPU up to this
+#define VNET_MAX_PAIRS		16
+
+
+// Device feature bits
+#define VIRTIO_NET_F_CSUM	0	// device sums frames we send
+#define VIRTIO_NET_F_GUEST_CSUM	1	// ... and tells us about those it checked
+#define VIRTIO_NET_F_MAC	5	// device has a MAC address for us
+#define VIRTIO_NET_F_MRG_RXBUF	15	// frames may span receive buffers
+#define VIRTIO_NET_F_CTRL_VQ	17	// control virtqueue
+#define VIRTIO_NET_F_MQ		22	// multiple queue pairs
+
+
+// Device configuration layout
+#define VIRTIO_NET_CFG_MAC		0
+#define VIRTIO_NET_CFG_MAX_PAIRS	8
+
+
+// Precedes every frame in both directions. With VIRTIO_F_VERSION_1
+// num_buffers is always there, the device fills it in on receive.
+struct virtio_net_hdr {
+	uint8_t			flags;
+	uint8_t			gso_type;
+	uint16_t		hdr_len;
+	uint16_t		gso_size;
+	uint16_t		csum_start;	// sum from here to the end
+	uint16_t		csum_offset;	// ... and store it this far on
+	uint16_t		num_buffers;	// receive buffers the frame spans
+} __attribute__((packed));
+
+#define VIRTIO_NET_HDR_F_NEEDS_CSUM	1
+#define VIRTIO_NET_HDR_F_DATA_VALID	2
+
+
+// Control virtqueue commands, a class/command header, its data and a
+// status byte the device writes
+struct virtio_net_ctrl {
+	uint8_t			class;
+	uint8_t			cmd;
+	uint16_t		pairs;
+	uint8_t			ack;
+} __attribute__((packed));
+
+#define VIRTIO_NET_CTRL_MQ		4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET	0
+#define VIRTIO_NET_OK			0
+
+
+#define VNET_ETH_HLEN		14
+#define VNET_ETHTYPE_IP		0x0800
+
+
+struct vnet_device_s;
+
+
+// One receive and transmit virtqueue pair
+typedef struct vnet_queue_s
+{
+	struct vnet_device_s *		dev;
+	unsigned int			index;
+	unsigned int			cpu;		// interrupts go here
+	int				vector;		// -1 if sharing INTx
+
+	struct virtqueue *		rx_vq;
+	bool				rx_polling;	// callbacks off, poll queued
+	struct tcpip_callback_msg	*rx_poll_msg;
+	unsigned int			rx_skip;	// buffers left of a dropped frame
+	spinlock_t			irq_lock;
+
+	struct virtqueue *		tx_vq;
+	struct virtio_net_hdr *		tx_hdr;		// per chain head
+	spinlock_t			tx_lock;
+
+	uint64_t			rx_frames;
+	uint64_t			rx_dropped;
+	uint64_t			rx_polls;
+	uint64_t			tx_frames;
+	uint64_t			tx_copied;	// frames sent from a private copy
+	uint64_t			tx_busy;	// frames refused with the ring full
+	uint64_t			tx_csum;	// frames checksummed by the device
+} vnet_queue_t;
+
+
+// Device-specific structure
+typedef struct vnet_device_s
+{
+	pci_dev_t *			pci_dev;
+	struct virtio_dev		vdev;
+	struct netif *			netif;
+
+	char				ip_str[16];
+	char				nm_str[16];
+	char				gw_str[16];
+
+	ip_addr_t			ip;
+	ip_addr_t			nm;
+	ip_addr_t			gw;
+
+	unsigned int			ring_size;	// requested per virtqueue
+	unsigned int			rx_budget;	// frames per poll
+	unsigned int			max_pairs;	// queues=, 0 for one per CPU
+	bool				csum_offload;
+
+	unsigned int			num_pairs;
+	vnet_queue_t			queue[VNET_MAX_PAIRS];
+	struct virtqueue *		ctrl_vq;
+	bool				msix;
+	bool				tx_defer;	// a poll kicks TX when done
+#if LWIP_NETCORE
+	struct tcpip_poller		poller;		// with net_core=, no RX irqs
+#endif
+} vnet_device_t;
+
+
+// Lightweight IP network interface structure for the virtio-net driver.
+// Only one instance is supported, so this is a global.
+static struct netif vnet_netif;
+
+
+// vnet_netif.state points to this.
+// Only one instance is supported, so this is a global.
+static vnet_device_t vnet_state = {
+	.ring_size	= VNET_RING_SIZE,
+	.rx_budget	= VNET_RX_BUDGET,
+	.csum_offload	= true,
+};
+
+
+// Posts fresh receive pbufs until the ring is full and notifies the
+// device once, if it is waiting for them. A failed allocation just leaves
+// the rest for the next poll.
+static void
+vnet_rx_refill(vnet_queue_t *q)
+{
+	while (vq_num_free(q->rx_vq)) {
+		struct pbuf *p = pbuf_alloc(PBUF_RAW, VNET_RX_BUF_SIZE, PBUF_RAM);
+		struct virtio_buf buf;
+
+		if (!p)
+			break;
+
+		buf.addr = __pa(p->payload);
+		buf.len  = VNET_RX_BUF_SIZE;
+		vq_add(q->rx_vq, &buf, 0, 1, p);
+	}
+
+	vq_kick(q->rx_vq);
+}
+
+
+// Hands up to budget received frames to the stack and refills the ring.
+// The pbufs a frame was received into go up as they are, the header
+// stripped off the first. Runs in the tcpip thread, so frames skip
+// tcpip_input()'s mailbox. Returns the number of frames taken.
+static unsigned int
+vnet_rx_clean(vnet_queue_t *q, unsigned int budget)
+{
+	vnet_device_t *dev = q->dev;
+	struct netif *netif = dev->netif;
+	unsigned int done = 0;
+	struct pbuf *p;
+	u32 len;
+
+	while (done < budget && (p = vq_get(q->rx_vq, &len)) != NULL) {
+		struct virtio_net_hdr *hdr;
+		uint16_t nbufs;
+		uint8_t flags;
+		bool dropflag = false;
+
+		// The tail of a frame dropped for missing buffers, not a header
+		if (q->rx_skip) {
+			q->rx_skip--;
+			pbuf_free(p);
+			continue;
+		}
+
+		hdr = p->payload;
+		nbufs = hdr->num_buffers;
+		flags = hdr->flags;
+		done++;
+
+		if (len < sizeof(*hdr) + VNET_ETH_HLEN) {
+			printk(KERN_WARNING "virtio-net: short packet (%u bytes)\n", len);
+			dropflag = true;
+		}
+
+		pbuf_realloc(p, len);
+		pbuf_header(p, -(s16_t)sizeof(*hdr));
+
+		// The rest of a frame spanning several buffers follows in order
+		if (!virtio_has_feature(&dev->vdev, VIRTIO_NET_F_MRG_RXBUF))
+			nbufs = 1;
+		while (nbufs-- > 1) {
+			struct pbuf *m = vq_get(q->rx_vq, &len);
+
+			if (!m) {
+				printk(KERN_WARNING "virtio-net: frame missing %u buffers\n", nbufs);
+				q->rx_skip = nbufs;
+				dropflag = true;
+				break;
+			}
+			pbuf_realloc(m, len);
+			pbuf_cat(p, m);
+		}
+
+		if (dropflag) {
+			q->rx_dropped++;
+			pbuf_free(p);
+			continue;
+		}
+
+		// Checked by the device, or a local sender left the L4 checksum to
+		// a NIC that was never there. Either way it needn't be summed.
+		if (flags & (VIRTIO_NET_HDR_F_DATA_VALID | VIRTIO_NET_HDR_F_NEEDS_CSUM))
+			p->flags |= PBUF_FLAG_L4_CHKSUM_OK;
+
+		q->rx_frames++;
+
+		// send the packet to higher layers for parsing
+		if (ethernet_input(p, netif) != ERR_OK) {
+			printk(KERN_ERR "Packet receive failed!\n");
+			pbuf_free(p);
+		}
+	}
+
+	vnet_rx_refill(q);
+
+	return done;
+}
+
+
+// Releases the pbufs of every frame the device has finished with.
+// Called with tx_lock held.
+static void
+vnet_tx_reclaim(vnet_queue_t *q)
+{
+	struct pbuf *p;
+
+	while ((p = vq_get(q->tx_vq, NULL)) != NULL)
+		pbuf_free(p);
+}
+
+
+// Notifies the device of the frames queued while tx_defer was set
+static void
+vnet_tx_flush(vnet_device_t *dev)
+{
+	unsigned long flags;
+	unsigned int i;
+
+	for (i = 0; i < dev->num_pairs; i++) {
+		vnet_queue_t *q = &dev->queue[i];
+
+		spin_lock_irqsave(&q->tx_lock, flags);
+		vq_kick(q->tx_vq);
+		spin_unlock_irqrestore(&q->tx_lock, flags);
+	}
+}
+
+
+// Readies an IPv4 TCP or UDP frame for checksum offload: seeds its
+// checksum field with the pseudo header sum, to which the device adds the
+// sum over the segment, and tells it where that is in hdr. Returns 1 if
+// the frame is offloaded, 0 if not (not IPv4 TCP/UDP, or a fragment, whose
+// sum IP already did), or -1 if the headers are not all in the first pbuf.
+// The IP header checksum is always lwIP's.
+static int
+vnet_tx_csum_prep(struct pbuf *p, struct virtio_net_hdr *hdr)
+{
+	uint8_t *ip = (uint8_t *)p->payload + VNET_ETH_HLEN;
+	unsigned int ihl, l4off, csum_off;
+	ip_addr_t src, dst;
+	uint16_t csum;
+
+	if (p->len < VNET_ETH_HLEN + IP_HLEN)
+		return -1;
+
+	if (((ip[-2] << 8) | ip[-1]) != VNET_ETHTYPE_IP || (ip[0] >> 4) != 4)
+		return 0;
+
+	ihl = (ip[0] & 0x0f) * 4;
+	if (ihl < IP_HLEN || (ip[6] & 0x3f) || ip[7])
+		return 0;
+
+	switch (ip[9]) {
+	case IP_PROTO_TCP:
+		csum_off = 16;
+		break;
+	case IP_PROTO_UDP:
+		csum_off = 6;
+		break;
+	default:
+		return 0;
+	}
+
+	l4off = VNET_ETH_HLEN + ihl;
+	if (p->len < l4off + csum_off + 2)
+		return -1;
+
+	memcpy(&src, ip + 12, sizeof(src));
+	memcpy(&dst, ip + 16, sizeof(dst));
+	csum = inet_chksum_pseudo_hdr(ip[9], ((ip[2] << 8) | ip[3]) - ihl, &src, &dst);
+	memcpy(ip + ihl + csum_off, &csum, sizeof(csum));
+
+	hdr->flags       = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+	hdr->csum_start  = l4off;
+	hdr->csum_offset = csum_off;
+	return 1;
+}
+
+
+// Queues a frame on the transmit queue of the CPU we're on, a header and
+// one buffer per pbuf in the chain, and returns without waiting for the
+// device. The chain is held with pbuf_ref() until the device is done with
+// it. PBUF_REF payloads belong to the caller and may change once we
+// return, so those frames (and very fragmented ones) are copied into a
+// single pbuf first, as are frames whose headers need checksums seeded but
+// are split across pbufs. When the ring is full the frame is refused with
+// ERR_MEM; TCP retransmits it and UDP senders see the error.
+static err_t
+vnet_tx_queue(struct netif *netif, struct pbuf *pkt)
+{
+	vnet_device_t *dev = netif->state;
+	vnet_queue_t *q = &dev->queue[this_cpu % dev->num_pairs];
+	struct virtio_buf bufs[VNET_TX_MAX_SEGS + 1];
+	struct virtio_net_hdr hdr = { 0 };
+	struct pbuf *p;
+	unsigned int segs = 0, n;
+	bool copy = false;
+	int csum = 0;
+	unsigned long flags;
+
+	for (p = pkt; p != NULL; p = p->next) {
+		if (p->len)
+			segs++;
+		if (p->type == PBUF_REF)
+			copy = true;
+	}
+
+	if (segs == 0)
+		return ERR_OK;
+
+	if (dev->csum_offload && !copy && segs <= VNET_TX_MAX_SEGS) {
+		csum = vnet_tx_csum_prep(pkt, &hdr);
+		if (csum < 0)
+			copy = true;
+	}
+
+	if (copy || segs > VNET_TX_MAX_SEGS) {
+		p = pbuf_alloc(PBUF_RAW, pkt->tot_len, PBUF_RAM);
+		if (!p)
+			return ERR_MEM;
+		pbuf_copy(p, pkt);
+		pkt = p;
+		segs = 1;
+		copy = true;
+
+		// A runt that still doesn't hold the headers isn't worth offloading
+		if (dev->csum_offload)
+			csum = max(vnet_tx_csum_prep(pkt, &hdr), 0);
+	} else {
+		pbuf_ref(pkt);
+	}
+
+	spin_lock_irqsave(&q->tx_lock, flags);
+
+	vnet_tx_reclaim(q);
+
+	if (vq_num_free(q->tx_vq) < segs + 1) {
+		q->tx_busy++;
+		spin_unlock_irqrestore(&q->tx_lock, flags);
+		pbuf_free(pkt);
+		return ERR_MEM;
+	}
+
+	// The header lives in the slot of the descriptor the chain will
+	// start at, so it stays put until the device is done with the frame
+	q->tx_hdr[q->tx_vq->free_head] = hdr;
+	bufs[0].addr = __pa(&q->tx_hdr[q->tx_vq->free_head]);
+	bufs[0].len  = sizeof(hdr);
+
+	for (p = pkt, n = 1; p != NULL; p = p->next) {
+		if (!p->len)
+			continue;
+		bufs[n].addr = __pa(p->payload);
+		bufs[n].len  = p->len;
+		n++;
+	}
+
+	vq_add(q->tx_vq, bufs, n, 0, pkt);
+	if (!dev->tx_defer)
+		vq_kick(q->tx_vq);
+
+	q->tx_frames++;
+	if (copy)
+		q->tx_copied++;
+	if (csum > 0)
+		q->tx_csum++;
+
+	spin_unlock_irqrestore(&q->tx_lock, flags);
+
+	return ERR_OK;
+}
+
+
+// Queued by the interrupt handler with the pair's RX callbacks off. Works
+// through the ring rx_budget frames at a time, requeueing itself between
+// batches so other mailbox traffic gets in, and turns callbacks back on
+// once the ring is empty. Replies sent meanwhile go out with one
+// notification at the end of each batch.
+static void
+vnet_rx_poll(void *arg)
+{
+	vnet_queue_t *q = arg;
+	vnet_device_t *dev = q->dev;
+	unsigned long flags;
+	unsigned int done;
+
+	for (;;) {
+		q->rx_polls++;
+
+		dev->tx_defer = true;
+		done = vnet_rx_clean(q, dev->rx_budget);
+
+		spin_lock_irqsave(&q->tx_lock, flags);
+		vnet_tx_reclaim(q);
+		spin_unlock_irqrestore(&q->tx_lock, flags);
+
+		dev->tx_defer = false;
+		vnet_tx_flush(dev);
+
+		if (done == dev->rx_budget) {
+			if (tcpip_trycallback(q->rx_poll_msg) == ERR_OK)
+				return;
+			continue;
+		}
+
+		spin_lock_irqsave(&q->irq_lock, flags);
+
+		// A frame that landed after the last check is ours, not the IRQ's
+		if (!vq_enable_cb(q->rx_vq)) {
+			vq_disable_cb(q->rx_vq);
+			spin_unlock_irqrestore(&q->irq_lock, flags);
+			continue;
+		}
+
+		q->rx_polling = false;
+		spin_unlock_irqrestore(&q->irq_lock, flags);
+		return;
+	}
+}
+
+
+#if LWIP_NETCORE
+// Called by the tcpip thread on every pass of its loop when it has a core
+// to itself. RX callbacks stay off, so this reclaims finished frames as
+// well as handing up received ones, on every pair.
+static unsigned int
+vnet_netcore_poll(void *arg, unsigned int budget)
+{
+	vnet_device_t *dev = arg;
+	unsigned int i, done = 0;
+	unsigned long flags;
+
+	dev->tx_defer = true;
+	for (i = 0; i < dev->num_pairs; i++) {
+		vnet_queue_t *q = &dev->queue[i];
+
+		spin_lock_irqsave(&q->tx_lock, flags);
+		vnet_tx_reclaim(q);
+		spin_unlock_irqrestore(&q->tx_lock, flags);
+
+		done += vnet_rx_clean(q, min(budget, dev->rx_budget));
+	}
+	dev->tx_defer = false;
+	vnet_tx_flush(dev);
+
+	return done;
+}
+#endif
+
+
+// Queues the pair's RX poll with its callbacks off. If the tcpip mailbox
+// is full they stay on and the next interrupt retries.
+static void
+vnet_rx_schedule(vnet_queue_t *q)
+{
+	spin_lock(&q->irq_lock);
+	if (!q->rx_polling) {
+		vq_disable_cb(q->rx_vq);
+		q->rx_polling = true;
+		if (tcpip_trycallback(q->rx_poll_msg) != ERR_OK) {
+			q->rx_polling = false;
+			vq_enable_cb(q->rx_vq);
+		}
+	}
+	spin_unlock(&q->irq_lock);
+}
+
+
+// A pair's own MSI-X vector, only its receive queue interrupts
+static irqreturn_t
+vnet_msix_handler(int vector, void *priv)
+{
+	vnet_rx_schedule(priv);
+	return IRQ_HANDLED;
+}
+
+
+// Shared INTx line, reading the ISR tells whether it was us
+static irqreturn_t
+vnet_intx_handler(int vector, void *priv)
+{
+	vnet_device_t *dev = priv;
+
+	if (!(virtio_isr_read(&dev->vdev) & 1))
+		return IRQ_NONE;
+
+	vnet_rx_schedule(&dev->queue[0]);
+	return IRQ_HANDLED;
+}
+
+
+// Tells the device how many queue pairs to use, it starts with one
+static int
+vnet_set_pairs(vnet_device_t *dev, unsigned int pairs)
+{
+	struct virtio_net_ctrl *ctrl;
+	struct virtio_buf bufs[3];
+	unsigned int wait;
+	bool pending = false;
+	int status = -EIO;
+
+	ctrl = kmem_alloc(sizeof(*ctrl));
+	if (!ctrl)
+		return -ENOMEM;
+
+	ctrl->class = VIRTIO_NET_CTRL_MQ;
+	ctrl->cmd   = VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET;
+	ctrl->pairs = pairs;
+	ctrl->ack   = ~VIRTIO_NET_OK;
+
+	bufs[0].addr = __pa(&ctrl->class);
+	bufs[0].len  = 2;
+	bufs[1].addr = __pa(&ctrl->pairs);
+	bufs[1].len  = sizeof(ctrl->pairs);
+	bufs[2].addr = __pa(&ctrl->ack);
+	bufs[2].len  = sizeof(ctrl->ack);
+
+	if (vq_add(dev->ctrl_vq, bufs, 2, 1, ctrl) == 0) {
+		vq_kick(dev->ctrl_vq);
+
+		pending = true;
+		for (wait = 0; wait < 1000000 && pending; wait++) {
+			if (vq_get(dev->ctrl_vq, NULL)) {
+				status = (ctrl->ack == VIRTIO_NET_OK) ? 0 : -EIO;
+				pending = false;
+			} else {
+				udelay(1);
+			}
+		}
+	}
+
+	// A command the device still holds keeps its buffer
+	if (!pending)
+		kmem_free(ctrl);
+	return status;
+}
+
+
+// Gives every pair its own MSI-X vector aimed at its CPU. Falls back to
+// the INTx line, and a single pair, if the device or the vectors aren't
+// there.
+static void
+vnet_irq_init(vnet_device_t *dev)
+{
+	struct msix_entry entries[VNET_MAX_PAIRS];
+	unsigned int i;
+
+	for (i = 0; i < dev->num_pairs; i++) {
+		vnet_queue_t *q = &dev->queue[i];
+
+		q->vector = irq_request_free_vector(vnet_msix_handler, 0, "virtio-net", q);
+		if (q->vector < 0)
+			break;
+
+		entries[i].vector = q->vector;
+		entries[i].entry  = i;
+		entries[i].cpu    = q->cpu;
+	}
+
+	if (i == dev->num_pairs && pci_msix_setup(dev->pci_dev, entries, i) == 0) {
+		dev->msix = true;
+		return;
+	}
+
+	while (i--) {
+		irq_free(dev->queue[i].vector, &dev->queue[i]);
+		dev->queue[i].vector = -1;
+	}
+
+	dev->num_pairs = 1;
+	dev->queue[0].cpu = 0;
+	dev->queue[0].vector = -1;
+
+	int vector = ioapic_pcidev_vector(dev->pci_dev->cfg.bus, dev->pci_dev->cfg.slot, 0);
+	if (vector == -1) {
+		printk(KERN_WARNING "virtio-net: Failed to find interrupt vector.\n");
+		return;
+	}
+	printk(KERN_INFO "virtio-net IDT vector:  %d\n", vector);
+	irq_request(vector, &vnet_intx_handler, 0, "virtio-net", dev);
+}
+
+
+// Sets up pair i's virtqueues, receive queue 2i and transmit queue 2i+1
+static int
+vnet_queue_init(vnet_device_t *dev, unsigned int i)
+{
+	vnet_queue_t *q = &dev->queue[i];
+
+	q->dev = dev;
+	q->index = i;
+	spin_lock_init(&q->irq_lock);
+	spin_lock_init(&q->tx_lock);
+
+	q->rx_vq = virtio_vq_setup(&dev->vdev, 2 * i, dev->ring_size,
+	                           dev->msix ? i : VIRTIO_MSI_NO_VECTOR);
+	q->tx_vq = virtio_vq_setup(&dev->vdev, 2 * i + 1, dev->ring_size,
+	                           VIRTIO_MSI_NO_VECTOR);
+	if (!q->rx_vq || !q->tx_vq)
+		return -ENOMEM;
+
+	// Completions are reclaimed as we go, they needn't interrupt
+	vq_disable_cb(q->tx_vq);
+
+	q->tx_hdr = kmem_alloc(q->tx_vq->num * sizeof(*q->tx_hdr));
+	q->rx_poll_msg = tcpip_callbackmsg_new(vnet_rx_poll, q);
+	if (!q->tx_hdr || !q->rx_poll_msg)
+		return -ENOMEM;
+
+	return 0;
+}
+
+
+/*********************************
+ ** virtio-net Driver Entry Point **
+ *********************************/
+static err_t
+vnet_hw_init(struct netif *netif)
+{
+	vnet_device_t *dev = netif->state;
+	u64 wanted;
+	unsigned int i, cpu, pairs;
+
+	dev->netif = netif;
+
+	// "Name" the interface
+	netif->name[0] = 'e';
+	netif->name[1] = 'n';
+
+	if (virtio_pci_init(&dev->vdev, dev->pci_dev)) {
+		printk(KERN_ERR "virtio-net: not a modern virtio device\n");
+		return ERR_IF;
+	}
+
+	wanted = VIRTIO_FEATURE(VIRTIO_F_VERSION_1) |
+	         VIRTIO_FEATURE(VIRTIO_F_EVENT_IDX) |
+	         VIRTIO_FEATURE(VIRTIO_NET_F_MAC) |
+	         VIRTIO_FEATURE(VIRTIO_NET_F_MRG_RXBUF) |
+	         VIRTIO_FEATURE(VIRTIO_NET_F_CTRL_VQ) |
+	         VIRTIO_FEATURE(VIRTIO_NET_F_MQ);
+	if (dev->csum_offload)
+		wanted |= VIRTIO_FEATURE(VIRTIO_NET_F_CSUM) |
+		          VIRTIO_FEATURE(VIRTIO_NET_F_GUEST_CSUM);
+
+	if (virtio_negotiate(&dev->vdev, wanted)) {
+		printk(KERN_ERR "virtio-net: feature negotiation failed\n");
+		return ERR_IF;
+	}
+	dev->csum_offload = virtio_has_feature(&dev->vdev, VIRTIO_NET_F_CSUM);
+
+	// Get our MAC address
+	netif->hwaddr_len = 6;
+	for (i = 0; i < 6; i++) {
+		if (virtio_has_feature(&dev->vdev, VIRTIO_NET_F_MAC))
+			netif->hwaddr[i] = virtio_cfg_read8(&dev->vdev, VIRTIO_NET_CFG_MAC + i);
+		else
+			netif->hwaddr[i] = (i == 0) ? 0x02 : (i == 5);
+	}
+
+	printk(KERN_INFO "virtio-net MAC address: %.2x:%.2x:%.2x:%.2x:%.2x:%.2x\n",
+	       netif->hwaddr[0], netif->hwaddr[1], netif->hwaddr[2],
+	       netif->hwaddr[3], netif->hwaddr[4], netif->hwaddr[5]);
+
+	// One pair per online CPU, as many as the device and queues= allow
+	pairs = 1;
+	if (virtio_has_feature(&dev->vdev, VIRTIO_NET_F_MQ) &&
+	    virtio_has_feature(&dev->vdev, VIRTIO_NET_F_CTRL_VQ))
+		pairs = virtio_cfg_read16(&dev->vdev, VIRTIO_NET_CFG_MAX_PAIRS);
+	pairs = min(pairs, (unsigned int)num_online_cpus());
+	pairs = min(pairs, (unsigned int)VNET_MAX_PAIRS);
+	if (dev->max_pairs)
+		pairs = min(pairs, dev->max_pairs);
+	dev->num_pairs = max(pairs, 1U);
+
+	i = 0;
+	for_each_cpu_mask(cpu, cpu_online_map) {
+		if (i == dev->num_pairs)
+			break;
+		dev->queue[i++].cpu = cpu;
+	}
+
+	if (!dev->rx_budget)
+		dev->rx_budget = VNET_RX_BUDGET;
+	dev->ring_size = max(dev->ring_size, 2U);
+
+	vnet_irq_init(dev);
+
+	for (i = 0; i < dev->num_pairs; i++) {
+		if (vnet_queue_init(dev, i)) {
+			printk(KERN_ERR "virtio-net: failed to set up queue pair %u\n", i);
+			virtio_reset(&dev->vdev);
+			return ERR_MEM;
+		}
+	}
+
+	if (virtio_has_feature(&dev->vdev, VIRTIO_NET_F_CTRL_VQ)) {
+		unsigned int index = 2 * (virtio_has_feature(&dev->vdev, VIRTIO_NET_F_MQ) ?
+		                 virtio_cfg_read16(&dev->vdev, VIRTIO_NET_CFG_MAX_PAIRS) : 1);
+
+		dev->ctrl_vq = virtio_vq_setup(&dev->vdev, index, 64, VIRTIO_MSI_NO_VECTOR);
+		if (dev->ctrl_vq)
+			vq_disable_cb(dev->ctrl_vq);
+	}
+
+	if (dev->msix)
+		virtio_config_vector(&dev->vdev, VIRTIO_MSI_NO_VECTOR);
+
+	// Initialize the rest of the Lightweight IP netif structure
+	netif->mtu        = 1500;
+	netif->flags      = (NETIF_FLAG_LINK_UP | NETIF_FLAG_ETHARP);
+	netif->linkoutput = vnet_tx_queue;
+	netif->output     = etharp_output;
+
+	// The device sums TCP and UDP, see vnet_tx_csum_prep()
+	if (dev->csum_offload)
+		NETIF_SET_CHECKSUM_CTRL(netif, NETIF_CHECKSUM_ENABLE_ALL &
+		                        ~(NETIF_CHECKSUM_GEN_UDP |
+		                          NETIF_CHECKSUM_GEN_TCP));
+
+	virtio_driver_ok(&dev->vdev);
+
+	if (dev->num_pairs > 1 && (!dev->ctrl_vq || vnet_set_pairs(dev, dev->num_pairs))) {
+		printk(KERN_WARNING "virtio-net: device refused %u queue pairs\n",
+		       dev->num_pairs);
+		dev->num_pairs = 1;
+	}
+
+#if LWIP_NETCORE
+	// The network core polls the rings, nothing interrupts
+	if (tcpip_polling()) {
+		for (i = 0; i < dev->num_pairs; i++) {
+			vq_disable_cb(dev->queue[i].rx_vq);
+			dev->queue[i].rx_polling = true;
+		}
+		dev->poller.poll = vnet_netcore_poll;
+		dev->poller.arg = dev;
+		tcpip_poller_add(&dev->poller);
+	}
+#endif
+
+	for (i = 0; i < dev->num_pairs; i++)
+		vnet_rx_refill(&dev->queue[i]);
+
+	printk(KERN_INFO "virtio-net: %u queue pair(s), %u descriptors, %s%s%s\n",
+	       dev->num_pairs, dev->queue[0].rx_vq->num,
+	       dev->msix ? "MSI-X" : "INTx",
+	       virtio_has_feature(&dev->vdev, VIRTIO_F_EVENT_IDX) ? ", event idx" : "",
+	       dev->csum_offload ? ", csum offload" : "");
+
+	return 0;
+}
+
+
+// Initialize a new virtio-net PCI device.
+// Only one device is supported.
+int
+vnet_probe(pci_dev_t *pci_dev, const pci_dev_id_t *id)
+{
+	vnet_device_t *dev = &vnet_state;
+
+	// Remember our PCI info
+	dev->pci_dev = pci_dev;
+
+	// Figure out our IP info
+	if (!strlen(dev->ip_str) ||
+	    !strcmp(dev->ip_str, "0.0.0.0") || !strcmp(dev->ip_str, "dhcp")) {
+		printk(KERN_INFO "virtio-net IP address:  Using DHCP\n");
+	} else {
+		printk(KERN_INFO "virtio-net IP address:  %s\n", dev->ip_str);
+		printk(KERN_INFO "virtio-net Netmask:     %s\n", dev->nm_str);
+		printk(KERN_INFO "virtio-net Gateway:     %s\n", dev->gw_str);
+
+		// Convert IP strings to lightweight IP address structures
+		dev->ip.addr = inet_addr(dev->ip_str);
+		dev->nm.addr = inet_addr(dev->nm_str);
+		dev->gw.addr = inet_addr(dev->gw_str);
+	}
+
+	// Tell Lightweight IP (lwip) about the new interface.
+	// vnet_hw_init() is called immediately by netif_add().
+	netif_add(&vnet_netif, &dev->ip, &dev->nm, &dev->gw, dev, vnet_hw_init, tcpip_input);
+
+	return 0;
+}
+
+
+// Modern virtio-net only, legacy and transitional devices (0x1000) are not
+// driven.
+static const pci_dev_id_t vnet_id_table[] = {
+        { VIRTIO_PCI_VENDOR, VIRTIO_PCI_DEVICE(VIRTIO_ID_NET), 0, 0, 0, 0 },
+        { 0, }
+};
+
+
+pci_driver_t vnet_driver = {
+	.name     = "virtio_net",
+	.id_table = vnet_id_table,
+	.probe    = vnet_probe,
+};
+
+
+int
+vnet_init(void)
+{
+	if (pci_register_driver(&vnet_driver) != 0) {
+		printk(KERN_WARNING "Failed to register virtio-net PCI driver.\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+
+DRIVER_INIT("net", vnet_init);
+
+DRIVER_PARAM_STRING(ip, vnet_state.ip_str, sizeof(vnet_state.ip_str));
+DRIVER_PARAM_STRING(nm, vnet_state.nm_str, sizeof(vnet_state.nm_str));
+DRIVER_PARAM_STRING(gw, vnet_state.gw_str, sizeof(vnet_state.gw_str));
+DRIVER_PARAM_NAMED(ring, vnet_state.ring_size, uint);
+DRIVER_PARAM_NAMED(rx_budget, vnet_state.rx_budget, uint);
+DRIVER_PARAM_NAMED(queues, vnet_state.max_pairs, uint);
+DRIVER_PARAM_NAMED(csum_offload, vnet_state.csum_offload, bool);
@@ -0,0 +1,288 @@
+/** \file
+ * Modern (virtio 1.0) PCI transport.
+ *
+ * The device describes where its configuration structures live with
+ * vendor specific PCI capabilities, each naming a BAR and a range in it:
+ * the common configuration (features, status, queue setup), the queue
+ * notification area, the INTx status byte and the device type's own
+ * configuration. Everything is memory mapped; the legacy I/O port
+ * interface is not used.
+ */
+#include <lwk/kernel.h>
+#include <lwk/delay.h>
+#include <lwk/virtio.h>
+#include <arch/page.h>
+#include <arch/io.h>
+#include <arch/system.h>
+
+
+/* Vendor capability layout and the structures it can describe */
+#define VIRTIO_PCI_CAP_CFG_TYPE		3
+#define VIRTIO_PCI_CAP_BAR		4
+#define VIRTIO_PCI_CAP_OFFSET		8
+#define VIRTIO_PCI_CAP_LENGTH		12
+#define VIRTIO_PCI_CAP_NOTIFY_MULT	16
+
+#define VIRTIO_PCI_CAP_COMMON_CFG	1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG	2
+#define VIRTIO_PCI_CAP_ISR_CFG		3
+#define VIRTIO_PCI_CAP_DEVICE_CFG	4
+
+
+/* Maps length bytes at offset into a memory BAR, NULL if it isn't one */
+static volatile void *
+virtio_pci_map(pci_dev_t *pci_dev, unsigned int bar_idx,
+               u32 offset, u32 length)
+{
+	pci_bar_t bar;
+	paddr_t paddr, base;
+
+	if (bar_idx > 5 || pcicfg_bar_decode(&pci_dev->cfg, bar_idx, &bar))
+		return NULL;
+	if (bar.mem != 0 || !bar.address)
+		return NULL;
+
+	paddr = bar.address + offset;
+	base  = paddr & PAGE_MASK;
+	if (!ioremap(base, paddr + length - base))
+		return NULL;
+
+	return (volatile void *)__va(paddr);
+}
+
+
+static void
+virtio_set_status(struct virtio_dev *vdev, u8 status)
+{
+	vdev->common->device_status |= status;
+}
+
+
+/**
+ * Resets the device. It has to read back a status of 0 before it may be
+ * set up again, which takes a while on some hosts.
+ */
+void
+virtio_reset(struct virtio_dev *vdev)
+{
+	vdev->common->device_status = 0;
+	while (vdev->common->device_status != 0)
+		udelay(1);
+}
+
+
+/**
+ * Finds the configuration structures of a modern virtio PCI device, maps
+ * them, turns on bus mastering and resets the device, leaving it
+ * acknowledged and waiting for feature negotiation.
+ *
+ * Returns 0, or -ENODEV if the device lacks the common, notification or
+ * ISR structures (e.g. a legacy only device).
+ */
+int
+virtio_pci_init(struct virtio_dev *vdev, pci_dev_t *pci_dev)
+{
+	unsigned int pos;
+	u16 cmd;
+
+	memset(vdev, 0, sizeof(*vdev));
+	vdev->pci_dev = pci_dev;
+
+	if (!(pci_read(pci_dev, PCIR_STATUS, 2) & PCIM_STATUS_CAPPRESENT))
+		return -ENODEV;
+
+	for (pos = pci_read(pci_dev, PCIR_CAP_PTR, 1) & ~3;
+	     pos != 0;
+	     pos = pci_read(pci_dev, pos + 1, 1) & ~3) {
+		unsigned int type, bar;
+		u32 offset, length;
+		volatile void *p;
+
+		if (pci_read(pci_dev, pos, 1) != PCIY_VENDOR)
+			continue;
+
+		type   = pci_read(pci_dev, pos + VIRTIO_PCI_CAP_CFG_TYPE, 1);
+		bar    = pci_read(pci_dev, pos + VIRTIO_PCI_CAP_BAR, 1);
+		offset = pci_read(pci_dev, pos + VIRTIO_PCI_CAP_OFFSET, 4);
+		length = pci_read(pci_dev, pos + VIRTIO_PCI_CAP_LENGTH, 4);
+
+		/* The first structure of each type is the preferred one */
+		switch (type) {
+		case VIRTIO_PCI_CAP_COMMON_CFG:
+			if (vdev->common)
+				continue;
+			break;
+		case VIRTIO_PCI_CAP_NOTIFY_CFG:
+			if (vdev->notify_base)
+				continue;
+			break;
+		case VIRTIO_PCI_CAP_ISR_CFG:
+			if (vdev->isr)
+				continue;
+			break;
+		case VIRTIO_PCI_CAP_DEVICE_CFG:
+			if (vdev->device_cfg)
+				continue;
+			break;
+		default:
+			continue;
+		}
+
+		p = virtio_pci_map(pci_dev, bar, offset, length);
+		if (!p)
+			continue;
+
+		switch (type) {
+		case VIRTIO_PCI_CAP_COMMON_CFG:
+			vdev->common = p;
+			break;
+		case VIRTIO_PCI_CAP_NOTIFY_CFG:
+			vdev->notify_base = p;
+			vdev->notify_mult = pci_read(pci_dev,
+			                    pos + VIRTIO_PCI_CAP_NOTIFY_MULT, 4);
+			break;
+		case VIRTIO_PCI_CAP_ISR_CFG:
+			vdev->isr = p;
+			break;
+		case VIRTIO_PCI_CAP_DEVICE_CFG:
+			vdev->device_cfg = p;
+			break;
+		}
+	}
+
+	if (!vdev->common || !vdev->notify_base || !vdev->isr)
+		return -ENODEV;
+
+	cmd = pci_read(pci_dev, PCIR_COMMAND, 2);
+	cmd |= PCIM_CMD_MEMEN | PCIM_CMD_BUSMASTEREN;
+	pci_write(pci_dev, PCIR_COMMAND, 2, cmd);
+
+	virtio_reset(vdev);
+	virtio_set_status(vdev, VIRTIO_STATUS_ACKNOWLEDGE);
+	virtio_set_status(vdev, VIRTIO_STATUS_DRIVER);
+
+	return 0;
+}
+
+
+/**
+ * Accepts the features in wanted that the device offers, which must
+ * include VIRTIO_F_VERSION_1, and records them in vdev->features.
+ *
+ * Returns 0, or -EIO if the device doesn't take them.
+ */
+int
+virtio_negotiate(struct virtio_dev *vdev, u64 wanted)
+{
+	volatile struct virtio_pci_common_cfg *common = vdev->common;
+	u64 offered;
+
+	common->device_feature_select = 0;
+	offered = common->device_feature;
+	common->device_feature_select = 1;
+	offered |= (u64)common->device_feature << 32;
+
+	vdev->features = offered & wanted;
+	if (!virtio_has_feature(vdev, VIRTIO_F_VERSION_1))
+		goto fail;
+
+	common->driver_feature_select = 0;
+	common->driver_feature = (u32)vdev->features;
+	common->driver_feature_select = 1;
+	common->driver_feature = (u32)(vdev->features >> 32);
+
+	virtio_set_status(vdev, VIRTIO_STATUS_FEATURES_OK);
+	if (!(common->device_status & VIRTIO_STATUS_FEATURES_OK))
+		goto fail;
+
+	return 0;
+
+fail:
+	virtio_set_status(vdev, VIRTIO_STATUS_FAILED);
+	return -EIO;
+}
+
+
+unsigned int
+virtio_num_queues(struct virtio_dev *vdev)
+{
+	return vdev->common->num_queues;
+}
+
+
+/**
+ * Sets up queue index with up to num descriptors, fewer if the device's
+ * maximum is smaller, interrupting through MSI-X table entry msix_vector
+ * (VIRTIO_MSI_NO_VECTOR for none, or when MSI-X isn't in use).
+ *
+ * Returns the queue, or NULL if the device hasn't got it, it can't be
+ * allocated or the device refuses the vector.
+ */
+struct virtqueue *
+virtio_vq_setup(struct virtio_dev *vdev, unsigned int index,
+                unsigned int num, u16 msix_vector)
+{
+	volatile struct virtio_pci_common_cfg *common = vdev->common;
+	struct virtqueue *vq;
+	unsigned int size;
+	paddr_t pa;
+
+	common->queue_select = index;
+	size = common->queue_size;
+	if (!size || common->queue_enable)
+		return NULL;
+
+	/* Sizes are powers of two, so halving keeps them one */
+	while (size > num && size > 1)
+		size >>= 1;
+
+	vq = vq_alloc(vdev, index, size);
+	if (!vq)
+		return NULL;
+
+	common->queue_size = size;
+
+	pa = __pa(vq->desc);
+	common->queue_desc_lo = (u32)pa;
+	common->queue_desc_hi = (u32)(pa >> 32);
+	pa = __pa(vq->avail);
+	common->queue_driver_lo = (u32)pa;
+	common->queue_driver_hi = (u32)(pa >> 32);
+	pa = __pa(vq->used);
+	common->queue_device_lo = (u32)pa;
+	common->queue_device_hi = (u32)(pa >> 32);
+
+	common->queue_msix_vector = msix_vector;
+	if (common->queue_msix_vector != msix_vector) {
+		printk(KERN_WARNING "virtio: queue %u refused MSI-X vector %u\n",
+		       index, msix_vector);
+		vq_free(vq);
+		return NULL;
+	}
+
+	vq->notify = (volatile u16 *)(vdev->notify_base +
+	             common->queue_notify_off * vdev->notify_mult);
+
+	/* The rings have to be in place before the device may use them */
+	wmb();
+	common->queue_enable = 1;
+
+	return vq;
+}
+
+
+/* Sets the configuration interrupt's MSI-X table entry */
+void
+virtio_config_vector(struct virtio_dev *vdev, u16 msix_vector)
+{
+	vdev->common->msix_config = msix_vector;
+}
+
+
+/* Done setting up, the device may start using its queues */
+void
+virtio_driver_ok(struct virtio_dev *vdev)
+{
+	wmb();
+	virtio_set_status(vdev, VIRTIO_STATUS_DRIVER_OK);
+}
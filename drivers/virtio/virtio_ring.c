@@ -0,0 +1,314 @@
+/** \file
+ * Split virtqueues.
+ *
+ * A request is a chain of descriptors, the buffers the device reads
+ * first and then the ones it writes. Its head goes into the avail ring
+ * and comes back through the used ring once the device is done, in
+ * whatever order the device completes them. Free descriptors are kept on
+ * a list threaded through their next fields. With indirect descriptors a
+ * whole chain lives in a table of the driver's and takes one descriptor.
+ *
+ * None of this locks; each queue belongs to one context at a time, which
+ * is the driver's to arrange.
+ */
+#include <lwk/kernel.h>
+#include <lwk/kmem.h>
+#include <lwk/virtio.h>
+#include <arch/page.h>
+#include <arch/system.h>
+
+
+/*
+ * True if moving the index from old to new_idx passes event, i.e. the
+ * other side asked to hear about the entry at event.
+ */
+static inline bool
+vring_need_event(u16 event, u16 new_idx, u16 old)
+{
+	return (u16)(new_idx - event - 1) < (u16)(new_idx - old);
+}
+
+
+static size_t
+vring_size(unsigned int num)
+{
+	size_t size;
+
+	size  = num * sizeof(struct vring_desc);
+	size += sizeof(struct vring_avail) + (num + 1) * sizeof(u16);
+	size  = ALIGN(size, 4);
+	size += sizeof(struct vring_used) +
+		num * sizeof(struct vring_used_elem) + sizeof(u16);
+
+	return size;
+}
+
+
+/**
+ * Allocates a queue of num descriptors (a power of two) and lays out its
+ * rings in one physically contiguous block: the descriptor table, the
+ * avail ring and, 4-byte aligned, the used ring. The transport tells the
+ * device where they are.
+ */
+struct virtqueue *
+vq_alloc(struct virtio_dev *vdev, unsigned int index, unsigned int num)
+{
+	struct virtqueue *vq;
+	unsigned int i;
+	u8 *ring;
+
+	vq = kmem_alloc(sizeof(*vq));
+	if (!vq)
+		return NULL;
+
+	vq->token = kmem_alloc(num * sizeof(void *));
+	ring = kmem_get_pages(get_order(vring_size(num)));
+	if (!vq->token || !ring) {
+		if (ring)
+			kmem_free_pages(ring, get_order(vring_size(num)));
+		kmem_free(vq->token);
+		kmem_free(vq);
+		return NULL;
+	}
+	memset(ring, 0, vring_size(num));
+
+	vq->vdev  = vdev;
+	vq->index = index;
+	vq->num   = num;
+
+	vq->desc  = (struct vring_desc *)ring;
+	vq->avail = (struct vring_avail *)(ring + num * sizeof(struct vring_desc));
+	vq->used  = (struct vring_used *)ALIGN((unsigned long)&vq->avail->ring[num + 1], 4);
+	vq->used_event  = &vq->avail->ring[num];
+	vq->avail_event = (volatile u16 *)&vq->used->ring[num];
+
+	vq->event_idx = virtio_has_feature(vdev, VIRTIO_F_EVENT_IDX);
+	vq->indirect  = virtio_has_feature(vdev, VIRTIO_F_INDIRECT_DESC);
+
+	for (i = 0; i < num - 1; i++)
+		vq->desc[i].next = i + 1;
+	vq->free_head = 0;
+	vq->num_free  = num;
+
+	vq->avail_idx = vq->kick_idx = vq->last_used = 0;
+	vq->kicks = vq->kicks_saved = 0;
+
+	return vq;
+}
+
+
+/* Frees a queue from vq_alloc that the device isn't using */
+void
+vq_free(struct virtqueue *vq)
+{
+	kmem_free_pages(vq->desc, get_order(vring_size(vq->num)));
+	kmem_free(vq->token);
+	kmem_free(vq);
+}
+
+
+/*
+ * Chains bufs through free descriptors and publishes the chain's head. A
+ * single descriptor may carry extra flags, VRING_DESC_F_INDIRECT.
+ */
+static int
+vq_add_chain(struct virtqueue *vq, const struct virtio_buf *bufs,
+	     unsigned int out, unsigned int in, u16 flags, void *token)
+{
+	unsigned int n = out + in;
+	unsigned int i;
+	u16 head, d, prev = 0;
+
+	if (n == 0 || n > vq->num_free)
+		return -ENOSPC;
+
+	head = d = vq->free_head;
+	for (i = 0; i < n; i++) {
+		struct vring_desc *desc = &vq->desc[d];
+
+		desc->addr  = bufs[i].addr;
+		desc->len   = bufs[i].len;
+		desc->flags = VRING_DESC_F_NEXT | (i >= out ? VRING_DESC_F_WRITE : 0);
+		prev = d;
+		d = desc->next;
+	}
+	vq->desc[prev].flags &= ~VRING_DESC_F_NEXT;
+	vq->desc[head].flags |= flags;
+
+	vq->free_head = d;
+	vq->num_free -= n;
+	vq->token[head] = token;
+
+	vq->avail->ring[vq->avail_idx & (vq->num - 1)] = head;
+	vq->avail_idx++;
+
+	/* The entry has to be visible before the index that covers it */
+	smp_wmb();
+	ACCESS_ONCE(vq->avail->idx) = vq->avail_idx;
+
+	return 0;
+}
+
+
+/**
+ * Queues a request of out device-readable buffers followed by in
+ * device-writable ones. It becomes visible to the device right away, but
+ * the device is only told with vq_kick(), so a batch costs one
+ * notification. token comes back from vq_get() when the device is done.
+ *
+ * Returns 0, or -ENOSPC if the queue hasn't enough free descriptors.
+ */
+int
+vq_add(struct virtqueue *vq, const struct virtio_buf *bufs,
+       unsigned int out, unsigned int in, void *token)
+{
+	return vq_add_chain(vq, bufs, out, in, 0, token);
+}
+
+
+/**
+ * Like vq_add(), but builds the chain in table, which must hold out + in
+ * descriptors, and queues it as a single indirect descriptor, so a request
+ * of any length takes one slot of the ring. table belongs to the device
+ * until token comes back. Falls back to vq_add() if the device doesn't do
+ * indirect descriptors.
+ */
+int
+vq_add_indirect(struct virtqueue *vq, struct vring_desc *table,
+		const struct virtio_buf *bufs,
+		unsigned int out, unsigned int in, void *token)
+{
+	struct virtio_buf ind;
+	unsigned int n = out + in;
+	unsigned int i;
+
+	if (!vq->indirect || n < 2)
+		return vq_add(vq, bufs, out, in, token);
+
+	for (i = 0; i < n; i++) {
+		table[i].addr  = bufs[i].addr;
+		table[i].len   = bufs[i].len;
+		table[i].flags = VRING_DESC_F_NEXT | (i >= out ? VRING_DESC_F_WRITE : 0);
+		table[i].next  = i + 1;
+	}
+	table[n - 1].flags &= ~VRING_DESC_F_NEXT;
+
+	ind.addr = __pa(table);
+	ind.len  = n * sizeof(struct vring_desc);
+
+	return vq_add_chain(vq, &ind, 1, 0, VRING_DESC_F_INDIRECT, token);
+}
+
+
+/**
+ * Tells the device about the requests added since the last kick, unless
+ * it said it doesn't need to hear about them: with event indexes it asks
+ * for the one ring position it wants to be notified at, otherwise it can
+ * turn notifications off while it is busy with the queue.
+ */
+void
+vq_kick(struct virtqueue *vq)
+{
+	u16 old = vq->kick_idx;
+	u16 new_idx = vq->avail_idx;
+	bool need;
+
+	if (old == new_idx)
+		return;
+	vq->kick_idx = new_idx;
+
+	/* Publish avail->idx before reading what the device asked for */
+	smp_mb();
+
+	if (vq->event_idx)
+		need = vring_need_event(*vq->avail_event, new_idx, old);
+	else
+		need = !(ACCESS_ONCE(vq->used->flags) & VRING_USED_F_NO_NOTIFY);
+
+	if (!need) {
+		vq->kicks_saved++;
+		return;
+	}
+
+	vq->kicks++;
+	*vq->notify = vq->index;
+}
+
+
+bool
+vq_has_used(struct virtqueue *vq)
+{
+	return ACCESS_ONCE(vq->used->idx) != vq->last_used;
+}
+
+
+/**
+ * Takes the next request the device has finished with and frees its
+ * descriptors. Returns its token and stores the number of bytes the
+ * device wrote in len, or returns NULL if there is none.
+ */
+void *
+vq_get(struct virtqueue *vq, u32 *len)
+{
+	struct vring_used_elem *elem;
+	void *token;
+	u16 head, d;
+
+	if (!vq_has_used(vq))
+		return NULL;
+
+	/* Read the entry only after seeing the index that covers it */
+	smp_rmb();
+
+	elem = &vq->used->ring[vq->last_used & (vq->num - 1)];
+	head = elem->id;
+	if (len)
+		*len = elem->len;
+	vq->last_used++;
+
+	token = vq->token[head];
+	vq->token[head] = NULL;
+
+	for (d = head; vq->desc[d].flags & VRING_DESC_F_NEXT; d = vq->desc[d].next)
+		vq->num_free++;
+	vq->num_free++;
+	vq->desc[d].next = vq->free_head;
+	vq->free_head = head;
+
+	return token;
+}
+
+
+/**
+ * Asks the device not to interrupt for this queue. Only a hint; with
+ * event indexes the requested position is moved half the ring index
+ * space away instead, out of reach of any batch the device will use.
+ */
+void
+vq_disable_cb(struct virtqueue *vq)
+{
+	if (vq->event_idx)
+		*vq->used_event = vq->last_used + 0x8000;
+	else
+		vq->avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
+}
+
+
+/**
+ * Asks for an interrupt when the device next uses a request. Returns
+ * false if one was used meanwhile, which may not interrupt; the caller
+ * should take it and try again.
+ */
+bool
+vq_enable_cb(struct virtqueue *vq)
+{
+	if (vq->event_idx)
+		*vq->used_event = vq->last_used;
+	else
+		vq->avail->flags &= ~VRING_AVAIL_F_NO_INTERRUPT;
+
+	/* The request has to be visible before checking for work again */
+	smp_mb();
+
+	return !vq_has_used(vq);
+}
@@ -120,6 +120,12 @@ void free_htable(struct xpmem_hashtable * htable, int free_values, int free_keys
  */
 int htable_insert(struct xpmem_hashtable * htable, uintptr_t key, uintptr_t value);
 
+/*
+ * Like htable_insert, but atomically fails (returns zero) if the key is
+ * already present
+ */
+int htable_insert_unique(struct xpmem_hashtable * htable, uintptr_t key, uintptr_t value);
+
 int htable_change(struct xpmem_hashtable * htable, uintptr_t key, uintptr_t value, int free_value);
 
 
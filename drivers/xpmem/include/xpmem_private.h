@@ -127,6 +127,11 @@ struct xpmem_attachment {
     size_t                       at_size;
     xpmem_pfn_range_t          * pfn_range;
 
+    /* pages mapped for shadow attachments, by size */
+    uint64_t                     nr_4kb_pages;
+    uint64_t                     nr_2mb_pages;
+    uint64_t                     nr_1gb_pages;
+
     /* other misc */
     volatile int                 flags;
     atomic_t                     refcnt;
@@ -229,6 +234,7 @@ extern int xpmem_signal(xpmem_apid_t);
 extern struct vm_operations_struct xpmem_vm_ops;
 extern int xpmem_attach(xpmem_apid_t, off_t, size_t, vaddr_t, int, vaddr_t *);
 extern int xpmem_detach(vaddr_t);
+extern int xpmem_attach_info(vaddr_t, struct xpmem_cmd_attach_info *);
 extern void xpmem_detach_att(struct xpmem_access_permit *,
                  struct xpmem_attachment *);
 
@@ -32,98 +32,78 @@ xpmem_shadow_vaddr_to_PFN(struct xpmem_attachment * att,
     return 0;
 }
 
-static int
-xpmem_map_pfn_region(struct xpmem_thread_group * ap_tg,
-		     vaddr_t                     at_vaddr,
-		     vmpagesize_t                page_size,
-		     xpmem_pfn_region_t        * rgn)
+/* Page sizes shadow attachments may be mapped with */
+static vmpagesize_t
+xpmem_attach_pagesz_mask(void)
 {
-    uint64_t pfn_off;
-    vaddr_t  vaddr;
-    paddr_t  paddr;
-    int      status;
+    return cpu_info[0].pagesz_mask & (VM_PAGE_4KB | VM_PAGE_2MB | VM_PAGE_1GB);
+}
 
-    vaddr   = at_vaddr;
-    pfn_off = 0;
+/*
+ * Large pages are only usable where the virtual and physical addresses
+ * agree modulo the page size. Choose the alignment and offset of the
+ * attachment so that this holds for the largest pfn region, and return
+ * the page size it can then use.
+ */
+static vmpagesize_t
+xpmem_attach_alignment(xpmem_pfn_range_t * range,
+		       vmpagesize_t        pagesz_mask,
+		       vaddr_t           * phase)
+{
+    xpmem_pfn_region_t * rgn;
+    uint64_t             rgn_idx;
+    uint64_t             rgn_len;
+    uint64_t             rgn_off;
+    uint64_t             max_len;
+    paddr_t              paddr;
+    vmpagesize_t         page_size;
 
-    while (pfn_off < rgn->nr_pfns) {
-	paddr  = (rgn->first_pfn + pfn_off) << PAGE_SHIFT;
+    max_len = 0;
+    paddr   = 0;
+    rgn_off = 0;
+    *phase  = 0;
 
-	status = aspace_map_pmem(
-		ap_tg->aspace->id,
-		paddr,
-		vaddr,
-		page_size
-	    );
+    for (rgn_idx = 0; rgn_idx < range->nr_regions; rgn_idx++) {
+	rgn     = &(range->pfn_list[rgn_idx]);
+	rgn_len = rgn->nr_pfns * VM_PAGE_4KB;
 
-	if (status != 0) {
-	    XPMEM_ERR("aspace_map_pmem() failed (%d)", status);
-	    goto err;
+	if (rgn_len > max_len) {
+	    max_len = rgn_len;
+	    paddr   = (rgn->first_pfn << PAGE_SHIFT) - rgn_off;
 	}
 
-	vaddr   += page_size;
-	pfn_off += page_size / VM_PAGE_4KB;
+	rgn_off += rgn_len;
     }
 
-    return 0;
-
-err:
-    {
-	uint64_t j = 0;
-	vaddr      = at_vaddr;
-	while (j < pfn_off) {
-
-	    status = aspace_unmap_pmem(
-		    ap_tg->aspace->id,
-		    vaddr,
-		    page_size
-		);
+    page_size = VM_PAGE_4KB;
+    while (pagesz_mask) {
+	page_size = 1UL << __fls(pagesz_mask);
+	if (page_size <= max_len)
+	    break;
 
-	    BUG_ON(status != 0);
-
-	    vaddr += page_size;
-	}
+	pagesz_mask &= ~page_size;
+	page_size    = VM_PAGE_4KB;
     }
 
-    return status;
-}
-
-static void 
-xpmem_unmap_pfn_region(struct xpmem_thread_group * ap_tg,
-		       vaddr_t                     at_vaddr,
-		       vmpagesize_t                page_size,
-		       xpmem_pfn_region_t        * rgn)
-{
-    uint64_t pfn_off;
-    vaddr_t  vaddr;
-    int      status;
-
-    vaddr   = at_vaddr;
-    pfn_off = 0;
-    
-    while (pfn_off < rgn->nr_pfns) {
-	status = aspace_unmap_pmem(
-		ap_tg->aspace->id,
-		vaddr,
-		page_size
-	    );
-
-	BUG_ON(status != 0);
-
-	vaddr += page_size;
-    }
+    *phase = paddr & (page_size - 1);
+    return page_size;
 }
 
+/* Map each pfn region with the largest page sizes its own alignment allows */
 static int
 xpmem_map_pfn_range(struct xpmem_thread_group * ap_tg,
+		    struct xpmem_attachment   * att,
 		    vaddr_t                     at_vaddr,
-		    vmpagesize_t                page_size,
-		    xpmem_pfn_range_t         * range)
+		    vmpagesize_t                pagesz_mask)
 {
+    xpmem_pfn_range_t  * range = att->pfn_range;
     xpmem_pfn_region_t * rgn;
     uint64_t             rgn_idx;
     uint64_t             rgn_len;
+    uint64_t             off;
+    vmpagesize_t         page_size;
     vaddr_t              vaddr;
+    paddr_t              paddr;
     int                  status;
 
     vaddr = at_vaddr;
@@ -131,95 +111,50 @@ xpmem_map_pfn_range(struct xpmem_thread_group * ap_tg,
     for (rgn_idx = 0; rgn_idx < range->nr_regions; rgn_idx++) {
 	rgn     = &(range->pfn_list[rgn_idx]);
 	rgn_len = rgn->nr_pfns * VM_PAGE_4KB;
+	paddr   = rgn->first_pfn << PAGE_SHIFT;
 
-	status = xpmem_map_pfn_region(ap_tg, vaddr, page_size, rgn);
+	status = aspace_map_pmem(ap_tg->aspace->id, paddr, vaddr, rgn_len);
 	if (status != 0) {
-	    XPMEM_ERR("xpmem_map_pfn_region() failed (%d)", status);
-	    goto err;
+	    XPMEM_ERR("aspace_map_pmem() failed (%d)", status);
+	    return status;
 	}
 
-	vaddr += rgn_len;
-    }
-
-    return 0;
-
-err:
-    {
-	uint64_t j;
-	vaddr = at_vaddr;
-
-	for (j = 0; j < rgn_idx; j++) {
-	    rgn     = &(range->pfn_list[j]);
-	    rgn_len = rgn->nr_pfns * VM_PAGE_4KB;
-
-	    xpmem_unmap_pfn_region(ap_tg, vaddr, page_size, rgn);
-
-	    vaddr += rgn_len;
+	/* Account for the pages exactly as aspace_map_pmem() chose them */
+	for (off = 0; off < rgn_len; off += page_size) {
+	    page_size = aspace_pick_pagesz(pagesz_mask, vaddr + off, 
+			    paddr + off, rgn_len - off);
+
+	    switch (page_size) {
+		case VM_PAGE_1GB:
+		    att->nr_1gb_pages++;
+		    break;
+		case VM_PAGE_2MB:
+		    att->nr_2mb_pages++;
+		    break;
+		default:
+		    att->nr_4kb_pages++;
+		    break;
+	    }
 	}
-    }
-
-    return status;
-}
-
-static vmpagesize_t
-get_max_page_size(xpmem_pfn_range_t * range,
-		  vaddr_t             target_vaddr)
-{
-    vmpagesize_t          page_size;
-    xpmem_pfn_region_t  * rgn;
-    uint64_t              rgn_idx;
-    uint64_t              rgn_len;
-    paddr_t               paddr;
-
-    if (cpu_info[0].pagesz_mask & VM_PAGE_1GB)
-	page_size = VM_PAGE_1GB;
-    else
-	page_size = VM_PAGE_2MB;
-
-    for (rgn_idx = 0; rgn_idx < range->nr_regions; rgn_idx++) {
-	rgn     = &(range->pfn_list[rgn_idx]);
-	rgn_len = rgn->nr_pfns * VM_PAGE_4KB;
-	paddr   = rgn->first_pfn << PAGE_SHIFT;
 
-retry:
-	if ( 
-	    (      rgn_len & (page_size - 1)) ||
-	    (      paddr   & (page_size - 1)) ||
-	    (target_vaddr && 
-	     (target_vaddr & (page_size - 1))
-	    )
-	   )
-	{
-	    /* page size too large: retry with next smallest.
-	     * Note that any previous regions that were compatible
-	     * with a larger page size will also be compatible with
-	     * a smaller size
-	     */
-	    page_size /= 512;
-	    if (page_size == VM_PAGE_4KB)
-		break;
-
-	    goto retry;
-	}
+	vaddr += rgn_len;
     }
 
-    return page_size;
+    return 0;
 }
 		    
 
 /* BJK:
  *
- * This now maps xpmem segments in with large pages as long as the
- * following conditions hold:
+ * This maps xpmem segments in with the largest pages possible. The
+ * attachment's aspace region allows every page size the CPU supports,
+ * and each contiguous pfn region is mapped with 1GB, 2MB or 4KB pages
+ * according to its own alignment and length, so one unaligned fragment
+ * only costs small pages for that fragment.
  *
- * (1) att->at_size is an even multiple of the large page size
- * (2) the xpmem_pfn_range_t structure we get from the source segment
- *     maps contiguous pfn regions which can all be mapped by large pages 
- *	(i.e., there are no regions that are not a multiple of large
- *		page size and would need some small pages)
- * (3) we have enough free aspace to find a large page-aligned region
- * (4) if the user requested a specific target vaddr, that vaddr is
- *     appropriately aligned
+ * If the user did not request a specific target vaddr, the attachment
+ * is placed so that the largest pfn region lines up with its physical
+ * large page boundaries.
  */
 static int
 xpmem_map_shadow_pages(struct xpmem_thread_group * ap_tg,
@@ -228,15 +163,23 @@ xpmem_map_shadow_pages(struct xpmem_thread_group * ap_tg,
 	               vaddr_t                   * at_vaddr_p)
 {
     vaddr_t      at_vaddr;
+    vaddr_t      phase;
     vmpagesize_t alignment;
+    vmpagesize_t pagesz_mask;
     int          status;
 
-    /* get largest page size compatible with this attachment and the virtual address */
-    alignment = get_max_page_size(att->pfn_range, target_vaddr);
+    pagesz_mask = xpmem_attach_pagesz_mask();
+
+    if (target_vaddr) {
+	alignment = VM_PAGE_4KB;
+	phase     = 0;
+    } else {
+	alignment = xpmem_attach_alignment(att->pfn_range, pagesz_mask, &phase);
+    }
 
     /* Find free address space  */
     status = aspace_find_hole(ap_tg->aspace->id, target_vaddr, 
-		att->at_size, alignment, &at_vaddr);
+		att->at_size + phase, alignment, &at_vaddr);
     if (status != 0) {
 	XPMEM_ERR("aspace_find_hole() failed (%d)", status);
 	return status;
@@ -254,18 +197,19 @@ xpmem_map_shadow_pages(struct xpmem_thread_group * ap_tg,
 	BUG();
     }
 
+    at_vaddr += phase;
+
     /* Add region to aspace */
     /* TODO: use page flags in att->pfn_range */
     status = aspace_add_region(ap_tg->aspace->id, at_vaddr, att->at_size, 
-		VM_READ | VM_WRITE | VM_USER, alignment, "xpmem");
+		VM_READ | VM_WRITE | VM_USER, pagesz_mask, "xpmem");
     if (status != 0) {
 	XPMEM_ERR("aspace_add_region() failed (%d)", status);
 	return status;
     }
 
     /* Map each page in */
-    status = xpmem_map_pfn_range(ap_tg, at_vaddr, alignment, 
-		att->pfn_range);
+    status = xpmem_map_pfn_range(ap_tg, att, at_vaddr, pagesz_mask);
     if (status != 0) {
 	XPMEM_ERR("xpmem_map_pfn_range() failed (%d)", status);
 	aspace_del_region(ap_tg->aspace->id, at_vaddr, att->at_size);
@@ -695,3 +639,37 @@ xpmem_detach(vaddr_t at_vaddr)
 
     return 0;
 }
+
+
+/*
+ * Report the page sizes an attachment was mapped with. Only shadow
+ * attachments are mapped by XPMEM; local attachments go through SMARTMAP
+ * and share the source's page tables, so they report no pages.
+ */
+int
+xpmem_attach_info(vaddr_t                        at_vaddr,
+		  struct xpmem_cmd_attach_info * info)
+{
+    struct xpmem_thread_group *tg;
+    struct xpmem_attachment *att;
+
+    tg = xpmem_tg_ref_by_tgid(current->aspace->id);
+    if (IS_ERR(tg))
+	return PTR_ERR(tg);
+
+    att = xpmem_att_ref_by_vaddr(tg, at_vaddr & PAGE_MASK);
+    if (IS_ERR(att)) {
+	xpmem_tg_deref(tg);
+	return PTR_ERR(att);
+    }
+
+    info->size         = att->at_size;
+    info->nr_4kb_pages = att->nr_4kb_pages;
+    info->nr_2mb_pages = att->nr_2mb_pages;
+    info->nr_1gb_pages = att->nr_1gb_pages;
+
+    xpmem_att_deref(att);
+    xpmem_tg_deref(tg);
+
+    return 0;
+}
@@ -248,38 +248,64 @@ xpmem_init_pfn_range(xpmem_pfn_range_t ** pfn_range,
 }
 
 static void
-xpmem_add_pfn_to_pfn_range(xpmem_pfn_range_t * pfn_range,
-			   u64		       pfn)
+xpmem_add_pfns_to_pfn_range(xpmem_pfn_range_t * pfn_range,
+			    u64		        pfn,
+			    u64			nr_pfns)
 {
     xpmem_pfn_region_t * pfn_list = NULL;
     xpmem_pfn_region_t * last_reg = NULL;
-    xpmem_pfn_region_t * new_reg  = NULL;
     u64			 next_pfn = 0;
+    u64			 count    = 0;
 
     pfn_list = pfn_range->pfn_list;
 
     /* Update total size */
-    pfn_range->total_size += PAGE_SIZE;
+    pfn_range->total_size += nr_pfns * PAGE_SIZE;
 
-    if (pfn_range->nr_regions == 0) {
-	pfn_list[0].first_pfn = pfn;
-	pfn_list[0].nr_pfns   = 1;
-	pfn_range->nr_regions = 1;
-	return;
+    while (nr_pfns > 0) {
+	if (pfn_range->nr_regions > 0) {
+	    last_reg = &(pfn_list[pfn_range->nr_regions - 1]);
+	    next_pfn = last_reg->first_pfn + last_reg->nr_pfns;
+
+	    /* Check if we can extend the previous region */
+	    if ((pfn == next_pfn) && (last_reg->nr_pfns < XPMEM_MAX_NR_PFNS - 1)) {
+		count = min(nr_pfns, (XPMEM_MAX_NR_PFNS - 1) - last_reg->nr_pfns);
+
+		last_reg->nr_pfns += count;
+		pfn               += count;
+		nr_pfns           -= count;
+		continue;
+	    }
+	}
+
+	/* A region's nr_pfns bitfield caps how much one entry can describe */
+	count = min(nr_pfns, XPMEM_MAX_NR_PFNS - 1);
+
+	last_reg = &(pfn_list[pfn_range->nr_regions++]);
+	last_reg->first_pfn = pfn;
+	last_reg->nr_pfns   = count;
+
+	pfn     += count;
+	nr_pfns -= count;
     }
+}
 
-    last_reg = &(pfn_list[pfn_range->nr_regions - 1]);
-    next_pfn = last_reg->first_pfn + last_reg->nr_pfns;
+static int
+xpmem_add_extent_to_pfn_range(paddr_t paddr,
+			      size_t  size,
+			      void  * priv)
+{
+    xpmem_pfn_range_t * pfn_range = priv;
+    u64                 pfn       = paddr >> PAGE_SHIFT;
+    u64                 nr_pfns   = size  >> PAGE_SHIFT;
 
-    /* Check if we can extend the previous region */
-    if (pfn == next_pfn) {
-	last_reg->nr_pfns++;
-	return;
+    if (!xpmem_pfn_valid(pfn + nr_pfns - 1)) {
+	XPMEM_ERR("Invalid XPMEM PFN");
+	return -EFAULT;
     }
 
-    new_reg = &(pfn_list[pfn_range->nr_regions++]);
-    new_reg->first_pfn = pfn;
-    new_reg->nr_pfns   = 1;
+    xpmem_add_pfns_to_pfn_range(pfn_range, pfn, nr_pfns);
+    return 0;
 }
 
 static int
@@ -292,8 +318,6 @@ xpmem_get_pages(struct xpmem_attachment * att,
     struct xpmem_thread_group  * ap_tg  = NULL;
 
     u64   seg_vaddr = 0;
-    u64   i         = 0;
-    u64   pfn       = 0;
     u64   num_pfns  = att->at_size / PAGE_SIZE;
 
     int ret = 0;
@@ -324,26 +348,13 @@ xpmem_get_pages(struct xpmem_attachment * att,
     /* The list is preallocated by the remote domain */
     xpmem_init_pfn_range(&(att->pfn_range), pfn_pa);
 
-    for (i = 0; i < num_pfns; i++) {
-	vaddr_t vaddr = 0;
-	paddr_t paddr = 0;
-
-	vaddr = seg_vaddr + (i * PAGE_SIZE);
-
-	ret = aspace_virt_to_phys(seg_tg->aspace->id, vaddr, &paddr);
-	if (ret != 0) {
-	    XPMEM_ERR("aspace_virt_to_phys() failed (%d)", ret);
-	    goto out;
-	}
-
-        pfn = paddr >> PAGE_SHIFT;
-	if (!xpmem_pfn_valid(pfn)) {
-	    XPMEM_ERR("Invalid XPMEM PFN");
-	    ret = -EFAULT;
-	    goto out;
-	}
-
-	xpmem_add_pfn_to_pfn_range(att->pfn_range, pfn);
+    /* Translate the whole segment in one locked page table pass, adding
+     * physically contiguous extents rather than individual pages */
+    ret = aspace_virt_to_phys_range(seg_tg->aspace->id, seg_vaddr, num_pfns * PAGE_SIZE,
+	    xpmem_add_extent_to_pfn_range, att->pfn_range);
+    if (ret != 0) {
+	XPMEM_ERR("aspace_virt_to_phys_range() failed (%d)", ret);
+	goto out;
     }
 
     /* TODO: set flags for pfn range (grab them from the PTE?) */
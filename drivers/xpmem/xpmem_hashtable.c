@@ -36,11 +36,34 @@
 #include <lwk/types.h>
 #include <lwk/kmem.h>
 #include <lwk/spinlock.h>
+#include <lwk/cache.h>
+#include <arch/atomic.h>
 #include <arch/string.h>
 
 #include <xpmem_hashtable.h>
 
 
+/*
+ * Concurrency model
+ *
+ * Buckets are guarded by NR_STRIPES stripe locks rather than one table lock.
+ * Table lengths are powers of two no smaller than NR_STRIPES, so an entry's
+ * stripe (hash & (NR_STRIPES - 1)) is the same in every table size and an
+ * operation only ever takes the one stripe lock covering its key.
+ *
+ * Growing is incremental: the new table is allocated with no locks held and
+ * installed (briefly holding every stripe lock), after which each update
+ * migrates a few buckets of the old table. Until migration finishes, lookups
+ * check both tables; migrated old buckets are simply empty.
+ *
+ * Kitten has no RCU grace periods, so lookups take their stripe lock too
+ * instead of walking chains locklessly. With many stripes, concurrent
+ * lookups of different keys almost never meet on the same lock.
+ */
+#define NR_STRIPES	64	/* must be a power of 2 */
+#define MIGRATE_BATCH	8	/* old buckets moved per update while growing */
+#define MAX_LENGTH	(1u << 30)
+
 struct hash_entry {
     uintptr_t		key;
     uintptr_t		value;
@@ -48,17 +71,28 @@ struct hash_entry {
     struct hash_entry * next;
 };
 
+struct htable_stripe {
+    spinlock_t		 lock;
+} ____cacheline_aligned;
+
 struct xpmem_hashtable {
+    /* Changed only with every stripe lock and resize_lock held */
     struct hash_entry ** table;
     u32			 table_length;
-    u32			 entry_count;
-    u32			 load_limit;
-    u32			 prime_index;
+    struct hash_entry ** old_table;	/* being migrated into table, or NULL */
+    u32			 old_length;
+
+    /* Protected by resize_lock */
+    u32			 migrate_pos;	/* next old bucket to hand out */
+    u32			 migrated;	/* old buckets fully moved */
+    int			 expanding;	/* a new table is being allocated */
+    spinlock_t		 resize_lock;
+
+    atomic_t		 entry_count;
     u32 (*hash_fn) (uintptr_t key);
     int (*eq_fn) (uintptr_t key1, uintptr_t key2);
 
-    spinlock_t		 lock;
-    int			 expanding;
+    struct htable_stripe stripes[NR_STRIPES];
 };
 
 
@@ -140,57 +174,53 @@ static inline u32
 indexFor(u32 table_length, 
 	 u32 hash_value) 
 {
-    return (hash_value % table_length);
+    return (hash_value & (table_length - 1));
 };
 
 #define freekey(X) kmem_free(X)
 
 
-/*
-  Credit for primes table: Aaron Krowne
-  http://br.endernet.org/~akrowne/
-  http://planetmath.org/encyclopedia/GoodHashTablePrimes.html
-*/
-static const u32 primes[] = { 
-    53, 97, 193, 389,
-    769, 1543, 3079, 6151,
-    12289, 24593, 49157, 98317,
-    196613, 393241, 786433, 1572869,
-    3145739, 6291469, 12582917, 25165843,
-    50331653, 100663319, 201326611, 402653189,
-    805306457, 1610612741 };
-
-
-// this assumes that the max load factor is .65
-static const u32 load_factors[] = {
-    35, 64, 126, 253,
-    500, 1003, 2002, 3999,
-    7988, 15986, 31953, 63907,
-    127799, 255607, 511182, 1022365,
-    2044731, 4089455, 8178897, 16357798,
-    32715575, 65431158, 130862298, 261724573,
-    523449198, 1046898282 };
-
-const u32 prime_table_len = sizeof(primes) / sizeof(primes[0]);
+static inline spinlock_t *
+stripe_lock(struct xpmem_hashtable * htable,
+	    u32			     hash_value)
+{
+    return &(htable->stripes[hash_value & (NR_STRIPES - 1)].lock);
+}
+
+static void
+lock_all_stripes(struct xpmem_hashtable * htable)
+{
+    u32 i;
+
+    /* Always in ascending order, callers have interrupts disabled */
+    for (i = 0; i < NR_STRIPES; i++)
+	spin_lock(&(htable->stripes[i].lock));
+}
+
+static void
+unlock_all_stripes(struct xpmem_hashtable * htable)
+{
+    u32 i;
+
+    for (i = NR_STRIPES; i > 0; i--)
+	spin_unlock(&(htable->stripes[i - 1].lock));
+}
 
 struct xpmem_hashtable * create_htable(u32 min_size,
 				    u32 (*hash_fn) (uintptr_t),
 				    int (*eq_fn) (uintptr_t, uintptr_t)) {
     struct xpmem_hashtable * htable;
-    u32 prime_index;
-    u32 size = primes[0];
+    u32 size = NR_STRIPES;
+    u32 i;
 
     /* Check requested hashtable isn't too large */
-    if (min_size > (1u << 30)) {
+    if (min_size > MAX_LENGTH) {
 	return NULL;
     }
 
-    /* Enforce size as prime */
-    for (prime_index = 0; prime_index < prime_table_len; prime_index++) {
-	if (primes[prime_index] > min_size) { 
-	    size = primes[prime_index]; 
-	    break; 
-	}
+    /* Enforce size as a power of 2, at least one bucket per stripe */
+    while (size < min_size) {
+	size <<= 1;
     }
 
     htable = (struct xpmem_hashtable *)kmem_alloc(sizeof(struct xpmem_hashtable));
@@ -209,221 +239,321 @@ struct xpmem_hashtable * create_htable(u32 min_size,
     memset(htable->table, 0, size * sizeof(struct hash_entry *));
 
     htable->table_length  = size;
-    htable->prime_index   = prime_index;
-    htable->entry_count   = 0;
+    htable->old_table	  = NULL;
+    htable->old_length	  = 0;
+    htable->migrate_pos	  = 0;
+    htable->migrated	  = 0;
+    htable->expanding	  = 0;
     htable->hash_fn	  = hash_fn;
     htable->eq_fn	  = eq_fn;
-    htable->load_limit	  = load_factors[prime_index];
-    htable->expanding	  = 0;
-    
-    spin_lock_init(&(htable->lock));
+    atomic_set(&(htable->entry_count), 0);
+
+    spin_lock_init(&(htable->resize_lock));
+    for (i = 0; i < NR_STRIPES; i++) {
+	spin_lock_init(&(htable->stripes[i].lock));
+    }
 
     return htable;
 }
 
 
-static int 
-hashtable_expand(struct xpmem_hashtable * htable,
-		 struct hash_entry     ** new_table,
-		 u32			  new_size) 
+/* Move one bucket of the old table. The caller holds that bucket's stripe lock */
+static void
+__migrate_bucket(struct xpmem_hashtable * htable,
+		 u32			  bucket)
 {
-    /* Double the size of the table to accomodate more entries */
     struct hash_entry * tmp_entry = NULL;
-    u32 i = 0;
     u32 index = 0;
 
-    memset(new_table, 0, new_size * sizeof(struct hash_entry *));
-    /* This algorithm is not 'stable'. ie. it reverses the list
-    * when it transfers entries between the tables */
-
-    for (i = 0; i < htable->table_length; i++) {
+    while ((tmp_entry = htable->old_table[bucket]) != NULL) {
+	htable->old_table[bucket] = tmp_entry->next;
 
-	while ((tmp_entry = htable->table[i]) != NULL) {
-	    htable->table[i] = tmp_entry->next;
+	index = indexFor(htable->table_length, tmp_entry->hash);
 
-	    index = indexFor(new_size, tmp_entry->hash);
+	tmp_entry->next = htable->table[index];
+	htable->table[index] = tmp_entry;
+    }
+}
 
-	    tmp_entry->next = new_table[index];
+static void
+migrate_buckets(struct xpmem_hashtable * htable)
+{
+    struct hash_entry ** old_table = NULL;
+    unsigned long flags;
+    u32 bucket = 0;
+    u32 i = 0;
 
-	    new_table[index] = tmp_entry;
+    for (i = 0; i < MIGRATE_BATCH; i++) {
+	spin_lock_irqsave(&(htable->resize_lock), flags);
+	if ((htable->old_table == NULL) ||
+	    (htable->migrate_pos == htable->old_length)) {
+	    spin_unlock_irqrestore(&(htable->resize_lock), flags);
+	    return;
 	}
+	bucket = htable->migrate_pos++;
+	spin_unlock_irqrestore(&(htable->resize_lock), flags);
+
+	/* old_table cannot be freed until this bucket is counted as migrated */
+	spin_lock_irqsave(stripe_lock(htable, bucket), flags);
+	__migrate_bucket(htable, bucket);
+	spin_unlock_irqrestore(stripe_lock(htable, bucket), flags);
+
+	spin_lock_irqsave(&(htable->resize_lock), flags);
+	if (++(htable->migrated) < htable->old_length) {
+	    spin_unlock_irqrestore(&(htable->resize_lock), flags);
+	    continue;
+	}
+	spin_unlock_irqrestore(&(htable->resize_lock), flags);
+
+	/* Last bucket moved: retire the old table */
+	local_irq_save(flags);
+	lock_all_stripes(htable);
+	spin_lock(&(htable->resize_lock));
+
+	old_table	    = htable->old_table;
+	htable->old_table   = NULL;
+	htable->old_length  = 0;
+	htable->migrate_pos = 0;
+	htable->migrated    = 0;
+
+	spin_unlock(&(htable->resize_lock));
+	unlock_all_stripes(htable);
+	local_irq_restore(flags);
+
+	kmem_free(old_table);
+	return;
+    }
+}
+
+static void
+hashtable_expand(struct xpmem_hashtable * htable)
+{
+    struct hash_entry ** new_table = NULL;
+    unsigned long flags;
+    u32 new_size = 0;
+
+    spin_lock_irqsave(&(htable->resize_lock), flags);
+    if ((htable->expanding) ||
+	(htable->old_table != NULL) ||
+	(htable->table_length >= MAX_LENGTH))
+    {
+	spin_unlock_irqrestore(&(htable->resize_lock), flags);
+	return;
+    }
+    htable->expanding = 1;
+    new_size = htable->table_length << 1;
+    spin_unlock_irqrestore(&(htable->resize_lock), flags);
+
+    /* Allocate with no locks held; only this thread can be expanding */
+    new_table = (struct hash_entry **)kmem_alloc(sizeof(struct hash_entry *) * new_size);
+    if (new_table != NULL) {
+	memset(new_table, 0, new_size * sizeof(struct hash_entry *));
     }
 
-    kmem_free(htable->table);
+    local_irq_save(flags);
+    lock_all_stripes(htable);
+    spin_lock(&(htable->resize_lock));
+
+    /* If allocation failed, we still keep inserting into the existing table
+     * -- the next insert over the load limit will try expanding again */
+    if (new_table != NULL) {
+	htable->old_table    = htable->table;
+	htable->old_length   = htable->table_length;
+	htable->table	     = new_table;
+	htable->table_length = new_size;
+	htable->migrate_pos  = 0;
+	htable->migrated     = 0;
+    }
+    htable->expanding = 0;
 
-    htable->table	 = new_table;
-    htable->table_length = new_size;
-    htable->load_limit	 = load_factors[htable->prime_index];
+    spin_unlock(&(htable->resize_lock));
+    unlock_all_stripes(htable);
+    local_irq_restore(flags);
+}
 
-    return -1;
+/* Called after every successful update, outside the stripe lock */
+static void
+htable_maintain(struct xpmem_hashtable * htable)
+{
+    /* max load factor of .75 */
+    if ((u32)atomic_read(&(htable->entry_count)) > ((htable->table_length >> 2) * 3)) {
+	hashtable_expand(htable);
+    }
+
+    if (htable->old_table != NULL) {
+	migrate_buckets(htable);
+    }
 }
 
 u32 
 htable_count(struct xpmem_hashtable * htable)
 {
-    return htable->entry_count;
+    return atomic_read(&(htable->entry_count));
 }
 
-int 
-htable_insert(struct xpmem_hashtable * htable, uintptr_t key, uintptr_t value) {
+
+/* Returns the link pointing at the entry for key in a chain, or NULL */
+static struct hash_entry **
+__chain_find(struct xpmem_hashtable * htable,
+	     struct hash_entry	   ** entry_ptr,
+	     uintptr_t		      key,
+	     u32		      hash_value)
+{
+    struct hash_entry * cursor = NULL;
+
+    while ((cursor = *entry_ptr) != NULL) {
+	/* Check hash value to short circuit heavier comparison */
+	if ((hash_value == cursor->hash) && 
+		(htable->eq_fn(key, cursor->key))) {
+	    return entry_ptr;
+	}
+
+	entry_ptr = &(cursor->next);
+    }
+
+    return NULL;
+}
+
+/* Looks in the current table, then the one being migrated. Caller holds the stripe lock */
+static struct hash_entry **
+__htable_find(struct xpmem_hashtable * htable, 
+	      uintptr_t		       key,
+	      u32		       hash_value)
+{
+    struct hash_entry ** entry_ptr = NULL;
+
+    entry_ptr = __chain_find(htable, 
+			     &(htable->table[indexFor(htable->table_length, hash_value)]),
+			     key, hash_value);
+
+    if ((entry_ptr == NULL) && (htable->old_table != NULL)) {
+	entry_ptr = __chain_find(htable,
+				 &(htable->old_table[indexFor(htable->old_length, hash_value)]),
+				 key, hash_value);
+    }
+
+    return entry_ptr;
+}
+
+static int
+__htable_insert(struct xpmem_hashtable * htable,
+		uintptr_t		 key,
+		uintptr_t		 value,
+		int			 unique)
+{
     /* This method allows duplicate keys - but they shouldn't be used */
-    struct hash_entry ** new_table = NULL;
     struct hash_entry * new_entry = NULL;
-    u32 index = 0;
-    u32 new_size = 0;
-    int expand = 0;
     unsigned long flags;
+    u32 hash_value = 0;
+    u32 index = 0;
 
     /* Allocate new entry */
     new_entry = (struct hash_entry *)kmem_alloc(sizeof(struct hash_entry));
     if (new_entry == NULL) {
 	return 0; /* oom */
     }
-    
-    /* Lock htable */
-    spin_lock_irqsave(&(htable->lock), flags);
-
-    /* Determine if table needs expanding */
-    if ((htable->expanding	  == 0) &&
-	(htable->entry_count + 1)  > htable->load_limit)
-    {
-	expand		  = 1;
-	htable->expanding = 1;
-    }
 
-    /* Increment entry count */
-    ++(htable->entry_count);
+    hash_value = do_hash(htable, key);
 
-    if (expand) {
-	/* Check we're not hitting max capacity */
-	if (htable->prime_index == (prime_table_len - 1)) {
-	    kmem_free(new_entry);
-	    htable->expanding = 0;
-	    spin_unlock_irqrestore(&(htable->lock), flags);
-	    return 0;
-	}
+    new_entry->hash  = hash_value;
+    new_entry->key   = key;
+    new_entry->value = value;
 
-	new_size = primes[++(htable->prime_index)];
-	
-	/* Drop lock just to allocate memory. There's a race between re-acquiring the lock
-	 * after allocation and another process skipping over the expansion block and
-	 * inserting, but expansion is not strictly required for insertion so the race is
-	 * inconsequential
-	 */
-	spin_unlock_irqrestore(&(htable->lock), flags);
-	new_table = (struct hash_entry **)kmem_alloc(sizeof(struct hash_entry *) * new_size);
-	spin_lock_irqsave(&(htable->lock), flags);
-
-	if (new_table == NULL) {
-	    (htable->prime_index)--;
-	    kmem_free(new_entry);
-	    htable->expanding = 0;
-	    spin_unlock_irqrestore(&(htable->lock), flags);
-	    return 0; /* oom */
-	}
+    spin_lock_irqsave(stripe_lock(htable, hash_value), flags);
 
-	/* Ignore the return value. If expand fails, we should
-	 * still try cramming just this value into the existing table
-	 * -- we may not have memory for a larger table, but one more
-	 * element may be ok. Next time we insert, we'll try expanding again.*/
-	hashtable_expand(htable, new_table, new_size);
+    if (unique && (__htable_find(htable, key, hash_value) != NULL)) {
+	spin_unlock_irqrestore(stripe_lock(htable, hash_value), flags);
+	kmem_free(new_entry);
+	return 0;
     }
 
-    new_entry->hash = do_hash(htable, key);
-
-    index = indexFor(htable->table_length, new_entry->hash);
-
-    new_entry->key = key;
-    new_entry->value = value;
+    /* New entries always go to the current table */
+    index = indexFor(htable->table_length, hash_value);
 
     new_entry->next = htable->table[index];
-
     htable->table[index] = new_entry;
 
-    /* Unlock htable */
-    spin_unlock_irqrestore(&(htable->lock), flags);
-
-    return -1;
-}
-
-
-static int 
-__htable_change(struct xpmem_hashtable * htable, 
-		uintptr_t		 key, 
-		uintptr_t		 value, 
-		int			 free_value)
-{
-    struct hash_entry * tmp_entry;
-    u32 hash_value;
-    u32 index;
-
-    hash_value = do_hash(htable, key);
+    atomic_inc(&(htable->entry_count));
 
-    index = indexFor(htable->table_length, hash_value);
+    spin_unlock_irqrestore(stripe_lock(htable, hash_value), flags);
 
-    tmp_entry = htable->table[index];
+    htable_maintain(htable);
 
-    while (tmp_entry != NULL) {
-	/* Check hash value to short circuit heavier comparison */
-	if ((hash_value == tmp_entry->hash) && (htable->eq_fn(key, tmp_entry->key))) {
+    return -1;
+}
 
-	    if (free_value) {
-		kmem_free((void *)(tmp_entry->value));
-	    }
+int 
+htable_insert(struct xpmem_hashtable * htable, uintptr_t key, uintptr_t value) {
+    return __htable_insert(htable, key, value, 0);
+}
 
-	    tmp_entry->value = value;
-	    return -1;
-	}
-	tmp_entry = tmp_entry->next;
-    }
-    return 0;
+int 
+htable_insert_unique(struct xpmem_hashtable * htable, uintptr_t key, uintptr_t value) {
+    return __htable_insert(htable, key, value, 1);
 }
 
+
 int
 htable_change(struct xpmem_hashtable * htable,
 	      uintptr_t		       key,
 	      uintptr_t		       value,
 	      int		       free_value)
 {
-    int ret = 0;
+    struct hash_entry ** entry_ptr = NULL;
+    uintptr_t old_value = 0;
     unsigned long flags;
+    u32 hash_value = 0;
+    int ret = 0;
 
-    spin_lock_irqsave(&(htable->lock), flags);
+    hash_value = do_hash(htable, key);
+
+    spin_lock_irqsave(stripe_lock(htable, hash_value), flags);
     {
-	ret = __htable_change(htable, key, value, free_value);
+	entry_ptr = __htable_find(htable, key, hash_value);
+	if (entry_ptr != NULL) {
+	    old_value	       = (*entry_ptr)->value;
+	    (*entry_ptr)->value = value;
+	    ret		       = -1;
+	}
+    }
+    spin_unlock_irqrestore(stripe_lock(htable, hash_value), flags);
+
+    if (ret && free_value) {
+	kmem_free((void *)old_value);
     }
-    spin_unlock_irqrestore(&(htable->lock), flags);
 
     return ret;
 }
 
 
-
 static int 
-__htable_inc(struct xpmem_hashtable * htable, 
+__htable_add(struct xpmem_hashtable * htable, 
 	     uintptr_t		      key, 
-	     uintptr_t		      value)
+	     uintptr_t		      value,
+	     int		      negate)
 {
-    struct hash_entry * tmp_entry = NULL;
+    struct hash_entry ** entry_ptr = NULL;
+    unsigned long flags;
     u32 hash_value = 0;
-    u32 index = 0;
+    int ret = 0;
 
     hash_value = do_hash(htable, key);
 
-    index = indexFor(htable->table_length, hash_value);
-
-    tmp_entry = htable->table[index];
-
-    while (tmp_entry != NULL) {
-	/* Check hash value to short circuit heavier comparison */
-	if ((hash_value == tmp_entry->hash) && (htable->eq_fn(key, tmp_entry->key))) {
-
-	    tmp_entry->value += value;
-	    return -1;
+    spin_lock_irqsave(stripe_lock(htable, hash_value), flags);
+    {
+	entry_ptr = __htable_find(htable, key, hash_value);
+	if (entry_ptr != NULL) {
+	    if (negate) {
+		(*entry_ptr)->value -= value;
+	    } else {
+		(*entry_ptr)->value += value;
+	    }
+	    ret = -1;
 	}
-	tmp_entry = tmp_entry->next;
     }
-    return 0;
+    spin_unlock_irqrestore(stripe_lock(htable, hash_value), flags);
+
+    return ret;
 }
 
 int
@@ -431,45 +561,7 @@ htable_inc(struct xpmem_hashtable * htable,
 	   uintptr_t		    key, 
 	   uintptr_t		    value)
 {
-    int ret = 0;
-    unsigned long flags;
-
-    spin_lock_irqsave(&(htable->lock), flags);
-    {
-	ret = __htable_inc(htable, key, value);
-    }
-    spin_unlock_irqrestore(&(htable->lock), flags);
-
-    return ret;
-}
-
-
-
-static int 
-__htable_dec(struct xpmem_hashtable * htable, 
-	     uintptr_t		      key, 
-	     uintptr_t		      value)
-{
-    struct hash_entry * tmp_entry = NULL;
-    u32 hash_value = 0;
-    u32 index = 0;
-
-    hash_value = do_hash(htable, key);
-
-    index = indexFor(htable->table_length, hash_value);
-
-    tmp_entry = htable->table[index];
-
-    while (tmp_entry != NULL) {
-	/* Check hash value to short circuit heavier comparison */
-	if ((hash_value == tmp_entry->hash) && (htable->eq_fn(key, tmp_entry->key))) {
-
-	    tmp_entry->value -= value;
-	    return -1;
-	}
-	tmp_entry = tmp_entry->next;
-    }
-    return 0;
+    return __htable_add(htable, key, value, 0);
 }
 
 int 
@@ -477,60 +569,31 @@ htable_dec(struct xpmem_hashtable * htable,
 	   uintptr_t		    key, 
 	   uintptr_t		    value)
 {
-    int ret = 0;
-    unsigned long flags;
-
-    spin_lock_irqsave(&(htable->lock), flags);
-    {
-	ret = __htable_dec(htable, key, value);
-    }
-    spin_unlock_irqrestore(&(htable->lock), flags);
-
-    return ret;
+    return __htable_add(htable, key, value, 1);
 }
 
 
 
 /* returns value associated with key */
-static uintptr_t 
-__htable_search(struct xpmem_hashtable * htable, 
-		uintptr_t		 key)
-{
-    struct hash_entry * cursor = NULL;
-    u32 hash_value = 0;
-    u32 index = 0;
-
-    hash_value = do_hash(htable, key);
-
-    index = indexFor(htable->table_length, hash_value);
-
-    cursor = htable->table[index];
-
-    while (cursor != NULL) {
-	/* Check hash value to short circuit heavier comparison */
-	if ((hash_value == cursor->hash) && 
-		(htable->eq_fn(key, cursor->key))) {
-	    return cursor->value;
-	}
-
-	cursor = cursor->next;
-    }
-
-    return (uintptr_t)NULL;
-}
-
 uintptr_t 
 htable_search(struct xpmem_hashtable * htable, 
 	      uintptr_t		       key)
 {
+    struct hash_entry ** entry_ptr = NULL;
     uintptr_t ret = 0;
     unsigned long flags;
+    u32 hash_value = 0;
 
-    spin_lock_irqsave(&(htable->lock), flags);
+    hash_value = do_hash(htable, key);
+
+    spin_lock_irqsave(stripe_lock(htable, hash_value), flags);
     {
-	ret = __htable_search(htable, key);
+	entry_ptr = __htable_find(htable, key, hash_value);
+	if (entry_ptr != NULL) {
+	    ret = (*entry_ptr)->value;
+	}
     }
-    spin_unlock_irqrestore(&(htable->lock), flags);
+    spin_unlock_irqrestore(stripe_lock(htable, hash_value), flags);
 
     return ret;
 }
@@ -538,129 +601,92 @@ htable_search(struct xpmem_hashtable * htable,
 
 
 /* returns value associated with key */
-static uintptr_t 
-__htable_remove(struct xpmem_hashtable * htable, 
-		uintptr_t		 key, 
-		int			 free_key)
+uintptr_t 
+htable_remove(struct xpmem_hashtable * htable, 
+	      uintptr_t		       key, 
+	      int		       free_key)
 {
     /* TODO: consider compacting the table when the load factor drops enough,
      *	     or provide a 'compact' method. */
 
-    struct hash_entry * cursor = NULL;
     struct hash_entry ** entry_ptr = NULL;
+    struct hash_entry  * cursor    = NULL;
     uintptr_t value = 0;
+    unsigned long flags;
     u32 hash_value = 0;
-    u32 index = 0;
 
     hash_value = do_hash(htable, key);
 
-    index = indexFor(htable->table_length, hash_value);
-
-    entry_ptr = &(htable->table[index]);
-    cursor = *entry_ptr;
-
-    while (cursor != NULL) {
-	/* Check hash value to short circuit heavier comparison */
-	if ((hash_value == cursor->hash) && 
-		(htable->eq_fn(key, cursor->key))) {
-
+    spin_lock_irqsave(stripe_lock(htable, hash_value), flags);
+    {
+	entry_ptr = __htable_find(htable, key, hash_value);
+	if (entry_ptr != NULL) {
+	    cursor     = *entry_ptr;
 	    *entry_ptr = cursor->next;
-	    htable->entry_count--;
-	    value = cursor->value;
-
-	    if (free_key) {
-		freekey((void *)(cursor->key));
-	    }
-	    kmem_free(cursor);
-
-	    return value;
+	    atomic_dec(&(htable->entry_count));
 	}
+    }
+    spin_unlock_irqrestore(stripe_lock(htable, hash_value), flags);
 
-	entry_ptr = &(cursor->next);
-	cursor = cursor->next;
+    if (cursor == NULL) {
+	return (uintptr_t)NULL;
     }
-    return (uintptr_t)NULL;
-}
 
-uintptr_t 
-htable_remove(struct xpmem_hashtable * htable, 
-	      uintptr_t		       key, 
-	      int		       free_key)
-{
-    uintptr_t ret = 0;
-    unsigned long flags;
+    value = cursor->value;
 
-    spin_lock_irqsave(&(htable->lock), flags);
-    {
-	ret = __htable_remove(htable, key, free_key);
+    if (free_key) {
+	freekey((void *)(cursor->key));
     }
-    spin_unlock_irqrestore(&(htable->lock), flags);
+    kmem_free(cursor);
 
-    return ret;
+    return value;
 }
 
 
 
 /* destroy */
 static void 
-__free_htable(struct xpmem_hashtable * htable, 
-	      int		       free_values, 
-	      int		       free_keys)
+__free_table(struct hash_entry ** table,
+	     u32		  table_length,
+	     int		  free_values, 
+	     int		  free_keys)
 {
     u32 i;
     struct hash_entry * cursor = NULL;
     struct hash_entry * tmp = NULL;
-    struct hash_entry ** table = htable->table;
 
-    if (free_values) {
-	for (i = 0; i < htable->table_length; i++) {
-	    cursor = table[i];
+    for (i = 0; i < table_length; i++) {
+	cursor = table[i];
 
-	    while (cursor != NULL) { 
-		tmp = cursor; 
-		cursor = cursor->next; 
+	while (cursor != NULL) { 
+	    tmp = cursor; 
+	    cursor = cursor->next; 
 
-		if (free_keys) {
-		    freekey((void *)(tmp->key)); 
-		}
-		kmem_free((void *)(tmp->value)); 
-		kmem_free(tmp); 
+	    if (free_keys) {
+		freekey((void *)(tmp->key)); 
 	    }
-	}
-    } else {
-	for (i = 0; i < htable->table_length; i++) {
-	    cursor = table[i];
-
-	    while (cursor != NULL) { 
-		struct hash_entry * tmp = NULL;
-
-		tmp = cursor; 
-		cursor = cursor->next; 
-
-		if (free_keys) {
-		    freekey((void *)(tmp->key)); 
-		}
-		kmem_free(tmp); 
+	    if (free_values) {
+		kmem_free((void *)(tmp->value)); 
 	    }
+	    kmem_free(tmp); 
 	}
     }
 
-    kmem_free(htable->table);
+    kmem_free(table);
 }
 
 
+/* The caller guarantees there are no concurrent users left */
 void 
 free_htable(struct xpmem_hashtable * htable, 
 	    int			     free_values, 
 	    int			     free_keys)
 {
-    unsigned long flags;
+    __free_table(htable->table, htable->table_length, free_values, free_keys);
 
-    spin_lock_irqsave(&(htable->lock), flags);
-    {
-	__free_htable(htable, free_values, free_keys);
+    if (htable->old_table != NULL) {
+	__free_table(htable->old_table, htable->old_length, free_values, free_keys);
     }
-    spin_unlock_irqrestore(&(htable->lock), flags);
 
     kmem_free(htable);
 }
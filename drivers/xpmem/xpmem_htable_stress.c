@@ -0,0 +1,199 @@
+/*
+ * XPMEM hashtable stress test
+ *
+ * Runs a mixed search/insert/remove workload against one shared
+ * xpmem_hashtable from 1, 2, 4, ... kernel threads (one per CPU) at boot and
+ * reports throughput for each thread count, along with any lookups that
+ * returned the wrong value.
+ */
+
+#include <lwk/kernel.h>
+#include <lwk/driver.h>
+#include <lwk/kthread.h>
+#include <lwk/sched.h>
+#include <lwk/smp.h>
+#include <lwk/cpumask.h>
+#include <lwk/time.h>
+#include <arch/atomic.h>
+
+#include <xpmem_hashtable.h>
+
+#define STRESS_MAX_THREADS	64
+#define STRESS_SHARED_KEYS	4096	/* preloaded, searched by every thread */
+#define STRESS_PRIVATE_KEYS	1024	/* inserted/removed by one thread */
+#define STRESS_OPS		200000	/* per thread, per round */
+
+struct stress_state {
+    struct xpmem_hashtable * ht;
+    atomic_t		     ready;
+    atomic_t		     done;
+    atomic_t		     errors;
+    volatile int	     go;
+};
+
+struct stress_thread {
+    struct stress_state * state;
+    int			  id;
+};
+
+static struct stress_state  stress;
+static struct stress_thread threads[STRESS_MAX_THREADS];
+
+
+static u32
+stress_hash(uintptr_t key)
+{
+    return hash_long(key, 32);
+}
+
+static int
+stress_eq(uintptr_t key1, uintptr_t key2)
+{
+    return (key1 == key2);
+}
+
+static inline u32
+xorshift(u32 * seed)
+{
+    u32 x = *seed;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+
+    return (*seed = x);
+}
+
+static int
+stress_thread_fn(void * arg)
+{
+    struct stress_thread * thread = (struct stress_thread *)arg;
+    struct stress_state  * state  = thread->state;
+    uintptr_t private_base = STRESS_SHARED_KEYS + (thread->id * STRESS_PRIVATE_KEYS);
+    uintptr_t key, val;
+    u32 seed = 2463534242u + thread->id;
+    u32 r, i;
+
+    atomic_inc(&(state->ready));
+    while (!state->go)
+	schedule();
+
+    for (i = 0; i < STRESS_OPS; i++) {
+	r = xorshift(&seed);
+
+	/* 80% lookups of shared keys, 20% private insert/remove churn */
+	if ((r % 10) < 8) {
+	    key = (r >> 8) % STRESS_SHARED_KEYS;
+	    val = htable_search(state->ht, key);
+	    if (val != key + 1)
+		atomic_inc(&(state->errors));
+	    continue;
+	}
+
+	key = private_base + ((r >> 8) % STRESS_PRIVATE_KEYS);
+
+	if (r & 0x10) {
+	    htable_insert_unique(state->ht, key, key + 1);
+	} else {
+	    val = htable_remove(state->ht, key, 0);
+	    if ((val != 0) && (val != key + 1))
+		atomic_inc(&(state->errors));
+	}
+    }
+
+    atomic_inc(&(state->done));
+    return 0;
+}
+
+static void
+stress_round(int nr_threads)
+{
+    ktime_t start, elapsed;
+    u64 ops;
+    int cpu, i;
+
+    atomic_set(&(stress.ready), 0);
+    atomic_set(&(stress.done), 0);
+    atomic_set(&(stress.errors), 0);
+    stress.go = 0;
+
+    i = 0;
+    for_each_online_cpu(cpu) {
+	if (i == nr_threads)
+	    break;
+
+	threads[i].state = &stress;
+	threads[i].id	 = i;
+
+	if (kthread_create_on_cpu(cpu, stress_thread_fn, &threads[i],
+				  "htable_stress_%d", i) == NULL) {
+	    printk(KERN_ERR "XPMEM htable stress: could not start thread on cpu %d\n", cpu);
+	    break;
+	}
+	i++;
+    }
+    nr_threads = i;
+
+    while (atomic_read(&(stress.ready)) < nr_threads)
+	schedule();
+
+    start = get_time();
+    stress.go = 1;
+
+    while (atomic_read(&(stress.done)) < nr_threads)
+	schedule();
+
+    elapsed = get_time() - start;
+    ops	    = (u64)nr_threads * STRESS_OPS;
+
+    printk(KERN_INFO "XPMEM htable stress: %2d threads, %llu ops in %llu us, %llu ops/sec, %u entries, %d errors\n",
+	   nr_threads,
+	   (unsigned long long)ops,
+	   (unsigned long long)(elapsed / 1000),
+	   (unsigned long long)((elapsed) ? (ops * NSEC_PER_SEC) / elapsed : 0),
+	   htable_count(stress.ht),
+	   atomic_read(&(stress.errors)));
+}
+
+static int
+stress_main(void * arg)
+{
+    int max_threads = min(num_online_cpus(), STRESS_MAX_THREADS);
+    int nr_threads;
+    uintptr_t key;
+
+    /* Start small so the table has to grow while the first round runs */
+    stress.ht = create_htable(0, stress_hash, stress_eq);
+    if (stress.ht == NULL) {
+	printk(KERN_ERR "XPMEM htable stress: could not create hashtable\n");
+	return -ENOMEM;
+    }
+
+    for (key = 0; key < STRESS_SHARED_KEYS; key++) {
+	if (htable_insert(stress.ht, key, key + 1) == 0) {
+	    printk(KERN_ERR "XPMEM htable stress: could not preload hashtable\n");
+	    free_htable(stress.ht, 0, 0);
+	    return -ENOMEM;
+	}
+    }
+
+    for (nr_threads = 1; nr_threads <= max_threads; nr_threads <<= 1)
+	stress_round(nr_threads);
+
+    free_htable(stress.ht, 0, 0);
+    stress.ht = NULL;
+
+    return 0;
+}
+
+static int
+xpmem_htable_stress_init(void)
+{
+    /* Workers are spawned and joined from here, init can't wait on them */
+    if (kthread_create(stress_main, NULL, "htable_stress") == NULL)
+	return -ENOMEM;
+
+    return 0;
+}
+
+DRIVER_INIT("late", xpmem_htable_stress_init);
@@ -326,6 +326,23 @@ xpmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 
             return xpmem_detach(detach_info.vaddr);
         }
+        case XPMEM_CMD_ATTACH_INFO: {
+            struct xpmem_cmd_attach_info info;
+
+            if (copy_from_user(&info, (void __user *)arg,
+                       sizeof(struct xpmem_cmd_attach_info)))
+                return -EFAULT;
+
+            ret = xpmem_attach_info(info.vaddr, &info);
+            if (ret != 0)
+                return ret;
+
+            if (copy_to_user((void __user *)arg, &info,
+                       sizeof(struct xpmem_cmd_attach_info)))
+                return -EFAULT;
+
+            return 0;
+        }
         default:
             break;
     }
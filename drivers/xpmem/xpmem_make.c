@@ -279,8 +279,13 @@ xpmem_remove_seg(struct xpmem_thread_group * seg_tg,
     } else {
 	/* Remove signal and free from name server if this is a real segment */
         if (xpmem_free_seg_signal(seg) == 0) {
-	    kfs_close(seg->kfs_file);
-	    fdTableInstallFd(current->fdTable, seg->kfs_fd, NULL);
+	    /* Only if the fd still refers to our file, userspace may have closed it */
+	    if (fdTableFile(current->fdTable, seg->kfs_fd) == seg->kfs_file) {
+		struct file * file = fdTableRemoveFd(current->fdTable, seg->kfs_fd);
+
+		if (file == seg->kfs_file && atomic_dec_and_test(&file->f_count))
+		    kfs_close(file);
+	    }
 	}
 
         xpmem_remove_remote(xpmem_my_part->domain_link, seg->segid);
@@ -129,12 +129,8 @@ xpmem_htable_add(struct xpmem_hashtable * ht,
 		 uintptr_t		  key,
 		 uintptr_t		  val)
 {
-    /* Search for duplicate first */
-    if (htable_search(ht, key) != 0) {
-	return 0;
-    } else {
-	return htable_insert(ht, key, val);
-    }
+    /* Fails if the key is already present */
+    return htable_insert_unique(ht, key, val);
 }
 
 
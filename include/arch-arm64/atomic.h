@@ -132,6 +132,9 @@ static inline int __atomic_add_unless(atomic_t *v, int a, int u)
 	return c;
 }
 
+#define atomic_add_unless(v, a, u)	(__atomic_add_unless((v), (a), (u)) != (u))
+#define atomic_inc_not_zero(v)		atomic_add_unless((v), 1, 0)
+
 #define atomic_inc(v)		atomic_add(1, v)
 #define atomic_dec(v)		atomic_sub(1, v)
 
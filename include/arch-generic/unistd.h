@@ -116,13 +116,13 @@ __SYSCALL(__NR_eventfd2, sys_eventfd2)
 /* fs/eventpoll.c */
 #define __NR_epoll_create1 20
 //__SYSCALL(__NR_epoll_create1, sys_epoll_create1)
-__SYSCALL(__NR_epoll_create1, syscall_not_implemented)
+__SYSCALL(__NR_epoll_create1, sys_epoll_create1)
 #define __NR_epoll_ctl 21
 //__SYSCALL(__NR_epoll_ctl, sys_epoll_ctl)
-__SYSCALL(__NR_epoll_ctl, syscall_not_implemented)
+__SYSCALL(__NR_epoll_ctl, sys_epoll_ctl)
 #define __NR_epoll_pwait 22
 //__SC_COMP(__NR_epoll_pwait, sys_epoll_pwait, compat_sys_epoll_pwait)
-__SYSCALL(__NR_epoll_pwait, syscall_not_implemented)
+__SYSCALL(__NR_epoll_pwait, sys_epoll_pwait)
 
 /* fs/fcntl.c */
 #define __NR_dup 23
@@ -353,10 +353,10 @@ __SYSCALL(__NR3264_fstat, sys_fstat)
 __SYSCALL(__NR_sync, syscall_not_implemented)
 #define __NR_fsync 82
 //__SYSCALL(__NR_fsync, sys_fsync)
-__SYSCALL(__NR_fsync, syscall_not_implemented)
+__SYSCALL(__NR_fsync, sys_fsync)
 #define __NR_fdatasync 83
 //__SYSCALL(__NR_fdatasync, sys_fdatasync)
-__SYSCALL(__NR_fdatasync, syscall_not_implemented)
+__SYSCALL(__NR_fdatasync, sys_fdatasync)
 #ifdef __ARCH_WANT_SYNC_FILE_RANGE2
 #define __NR_sync_file_range2 84
 //__SC_COMP(__NR_sync_file_range2, sys_sync_file_range2,  compat_sys_sync_file_range2)
@@ -792,43 +792,43 @@ __SYSCALL(__NR_socket, sys_socket)
 __SYSCALL(__NR_socketpair, sys_socketpair)
 #define __NR_bind 200
 //__SYSCALL(__NR_bind, sys_bind)
-__SYSCALL(__NR_bind, syscall_not_implemented)
+__SYSCALL(__NR_bind, sys_bind)
 #define __NR_listen 201
 //__SYSCALL(__NR_listen, sys_listen)
-__SYSCALL(__NR_listen, syscall_not_implemented)
+__SYSCALL(__NR_listen, sys_listen)
 #define __NR_accept 202
 //__SYSCALL(__NR_accept, sys_accept)
-__SYSCALL(__NR_accept, syscall_not_implemented)
+__SYSCALL(__NR_accept, sys_accept)
 #define __NR_connect 203
 //__SYSCALL(__NR_connect, sys_connect)
 __SYSCALL(__NR_connect, sys_connect)
 #define __NR_getsockname 204
 //__SYSCALL(__NR_getsockname, sys_getsockname)
-__SYSCALL(__NR_getsockname, syscall_not_implemented)
+__SYSCALL(__NR_getsockname, sys_getsockname)
 #define __NR_getpeername 205
 //__SYSCALL(__NR_getpeername, sys_getpeername)
-__SYSCALL(__NR_getpeername, syscall_not_implemented)
+__SYSCALL(__NR_getpeername, sys_getpeername)
 #define __NR_sendto 206
 //__SYSCALL(__NR_sendto, sys_sendto)
 __SYSCALL(__NR_sendto, sys_sendto)
 #define __NR_recvfrom 207
 //__SC_COMP(__NR_recvfrom, sys_recvfrom, compat_sys_recvfrom)
-__SYSCALL(__NR_recvfrom, syscall_not_implemented)
+__SYSCALL(__NR_recvfrom, sys_recvfrom)
 #define __NR_setsockopt 208
 //__SC_COMP(__NR_setsockopt, sys_setsockopt, sys_setsockopt)
-__SYSCALL(__NR_setsockopt, syscall_not_implemented)
+__SYSCALL(__NR_setsockopt, sys_setsockopt)
 #define __NR_getsockopt 209
 //__SC_COMP(__NR_getsockopt, sys_getsockopt, sys_getsockopt)
-__SYSCALL(__NR_getsockopt, syscall_not_implemented)
+__SYSCALL(__NR_getsockopt, sys_getsockopt)
 #define __NR_shutdown 210
 //__SYSCALL(__NR_shutdown, sys_shutdown)
-__SYSCALL(__NR_shutdown, syscall_not_implemented)
+__SYSCALL(__NR_shutdown, sys_shutdown)
 #define __NR_sendmsg 211
 //__SC_COMP(__NR_sendmsg, sys_sendmsg, compat_sys_sendmsg)
-__SYSCALL(__NR_sendmsg, syscall_not_implemented)
+__SYSCALL(__NR_sendmsg, sys_sendmsg)
 #define __NR_recvmsg 212
 //__SC_COMP(__NR_recvmsg, sys_recvmsg, compat_sys_recvmsg)
-__SYSCALL(__NR_recvmsg, syscall_not_implemented)
+__SYSCALL(__NR_recvmsg, sys_recvmsg)
 
 /* mm/filemap.c */
 #define __NR_readahead 213
@@ -929,7 +929,7 @@ __SYSCALL(__NR_rt_tgsigqueueinfo, syscall_not_implemented)
 __SYSCALL(__NR_perf_event_open, syscall_not_implemented)
 #define __NR_accept4 242
 //__SYSCALL(__NR_accept4, sys_accept4)
-__SYSCALL(__NR_accept4, syscall_not_implemented)
+__SYSCALL(__NR_accept4, sys_accept4)
 #if defined(__ARCH_WANT_TIME32_SYSCALLS) || __BITS_PER_LONG != 32
 #define __NR_recvmmsg 243
 //__SC_COMP_3264(__NR_recvmmsg, sys_recvmmsg_time32, sys_recvmmsg, compat_sys_recvmmsg_time32)
@@ -1278,6 +1278,10 @@ __SYSCALL(__NR_aspace_set_rank, sys_set_rank)
 
 #define __NR_aspace_update_user_hio_syscall_mask 534
 __SYSCALL(__NR_aspace_update_user_hio_syscall_mask, sys_aspace_update_user_hio_syscall_mask)
+#define __NR_aspace_update_hio_cache_policy 535
+__SYSCALL(__NR_aspace_update_hio_cache_policy, sys_aspace_update_hio_cache_policy)
+#define __NR_aspace_update_hio_channel 536
+__SYSCALL(__NR_aspace_update_hio_channel, sys_aspace_update_hio_channel)
 
 
 #undef __NR_syscalls
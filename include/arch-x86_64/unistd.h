@@ -102,32 +102,32 @@ __SYSCALL(__NR_socket, sys_socket)
 #define __NR_connect                            42
 __SYSCALL(__NR_connect, sys_connect)
 #define __NR_accept                             43
-__SYSCALL(__NR_accept, syscall_not_implemented)
+__SYSCALL(__NR_accept, sys_accept)
 #define __NR_sendto                             44
 __SYSCALL(__NR_sendto, sys_sendto)
 #define __NR_recvfrom                           45
-__SYSCALL(__NR_recvfrom, syscall_not_implemented)
+__SYSCALL(__NR_recvfrom, sys_recvfrom)
 #define __NR_sendmsg                            46
-__SYSCALL(__NR_sendmsg, syscall_not_implemented)
+__SYSCALL(__NR_sendmsg, sys_sendmsg)
 #define __NR_recvmsg                            47
-__SYSCALL(__NR_recvmsg, syscall_not_implemented)
+__SYSCALL(__NR_recvmsg, sys_recvmsg)
 
 #define __NR_shutdown                           48
-__SYSCALL(__NR_shutdown, syscall_not_implemented)
+__SYSCALL(__NR_shutdown, sys_shutdown)
 #define __NR_bind                               49
-__SYSCALL(__NR_bind, syscall_not_implemented)
+__SYSCALL(__NR_bind, sys_bind)
 #define __NR_listen                             50
-__SYSCALL(__NR_listen, syscall_not_implemented)
+__SYSCALL(__NR_listen, sys_listen)
 #define __NR_getsockname                        51
-__SYSCALL(__NR_getsockname, syscall_not_implemented)
+__SYSCALL(__NR_getsockname, sys_getsockname)
 #define __NR_getpeername                        52
-__SYSCALL(__NR_getpeername, syscall_not_implemented)
+__SYSCALL(__NR_getpeername, sys_getpeername)
 #define __NR_socketpair                         53
 __SYSCALL(__NR_socketpair, sys_socketpair)
 #define __NR_setsockopt                         54
-__SYSCALL(__NR_setsockopt, syscall_not_implemented)
+__SYSCALL(__NR_setsockopt, sys_setsockopt)
 #define __NR_getsockopt                         55
-__SYSCALL(__NR_getsockopt, syscall_not_implemented)
+__SYSCALL(__NR_getsockopt, sys_getsockopt)
 
 #define __NR_clone                              56
 __SYSCALL(__NR_clone, asm_sys_clone)
@@ -168,9 +168,9 @@ __SYSCALL(__NR_fcntl, sys_fcntl)
 #define __NR_flock                              73
 __SYSCALL(__NR_flock, syscall_not_implemented)
 #define __NR_fsync                              74
-__SYSCALL(__NR_fsync, syscall_not_implemented)
+__SYSCALL(__NR_fsync, sys_fsync)
 #define __NR_fdatasync                          75
-__SYSCALL(__NR_fdatasync, syscall_not_implemented)
+__SYSCALL(__NR_fdatasync, sys_fdatasync)
 #define __NR_truncate                           76
 __SYSCALL(__NR_truncate, syscall_not_implemented)
 #define __NR_ftruncate                          77
@@ -484,7 +484,7 @@ __SYSCALL(__NR_get_thread_area, syscall_not_implemented)
 #define __NR_lookup_dcookie	212
 __SYSCALL(__NR_lookup_dcookie, syscall_not_implemented)
 #define __NR_epoll_create	213
-__SYSCALL(__NR_epoll_create, syscall_not_implemented)
+__SYSCALL(__NR_epoll_create, sys_epoll_create)
 #define __NR_epoll_ctl_old	214
 __SYSCALL(__NR_epoll_ctl_old, syscall_not_implemented)
 #define __NR_epoll_wait_old	215
@@ -522,9 +522,9 @@ __SYSCALL(__NR_clock_nanosleep, syscall_not_implemented)
 #define __NR_exit_group		231
 __SYSCALL(__NR_exit_group, sys_exit_group)
 #define __NR_epoll_wait		232
-__SYSCALL(__NR_epoll_wait, syscall_not_implemented)
+__SYSCALL(__NR_epoll_wait, sys_epoll_wait)
 #define __NR_epoll_ctl		233
-__SYSCALL(__NR_epoll_ctl, syscall_not_implemented)
+__SYSCALL(__NR_epoll_ctl, sys_epoll_ctl)
 #define __NR_tgkill		234
 __SYSCALL(__NR_tgkill, sys_tgkill)
 #define __NR_utimes		235
@@ -621,13 +621,13 @@ __SYSCALL(__NR_move_pages, syscall_not_implemented)
 __SYSCALL(__NR_utimensat, syscall_not_implemented)
 #define __IGNORE_getcpu		/* implemented as a vsyscall */
 #define __NR_epoll_pwait	281
-__SYSCALL(__NR_epoll_pwait, syscall_not_implemented)
+__SYSCALL(__NR_epoll_pwait, sys_epoll_pwait)
 #define __NR_signalfd		282
 __SYSCALL(__NR_signalfd, syscall_not_implemented)
 #define __NR_timerfd		283
 __SYSCALL(__NR_timerfd, syscall_not_implemented)
 #define __NR_eventfd		284
-__SYSCALL(__NR_eventfd, syscall_not_implemented)
+__SYSCALL(__NR_eventfd, sys_eventfd)
 #define __NR_fallocate		285
 __SYSCALL(__NR_fallocate, syscall_not_implemented)
 #define __NR_timerfd_settime 286
@@ -635,13 +635,13 @@ __SYSCALL(__NR_timerfd_settime, syscall_not_implemented)
 #define __NR_timerfd_gettime 287
 __SYSCALL(__NR_timerfd_gettime, syscall_not_implemented)
 #define __NR_accept4 288
-__SYSCALL(__NR_accept4, syscall_not_implemented)
+__SYSCALL(__NR_accept4, sys_accept4)
 #define __NR_signalfd4 289
 __SYSCALL(__NR_signalfd4, syscall_not_implemented)
 #define __NR_eventfd2 290
 __SYSCALL(__NR_eventfd2, sys_eventfd2)
 #define __NR_epoll_create1 291
-__SYSCALL(__NR_epoll_create1, syscall_not_implemented)
+__SYSCALL(__NR_epoll_create1, sys_epoll_create1)
 #define __NR_dup3 292
 __SYSCALL(__NR_dup3, syscall_not_implemented)
 #define __NR_pipe2 293
@@ -752,5 +752,9 @@ __SYSCALL(__NR_aspace_set_rank, sys_set_rank)
 
 #define __NR_aspace_update_user_hio_syscall_mask 534
 __SYSCALL(__NR_aspace_update_user_hio_syscall_mask, sys_aspace_update_user_hio_syscall_mask)
+#define __NR_aspace_update_hio_cache_policy 535
+__SYSCALL(__NR_aspace_update_hio_cache_policy, sys_aspace_update_hio_cache_policy)
+#define __NR_aspace_update_hio_channel 536
+__SYSCALL(__NR_aspace_update_hio_channel, sys_aspace_update_hio_channel)
 
 #endif /* _ARCH_X86_64_UNISTD_H */
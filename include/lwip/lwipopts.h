@@ -14,6 +14,25 @@
 
 // BJK: These options are needed to support larger UDP messages. Tune as needed.
 // Note: Need invariant PBUF_POOL_SIZE > IP_REASS_MAX_PBUFS
+#ifdef CONFIG_LWIP_PROFILE_HPC
+// Full-sized segments and the largest window lwIP can advertise; 1.4.1 has
+// no window scaling, so that is 64 KB, rounded down to whole segments.
+#define TCP_MSS 1460
+#define TCP_WND (44 * TCP_MSS)
+#define TCP_SND_BUF (44 * TCP_MSS)
+
+// Enough mailbox slots to queue a full window per socket
+#define TCPIP_MBOX_SIZE 256
+#define DEFAULT_TCP_RECVMBOX_SIZE 64
+#define DEFAULT_UDP_RECVMBOX_SIZE 64
+#define DEFAULT_RAW_RECVMBOX_SIZE 64
+#define DEFAULT_ACCEPTMBOX_SIZE 16
+
+#define PBUF_POOL_SIZE 256
+
+// A 64 KB UDP datagram is 45 fragments at a 1500 byte MTU
+#define IP_REASS_MAX_PBUFS 64
+#else
 // Maximum outstanding messages in the mailbox. To be safe, message sizes should be
 // less than MTU * TCPIP_MBOX_SIZE (other processes can consume slots as well)
 #define TCPIP_MBOX_SIZE 32
@@ -24,6 +43,26 @@
 // Number of pbufs that can be used in a single packet reassembly. Message size,
 // then, is limited to MTU * IP_REASS_MAX_PBUFS
 #define IP_REASS_MAX_PBUFS 32
+#endif
+
+// The tcpip thread can be bound to a CPU of its own and poll, see net_core=
+#ifdef CONFIG_LWIP_NETCORE
+#define LWIP_NETCORE 1
+#endif
+
+// Connections between two local sockets skip segmentation and IP
+#ifdef CONFIG_LWIP_TCP_LOCAL
+#define LWIP_TCP_LOCAL 1
+#endif
+
+// 32-bit counters, the 16-bit ones wrap within seconds at line rate
+#define LWIP_STATS_LARGE 1
+
+// Drivers can leave checksums to their NIC (NETIF_SET_CHECKSUM_CTRL); the
+// rest use the variant the kernel picked at boot for the length
+#define LWIP_CHECKSUM_CTRL_PER_NETIF 1
+#include <lwk/memops.h>
+#define LWIP_CHKSUM memops_csum
 
 #ifdef CONFIG_LWIP_SOCKET
 #define LWIP_SOCKET 1
@@ -53,7 +92,9 @@
 // We have struct timeval
 //#define LWIP_TIMEVAL_PRIVATE 0
 
+#ifdef CONFIG_LWIP_DEBUG
 #define LWIP_DEBUG 1
+#endif
 #define IP_REASS_DEBUG LWIP_DBG_OFF
 #define LWIP_DBG_MIN_LEVEL LWIP_DBG_LEVEL_ALL
 #define IP_DEBUG LWIP_DBG_OFF
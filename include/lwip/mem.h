@@ -47,6 +47,17 @@ typedef size_t mem_size_t;
 
 /* aliases for C library malloc() */
 #define mem_init()
+#ifdef CONFIG_LWIP_MEM_POOL
+/* Per-CPU fixed-size pools, net/mem_pool.c */
+void *lwk_mem_malloc(size_t size);
+void *lwk_mem_calloc(size_t count, size_t size);
+void  lwk_mem_free(void *mem);
+struct file;
+void  lwk_mem_proc_stats(struct file *file);
+#define mem_free lwk_mem_free
+#define mem_malloc lwk_mem_malloc
+#define mem_calloc lwk_mem_calloc
+#endif
 /* in case C library malloc() needs extra protection,
  * allow these defines to be overridden.
  */
@@ -98,6 +98,18 @@ extern "C" {
  * Set by the netif driver in its init function. */
 #define NETIF_FLAG_IGMP         0x80U
 
+/** Checksums lwIP generates in software for IPv4 packets sent on a netif
+ * (netif->chksum_flags). A driver whose hardware inserts some of them
+ * clears those in its init function with NETIF_SET_CHECKSUM_CTRL(); the
+ * fields are then left zero. A UDP datagram that has to be fragmented is
+ * still checksummed in software, as hardware only sees one fragment.
+ */
+#define NETIF_CHECKSUM_GEN_IP       0x0001U
+#define NETIF_CHECKSUM_GEN_UDP      0x0002U
+#define NETIF_CHECKSUM_GEN_TCP      0x0004U
+#define NETIF_CHECKSUM_ENABLE_ALL   0xFFFFU
+#define NETIF_CHECKSUM_DISABLE_ALL  0x0000U
+
 /** Function prototype for netif init functions. Set up flags and output/linkoutput
  * callback functions in this function.
  *
@@ -236,6 +248,10 @@ struct netif {
   u8_t hwaddr[NETIF_MAX_HWADDR_LEN];
   /** flags (see NETIF_FLAG_ above) */
   u8_t flags;
+#if LWIP_CHECKSUM_CTRL_PER_NETIF
+  /** checksums generated in software (see NETIF_CHECKSUM_ above) */
+  u16_t chksum_flags;
+#endif /* LWIP_CHECKSUM_CTRL_PER_NETIF */
   /** descriptive abbreviation */
   char name[2];
   /** number of this interface */
@@ -280,6 +296,16 @@ struct netif {
 #endif /* ENABLE_LOOPBACK */
 };
 
+#if LWIP_CHECKSUM_CTRL_PER_NETIF
+#define NETIF_SET_CHECKSUM_CTRL(netif, chksumflags) do { \
+  (netif)->chksum_flags = (chksumflags); } while(0)
+#define NETIF_CHECKSUM_ENABLED(netif, chksumflag) \
+  (((netif) == NULL) || (((netif)->chksum_flags & (chksumflag)) != 0))
+#else /* LWIP_CHECKSUM_CTRL_PER_NETIF */
+#define NETIF_SET_CHECKSUM_CTRL(netif, chksumflags)
+#define NETIF_CHECKSUM_ENABLED(netif, chksumflag) 1
+#endif /* LWIP_CHECKSUM_CTRL_PER_NETIF */
+
 #if LWIP_SNMP
 #define NETIF_INIT_SNMP(netif, type, speed) \
   /* use "snmp_ifType" enum from snmp.h for "type", snmp_ifType_ethernet_csmacd by example */ \
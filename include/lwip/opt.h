@@ -1060,6 +1060,15 @@
 #define LWIP_TCP_TIMESTAMPS             0
 #endif
 
+/**
+ * LWIP_TCP_LOCAL==1: When both ends of a TCP connection are on this host,
+ * hand written data straight to the receiving pcb instead of building
+ * segments and looping them through IP. IPv4 connections only.
+ */
+#ifndef LWIP_TCP_LOCAL
+#define LWIP_TCP_LOCAL                  0
+#endif
+
 /**
  * TCP_WND_UPDATE_THRESHOLD: difference in window to trigger an
  * explicit window update
@@ -1268,6 +1277,25 @@
 #define TCPIP_MBOX_SIZE                 0
 #endif
 
+/**
+ * LWIP_NETCORE==1: Let the tcpip thread run as a poller bound to one CPU
+ * (chosen at boot). It then services the NICs registered with
+ * tcpip_poller_add() and per-CPU message rings instead of sleeping on its
+ * mailbox, and threads post their requests to the ring of the CPU they
+ * run on.
+ */
+#ifndef LWIP_NETCORE
+#define LWIP_NETCORE                    0
+#endif
+
+/**
+ * TCPIP_NETCORE_RING_SIZE: Messages each CPU can have queued for the
+ * polling tcpip thread. Rounded up to a power of two.
+ */
+#ifndef TCPIP_NETCORE_RING_SIZE
+#define TCPIP_NETCORE_RING_SIZE         64
+#endif
+
 /**
  * SLIPIF_THREAD_NAME: The name assigned to the slipif_loop thread.
  */
@@ -1900,6 +1928,16 @@
 #define LWIP_CHECKSUM_ON_COPY           0
 #endif
 
+/**
+ * LWIP_CHECKSUM_CTRL_PER_NETIF==1: Let a netif turn off software checksum
+ * generation for the IPv4 packets it sends (netif->chksum_flags), e.g.
+ * because its hardware inserts them. The CHECKSUM_GEN_* defines must
+ * still be enabled.
+ */
+#ifndef LWIP_CHECKSUM_CTRL_PER_NETIF
+#define LWIP_CHECKSUM_CTRL_PER_NETIF    0
+#endif
+
 /*
    ---------------------------------------
    ---------- IPv6 options ---------------
@@ -362,6 +362,9 @@ err_t            tcp_shutdown(struct tcp_pcb *pcb, int shut_rx, int shut_tx);
 
 err_t            tcp_write   (struct tcp_pcb *pcb, const void *dataptr, u16_t len,
                               u8_t apiflags);
+#if LWIP_TCP_LOCAL
+err_t            tcp_write_local(struct tcp_pcb *pcb, const void *arg, u16_t *len);
+#endif /* LWIP_TCP_LOCAL */
 
 void             tcp_setprio (struct tcp_pcb *pcb, u8_t prio);
 
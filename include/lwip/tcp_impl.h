@@ -68,11 +68,15 @@ void             tcp_input   (struct pbuf *p, struct netif *inp);
 struct tcp_pcb * tcp_alloc   (u8_t prio);
 void             tcp_abandon (struct tcp_pcb *pcb, int reset);
 err_t            tcp_send_empty_ack(struct tcp_pcb *pcb);
-void             tcp_rexmit  (struct tcp_pcb *pcb);
+err_t            tcp_rexmit  (struct tcp_pcb *pcb);
 void             tcp_rexmit_rto  (struct tcp_pcb *pcb);
 void             tcp_rexmit_fast (struct tcp_pcb *pcb);
 u32_t            tcp_update_rcv_ann_wnd(struct tcp_pcb *pcb);
 err_t            tcp_process_refused_data(struct tcp_pcb *pcb);
+#if LWIP_TCP_LOCAL
+struct tcp_pcb * tcp_local_peer(struct tcp_pcb *pcb);
+void             tcp_local_wake(struct tcp_pcb *pcb);
+#endif /* LWIP_TCP_LOCAL */
 
 /**
  * This is the Nagle algorithm: try to combine user data to send as few TCP
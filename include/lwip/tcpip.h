@@ -126,6 +126,24 @@ err_t tcpip_timeout(u32_t msecs, sys_timeout_handler h, void *arg);
 err_t tcpip_untimeout(sys_timeout_handler h, void *arg);
 #endif /* LWIP_TCPIP_TIMEOUT */
 
+#if LWIP_NETCORE
+/** A device the polling tcpip thread services, see tcpip_poller_add() */
+struct tcpip_poller {
+  struct tcpip_poller *next;
+  /** Handles up to budget units of work, returns how many it did */
+  unsigned int (*poll)(void *arg, unsigned int budget);
+  void *arg;
+};
+
+/** CPU the tcpip thread polls on, -1 if it is interrupt driven */
+extern int net_core;
+#define tcpip_polling()                     (net_core >= 0)
+
+void tcpip_poller_add(struct tcpip_poller *poller);
+#else /* LWIP_NETCORE */
+#define tcpip_polling()                     0
+#endif /* LWIP_NETCORE */
+
 enum tcpip_msg_type {
 #if LWIP_NETCONN
   TCPIP_MSG_API,
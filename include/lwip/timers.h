@@ -89,6 +89,9 @@ void sys_check_timeouts(void);
 void sys_restart_timeouts(void);
 #else /* NO_SYS */
 void sys_timeouts_mbox_fetch(sys_mbox_t *mbox, void **msg);
+#if LWIP_NETCORE
+void sys_timeouts_poll(void);
+#endif /* LWIP_NETCORE */
 #endif /* NO_SYS */
 
 
@@ -170,6 +170,19 @@ aspace_update_user_hio_syscall_mask(
 		user_syscall_mask_t *	user_syscall_mask
 );
 
+extern int
+aspace_update_hio_cache_policy(
+		id_t			id,
+		unsigned long		flags,
+		unsigned long		ttl_ms
+);
+
+extern int
+aspace_update_hio_channel(
+		id_t			id,
+		int			channel
+);
+
 // End core address space management API
 
 
@@ -215,10 +228,20 @@ aspace_unmap_region(
 #include <lwk/init.h>
 #include <lwk/signal.h>
 #include <lwk/waitq.h>
+#include <lwk/time.h>
 #include <lwk/hio.h>
 #include <arch/aspace.h>
 
 
+// Callback for the physical extents found by aspace_virt_to_phys_range().
+// Each call covers a physically contiguous [paddr, paddr + size) run that
+// maps the next part of the virtual range. A non-zero return aborts the walk.
+typedef int (*aspace_extent_fn_t)(paddr_t paddr, size_t size, void *priv);
+
+// Called when a region goes away, see aspace_set_region_unmap().
+typedef void (*aspace_unmap_fn_t)(void *priv);
+
+
 // Address space structure
 //
 // This structure represents the kernel's view of an address space,
@@ -242,6 +265,7 @@ struct aspace {
 	waitq_t			child_exit_waitq; // Wait queue for waiting on child exits
 
 	struct list_head	region_list;	// Sorted non-overlapping region list
+	unsigned long		map_generation;	// Changes whenever pages are unmapped
 
 	struct list_head	task_list;	// List of tasks using this aspace
 	id_t			next_task_id;	// ID for next task created in aspace
@@ -250,6 +274,10 @@ struct aspace {
 	id_t			next_cpu_id;	// CPU ID for next task created in aspace
 
 	syscall_mask_t		hio_syscall_mask; // Syscalls this aspace is delegating via HIO
+	unsigned long		hio_cache_flags;  // HIO_CACHE_* policy for forwarded syscalls
+	ktime_t			hio_cache_ttl;	  // Lifetime of cached HIO results, 0 = until invalidated
+	struct hio_cache *	hio_cache;	  // Cached HIO metadata results
+	int			hio_channel;	  // HIO forwarding channel, or HIO_CHANNEL_BY_RANK
 
 	int			exit_status;	// Value to return to waitpid() and friends
 
@@ -357,6 +385,15 @@ __aspace_virt_to_phys(
 	paddr_t *		paddr
 );
 
+extern int
+__aspace_virt_to_phys_range(
+	struct aspace *		aspace,
+	vaddr_t			start,
+	size_t			extent,
+	aspace_extent_fn_t	fn,
+	void *			priv
+);
+
 // End kernel-only "unlocked" versions of the core aspace management API
 
 
@@ -400,6 +437,44 @@ aspace_update_hio_syscall_mask(
 		syscall_mask_t	* syscall_mask
 );
 
+extern int
+aspace_virt_to_phys_range(
+	id_t			id,
+	vaddr_t			start,
+	size_t			extent,
+	aspace_extent_fn_t	fn,
+	void *			priv
+);
+
+extern int
+aspace_set_region_unmap(
+	id_t			id,
+	vaddr_t			start,
+	aspace_unmap_fn_t	fn,
+	void *			priv
+);
+
+extern int
+aspace_virt_to_phys_range_flags(
+	id_t			id,
+	vaddr_t			start,
+	size_t			extent,
+	vmflags_t		vmflags,
+	aspace_extent_fn_t	fn,
+	void *			priv
+);
+
+// Returns the largest page size in pagesz_mask that can map start to pmem
+// with at least extent bytes left, or 0 if none fits. Regions allowing
+// several page sizes are mapped this way, one page at a time.
+extern vmpagesize_t
+aspace_pick_pagesz(
+	vmpagesize_t		pagesz_mask,
+	vaddr_t			start,
+	paddr_t			pmem,
+	size_t			extent
+);
+
 
 // End kernel-only address space management API
 
@@ -460,6 +535,14 @@ arch_aspace_virt_to_phys(
 	paddr_t *		paddr
 );
 
+extern int
+arch_aspace_lookup_page(
+	struct aspace *		aspace,
+	vaddr_t			vaddr,
+	paddr_t *		paddr,
+	vmpagesize_t *		pagesz
+);
+
 extern int
 arch_aspace_map_pmem_into_kernel(
 	paddr_t			start,
@@ -586,6 +669,19 @@ sys_aspace_update_hio_syscall_mask(
 	id_t				aspace_id,
 	user_syscall_mask_t __user *	user_syscall_mask
 );
+
+extern int
+sys_aspace_update_hio_cache_policy(
+	id_t				aspace_id,
+	unsigned long			flags,
+	unsigned long			ttl_ms
+);
+
+extern int
+sys_aspace_update_hio_channel(
+	id_t				aspace_id,
+	int				channel
+);
 // End aspace system call handler prototypes
 
 
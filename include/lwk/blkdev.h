@@ -8,6 +8,7 @@
 #define _LWK_BLKDEV_H
 
 #include <lwk/waitq.h>
+#include <lwk/list.h>
 
 
 typedef struct {
@@ -17,12 +18,21 @@ typedef struct {
 
 typedef void * blkdev_handle_t;
 
-typedef struct {
+typedef struct blk_req blk_req_t;
+
+/**
+ * Completion callback for asynchronous requests. Runs in interrupt
+ * context and may free the request.
+ */
+typedef void (*blk_end_io_t)(blk_req_t * blk_req, int status);
+
+struct blk_req {
 	struct __attribute__((packed)) {
 		u32 async        : 1; 
 		u32 write        : 1;
 		u32 complete     : 1;
-		u32 rsvd         : 29;
+		u32 merged       : 1;   /* Built by the block layer from merge_list */
+		u32 rsvd         : 28;
 	};
 
 
@@ -32,9 +42,30 @@ typedef struct {
 	u32 desc_cnt;
 	blk_dma_desc_t * dma_descs;
 
-	waitq_t user_waitq;
 	int status;
-} blk_req_t;
+
+	blk_end_io_t end_io;  /* NULL: the submitter waits with blkdev_wait() */
+	void *       end_io_data;
+
+	/* Block layer private */
+	void *           blkdev;
+	struct list_head q_link;
+	struct list_head merge_list;
+};
+
+
+/**
+ * Batches requests submitted by one thread. Requests are held back until
+ * blk_finish_plug() (or the plug fills up), then sorted, merged with their
+ * neighbours where possible and queued together.
+ */
+#define BLK_PLUG_MAX_REQS 32
+
+struct blk_plug {
+	blkdev_handle_t  blkdev;
+	struct list_head reqs;
+	u32              count;
+};
 
 
 typedef struct {
@@ -51,6 +82,38 @@ blkdev_handle_t get_blkdev(char * name);
 u64 blkdev_get_capacity(blkdev_handle_t blkdev_handle);
 int blkdev_do_request(blkdev_handle_t blkdev_handle, blk_req_t * request);
 
+int  blkdev_submit(blkdev_handle_t blkdev_handle, blk_req_t * request, struct blk_plug * plug);
+int  blkdev_wait(blkdev_handle_t blkdev_handle, blk_req_t * request);
+u32  blkdev_get_queue_depth(blkdev_handle_t blkdev_handle);
+u64  blkdev_get_sector_size(blkdev_handle_t blkdev_handle);
+u32  blkdev_get_max_dma_descs(blkdev_handle_t blkdev_handle);
+
+void blk_start_plug(struct blk_plug * plug, blkdev_handle_t blkdev_handle);
+void blk_finish_plug(struct blk_plug * plug);
+
+
+
+/*
+ * Page cache in front of a block device, used by the /dev/block files
+ */
+struct blk_cache;
+
+/* Per open file readahead state */
+struct blk_ra_state {
+	u64 next_index;       /* Page a sequential reader asks for next */
+	u64 ra_end;           /* Readahead has been started up to here */
+	u32 window;           /* Pages to keep read ahead, 0 if not sequential */
+};
+
+struct blk_cache * blk_cache_create(blkdev_handle_t blkdev_handle);
+
+ssize_t blk_cache_read(struct blk_cache * cache, struct blk_ra_state * ra,
+		       char __user * buf, size_t len, loff_t pos);
+ssize_t blk_cache_write(struct blk_cache * cache, const char __user * buf,
+			size_t len, loff_t pos);
+int     blk_cache_sync(struct blk_cache * cache);
+int     blk_cache_invalidate(struct blk_cache * cache, loff_t pos, size_t len);
+
 
 int 
 blkdev_register(char * name, 
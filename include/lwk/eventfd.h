@@ -0,0 +1,17 @@
+#ifndef _LWK_EVENTFD_H
+#define _LWK_EVENTFD_H
+
+#include <lwk/types.h>
+#include <arch-generic/fcntl.h>
+
+/* eventfd2() flags */
+#define EFD_SEMAPHORE		(1 << 0)
+#define EFD_CLOEXEC		O_CLOEXEC
+#define EFD_NONBLOCK		O_NONBLOCK
+
+#define EFD_FLAGS_SET		(EFD_SEMAPHORE | EFD_CLOEXEC | EFD_NONBLOCK)
+
+/* Creates an eventfd with the given initial count and installs it */
+extern int eventfd_create(unsigned int count, int flags);
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef _LWK_EVENTPOLL_H
+#define _LWK_EVENTPOLL_H
+
+#include <lwk/types.h>
+#include <lwk/list.h>
+#include <lwk/poll.h>
+
+/* epoll_ctl() operations */
+#define EPOLL_CTL_ADD		1
+#define EPOLL_CTL_DEL		2
+#define EPOLL_CTL_MOD		3
+
+/* Event bits beyond the poll ones */
+#define EPOLLIN			POLLIN
+#define EPOLLPRI		POLLPRI
+#define EPOLLOUT		POLLOUT
+#define EPOLLERR		POLLERR
+#define EPOLLHUP		POLLHUP
+#define EPOLLRDNORM		POLLRDNORM
+#define EPOLLRDBAND		POLLRDBAND
+#define EPOLLWRNORM		POLLWRNORM
+#define EPOLLRDHUP		POLLRDHUP
+#define EPOLLONESHOT		(1U << 30)
+#define EPOLLET			(1U << 31)
+
+/* Control bits, never reported back */
+#define EP_PRIVATE_BITS		(EPOLLONESHOT | EPOLLET)
+
+#define EPOLL_CLOEXEC		02000000
+
+/* Upper bound on maxevents, as in Linux */
+#define EP_MAX_EVENTS		(INT_MAX / sizeof(struct epoll_event))
+
+struct epoll_event {
+	u32	events;
+	u64	data;
+}
+#ifdef CONFIG_X86_64
+__attribute__((packed))
+#endif
+;
+
+struct file;
+
+extern int eventpoll_create(int flags);
+extern int eventpoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+extern int eventpoll_wait(int epfd, struct epoll_event __user *events,
+			  int maxevents, int timeout);
+
+/* Called before a file is torn down, drops it from every epoll set */
+extern void eventpoll_release_file(struct file *file);
+
+static inline void eventpoll_release(struct file *file)
+{
+	if (!list_empty(&file->f_ep_links))
+		eventpoll_release_file(file);
+}
+
+#endif
@@ -2,39 +2,42 @@
 #define _LWK_FDTABLE_H
 
 // Maximum files opened at one time
-#define MAX_FILES       32
+#define MAX_FILES       65536
 
+// Size of the array embedded in every table, grown by doubling from there
+#define NR_OPEN_DEFAULT BITS_PER_LONG
+
+#include <lwk/types.h>
 #include <lwk/spinlock.h>
 
 struct file;
-struct fdTable {
-        struct file* files[ MAX_FILES];
-        int ref_count;
-	spinlock_t	lock;
-};
 
-static inline struct fdTable* fdTableAlloc( void )
-{
-	struct fdTable* tbl = kmem_alloc( sizeof( struct fdTable ) );
-	//_KDBG("\n");
-	memset( tbl, 0, sizeof( *tbl ) );
-	tbl->ref_count = 1;
-	spin_lock_init(&tbl->lock );
-	return tbl;
-}
+/*
+ * The fd -> file array. Readers find it through fdTable->fds without
+ * taking the table lock, so once published an array is never freed or
+ * shrunk; a larger one replaces it and the old one is chained on
+ * `retired` until the table itself goes away.
+ */
+struct fdArray {
+	unsigned int		max_fds;
+	struct file **		files;
+	unsigned long *		open_fds;	/* installed or reserved fds */
+	struct fdArray *	retired;
+};
 
-static inline void fdTableFree( struct fdTable* tbl )
-{
-	spin_lock( &tbl->lock );
+struct fdTable {
+	struct fdArray * volatile fds;
+	unsigned int		next_fd;	/* no free fd below this */
+	int			ref_count;
+	spinlock_t		lock;
+
+	struct fdArray		fds_init;
+	struct file *		files_init[NR_OPEN_DEFAULT];
+	unsigned long		open_fds_init[BITS_TO_LONGS(NR_OPEN_DEFAULT)];
+};
 
-	//_KDBG("ref_count=%d\n",tbl->ref_count);
-
-	--tbl->ref_count;
-	if ( tbl->ref_count == 0  ) {
-		kmem_free( tbl ); 
-	}
-	spin_unlock( &tbl->lock );
-}
+extern struct fdTable* fdTableAlloc( void );
+extern void fdTableFree( struct fdTable* tbl );
 
 static inline struct fdTable* fdTableClone( struct fdTable* tbl )
 {
@@ -46,46 +49,29 @@ static inline struct fdTable* fdTableClone( struct fdTable* tbl )
 }
 
 
+/*
+ * Lock-free lookup. The returned file is only borrowed: it is safe to use
+ * while nothing can close `fd` behind the caller's back. Use
+ * fdTableGetFile() when another task sharing the table may close it.
+ */
 static inline struct file* fdTableFile( struct fdTable* tbl, int fd )
 {
-        if( fd < 0 || fd >= MAX_FILES )
-                return NULL;
-
-        struct file* file;
+	struct fdArray* fds = tbl->fds;
 
-        spin_lock( &tbl->lock );
-        file = tbl->files[ fd ];
-        spin_unlock( &tbl->lock );
-        return file;
-}
+	smp_rmb();
 
+	if( fd < 0 || fd >= fds->max_fds )
+		return NULL;
 
-static inline void fdTableInstallFd( struct fdTable* tbl, int fd, struct file* file )
-{
-	spin_lock( &tbl->lock );
-	//_KDBG("fd=%d new=%p old=%p\n",fd,file,tbl->files[fd]);
-	tbl->files[fd] = file;
-	spin_unlock( &tbl->lock );
+	return ACCESS_ONCE( fds->files[ fd ] );
 }
 
-static inline int fdTableGetUnused( struct fdTable* tbl )
-{
-        int fd;
-	spin_lock( &tbl->lock );
-        for( fd=0 ; fd<MAX_FILES ; fd++ )
-        {
-                if( ! tbl->files[fd] ) {
-			tbl->files[fd] = (void*) 1;
-                        break;
-		}
-        }
-        //_KDBG("fd=%d\n", fd );
-	spin_unlock( &tbl->lock );
-
-        if( fd == MAX_FILES )
-                return -EMFILE;
-	return fd;
-}
+extern struct file* fdTableGetFile( struct fdTable* tbl, int fd );
+extern void fdTableInstallFd( struct fdTable* tbl, int fd, struct file* file );
+extern struct file* fdTableRemoveFd( struct fdTable* tbl, int fd );
+extern int fdTableGetUnused( struct fdTable* tbl );
+extern int fdTableReplaceFd( struct fdTable* tbl, int fd, struct file* file,
+			     struct file** old );
 extern void fdTableClose( struct fdTable* tbl );
 
 // this is the linux interface
@@ -0,0 +1,22 @@
+#ifndef _LWK_FIFO_H
+#define _LWK_FIFO_H
+
+#include <lwk/types.h>
+
+struct file;
+struct inode;
+
+/* Default and maximum capacity of a FIFO or pipe, see F_SETPIPE_SZ */
+#define FIFO_SIZE		(16 * PAGE_SIZE)
+#define FIFO_MAX_SIZE		(16UL << 20)
+
+extern int mkfifo(const char *name, mode_t mode);
+extern int mkfifo_at(struct inode *root_inode, const char *name, mode_t mode);
+
+/* Creates an anonymous FIFO and installs its read and write ends */
+extern int fifo_pipe(int fds[2], int flags);
+
+/* F_SETPIPE_SZ and F_GETPIPE_SZ, -EBADF if filep is not a FIFO */
+extern long fifo_fcntl(struct file *filep, unsigned int cmd, unsigned long arg);
+
+#endif
@@ -24,6 +24,28 @@ typedef struct {
 #define HIO_MAX_SEGC	16
 
 
+/**
+ * Per-aspace HIO caching policy flags, see aspace_update_hio_cache_policy().
+ *
+ * HIO_CACHE_LOCAL_IDS answers getpid/gettid/uname locally instead of
+ * forwarding them. HIO_CACHE_METADATA caches the results of forwarded
+ * stat/fstat/newfstatat/faccessat/readlink calls until they expire or are
+ * invalidated by a forwarded write/unlink/open-for-write. */
+#define HIO_CACHE_LOCAL_IDS	(1UL << 0)
+#define HIO_CACHE_METADATA	(1UL << 1)
+
+/**
+ * HIO forwarding channel assignment, see aspace_update_hio_channel().
+ * By default an aspace forwards on channel (rank % number of channels). */
+#define HIO_CHANNEL_BY_RANK	(-1)
+
+#ifdef CONFIG_HIO_SYSCALL
+#define HIO_NUM_CHANNELS	CONFIG_HIO_SYSCALL_CHANNELS
+#else
+#define HIO_NUM_CHANNELS	1
+#endif
+
+
 typedef struct {
 	xpmem_segid_t segid;
 	uint64_t      size;
@@ -102,7 +124,19 @@ syscall_mask_user2kernel(const user_syscall_mask_t *user)
 
 struct hio_implementation {
 	int (*init)(void);
-	int (*notify_new_syscall)(void);
+	int (*notify_new_syscall)(uint32_t channel);
+};
+
+struct aspace;
+struct hio_cache;
+
+/* Identifies one cached HIO result */
+struct hio_cache_key {
+	uint32_t     syscall_nr;
+	int          fd;          /* fd the result depends on, or -1 */
+	uintptr_t    arg;         /* flags/mode argument that affects the result */
+	const char * path;        /* kernel copy of the path, or NULL */
+	uint64_t     generation;  /* filled in by hio_cache_lookup() */
 };
 
 void __init
@@ -113,25 +147,64 @@ hio_syscall_init(void);
 uintptr_t
 hio_format_and_exec_syscall(uint32_t syscall_nr, uint32_t argc, ...);
 
-/* Execute an HIO system call */
+/* Execute an HIO system call on a forwarding channel */
 int
-hio_issue_syscall(hio_syscall_t * new_syscall);
+hio_issue_syscall(uint32_t channel, hio_syscall_t * new_syscall);
 
 /* Cancel a previously issued system call */
 void
 hio_cancel_syscall(hio_syscall_t * syscall);
 
+/* Hand a dequeued system call back to its channel, e.g. after a failed delivery */
+int
+hio_requeue_syscall(hio_syscall_t * syscall);
+
 /* Return a completed HIO system call */
 void
 hio_return_syscall(hio_syscall_t * finished_syscall);
 
-/* Returns number of pending system calls */
+/* Returns number of pending system calls on a channel */
 uint32_t
-hio_get_num_pending_syscalls(void);
+hio_get_num_pending_syscalls(uint32_t channel);
 
-/* Returns new syscall to execute */
+/* Returns new syscall to execute from a channel */
 int
-hio_get_pending_syscall(hio_syscall_t ** pending_syscall);
+hio_get_pending_syscall(uint32_t channel, hio_syscall_t ** pending_syscall);
+
+
+#ifdef CONFIG_HIO_SYSCALL
+
+/* Look up a cached result, copying its data to buf. Returns 0 on a hit */
+int
+hio_cache_lookup(struct hio_cache_key * key, void __user * buf, size_t len, long * ret_val);
+
+/* Cache the result of a forwarded call, reading len bytes of data from buf */
+void
+hio_cache_insert(struct hio_cache_key * key, const void __user * buf, size_t len, long ret_val);
+
+/* Invalidation hooks for forwarded calls that change metadata */
+void hio_cache_invalidate(void);
+void hio_cache_note_open(long fd, int flags);
+void hio_cache_note_dup(int old_fd, long new_fd);
+void hio_cache_note_write(int fd);
+void hio_cache_note_close(int fd);
+
+struct hio_cache *
+hio_cache_create(void);
+
+void
+hio_cache_flush(struct hio_cache * cache);
+
+void
+hio_cache_destroy(struct hio_cache * cache);
+
+#else
+
+static inline struct hio_cache * hio_cache_create(void) { return NULL; }
+static inline void hio_cache_flush(struct hio_cache * cache) {}
+static inline void hio_cache_destroy(struct hio_cache * cache) {}
+
+#endif /* CONFIG_HIO_SYSCALL */
 
 
 struct iovec;
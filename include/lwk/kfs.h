@@ -109,10 +109,19 @@ struct kfs_fops
 	int (*ioctl)(struct file *, int request, uaddr_t);
 	unsigned int (*poll) (struct file *, struct poll_table_struct *);
 	int (*release) (struct inode *, struct file *);
+	int (*fsync) (struct file *);
 	int (*readdir) (struct file *, uaddr_t, unsigned int, dirent_filler f);
 	ssize_t (*aio_write) (struct kiocb *, const struct iovec *,
 			      unsigned long, loff_t);
 
+	/* readv()/writev() on a kernel copy of the iovec array, so a file
+	 * can lock and wake once per call; files without them get one
+	 * read()/write() per segment */
+	ssize_t (*read_iter) (struct file *, const struct iovec *,
+			      unsigned long, loff_t *);
+	ssize_t (*write_iter) (struct file *, const struct iovec *,
+			       unsigned long, loff_t *);
+
 	struct module *owner; /* can we get rid of the module stuff? */
 };
 
@@ -121,20 +130,6 @@ extern struct kfs_fops kfs_default_fops;
 
 #define MAX_PATHLEN		1024
 
-#define PIPE_END_READ  0
-#define PIPE_END_WRITE 1
-
-#define PIPE_BUFFER_MAX 1024
-
-struct pipe {
-   	char *        buffer;
-	int           amount;       // num chars in buffer
-	unsigned char eof;          // EOF?
-	waitq_t       buffer_wait;
-	spinlock_t    buffer_lock;
-	int           ref_count;
-};
-
 struct file
 {
 	struct inode *          inode;
@@ -145,22 +140,10 @@ struct file
 	struct dentry *         f_dentry;
 	void *                  private_data;
 	atomic_t		f_count;
-	unsigned char		pipe_end_type;
-	struct pipe *		pipe;          // if this is NULL, it's not a pipe
+	struct file *		f_next_free;	/* kfs_alloc_file() cache */
+	struct list_head	f_ep_links;	/* epoll sets watching this file */
 };
 
-static inline bool pipe_buffer_full(struct pipe *p) {
-   return (p->amount >= PIPE_BUFFER_MAX);
-}
-
-static inline bool pipe_buffer_empty(struct pipe *p) {
-   return (p->amount == 0);
-}
-
-static inline int pipe_amount_free(struct pipe *p) {
-   return (PIPE_BUFFER_MAX - p->amount);
-}
-
 static inline struct file *get_current_file(int fd)
 {
 	return fdTableFile( current->fdTable, fd );
@@ -210,7 +193,9 @@ extern struct inode *kfs_link(struct inode *, struct inode *, const char *);
 /* generally useful file ops */
 extern int kfs_readdir(struct file *, uaddr_t, unsigned int, dirent_filler f);
 
+extern struct file *kfs_alloc_file( void );
 extern void kfs_close( struct file* );
+extern int kfs_put_file( struct file* );
 
 /* kfs path operations */
 
@@ -230,6 +215,35 @@ extern int kfs_open_anon(const struct kfs_fops * fops, void * priv_data);
 
 extern struct inode * kfs_lookup(struct inode * root, const char * dirname, unsigned create_mode);
 
+/* Vectored I/O, see kernel/kfs_iov.c */
+#define KFS_IOV_MAX		1024	/* UIO_MAXIOV */
+#define KFS_IOV_FAST		8	/* segments copied onto the stack */
+
+extern ssize_t kfs_import_iovec(const struct iovec __user * uvec,
+				unsigned long nr, struct iovec * fast,
+				struct iovec ** iovp);
+extern size_t kfs_iov_length(const struct iovec * iov, unsigned long nr);
+extern ssize_t kfs_readv(struct file *, const struct iovec __user *,
+			 unsigned long);
+extern ssize_t kfs_writev(struct file *, const struct iovec __user *,
+			  unsigned long);
+
+/* kfs path lookup cache, see kernel/kfs_dcache.c */
+struct kfs_dcache_cookie {
+	unsigned long pos_generation;
+	unsigned long neg_generation;
+};
+
+extern int kfs_dcache_lookup(struct inode * root, const char * path,
+			     struct inode ** inode,
+			     struct kfs_dcache_cookie * cookie);
+extern void kfs_dcache_insert(struct inode * root, const char * path,
+			      struct inode * inode,
+			      struct kfs_dcache_cookie * cookie);
+extern void kfs_dcache_note_create(void);
+extern void kfs_dcache_note_remove(void);
+extern void kfs_dcache_invalidate(void);
+
 extern struct inode * kfs_mkdir_at(struct inode * root_inode,  char* name, unsigned mode);
 extern struct inode * kfs_mkdir(char * name, unsigned mode);
 
@@ -0,0 +1,91 @@
+#ifndef _LWK_MEMOPS_H
+#define _LWK_MEMOPS_H
+
+/*
+ * Runtime-selected memcpy() and Internet checksum.
+ *
+ * Each architecture lists the variants it has, memops_init() times them
+ * at boot and picks the fastest per size class. The class boundaries are
+ * shared with the assembly memcpy() entry points, hence plain numbers.
+ */
+#define MEMCPY_CLASSES		4
+#define MEMCPY_CLASS1		256	/* smallest size of class 1 */
+#define MEMCPY_CLASS2		4096
+#define MEMCPY_CLASS3		262144
+
+#define CSUM_CLASSES		3
+#define CSUM_CLASS1		64
+#define CSUM_CLASS2		512
+
+#ifndef __ASSEMBLY__
+
+#include <lwk/types.h>
+
+struct memcpy_impl {
+	const char *	name;
+	void *		(*copy)(void *dst, const void *src, size_t len);
+	bool		(*usable)(void);	/* NULL if always usable */
+	unsigned int	min_class;		/* not tried on smaller classes */
+};
+
+/*
+ * Checksums return the non-inverted one's complement sum of buf in host
+ * order, what lwIP's LWIP_CHKSUM expects.
+ */
+struct csum_impl {
+	const char *	name;
+	u16		(*sum)(const void *buf, int len);
+	bool		(*usable)(void);
+	unsigned int	min_class;
+};
+
+/* Supplied by the architecture, the first entry of each must be usable */
+extern const struct memcpy_impl arch_memcpy_impls[];
+extern const unsigned int arch_memcpy_nr;
+extern const struct csum_impl arch_csum_impls[];
+extern const unsigned int arch_csum_nr;
+
+/* Variant for each size class, defined next to the arch memcpy() */
+extern void *(*memcpy_class[MEMCPY_CLASSES])(void *, const void *, size_t);
+
+static inline unsigned int
+memcpy_size_class(size_t len)
+{
+	if (len < MEMCPY_CLASS1)
+		return 0;
+	if (len < MEMCPY_CLASS2)
+		return 1;
+	if (len < MEMCPY_CLASS3)
+		return 2;
+	return 3;
+}
+
+static inline unsigned int
+csum_size_class(int len)
+{
+	if (len < CSUM_CLASS1)
+		return 0;
+	if (len < CSUM_CLASS2)
+		return 1;
+	return 2;
+}
+
+/* Folds a sum of 16- or 32-bit words down to 16 bits */
+static inline u16
+csum_fold64(u64 sum)
+{
+	sum = (sum >> 32) + (sum & 0xffffffffULL);
+	sum = (sum >> 32) + (sum & 0xffffffffULL);
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum = (sum >> 16) + (sum & 0xffff);
+	return (u16)sum;
+}
+
+extern u16 csum_generic(const void *buf, int len);
+extern u16 memops_csum(const void *buf, int len);
+
+extern void memops_init(void);
+
+#endif /* __ASSEMBLY__ */
+
+#endif
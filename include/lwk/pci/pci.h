@@ -164,6 +164,7 @@ typedef struct pci_driver {
 struct msix_entry {
   u16 vector;
   u16 entry;
+  u16 cpu;	/* destination, 0 is the boot CPU */
 }__attribute__((packed));
 
 struct msi_msg {
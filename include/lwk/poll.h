@@ -19,6 +19,7 @@
 #ifndef POLLWRNORM
 #define POLLWRNORM      0x0100
 #endif
+#define POLLRDHUP       0x2000
 
 #define DEFAULT_POLLMASK (POLLIN | POLLOUT | POLLRDNORM | POLLWRNORM)
 
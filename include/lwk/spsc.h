@@ -0,0 +1,89 @@
+#ifndef _LWK_SPSC_H
+#define _LWK_SPSC_H
+
+/*
+ * Lock-free ring of pointers with a single producer and a single consumer.
+ *
+ * Each side only writes its own index, so neither needs a lock or an
+ * atomic instruction, just the barrier that publishes the slot before the
+ * index that covers it. The indexes sit on separate cache lines and run
+ * freely, wrapping through the power of two sized slot array by mask.
+ *
+ * Keeping it to one producer is the caller's business, e.g. one ring per
+ * CPU filled with interrupts disabled.
+ */
+
+#include <lwk/kernel.h>
+#include <lwk/kmem.h>
+#include <lwk/cache.h>
+#include <lwk/log2.h>
+#include <arch/system.h>
+
+struct spsc_ring {
+	unsigned int	head ____cacheline_aligned_in_smp;	/* producer */
+	unsigned int	tail ____cacheline_aligned_in_smp;	/* consumer */
+	unsigned int	mask ____cacheline_aligned_in_smp;
+	void *		slots[];
+};
+
+/* size is rounded up to a power of two */
+static inline struct spsc_ring *
+spsc_ring_alloc(unsigned int size)
+{
+	struct spsc_ring *ring;
+
+	size = roundup_pow_of_two(size);
+	ring = kmem_alloc(sizeof(*ring) + size * sizeof(void *));
+	if (!ring)
+		return NULL;
+
+	ring->head = ring->tail = 0;
+	ring->mask = size - 1;
+	return ring;
+}
+
+static inline void
+spsc_ring_free(struct spsc_ring *ring)
+{
+	kmem_free(ring);
+}
+
+static inline bool
+spsc_ring_empty(const struct spsc_ring *ring)
+{
+	return ACCESS_ONCE(ring->head) == ACCESS_ONCE(ring->tail);
+}
+
+/* Producer side, false if the ring is full */
+static inline bool
+spsc_ring_push(struct spsc_ring *ring, void *p)
+{
+	unsigned int head = ring->head;
+
+	if (head - ACCESS_ONCE(ring->tail) > ring->mask)
+		return false;
+
+	ring->slots[head & ring->mask] = p;
+	smp_wmb();
+	ACCESS_ONCE(ring->head) = head + 1;
+	return true;
+}
+
+/* Consumer side, NULL if the ring is empty */
+static inline void *
+spsc_ring_pop(struct spsc_ring *ring)
+{
+	unsigned int tail = ring->tail;
+	void *p;
+
+	if (ACCESS_ONCE(ring->head) == tail)
+		return NULL;
+
+	smp_rmb();
+	p = ring->slots[tail & ring->mask];
+	smp_mb();
+	ACCESS_ONCE(ring->tail) = tail + 1;
+	return p;
+}
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef _LWK_UNIX_SOCKET_H
+#define _LWK_UNIX_SOCKET_H
+
+#include <lwk/types.h>
+
+/*
+ * Only the Linux ABI bits AF_UNIX needs. lwIP's sockets.h defines some of
+ * the same names with the same values, so those are guarded, and this
+ * header stays clear of both lwIP's and the kernel's struct iovec.
+ */
+#define AF_UNIX			1
+#define AF_LOCAL		AF_UNIX
+#define PF_UNIX			AF_UNIX
+
+#ifndef SOCK_STREAM
+#define SOCK_STREAM		1
+#define SOCK_DGRAM		2
+#endif
+
+/* socket(), socketpair() and accept4() flags, as in Linux */
+#define SOCK_TYPE_MASK		0xf
+#define SOCK_NONBLOCK		04000
+#define SOCK_CLOEXEC		02000000
+
+#ifndef MSG_OOB
+#define MSG_OOB			0x01
+#define MSG_PEEK		0x02
+#define MSG_DONTWAIT		0x40
+#define MSG_WAITALL		0x100
+#endif
+#define MSG_TRUNC		0x20
+#define MSG_NOSIGNAL		0x4000
+
+#ifndef SHUT_RD
+#define SHUT_RD			0
+#define SHUT_WR			1
+#define SHUT_RDWR		2
+#endif
+
+#define UNIX_PATH_MAX		108
+
+struct sockaddr_un {
+	unsigned short	sun_family;
+	char		sun_path[UNIX_PATH_MAX];
+};
+
+/* The sendmsg()/recvmsg() header as user space lays it out */
+struct user_msghdr {
+	void __user *		msg_name;
+	int			msg_namelen;
+	struct iovec __user *	msg_iov;
+	size_t			msg_iovlen;
+	void __user *		msg_control;
+	size_t			msg_controllen;
+	unsigned int		msg_flags;
+};
+
+struct file;
+
+extern bool is_unix_socket(struct file *file);
+
+extern int unix_socket(int type, int protocol);
+extern int unix_socketpair(int type, int protocol, int fds[2]);
+extern int unix_bind(struct file *file, const void __user *uaddr, int addrlen);
+extern int unix_connect(struct file *file, const void __user *uaddr,
+			int addrlen);
+extern int unix_listen(struct file *file, int backlog);
+extern int unix_accept(struct file *file, void __user *uaddr,
+		       int __user *uaddrlen, int flags);
+extern int unix_getname(struct file *file, void __user *uaddr,
+			int __user *uaddrlen, bool peer);
+extern int unix_shutdown(struct file *file, int how);
+
+extern ssize_t unix_sendto(struct file *file, const void __user *buf,
+			   size_t len, int flags, const void __user *uaddr,
+			   int addrlen);
+extern ssize_t unix_recvfrom(struct file *file, void __user *buf, size_t len,
+			     int flags, void __user *uaddr,
+			     int __user *uaddrlen);
+extern ssize_t unix_sendmsg(struct file *file,
+			    const struct user_msghdr __user *umsg, int flags);
+extern ssize_t unix_recvmsg(struct file *file,
+			    struct user_msghdr __user *umsg, int flags);
+
+extern int unix_setsockopt(struct file *file, int level, int optname,
+			   const void __user *optval, int optlen);
+extern int unix_getsockopt(struct file *file, int level, int optname,
+			   void __user *optval, int __user *optlen);
+
+#endif
@@ -0,0 +1,212 @@
+/** \file
+ * Virtio 1.0 devices over modern PCI, and their split virtqueues.
+ *
+ * The transport (drivers/virtio/virtio_pci.c) finds the device's
+ * configuration structures through its vendor PCI capabilities, resets it
+ * and negotiates features. Each virtqueue is a descriptor table plus the
+ * avail ring the driver fills and the used ring the device returns
+ * buffers through (drivers/virtio/virtio_ring.c). With VIRTIO_F_EVENT_IDX
+ * each side tells the other at which ring index it next wants to be
+ * notified, so neither sends a notification the other doesn't need.
+ *
+ * Legacy (pre 1.0) devices are not supported.
+ */
+
+#ifndef _LWK_VIRTIO_H
+#define _LWK_VIRTIO_H
+
+#include <lwk/types.h>
+#include <lwk/pci/pci.h>
+
+/* Device status bits */
+#define VIRTIO_STATUS_ACKNOWLEDGE	0x01
+#define VIRTIO_STATUS_DRIVER		0x02
+#define VIRTIO_STATUS_DRIVER_OK		0x04
+#define VIRTIO_STATUS_FEATURES_OK	0x08
+#define VIRTIO_STATUS_FAILED		0x80
+
+/* Feature bits common to all device types */
+#define VIRTIO_F_INDIRECT_DESC		28
+#define VIRTIO_F_EVENT_IDX		29
+#define VIRTIO_F_VERSION_1		32
+
+#define VIRTIO_FEATURE(bit)		(1ULL << (bit))
+
+/* PCI IDs, device ID 0x1040 + the virtio device type */
+#define VIRTIO_PCI_VENDOR		0x1af4
+#define VIRTIO_PCI_DEVICE(type)		(0x1040 + (type))
+#define VIRTIO_ID_NET			1
+#define VIRTIO_ID_BLOCK			2
+
+/* Written as a queue's MSI-X vector to have it not interrupt at all */
+#define VIRTIO_MSI_NO_VECTOR		0xffff
+
+
+/* Split virtqueue layout, shared with the device */
+#define VRING_DESC_F_NEXT		1	/* chained through next */
+#define VRING_DESC_F_WRITE		2	/* device writes the buffer */
+#define VRING_DESC_F_INDIRECT		4	/* buffer is a descriptor table */
+
+#define VRING_AVAIL_F_NO_INTERRUPT	1
+#define VRING_USED_F_NO_NOTIFY		1
+
+struct vring_desc {
+	u64		addr;
+	u32		len;
+	u16		flags;
+	u16		next;
+};
+
+/* Followed by the used_event index when VIRTIO_F_EVENT_IDX is on */
+struct vring_avail {
+	u16		flags;
+	u16		idx;
+	u16		ring[];
+};
+
+struct vring_used_elem {
+	u32		id;		/* head of the chain that was used */
+	u32		len;		/* bytes written into it */
+};
+
+/* Followed by the avail_event index when VIRTIO_F_EVENT_IDX is on */
+struct vring_used {
+	u16		flags;
+	u16		idx;
+	struct vring_used_elem ring[];
+};
+
+
+/* The common configuration structure of a modern PCI device */
+struct virtio_pci_common_cfg {
+	u32		device_feature_select;
+	u32		device_feature;
+	u32		driver_feature_select;
+	u32		driver_feature;
+	u16		msix_config;
+	u16		num_queues;
+	u8		device_status;
+	u8		config_generation;
+
+	u16		queue_select;
+	u16		queue_size;
+	u16		queue_msix_vector;
+	u16		queue_enable;
+	u16		queue_notify_off;
+	u32		queue_desc_lo;
+	u32		queue_desc_hi;
+	u32		queue_driver_lo;
+	u32		queue_driver_hi;
+	u32		queue_device_lo;
+	u32		queue_device_hi;
+} __attribute__((packed));
+
+
+struct virtio_dev {
+	pci_dev_t *				pci_dev;
+	volatile struct virtio_pci_common_cfg *	common;
+	volatile u8 *				isr;
+	volatile void *				device_cfg;
+	volatile u8 *				notify_base;
+	u32					notify_mult;
+	u64					features;	/* negotiated */
+};
+
+/* One buffer of a request, physically contiguous */
+struct virtio_buf {
+	paddr_t		addr;
+	u32		len;
+};
+
+struct virtqueue {
+	struct virtio_dev *	vdev;
+	unsigned int		index;
+	unsigned int		num;		/* descriptors, a power of two */
+
+	struct vring_desc *	desc;
+	struct vring_avail *	avail;
+	struct vring_used *	used;
+	volatile u16 *		used_event;	/* in the avail ring */
+	volatile u16 *		avail_event;	/* in the used ring */
+	volatile u16 *		notify;
+
+	bool			event_idx;
+	bool			indirect;	/* VIRTIO_F_INDIRECT_DESC */
+
+	u16			free_head;
+	unsigned int		num_free;
+	u16			avail_idx;	/* next avail entry to fill */
+	u16			kick_idx;	/* avail_idx at the last kick */
+	u16			last_used;	/* next used entry to take */
+	void **			token;		/* per chain head */
+
+	u64			kicks;		/* notifications sent */
+	u64			kicks_saved;	/* ... and left out */
+};
+
+
+static inline bool
+virtio_has_feature(const struct virtio_dev *vdev, unsigned int bit)
+{
+	return vdev->features & VIRTIO_FEATURE(bit);
+}
+
+static inline u8
+virtio_cfg_read8(struct virtio_dev *vdev, unsigned int off)
+{
+	return *((volatile u8 *)vdev->device_cfg + off);
+}
+
+static inline u16
+virtio_cfg_read16(struct virtio_dev *vdev, unsigned int off)
+{
+	return *(volatile u16 *)((volatile u8 *)vdev->device_cfg + off);
+}
+
+static inline u32
+virtio_cfg_read32(struct virtio_dev *vdev, unsigned int off)
+{
+	return *(volatile u32 *)((volatile u8 *)vdev->device_cfg + off);
+}
+
+/* Reads and thereby clears the INTx status, bit 0 for the queues */
+static inline u8
+virtio_isr_read(struct virtio_dev *vdev)
+{
+	return *vdev->isr;
+}
+
+
+/* Transport, virtio_pci.c */
+extern int virtio_pci_init(struct virtio_dev *vdev, pci_dev_t *pci_dev);
+extern int virtio_negotiate(struct virtio_dev *vdev, u64 wanted);
+extern unsigned int virtio_num_queues(struct virtio_dev *vdev);
+extern struct virtqueue *virtio_vq_setup(struct virtio_dev *vdev,
+					 unsigned int index, unsigned int num,
+					 u16 msix_vector);
+extern void virtio_config_vector(struct virtio_dev *vdev, u16 msix_vector);
+extern void virtio_driver_ok(struct virtio_dev *vdev);
+extern void virtio_reset(struct virtio_dev *vdev);
+
+/* Virtqueues, virtio_ring.c */
+extern struct virtqueue *vq_alloc(struct virtio_dev *vdev, unsigned int index,
+				  unsigned int num);
+extern void vq_free(struct virtqueue *vq);
+extern int vq_add(struct virtqueue *vq, const struct virtio_buf *bufs,
+		  unsigned int out, unsigned int in, void *token);
+extern int vq_add_indirect(struct virtqueue *vq, struct vring_desc *table,
+			   const struct virtio_buf *bufs,
+			   unsigned int out, unsigned int in, void *token);
+extern void vq_kick(struct virtqueue *vq);
+extern void *vq_get(struct virtqueue *vq, u32 *len);
+extern bool vq_has_used(struct virtqueue *vq);
+extern void vq_disable_cb(struct virtqueue *vq);
+extern bool vq_enable_cb(struct virtqueue *vq);
+
+static inline unsigned int
+vq_num_free(const struct virtqueue *vq)
+{
+	return vq->num_free;
+}
+
+#endif
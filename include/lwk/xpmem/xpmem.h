@@ -81,6 +81,7 @@ struct xpmem_addr {
 #define XPMEM_CMD_FORK_BEGIN	_IO(XPMEM_IOC_MAGIC, 8)
 #define XPMEM_CMD_FORK_END	_IO(XPMEM_IOC_MAGIC, 9)
 #define XPMEM_CMD_GET_DOMID	_IO(XPMEM_IOC_MAGIC, 10)
+#define XPMEM_CMD_ATTACH_INFO	_IO(XPMEM_IOC_MAGIC, 11)
 
 /*
  * Structures used with the preceding ioctl() commands to pass data.
@@ -132,6 +133,14 @@ struct xpmem_cmd_domid {
 	xpmem_domid_t domid;
 };
 
+struct xpmem_cmd_attach_info {
+	uint64_t vaddr;
+	size_t size;		/* returned on success */
+	uint64_t nr_4kb_pages;	/* returned on success */
+	uint64_t nr_2mb_pages;	/* returned on success */
+	uint64_t nr_1gb_pages;	/* returned on success */
+};
+
 
 
 #ifdef __KERNEL__
@@ -150,6 +159,7 @@ extern int xpmem_release(xpmem_apid_t);
 extern int xpmem_signal(xpmem_apid_t);
 extern int xpmem_attach(xpmem_apid_t, off_t, size_t, vaddr_t, int, vaddr_t *);
 extern int xpmem_detach(vaddr_t);
+extern int xpmem_attach_info(vaddr_t, struct xpmem_cmd_attach_info *);
 
 #endif /* __KERNEL__ */
 
@@ -10,11 +10,16 @@
 #include <lwk/driver.h>
 #include <lwk/list.h>
 #include <lwk/kfs.h>
+#include <lwk/uio.h>
 #include <lwk/fdTable.h>
 #include <lwk/blkdev.h>
 #include <lwk/pmem.h>
 #include <lwk/aspace.h>
 #include <lwk/delay.h>
+#include <lwk/smp.h>
+#include <lwk/cache.h>
+#include <arch/atomic.h>
+#include <arch-generic/fcntl.h>
 
 
 
@@ -26,6 +31,20 @@ static struct list_head blkdev_list;
 static struct inode *   blkdev_root;
 static spinlock_t       blkdev_lock;
 
+/*
+ * Requests are queued on the submitting CPU's software queue and moved
+ * from there to the driver by whichever CPU gets to dispatch next, until
+ * the device has request_slots requests in flight. Completions refill the
+ * device straight from interrupt context.
+ */
+struct blk_sw_queue {
+	spinlock_t       lock;
+	struct list_head reqs;
+} ____cacheline_aligned;
+
+/* Upper bound on the size of a request built by merging */
+#define BLK_MAX_MERGE_LEN (1024 * 1024)
+
 typedef struct {
 	char name[32];
 
@@ -37,7 +56,20 @@ typedef struct {
 	u32 max_dma_descs;  /* Maximum number of DMA descriptors per request */
 	u32 request_slots;  /* Maximum number of requests that can be issued simultaneously */
 
-	spinlock_t lock;
+	spinlock_t lock;          /* Protects the dispatch state below */
+
+	u32  inflight;            /* Requests handed to the driver */
+	int  dispatching;         /* Some CPU is feeding the driver */
+	int  rerun;               /* ... and has to look at the queues again */
+	u32  next_queue;          /* Round robin position over sw_queues */
+	struct list_head requeue; /* Refused by the driver for lack of slots */
+
+	struct blk_sw_queue * sw_queues;  /* One per CPU */
+	atomic_t              queued;     /* Requests sitting on sw_queues */
+
+	waitq_t done_waitq;       /* Synchronous submitters wait here */
+
+	struct blk_cache * cache; /* NULL if disabled */
 
 	struct inode *  dev_inode;
 
@@ -47,113 +79,384 @@ typedef struct {
 
 
 
-static int 
-get_needed_desc_cnt(vaddr_t vaddr, size_t size) 
+/*
+ * Descriptors never cover more than this, it is as much as one AHCI
+ * PRDT entry can describe.
+ */
+#define BLK_MAX_SEG_LEN (4 * 1024 * 1024)
+
+/* User I/O larger than this is split into several requests */
+#define BLK_MAX_REQ_LEN (16 * 1024 * 1024)
+
+/* Translations of recently used user buffers kept per open file */
+#define BLK_SG_CACHE_SIZE 4
+
+#define BLK_SG_INIT_DESCS 16
+
+struct blk_sg_cache_entry {
+	id_t             aspace_id;
+	unsigned long    map_generation;  /* aspace's when translated */
+	vaddr_t          vaddr;
+	size_t           size;
+	u32              desc_cnt;
+	blk_dma_desc_t * dma_descs;
+	u64              last_use;
+};
+
+struct blkdev_file {
+	blkdev_t * blkdev;
+
+	struct blk_ra_state       ra;
+
+	spinlock_t                sg_lock;
+	u64                       sg_clock;
+	struct blk_sg_cache_entry sg_cache[BLK_SG_CACHE_SIZE];
+};
+
+struct blk_sg_list {
+	blk_dma_desc_t * dma_descs;
+	u32              desc_cnt;
+	u32              max_descs;
+};
+
+
+/* Called once per physically contiguous run of the user buffer */
+static int
+blk_sg_add_extent(paddr_t paddr, size_t size, void * priv)
 {
-	vaddr_t vaddr_iter = vaddr;
-	int cnt            = 0;
+	struct blk_sg_list * sg = priv;
+
+	while (size > 0) {
+		size_t len = min_t(size_t, size, BLK_MAX_SEG_LEN);
 
-	while (vaddr_iter <= (vaddr + size)) {
-		aspace_mapping_t mapping;
-		memset(&mapping, 0, sizeof(aspace_mapping_t));
+		if (sg->desc_cnt == sg->max_descs) {
+			blk_dma_desc_t * descs = NULL;
 
-		
-		if (aspace_lookup_mapping(MY_ID, vaddr_iter, &mapping) != 0) {
-			printk(KERN_ERR "Invalid user address in blkdev read request\n");
- 			return -1;
+			descs = kmem_alloc(sizeof(blk_dma_desc_t) * sg->max_descs * 2);
+
+			if (descs == NULL) {
+				return -ENOMEM;
+			}
+
+			memcpy(descs, sg->dma_descs, sizeof(blk_dma_desc_t) * sg->desc_cnt);
+			kmem_free(sg->dma_descs);
+
+			sg->dma_descs  = descs;
+			sg->max_descs *= 2;
 		}
-		
-		vaddr_iter = mapping.end;
 
-		cnt++;
+		sg->dma_descs[sg->desc_cnt].buf_paddr = paddr;
+		sg->dma_descs[sg->desc_cnt].length    = len;
+		sg->desc_cnt++;
+
+		paddr += len;
+		size  -= len;
 	}
-	
-	return cnt;
+
+	return 0;
 }
 
+/* Carve [vaddr, vaddr + size) out of a cached translation covering it */
+static void
+blk_sg_slice(struct blk_sg_cache_entry * entry, 
+	     vaddr_t                     vaddr, 
+	     size_t                      size, 
+	     struct blk_sg_list        * sg)
+{
+	u64 skip = vaddr - entry->vaddr;
+	u32 i    = 0;
+
+	for (i = 0; (i < entry->desc_cnt) && (size > 0); i++) {
+		blk_dma_desc_t * desc = &(entry->dma_descs[i]);
+		u64 len = 0;
 
-static ssize_t
-__send_blk_req(struct file * filp, vaddr_t ubuf, size_t size, int is_write) 
+		if (skip >= desc->length) {
+			skip -= desc->length;
+			continue;
+		}
+
+		len = min_t(u64, desc->length - skip, size);
+
+		sg->dma_descs[sg->desc_cnt].buf_paddr = desc->buf_paddr + skip;
+		sg->dma_descs[sg->desc_cnt].length    = len;
+		sg->desc_cnt++;
+
+		size -= len;
+		skip  = 0;
+	}
+}
+
+static int
+blk_sg_cache_lookup(struct blkdev_file * bfile, 
+		    vaddr_t              vaddr, 
+		    size_t               size, 
+		    struct blk_sg_list * sg)
 {
-	loff_t offset      = filp->pos;
-	blkdev_t  * blkdev = filp->private_data;
-	blk_req_t * blkreq = NULL;
-	vaddr_t tmp_vaddr  = (vaddr_t)ubuf;
-	size_t tmp_size    = size;
-	int status         = 0;
-	int ret            = 0;
-	int i              = 0;
+	struct aspace * aspace = current->aspace;
+	unsigned long   irqstate;
+	int hit = 0;
+	int i   = 0;
 
-	// We only support block operations at the sector size granularity
-	if (((uintptr_t)ubuf % blkdev->sector_size) || 
-	    (offset          % blkdev->sector_size) || 
-	    (size            % blkdev->sector_size)) 
+	spin_lock_irqsave(&(bfile->sg_lock), irqstate);
 	{
-		return -EINVAL;
+		for (i = 0; i < BLK_SG_CACHE_SIZE; i++) {
+			struct blk_sg_cache_entry * entry = &(bfile->sg_cache[i]);
+
+			if ((entry->dma_descs      == NULL)                           ||
+			    (entry->aspace_id      != aspace->id)                     ||
+			    (entry->map_generation != ACCESS_ONCE(aspace->map_generation)) ||
+			    (vaddr                 <  entry->vaddr)                   ||
+			    (vaddr + size          >  entry->vaddr + entry->size)) {
+				continue;
+			}
+
+			/* A slice never needs more descriptors than the whole */
+			sg->dma_descs = kmem_alloc(sizeof(blk_dma_desc_t) * entry->desc_cnt);
+
+			if (sg->dma_descs == NULL) {
+				break;
+			}
+
+			sg->desc_cnt  = 0;
+			sg->max_descs = entry->desc_cnt;
+
+			blk_sg_slice(entry, vaddr, size, sg);
+			entry->last_use = ++bfile->sg_clock;
+			hit = 1;
+			break;
+		}
 	}
-	
-		
-	blkreq = kmem_alloc(sizeof(blk_req_t));
-	blkreq->total_len = size;
-	blkreq->offset    = offset;
-	blkreq->write     = is_write;
+	spin_unlock_irqrestore(&(bfile->sg_lock), irqstate);
 
-	blkreq->desc_cnt  = get_needed_desc_cnt(tmp_vaddr, size);
-	blkreq->dma_descs = kmem_alloc(sizeof(blk_dma_desc_t) * blkreq->desc_cnt);
+	return hit;
+}
 
-	for (i = 0; i < blkreq->desc_cnt; i++) {
-		aspace_mapping_t mapping;
-		u32 desc_len = 0;
+static void
+blk_sg_cache_insert(struct blkdev_file * bfile, 
+		    unsigned long        map_generation,
+		    vaddr_t              vaddr, 
+		    size_t               size, 
+		    struct blk_sg_list * sg)
+{
+	struct blk_sg_cache_entry * victim = &(bfile->sg_cache[0]);
+	blk_dma_desc_t            * descs  = NULL;
+	blk_dma_desc_t            * old    = NULL;
+	unsigned long               irqstate;
+	int i = 0;
 
-		memset(&mapping, 0, sizeof(aspace_mapping_t));
+	descs = kmem_alloc(sizeof(blk_dma_desc_t) * sg->desc_cnt);
 
-		aspace_lookup_mapping(MY_ID, tmp_vaddr, &mapping);
-		
-		desc_len = (mapping.end - tmp_vaddr) < tmp_size ? 
-			   (mapping.end - tmp_vaddr) : tmp_size;
+	if (descs == NULL) {
+		return;
+	}
 
-		blkreq->dma_descs[i].buf_paddr = mapping.paddr + (tmp_vaddr - mapping.start);
-		blkreq->dma_descs[i].length    = desc_len;
+	memcpy(descs, sg->dma_descs, sizeof(blk_dma_desc_t) * sg->desc_cnt);
 
-		tmp_vaddr += desc_len;
-		tmp_size  -= desc_len;
+	spin_lock_irqsave(&(bfile->sg_lock), irqstate);
+	{
+		for (i = 1; i < BLK_SG_CACHE_SIZE; i++) {
+			if (bfile->sg_cache[i].last_use < victim->last_use) {
+				victim = &(bfile->sg_cache[i]);
+			}
+		}
+
+		old = victim->dma_descs;
+
+		victim->aspace_id      = current->aspace->id;
+		victim->map_generation = map_generation;
+		victim->vaddr          = vaddr;
+		victim->size           = size;
+		victim->desc_cnt       = sg->desc_cnt;
+		victim->dma_descs      = descs;
+		victim->last_use       = ++bfile->sg_clock;
 	}
-	
-	waitq_init(&(blkreq->user_waitq));
+	spin_unlock_irqrestore(&(bfile->sg_lock), irqstate);
 
-	blkreq->complete = 0;
+	kmem_free(old);
+}
+
+/*
+ * A SMARTMAP region is translated through the source aspace, whose unmaps
+ * do not change our map_generation, so its translations can't be cached.
+ */
+static int
+blk_sg_cacheable(vaddr_t vaddr, size_t size)
+{
+	aspace_mapping_t mapping;
+
+	while (size > 0) {
+		if ((aspace_lookup_mapping(MY_ID, vaddr, &mapping) != 0) ||
+		    (mapping.flags & VM_SMARTMAP)) {
+			return 0;
+		}
+
+		if (mapping.end - vaddr >= size) {
+			break;
+		}
+
+		size  -= mapping.end - vaddr;
+		vaddr  = mapping.end;
+	}
+
+	return 1;
+}
+
+/**
+ * Build the DMA descriptor list for a user buffer in a single walk of
+ * its page tables, one descriptor per physically contiguous run, or take
+ * it from the translation of a recently used buffer that covers it.
+ */
+static int
+blk_sg_map_user(struct blkdev_file * bfile, 
+		vaddr_t              vaddr, 
+		size_t               size, 
+		struct blk_sg_list * sg)
+{
+	unsigned long map_generation = ACCESS_ONCE(current->aspace->map_generation);
+	int ret = 0;
+
+	if (blk_sg_cache_lookup(bfile, vaddr, size, sg)) {
+		return 0;
+	}
+
+	sg->desc_cnt  = 0;
+	sg->max_descs = BLK_SG_INIT_DESCS;
+	sg->dma_descs = kmem_alloc(sizeof(blk_dma_desc_t) * sg->max_descs);
+
+	if (sg->dma_descs == NULL) {
+		return -ENOMEM;
+	}
+
+	ret = aspace_virt_to_phys_range(MY_ID, vaddr, size, blk_sg_add_extent, sg);
 
-	ret = blkdev->ops->handle_blkreq(blkreq, blkdev->priv_data);
-	
-	/* Failed to issue block request 
-	 * This might be due to unavailable request slots
-	 */
 	if (ret != 0) {
-		kmem_free(blkreq->dma_descs);
-		kmem_free(blkreq);
-		return ret;
+		kmem_free(sg->dma_descs);
+
+		if (ret == -ENOMEM) {
+			return ret;
+		}
+
+		printk(KERN_ERR "Invalid user address in blkdev request\n");
+		return -EFAULT;
 	}
 
+	if (blk_sg_cacheable(vaddr, size)) {
+		blk_sg_cache_insert(bfile, map_generation, vaddr, size, sg);
+	}
 
+	return 0;
+}
+
+/* Descriptors [first, returned index) make up the next request */
+static u32
+blk_sg_next_chunk(blkdev_t           * blkdev, 
+		  struct blk_sg_list * sg, 
+		  u32                  first, 
+		  u64                * len)
+{
+	u32 last = first;
+
+	*len = 0;
 
-	/*	while (blkreq->complete == 0) {
-		mdelay(100);
-		blkdev->ops->dump_state(blkdev->priv_data);
+	while ((last < sg->desc_cnt) && 
+	       (last - first < blkdev->max_dma_descs) &&
+	       (*len + sg->dma_descs[last].length <= BLK_MAX_REQ_LEN)) {
+		*len += sg->dma_descs[last].length;
+		last++;
 	}
-	*/
 
-	wait_event_interruptible(blkreq->user_waitq,
-				 (blkreq->complete != 0));
+	return last;
+}
+
+/**
+ * Issue the I/O described by sg at the file position and wait for all of
+ * it, consuming sg's descriptor array
+ */
+static ssize_t
+__send_blk_sg(struct file * filp, struct blk_sg_list * sg, size_t size, int is_write)
+{
+	struct blkdev_file * bfile   = filp->private_data;
+	blkdev_t           * blkdev  = bfile->blkdev;
+	blk_req_t          * blkreqs = NULL;
+	loff_t               offset  = filp->pos;
+	struct blk_plug      plug;
+	u32 nr_reqs        = 0;
+	u32 nr_submitted   = 0;
+	u32 desc           = 0;
+	u32 next           = 0;
+	u64 len            = 0;
+	int status         = 0;
+	int ret            = 0;
 
+	/* The device has to agree with the cache around direct I/O */
+	if (blkdev->cache) {
+		status = (is_write) ? blk_cache_invalidate(blkdev->cache, offset, size) 
+				    : blk_cache_sync(blkdev->cache);
+
+		if (status != 0) {
+			kmem_free(sg->dma_descs);
+			return status;
+		}
+	}
+
+	/* 
+	 * Split whatever does not fit in one request. Every descriptor
+	 * boundary is page aligned within a buffer and buffers are sector
+	 * aligned, so each piece is still a whole number of sectors.
+	 */
+	for (desc = 0; desc < sg->desc_cnt; desc = next) {
+		next = blk_sg_next_chunk(blkdev, sg, desc, &len);
+		nr_reqs++;
+	}
+
+	blkreqs = kmem_alloc(sizeof(blk_req_t) * nr_reqs);
+
+	if (blkreqs == NULL) {
+		kmem_free(sg->dma_descs);
+		return -ENOMEM;
+	}
+
+	blk_start_plug(&plug, blkdev);
+
+	for (desc = 0; nr_submitted < nr_reqs; desc = next) {
+		blk_req_t * blkreq = &(blkreqs[nr_submitted]);
+
+		next = blk_sg_next_chunk(blkdev, sg, desc, &len);
+
+		blkreq->total_len = len;
+		blkreq->offset    = offset;
+		blkreq->write     = is_write;
+		blkreq->desc_cnt  = next - desc;
+		blkreq->dma_descs = &(sg->dma_descs[desc]);
+
+		ret = blkdev_submit(blkdev, blkreq, &plug);
+
+		if (ret != 0) {
+			break;
+		}
+
+		offset += len;
+		nr_submitted++;
+	}
+
+	blk_finish_plug(&plug);
 
 	/** 
-	 * At this point blkreq has returned, and the status field records sucess or failure
+	 * Once the requests have returned the status field records sucess or failure
 	 * Success (status = 0), Failure (status = error code) 
 	 */
-	status = blkreq->status;
+	status = ret;
 
-	kmem_free(blkreq->dma_descs);
-	kmem_free(blkreq);
+	while (nr_submitted > 0) {
+		ret = blkdev_wait(blkdev, &(blkreqs[--nr_submitted]));
+
+		if (status == 0) {
+			status = ret;
+		}
+	}
+
+	kmem_free(blkreqs);
+	kmem_free(sg->dma_descs);
 
 	if (status == 0) {
 	    filp->pos += size;
@@ -163,35 +466,247 @@ __send_blk_req(struct file * filp, vaddr_t ubuf, size_t size, int is_write)
 	return status;	
 }
 
+static ssize_t
+__send_blk_req(struct file * filp, vaddr_t ubuf, size_t size, int is_write) 
+{
+	struct blkdev_file * bfile   = filp->private_data;
+	blkdev_t           * blkdev  = bfile->blkdev;
+	struct blk_sg_list   sg;
+	int status         = 0;
+
+	// We only support block operations at the sector size granularity
+	if (((uintptr_t)ubuf % blkdev->sector_size) || 
+	    (filp->pos       % blkdev->sector_size) || 
+	    (size            % blkdev->sector_size)) 
+	{
+		return -EINVAL;
+	}
+
+	if (size == 0) {
+		return 0;
+	}
+
+	status = blk_sg_map_user(bfile, ubuf, size, &sg);
+
+	if (status != 0) {
+		return status;
+	}
+
+	return __send_blk_sg(filp, &sg, size, is_write);
+}
+
+/* Append seg's descriptors to sg, taking over seg's array if sg has none */
+static int
+blk_sg_append(struct blk_sg_list * sg, struct blk_sg_list * seg)
+{
+	blk_dma_desc_t * descs = NULL;
+	u32 max_descs          = 0;
+
+	if (sg->dma_descs == NULL) {
+		*sg = *seg;
+		seg->dma_descs = NULL;
+		return 0;
+	}
+
+	if (sg->desc_cnt + seg->desc_cnt > sg->max_descs) {
+		max_descs = max(sg->max_descs * 2, sg->desc_cnt + seg->desc_cnt);
+		descs     = kmem_alloc(sizeof(blk_dma_desc_t) * max_descs);
+
+		if (descs == NULL) {
+			return -ENOMEM;
+		}
+
+		memcpy(descs, sg->dma_descs, sizeof(blk_dma_desc_t) * sg->desc_cnt);
+		kmem_free(sg->dma_descs);
+
+		sg->dma_descs = descs;
+		sg->max_descs = max_descs;
+	}
+
+	memcpy(&(sg->dma_descs[sg->desc_cnt]), seg->dma_descs, 
+	       sizeof(blk_dma_desc_t) * seg->desc_cnt);
+	sg->desc_cnt += seg->desc_cnt;
+
+	return 0;
+}
+
+/**
+ * Direct I/O for a whole iovec: every segment goes into one descriptor
+ * list, so the vector is submitted under a single plug and waited for
+ * once. Each segment has to be sector aligned on its own.
+ */
+static ssize_t
+__send_blk_req_iov(struct file * filp, const struct iovec * iov, unsigned long nr, int is_write)
+{
+	struct blkdev_file * bfile   = filp->private_data;
+	blkdev_t           * blkdev  = bfile->blkdev;
+	struct blk_sg_list   sg      = { NULL, 0, 0 };
+	struct blk_sg_list   seg;
+	unsigned long i    = 0;
+	size_t size        = 0;
+	int status         = 0;
+
+	if (filp->pos % blkdev->sector_size) {
+		return -EINVAL;
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (((uintptr_t)iov[i].iov_base % blkdev->sector_size) || 
+		    (iov[i].iov_len             % blkdev->sector_size)) 
+		{
+			return -EINVAL;
+		}
+
+		size += iov[i].iov_len;
+	}
+
+	if (size == 0) {
+		return 0;
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (iov[i].iov_len == 0) {
+			continue;
+		}
+
+		status = blk_sg_map_user(bfile, (vaddr_t)iov[i].iov_base, iov[i].iov_len, &seg);
+
+		if (status == 0) {
+			status = blk_sg_append(&sg, &seg);
+			kmem_free(seg.dma_descs);
+		}
+
+		if (status != 0) {
+			kmem_free(sg.dma_descs);
+			return status;
+		}
+	}
+
+	return __send_blk_sg(filp, &sg, size, is_write);
+}
+
+
+static int
+blkdev_cached(struct file * filp)
+{
+	struct blkdev_file * bfile = filp->private_data;
+
+	return (bfile->blkdev->cache != NULL) && !(filp->f_flags & O_DIRECT);
+}
 
 static ssize_t 
 blkdev_write(struct file * filp, const char __user * ubuf, size_t size, loff_t * off)
 {
-	return __send_blk_req(filp, (vaddr_t)ubuf, size, 1);
+	struct blkdev_file * bfile = filp->private_data;
+	ssize_t ret = 0;
+
+	if (!blkdev_cached(filp)) {
+		return __send_blk_req(filp, (vaddr_t)ubuf, size, 1);
+	}
+
+	ret = blk_cache_write(bfile->blkdev->cache, ubuf, size, filp->pos);
+
+	if (ret > 0) {
+		filp->pos += ret;
+	}
+
+	return ret;
 }
 
 
 static ssize_t 
 blkdev_read(struct file * filp, char __user * ubuf, size_t size, loff_t * off) 
 {
-	return __send_blk_req(filp, (vaddr_t)ubuf, size, 0);
+	struct blkdev_file * bfile = filp->private_data;
+	ssize_t ret = 0;
+
+	if (!blkdev_cached(filp)) {
+		return __send_blk_req(filp, (vaddr_t)ubuf, size, 0);
+	}
+
+	ret = blk_cache_read(bfile->blkdev->cache, &(bfile->ra), ubuf, size, filp->pos);
+
+	if (ret > 0) {
+		filp->pos += ret;
+	}
+
+	return ret;
+}
+
+/* Cached vectors go through the cache one segment at a time */
+static ssize_t
+blkdev_cached_iov(struct file * filp, const struct iovec * iov, unsigned long nr, int is_write)
+{
+	ssize_t total = 0;
+	ssize_t ret   = 0;
+	unsigned long i;
+
+	for (i = 0; i < nr; i++) {
+		ret = (is_write) ? blkdev_write(filp, iov[i].iov_base, iov[i].iov_len, NULL)
+				 : blkdev_read(filp, iov[i].iov_base, iov[i].iov_len, NULL);
+
+		if (ret < 0) {
+			return (total) ? total : ret;
+		}
+
+		total += ret;
+
+		if (ret < iov[i].iov_len) {
+			break;
+		}
+	}
+
+	return total;
+}
+
+static ssize_t
+blkdev_write_iter(struct file * filp, const struct iovec * iov, unsigned long nr, loff_t * off)
+{
+	if (!blkdev_cached(filp)) {
+		return __send_blk_req_iov(filp, iov, nr, 1);
+	}
+
+	return blkdev_cached_iov(filp, iov, nr, 1);
+}
+
+static ssize_t
+blkdev_read_iter(struct file * filp, const struct iovec * iov, unsigned long nr, loff_t * off)
+{
+	if (!blkdev_cached(filp)) {
+		return __send_blk_req_iov(filp, iov, nr, 0);
+	}
+
+	return blkdev_cached_iov(filp, iov, nr, 0);
+}
+
+static int
+blkdev_fsync(struct file * filp)
+{
+	struct blkdev_file * bfile = filp->private_data;
+
+	if (bfile->blkdev->cache == NULL) {
+		return 0;
+	}
+
+	return blk_cache_sync(bfile->blkdev->cache);
 }
 
 /**
  * The only difference from the standard lseek is that we require aligned offsets 
- * that match the blkdev's sector size 
+ * that match the blkdev's sector size, unless I/O goes through the page cache
  */
 static off_t
 blkdev_lseek(struct file * filp,
 	     off_t         offset,
 	     int           whence) 
 {
-	blkdev_t * blkdev = filp->private_data;
+	struct blkdev_file * bfile  = filp->private_data;
+	blkdev_t           * blkdev = bfile->blkdev;
         loff_t new_offset = 0;
         int rv = 0;
 	
 
-	if (offset % blkdev->sector_size) {
+	if ((offset % blkdev->sector_size) && !blkdev_cached(filp)) {
 		return -EINVAL;
 	}
 
@@ -242,9 +757,18 @@ static int
 blkdev_open(struct inode * inodep, 
 	    struct file  * filp) 
 {
-	blkdev_t * blkdev   = inodep->priv;
-	
-	filp->private_data = blkdev;
+	struct blkdev_file * bfile = NULL;
+
+	bfile = kmem_alloc(sizeof(struct blkdev_file));
+
+	if (bfile == NULL) {
+		return -ENOMEM;
+	}
+
+	bfile->blkdev = inodep->priv;
+	spin_lock_init(&(bfile->sg_lock));
+
+	filp->private_data = bfile;
 
         return 0;
 }
@@ -252,9 +776,30 @@ blkdev_open(struct inode * inodep,
 static int 
 blkdev_close(struct file * filp) 
 {
-//	blkdev_t * blkdev = filp->private_data;
+	struct blkdev_file * bfile = filp->private_data;
+	int ret = 0;
+	int i   = 0;
 
-        return 0;
+	/* Like fsync(), so nothing written is still only cached once the device is closed */
+	if (bfile->blkdev->cache) {
+		ret = blk_cache_sync(bfile->blkdev->cache);
+	}
+
+	for (i = 0; i < BLK_SG_CACHE_SIZE; i++) {
+		kmem_free(bfile->sg_cache[i].dma_descs);
+	}
+
+	kmem_free(bfile);
+
+        return ret;
+}
+
+/* Files still open at exit are released instead of closed */
+static int
+blkdev_release(struct inode * inodep, 
+	       struct file  * filp) 
+{
+	return blkdev_close(filp);
 }
 
 static long 
@@ -266,20 +811,190 @@ blkdev_ioctl(struct file  * filp,
     return 0;
 }
 
+static void
+blk_req_end(blkdev_t  * blkdev, 
+	    blk_req_t * blkreq, 
+	    int         status)
+{
+	blk_req_t * child = NULL;
+	blk_req_t * tmp   = NULL;
+
+	if (blkreq->merged) {
+		list_for_each_entry_safe(child, tmp, &(blkreq->merge_list), q_link) {
+			list_del(&(child->q_link));
+			blk_req_end(blkdev, child, status);
+		}
+
+		/* The descriptor list lives in the same allocation */
+		kmem_free(blkreq);
+		return;
+	}
+
+	blkreq->status = status;
+
+	if (blkreq->end_io) {
+		blkreq->complete = 1;
+		blkreq->end_io(blkreq, status);
+		return;
+	}
+
+	/* The waiter may free the request as soon as it sees complete */
+	smp_wmb();
+	blkreq->complete = 1;
+
+	waitq_wakeup(&(blkdev->done_waitq));
+}
+
+static blk_req_t *
+__blkdev_next_req(blkdev_t * blkdev)
+{
+	struct blk_sw_queue * swq    = NULL;
+	blk_req_t           * blkreq = NULL;
+	u32 i = 0;
+
+	if (!list_empty(&(blkdev->requeue))) {
+		blkreq = list_first_entry(&(blkdev->requeue), blk_req_t, q_link);
+		list_del(&(blkreq->q_link));
+		return blkreq;
+	}
+
+	if (atomic_read(&(blkdev->queued)) == 0) {
+		return NULL;
+	}
+
+	for (i = 0; i < NR_CPUS; i++) {
+		u32 q = (blkdev->next_queue + i) % NR_CPUS;
+
+		swq = &(blkdev->sw_queues[q]);
+
+		if (list_empty(&(swq->reqs))) {
+			continue;
+		}
+
+		spin_lock(&(swq->lock));
+		{
+			if (!list_empty(&(swq->reqs))) {
+				blkreq = list_first_entry(&(swq->reqs), blk_req_t, q_link);
+				list_del(&(blkreq->q_link));
+			}
+		}
+		spin_unlock(&(swq->lock));
+
+		if (blkreq) {
+			atomic_dec(&(blkdev->queued));
+			blkdev->next_queue = q + 1;
+			return blkreq;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Hand queued requests to the driver until it has request_slots in
+ * flight. Only one CPU dispatches at a time; the others just ask it to
+ * go around once more.
+ */
+static void
+blkdev_run_queues(blkdev_t * blkdev)
+{
+	blk_req_t     * blkreq = NULL;
+	blk_req_t     * tmp    = NULL;
+	unsigned long   irqstate;
+	LIST_HEAD(failed);
+	int idle_retry = 0;
+	int ret = 0;
+
+	spin_lock_irqsave(&(blkdev->lock), irqstate);
+
+	if (blkdev->dispatching) {
+		blkdev->rerun = 1;
+		spin_unlock_irqrestore(&(blkdev->lock), irqstate);
+		return;
+	}
+
+	blkdev->dispatching = 1;
+
+	do {
+		blkdev->rerun = 0;
+
+		while ((blkdev->inflight < blkdev->request_slots) &&
+		       ((blkreq = __blkdev_next_req(blkdev)) != NULL)) {
+
+			blkdev->inflight++;
+			spin_unlock_irqrestore(&(blkdev->lock), irqstate);
+
+			ret = blkdev->ops->handle_blkreq(blkreq, blkdev->priv_data);
+
+			spin_lock_irqsave(&(blkdev->lock), irqstate);
+
+			if (ret == 0) {
+				idle_retry = 0;
+				continue;
+			}
+
+			blkdev->inflight--;
+
+			/* Out of slots after all, retry on the next completion */
+			if ((ret == -EAGAIN) && (blkdev->inflight > 0)) {
+				list_add(&(blkreq->q_link), &(blkdev->requeue));
+				break;
+			}
+
+			/*
+			 * With nothing in flight no completion will come to
+			 * retry it. One may just have raced with the submit,
+			 * so try once more; a driver that is full while idle
+			 * never takes the request.
+			 */
+			if (ret == -EAGAIN) {
+				if (!idle_retry) {
+					idle_retry = 1;
+					list_add(&(blkreq->q_link), &(blkdev->requeue));
+					continue;
+				}
+				ret = -EIO;
+			}
+
+			printk(KERN_ERR "BLKDEV: Error handling block request in block driver\n");
+			blkreq->status = ret;
+			list_add_tail(&(blkreq->q_link), &failed);
+		}
+	} while (blkdev->rerun);
+
+	blkdev->dispatching = 0;
+
+	spin_unlock_irqrestore(&(blkdev->lock), irqstate);
+
+	list_for_each_entry_safe(blkreq, tmp, &failed, q_link) {
+		list_del(&(blkreq->q_link));
+		blk_req_end(blkdev, blkreq, blkreq->status);
+	}
+}
+
 /** 
  * Called when the driver has completed the block request
  * On success: status = 0
  * On failure: status = error code
+ *
+ * Usually called from interrupt context.
  */
 int 
 blk_req_complete(blk_req_t * blkreq, 
 		 int         status) 
 {
+	blkdev_t      * blkdev = blkreq->blkdev;
+	unsigned long   irqstate;
 
-	blkreq->complete = 1;
-	blkreq->status   = status;
-    
-	waitq_wakeup(&(blkreq->user_waitq));
+	spin_lock_irqsave(&(blkdev->lock), irqstate);
+	{
+		blkdev->inflight--;
+	}
+	spin_unlock_irqrestore(&(blkdev->lock), irqstate);
+
+	blk_req_end(blkdev, blkreq, status);
+
+	blkdev_run_queues(blkdev);
 
 	return 0;
 }
@@ -289,21 +1004,22 @@ static struct kfs_fops blkdev_fops = {
         .open           = blkdev_open, 
         .write          = blkdev_write,
         .read           = blkdev_read,
+        .write_iter     = blkdev_write_iter,
+        .read_iter      = blkdev_read_iter,
 	.lseek          = blkdev_lseek,
         .poll           = blkdev_poll, 
         .close          = blkdev_close,
+        .release        = blkdev_release,
+        .fsync          = blkdev_fsync,
         .unlocked_ioctl = blkdev_ioctl,
 };
 
 
-int 
-blkdev_do_request(blkdev_handle_t   blkdev_handle, 
-		  blk_req_t       * request)
+static int
+blk_req_check(blkdev_t  * blkdev, 
+	      blk_req_t * request)
 {
-    
-        blkdev_t * blkdev = (blkdev_t *)blkdev_handle;
-	u32 total_len     = 0;
-	int ret           = 0;
+	u64 total_len     = 0;
 	int i             = 0;
 
 	/* Sanity Check Request */
@@ -325,7 +1041,7 @@ blkdev_do_request(blkdev_handle_t   blkdev_handle,
 
 	if (total_len != request->total_len) {
 		printk(KERN_ERR "BLKDEV: Invalid DMA Descriptor List.\n");
-		printk(KERN_ERR "BLKDEV:\tDMA descriptor Length=%u, Request Length=%llu\n", 
+		printk(KERN_ERR "BLKDEV:\tDMA descriptor Length=%llu, Request Length=%llu\n", 
 		       total_len, request->total_len);
 		return -EINVAL;
 	}
@@ -348,33 +1064,303 @@ blkdev_do_request(blkdev_handle_t   blkdev_handle,
 	}
 	
 
-	waitq_init(&(request->user_waitq));
+	return 0;
+}
 
-	request->complete = 0;
+/* Plugged requests are kept sorted by direction, then device offset */
+static void
+blk_plug_add(struct blk_plug * plug, 
+	     blk_req_t       * request)
+{
+	struct list_head * pos = NULL;
+
+	list_for_each_prev(pos, &(plug->reqs)) {
+		blk_req_t * iter = list_entry(pos, blk_req_t, q_link);
+
+		if ((iter->write < request->write) ||
+		    ((iter->write == request->write) && (iter->offset <= request->offset))) {
+			break;
+		}
+	}
+
+	list_add(&(request->q_link), pos);
+	plug->count++;
+}
+
+static int
+blk_reqs_mergeable(blkdev_t  * blkdev, 
+		   blk_req_t * last, 
+		   blk_req_t * next, 
+		   u64         run_len, 
+		   u32         run_descs)
+{
+	return ((last->write == next->write) &&
+		(last->offset + last->total_len == next->offset) &&
+		(run_len   + next->total_len <= BLK_MAX_MERGE_LEN) &&
+		(run_descs + next->desc_cnt  <= blkdev->max_dma_descs));
+}
+
+/**
+ * Build one request covering the adjacent requests on `run`, which move
+ * to its merge_list. Descriptors that continue one another physically are
+ * folded together. Returns NULL, leaving `run` alone, if out of memory.
+ */
+static blk_req_t *
+blk_merge_reqs(blkdev_t         * blkdev, 
+	       struct list_head * run, 
+	       u64                run_len, 
+	       u32                run_descs)
+{
+	blk_req_t      * merged = NULL;
+	blk_req_t      * iter   = NULL;
+	blk_dma_desc_t * desc   = NULL;
+	u32 cnt = 0;
+	u32 i   = 0;
+
+	merged = kmem_alloc(sizeof(blk_req_t) + (run_descs * sizeof(blk_dma_desc_t)));
+
+	if (merged == NULL) {
+		return NULL;
+	}
+
+	iter = list_first_entry(run, blk_req_t, q_link);
+
+	merged->merged    = 1;
+	merged->write     = iter->write;
+	merged->offset    = iter->offset;
+	merged->total_len = run_len;
+	merged->dma_descs = (blk_dma_desc_t *)(merged + 1);
+	merged->blkdev    = blkdev;
+
+	list_for_each_entry(iter, run, q_link) {
+		for (i = 0; i < iter->desc_cnt; i++) {
+			if (cnt > 0) {
+				desc = &(merged->dma_descs[cnt - 1]);
+
+				if (desc->buf_paddr + desc->length == iter->dma_descs[i].buf_paddr) {
+					desc->length += iter->dma_descs[i].length;
+					continue;
+				}
+			}
+
+			merged->dma_descs[cnt++] = iter->dma_descs[i];
+		}
+	}
+
+	merged->desc_cnt = cnt;
+
+	INIT_LIST_HEAD(&(merged->merge_list));
+	list_splice_init(run, &(merged->merge_list));
+
+	return merged;
+}
+
+/**
+ * Merge runs of adjacent plugged requests and queue the result on this
+ * CPU's software queue in one go.
+ */
+static void
+blk_flush_plug(struct blk_plug * plug)
+{
+	blkdev_t            * blkdev = (blkdev_t *)plug->blkdev;
+	struct blk_sw_queue * swq    = NULL;
+	blk_req_t           * merged = NULL;
+	unsigned long         irqstate;
+	LIST_HEAD(batch);
+	int nr_queued = 0;
+
+	while (!list_empty(&(plug->reqs))) {
+		blk_req_t * first = list_first_entry(&(plug->reqs), blk_req_t, q_link);
+		blk_req_t * last  = first;
+		blk_req_t * next  = NULL;
+		u64 run_len       = first->total_len;
+		u32 run_descs     = first->desc_cnt;
+		int run_cnt       = 1;
+		LIST_HEAD(run);
+
+		list_move_tail(&(first->q_link), &run);
+
+		while (!list_empty(&(plug->reqs))) {
+			next = list_first_entry(&(plug->reqs), blk_req_t, q_link);
+
+			if (!blk_reqs_mergeable(blkdev, last, next, run_len, run_descs)) {
+				break;
+			}
+
+			run_len   += next->total_len;
+			run_descs += next->desc_cnt;
+			run_cnt++;
+
+			list_move_tail(&(next->q_link), &run);
+			last = next;
+		}
+
+		merged = NULL;
+
+		if (run_cnt > 1) {
+			merged = blk_merge_reqs(blkdev, &run, run_len, run_descs);
+		}
+
+		if (merged) {
+			list_add_tail(&(merged->q_link), &batch);
+			nr_queued++;
+		} else {
+			list_splice(&run, batch.prev);
+			nr_queued += run_cnt;
+		}
+	}
+
+	plug->count = 0;
+
+	if (nr_queued == 0) {
+		return;
+	}
+
+	swq = &(blkdev->sw_queues[this_cpu]);
+
+	spin_lock_irqsave(&(swq->lock), irqstate);
+	{
+		list_splice(&batch, swq->reqs.prev);
+		atomic_add(nr_queued, &(blkdev->queued));
+	}
+	spin_unlock_irqrestore(&(swq->lock), irqstate);
+
+	blkdev_run_queues(blkdev);
+}
+
+void
+blk_start_plug(struct blk_plug * plug, 
+	       blkdev_handle_t   blkdev_handle)
+{
+	plug->blkdev = blkdev_handle;
+	plug->count  = 0;
+	INIT_LIST_HEAD(&(plug->reqs));
+}
+
+void
+blk_finish_plug(struct blk_plug * plug)
+{
+	blk_flush_plug(plug);
+}
+
+/**
+ * Queue a request without waiting for it. Requests with an end_io
+ * callback have it called on completion; others are waited for with
+ * blkdev_wait(). With a plug, the request is only batched up until
+ * blk_finish_plug().
+ *
+ * Requests in flight at the same time may complete in any order.
+ */
+int
+blkdev_submit(blkdev_handle_t   blkdev_handle, 
+	      blk_req_t       * request,
+	      struct blk_plug * plug)
+{
+	blkdev_t            * blkdev = (blkdev_t *)blkdev_handle;
+	struct blk_sw_queue * swq    = NULL;
+	unsigned long         irqstate;
+	int ret = 0;
+
+	ret = blk_req_check(blkdev, request);
 
-	ret = blkdev->ops->handle_blkreq(request, blkdev->priv_data);
-	
-	/* Failed to issue block request 
-	 * This might be due to unavailable request slots
-	 */
 	if (ret != 0) {
-		printk(KERN_ERR "BLKDEV: Error handling block request in block driver\n");
 		return ret;
 	}
 
-	/*
-	while (request->complete == 0) {
-		mdelay(100);
-		blkdev->ops->dump_state(blkdev->priv_data);
+	request->complete = 0;
+	request->merged   = 0;
+	request->status   = 0;
+	request->blkdev   = blkdev;
+
+	if (plug) {
+		if (plug->blkdev != blkdev) {
+			return -EINVAL;
+		}
+
+		blk_plug_add(plug, request);
+
+		if (plug->count >= BLK_PLUG_MAX_REQS) {
+			blk_flush_plug(plug);
+		}
+
+		return 0;
+	}
+
+	swq = &(blkdev->sw_queues[this_cpu]);
+
+	spin_lock_irqsave(&(swq->lock), irqstate);
+	{
+		list_add_tail(&(request->q_link), &(swq->reqs));
+		atomic_inc(&(blkdev->queued));
 	}
-	*/
+	spin_unlock_irqrestore(&(swq->lock), irqstate);
 
-	wait_event_interruptible(request->user_waitq,
-				 (request->complete != 0));
+	blkdev_run_queues(blkdev);
+
+	return 0;
+}
+
+/**
+ * Wait for a request submitted without an end_io callback.
+ * Returns the request's status.
+ */
+int
+blkdev_wait(blkdev_handle_t   blkdev_handle, 
+	    blk_req_t       * request)
+{
+	blkdev_t * blkdev = (blkdev_t *)blkdev_handle;
+
+	/* Not interruptible: the device may still be DMAing to the buffers */
+	wait_event(blkdev->done_waitq, (request->complete != 0));
+	smp_rmb();
 
 	return request->status;
 }
 
+int 
+blkdev_do_request(blkdev_handle_t   blkdev_handle, 
+		  blk_req_t       * request)
+{
+	int ret = 0;
+
+	request->end_io = NULL;
+
+	ret = blkdev_submit(blkdev_handle, request, NULL);
+
+	if (ret != 0) {
+		return ret;
+	}
+
+	return blkdev_wait(blkdev_handle, request);
+}
+
+u64
+blkdev_get_sector_size(blkdev_handle_t blkdev_handle)
+{
+	blkdev_t * blkdev = (blkdev_t *)blkdev_handle;
+
+	return blkdev->sector_size;
+}
+
+u32
+blkdev_get_max_dma_descs(blkdev_handle_t blkdev_handle)
+{
+	blkdev_t * blkdev = (blkdev_t *)blkdev_handle;
+
+	return blkdev->max_dma_descs;
+}
+
+/**
+ * Maximum number of requests the device works on at once
+ */
+u32
+blkdev_get_queue_depth(blkdev_handle_t blkdev_handle)
+{
+	blkdev_t * blkdev = (blkdev_t *)blkdev_handle;
+
+	return blkdev->request_slots;
+}
+
 u64
 blkdev_get_capacity(blkdev_handle_t blkdev_handle) 
 {
@@ -418,6 +1404,7 @@ blkdev_register(char         * name,
     
 	blkdev_t      * blkdev = kmem_alloc(sizeof(blkdev_t));
 	unsigned long   irqstate;
+	int i = 0;
 
 	if (blkdev == NULL) {
 		printk(KERN_ERR "Failed to allocate blkdev '%s'\n", name);
@@ -435,7 +1422,26 @@ blkdev_register(char         * name,
 	blkdev->max_dma_descs = max_dma_descs;
 	blkdev->request_slots = request_slots;
 
+	blkdev->sw_queues = kmem_alloc(sizeof(struct blk_sw_queue) * NR_CPUS);
+
+	if (blkdev->sw_queues == NULL) {
+		printk(KERN_ERR "Failed to allocate queues for blkdev '%s'\n", name);
+		kmem_free(blkdev);
+		return -1;
+	}
+
+	for (i = 0; i < NR_CPUS; i++) {
+		spin_lock_init(&(blkdev->sw_queues[i].lock));
+		INIT_LIST_HEAD(&(blkdev->sw_queues[i].reqs));
+	}
+
 	spin_lock_init(&(blkdev->lock));
+	INIT_LIST_HEAD(&(blkdev->requeue));
+	atomic_set(&(blkdev->queued), 0);
+	waitq_init(&(blkdev->done_waitq));
+
+	/* Before the device file exists, so every open sees it */
+	blkdev->cache = blk_cache_create(blkdev);
 
 	printk("Registering Block Device (%s) [Sect. Size=%llu, capacity=%lluGB]\n", 
 	       blkdev->name, blkdev->sector_size, blkdev->capacity / (1024 * 1024 * 1024));
@@ -454,6 +1460,10 @@ blkdev_register(char         * name,
 					 0777, 
 					 blkdev, 0);
 
+	if (blkdev->dev_inode) {
+		blkdev->dev_inode->size = blkdev->capacity;
+	}
+
 
 	return 0;
 }
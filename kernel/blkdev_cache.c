@@ -0,0 +1,753 @@
+/** \file
+ * Page cache for block devices.
+ *
+ * read() and write() on /dev/block files go through here unless the file
+ * was opened with O_DIRECT, so they need not be sector aligned. The cache
+ * holds whole pages of the device, indexed by page number in a radix tree,
+ * in memory taken from the user memory pool in large chunks and never
+ * given back; blkcache_mb= bounds it per device. Clean pages are evicted
+ * in LRU order.
+ *
+ * Reads that continue where the last one on the same file ended grow a
+ * readahead window, and the pages beyond the request are read
+ * asynchronously. Writes only dirty pages; they reach the device on
+ * fsync(), on the last close, or earlier in the background once half of
+ * the budget is dirty.
+ *
+ * The cache lock is a mutex that is never held across a wait for the
+ * device. Completions run in interrupt context and touch nothing but the
+ * page flag bits, so every page flag is changed with atomic bitops.
+ */
+#include <lwk/kernel.h>
+#include <lwk/kmem.h>
+#include <lwk/list.h>
+#include <lwk/mutex.h>
+#include <lwk/waitq.h>
+#include <lwk/params.h>
+#include <lwk/pmem.h>
+#include <lwk/aspace.h>
+#include <lwk/bitops.h>
+#include <lwk/radix-tree.h>
+#include <lwk/blkdev.h>
+#include <arch/atomic.h>
+#include <arch/uaccess.h>
+
+//#define dbg _KDBG
+#define dbg(fmt,args...)
+
+static unsigned int blkcache_mb = CONFIG_BLOCK_PAGE_CACHE_MB;
+param(blkcache_mb, uint);
+
+#define BLK_CACHE_CHUNK_SIZE	VM_PAGE_2MB
+#define BLK_CACHE_CHUNK_PAGES	(BLK_CACHE_CHUNK_SIZE >> PAGE_SHIFT)
+
+#define BLK_CACHE_MAX_IO_PAGES	256	/* per request */
+#define BLK_CACHE_WB_BATCH	64
+
+#define BLK_RA_INIT_PAGES	8
+#define BLK_RA_MAX_PAGES	256
+
+/* Page flag bits */
+#define BLK_PAGE_UPTODATE	0	/* Holds the device's data */
+#define BLK_PAGE_DIRTY		1	/* Newer than the device */
+#define BLK_PAGE_IO		2	/* Being read or written back */
+#define BLK_PAGE_ERROR		3	/* Last read failed */
+#define BLK_PAGE_STALE		4	/* Dropped while pinned, freed on unpin */
+
+/* Radix tree tag of dirty pages */
+#define BLK_CACHE_TAG_DIRTY	0
+
+struct blk_cache_page {
+	u64			index;		/* Page number on the device */
+	paddr_t			paddr;
+	unsigned long		flags;
+	int			refs;		/* Waiters, pins the page */
+	struct list_head	lru_link;	/* lru, or the free list */
+};
+
+struct blk_cache {
+	blkdev_handle_t		blkdev;
+	u64			nr_dev_pages;	/* Whole pages on the device */
+	u32			max_io_pages;
+
+	struct mutex		lock;
+	struct radix_tree_root	pages;
+	struct list_head	lru;		/* Most recently used first */
+	struct list_head	free_pages;
+	u64			nr_pages;	/* Allocated, cached or free */
+	u64			max_pages;
+	u64			nr_dirty;
+
+	atomic_t		wb_inflight;	/* Write back requests */
+	int			wb_error;	/* Reported by the next sync */
+	waitq_t			io_waitq;
+};
+
+/* One request's worth of consecutive pages */
+struct blk_cache_io {
+	blk_req_t		 req;
+	struct blk_cache *	 cache;
+	u32			 nr_pages;
+	struct blk_cache_page ** pages;
+};
+
+
+/* Interrupt context */
+static void
+blk_cache_end_io(blk_req_t * req, int status)
+{
+	struct blk_cache_io * io    = req->end_io_data;
+	struct blk_cache    * cache = io->cache;
+	u32 i;
+
+	for (i = 0; i < io->nr_pages; i++) {
+		struct blk_cache_page * page = io->pages[i];
+
+		if (!req->write)
+			set_bit((status) ? BLK_PAGE_ERROR : BLK_PAGE_UPTODATE,
+				&page->flags);
+
+		smp_mb__before_clear_bit();
+		clear_bit(BLK_PAGE_IO, &page->flags);
+	}
+
+	if (req->write) {
+		/* The data stays cached, only the device is out of date */
+		if (status)
+			cache->wb_error = status;
+		atomic_dec(&cache->wb_inflight);
+	}
+
+	waitq_wakeup(&cache->io_waitq);
+	kmem_free(io);
+}
+
+static struct blk_cache_io *
+blk_cache_io_alloc(struct blk_cache * cache, u32 nr_pages)
+{
+	struct blk_cache_io * io;
+
+	io = kmem_alloc(sizeof(struct blk_cache_io) +
+			nr_pages * (sizeof(struct blk_cache_page *) +
+				    sizeof(blk_dma_desc_t)));
+	if (!io)
+		return NULL;
+
+	io->cache		= cache;
+	io->pages		= (struct blk_cache_page **)(io + 1);
+	io->req.dma_descs	= (blk_dma_desc_t *)(io->pages + nr_pages);
+	io->req.end_io		= blk_cache_end_io;
+	io->req.end_io_data	= io;
+	return io;
+}
+
+/*
+ * Describe io->pages, which must be consecutive on the device, and hand
+ * the request to the block layer. Pages that happen to be physically
+ * contiguous share a descriptor.
+ */
+static int
+blk_cache_io_submit(struct blk_cache_io * io,
+		    int			  write,
+		    struct blk_plug *	  plug)
+{
+	blk_req_t * req = &io->req;
+	u32 i;
+
+	req->write     = write;
+	req->offset    = io->pages[0]->index << PAGE_SHIFT;
+	req->total_len = (u64)io->nr_pages << PAGE_SHIFT;
+	req->desc_cnt  = 0;
+
+	for (i = 0; i < io->nr_pages; i++) {
+		if (req->desc_cnt) {
+			blk_dma_desc_t * desc = &req->dma_descs[req->desc_cnt - 1];
+
+			if (desc->buf_paddr + desc->length == io->pages[i]->paddr) {
+				desc->length += PAGE_SIZE;
+				continue;
+			}
+		}
+
+		req->dma_descs[req->desc_cnt].buf_paddr = io->pages[i]->paddr;
+		req->dma_descs[req->desc_cnt].length	= PAGE_SIZE;
+		req->desc_cnt++;
+	}
+
+	return blkdev_submit(io->cache->blkdev, req, plug);
+}
+
+/* Carve another chunk of user memory into free pages */
+static int
+__blk_cache_grow(struct blk_cache * cache)
+{
+	struct blk_cache_page * pages;
+	struct pmem_region result;
+	u32 i;
+
+	if (cache->nr_pages + BLK_CACHE_CHUNK_PAGES > cache->max_pages)
+		return -ENOMEM;
+
+	pages = kmem_alloc(BLK_CACHE_CHUNK_PAGES * sizeof(struct blk_cache_page));
+	if (!pages)
+		return -ENOMEM;
+
+	if (pmem_alloc_umem(BLK_CACHE_CHUNK_SIZE, PAGE_SIZE, &result)) {
+		kmem_free(pages);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < BLK_CACHE_CHUNK_PAGES; i++) {
+		pages[i].paddr = result.start + ((paddr_t)i << PAGE_SHIFT);
+		list_add_tail(&pages[i].lru_link, &cache->free_pages);
+	}
+
+	cache->nr_pages += BLK_CACHE_CHUNK_PAGES;
+
+	dbg("%llu pages\n", cache->nr_pages);
+	return 0;
+}
+
+static void
+__blk_cache_remove(struct blk_cache * cache, struct blk_cache_page * page)
+{
+	radix_tree_delete(&cache->pages, page->index);
+	list_move(&page->lru_link, &cache->free_pages);
+}
+
+/*
+ * Take a clean page out of the cache. A pinned page can't be freed yet,
+ * so it is only unlinked and the last waiter frees it.
+ */
+static void
+__blk_cache_drop(struct blk_cache * cache, struct blk_cache_page * page)
+{
+	if (!page->refs) {
+		__blk_cache_remove(cache, page);
+		return;
+	}
+
+	radix_tree_delete(&cache->pages, page->index);
+	list_del_init(&page->lru_link);
+	set_bit(BLK_PAGE_STALE, &page->flags);
+}
+
+/* Free the least recently used clean page */
+static int
+__blk_cache_evict(struct blk_cache * cache)
+{
+	struct blk_cache_page * page;
+
+	list_for_each_entry_reverse(page, &cache->lru, lru_link) {
+		if (page->refs ||
+		    test_bit(BLK_PAGE_IO, &page->flags) ||
+		    test_bit(BLK_PAGE_DIRTY, &page->flags))
+			continue;
+
+		__blk_cache_remove(cache, page);
+		return 0;
+	}
+
+	return -ENOMEM;
+}
+
+/*
+ * Cache a new, empty page for `index`. Grows the cache up to its budget,
+ * then reuses the least recently used clean page.
+ */
+static struct blk_cache_page *
+__blk_cache_add(struct blk_cache * cache, u64 index)
+{
+	struct blk_cache_page * page;
+
+	if (list_empty(&cache->free_pages) &&
+	    __blk_cache_grow(cache) && __blk_cache_evict(cache))
+		return NULL;
+
+	page = list_first_entry(&cache->free_pages,
+				struct blk_cache_page, lru_link);
+
+	page->index = index;
+	page->flags = 0;
+	page->refs  = 0;
+
+	if (radix_tree_insert(&cache->pages, index, page))
+		return NULL;
+
+	list_move(&page->lru_link, &cache->lru);
+	return page;
+}
+
+/*
+ * Wait for I/O on a page to finish. Called and returns with the lock held
+ * but drops it meanwhile, so the caller has to look the page up again.
+ */
+static void
+__blk_cache_wait_page(struct blk_cache * cache, struct blk_cache_page * page)
+{
+	page->refs++;
+	mutex_unlock(&cache->lock);
+
+	wait_event(cache->io_waitq, !test_bit(BLK_PAGE_IO, &page->flags));
+
+	mutex_lock(&cache->lock);
+	page->refs--;
+
+	if (!page->refs && test_bit(BLK_PAGE_STALE, &page->flags))
+		list_add(&page->lru_link, &cache->free_pages);
+}
+
+/*
+ * Start reading the pages [first, first + nr) that are not cached yet,
+ * stopping at the first one that is. Returns how many were started.
+ */
+static int
+__blk_cache_start_read(struct blk_cache * cache, u64 first, u64 nr)
+{
+	struct blk_cache_io * io;
+	struct blk_cache_page * page;
+	u32 i;
+	int status;
+
+	if (first >= cache->nr_dev_pages)
+		return 0;
+
+	nr = min(nr, cache->nr_dev_pages - first);
+	nr = min_t(u64, nr, cache->max_io_pages);
+
+	io = blk_cache_io_alloc(cache, nr);
+	if (!io)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++) {
+		if (radix_tree_lookup(&cache->pages, first + i))
+			break;
+
+		page = __blk_cache_add(cache, first + i);
+		if (!page)
+			break;
+
+		set_bit(BLK_PAGE_IO, &page->flags);
+		io->pages[i] = page;
+	}
+
+	io->nr_pages = i;
+
+	if (i == 0) {
+		kmem_free(io);
+		return (radix_tree_lookup(&cache->pages, first)) ? 0 : -ENOMEM;
+	}
+
+	status = blk_cache_io_submit(io, 0, NULL);
+	if (status) {
+		for (i = 0; i < io->nr_pages; i++) {
+			set_bit(BLK_PAGE_ERROR, &io->pages[i]->flags);
+			clear_bit(BLK_PAGE_IO, &io->pages[i]->flags);
+		}
+		kmem_free(io);
+		return status;
+	}
+
+	return io->nr_pages;
+}
+
+/*
+ * Keep `window` pages read ahead of a sequential reader, growing the
+ * window each time the reader comes back for more.
+ */
+static void
+__blk_cache_readahead(struct blk_cache    * cache,
+		      struct blk_ra_state * ra,
+		      u64		    first,
+		      u64		    last)
+{
+	u64 start, target;
+	int ret;
+
+	if (first == ra->next_index) {
+		ra->window = (ra->window) ? min_t(u32, ra->window * 2, BLK_RA_MAX_PAGES)
+					  : BLK_RA_INIT_PAGES;
+	} else {
+		ra->window = 0;
+		ra->ra_end = 0;
+	}
+
+	ra->next_index = last + 1;
+
+	if (!ra->window)
+		return;
+
+	target = last + 1 + ra->window;
+	start  = max(ra->ra_end, last + 1);
+
+	while (start < target) {
+		ret = __blk_cache_start_read(cache, start, target - start);
+		if (ret < 0)
+			break;
+		start += (ret) ? ret : 1;
+	}
+
+	ra->ra_end = target;
+}
+
+/* Start writing back every dirty page, in device order */
+static void
+__blk_cache_start_writeback(struct blk_cache * cache)
+{
+	struct blk_cache_page * batch[BLK_CACHE_WB_BATCH];
+	struct blk_cache_io * io = NULL;
+	struct blk_plug plug;
+	u64 index = 0;
+	u32 nr, i;
+
+	if (!cache->nr_dirty)
+		return;
+
+	/* The plug glues runs split across batches back together */
+	blk_start_plug(&plug, cache->blkdev);
+
+	while ((nr = radix_tree_gang_lookup_tag(&cache->pages, (void **)batch,
+						index, BLK_CACHE_WB_BATCH,
+						BLK_CACHE_TAG_DIRTY)) > 0) {
+		for (i = 0; i < nr; i++) {
+			struct blk_cache_page * page = batch[i];
+
+			if (io && ((io->nr_pages == cache->max_io_pages) ||
+				   (io->pages[io->nr_pages - 1]->index + 1 != page->index))) {
+				atomic_inc(&cache->wb_inflight);
+				if (blk_cache_io_submit(io, 1, &plug))
+					blk_cache_end_io(&io->req, -EIO);
+				io = NULL;
+			}
+
+			if (!io) {
+				io = blk_cache_io_alloc(cache, cache->max_io_pages);
+				if (!io)
+					goto out;
+				io->nr_pages = 0;
+			}
+
+			radix_tree_tag_clear(&cache->pages, page->index,
+					     BLK_CACHE_TAG_DIRTY);
+			clear_bit(BLK_PAGE_DIRTY, &page->flags);
+			set_bit(BLK_PAGE_IO, &page->flags);
+			cache->nr_dirty--;
+
+			io->pages[io->nr_pages++] = page;
+		}
+
+		index = batch[nr - 1]->index + 1;
+	}
+
+	if (io) {
+		atomic_inc(&cache->wb_inflight);
+		if (blk_cache_io_submit(io, 1, &plug))
+			blk_cache_end_io(&io->req, -EIO);
+	}
+
+out:
+	blk_finish_plug(&plug);
+}
+
+/*
+ * Out of clean pages: write some back and wait for it, or wait for a read
+ * to finish if the rest is under readahead. Drops the lock meanwhile.
+ * Returns -ENOMEM if there is nothing to wait for.
+ */
+static int
+__blk_cache_reclaim(struct blk_cache * cache)
+{
+	struct blk_cache_page * page;
+
+	if (cache->nr_dirty || atomic_read(&cache->wb_inflight)) {
+		__blk_cache_start_writeback(cache);
+
+		mutex_unlock(&cache->lock);
+		wait_event(cache->io_waitq, !atomic_read(&cache->wb_inflight));
+		mutex_lock(&cache->lock);
+
+		return 0;
+	}
+
+	list_for_each_entry_reverse(page, &cache->lru, lru_link) {
+		if (test_bit(BLK_PAGE_IO, &page->flags)) {
+			__blk_cache_wait_page(cache, page);
+			return 0;
+		}
+	}
+
+	return -ENOMEM;
+}
+
+
+struct blk_cache *
+blk_cache_create(blkdev_handle_t blkdev_handle)
+{
+	struct blk_cache * cache;
+	u64 sector_size = blkdev_get_sector_size(blkdev_handle);
+
+	if (!blkcache_mb)
+		return NULL;
+
+	if ((sector_size > PAGE_SIZE) || (PAGE_SIZE % sector_size)) {
+		printk(KERN_WARNING "BLKDEV: No page cache for %llu byte sectors\n",
+		       sector_size);
+		return NULL;
+	}
+
+	cache = kmem_alloc(sizeof(struct blk_cache));
+	if (!cache)
+		return NULL;
+
+	cache->blkdev	    = blkdev_handle;
+	cache->nr_dev_pages = blkdev_get_capacity(blkdev_handle) >> PAGE_SHIFT;
+	cache->max_io_pages = min_t(u32, BLK_CACHE_MAX_IO_PAGES,
+				    blkdev_get_max_dma_descs(blkdev_handle));
+	/* The cache grows a chunk at a time, so the bound is one at least */
+	cache->max_pages    = ALIGN(((u64)blkcache_mb << 20) >> PAGE_SHIFT,
+				    (u64)BLK_CACHE_CHUNK_PAGES);
+
+	mutex_init(&cache->lock);
+	INIT_RADIX_TREE(&cache->pages, 0);
+	INIT_LIST_HEAD(&cache->lru);
+	INIT_LIST_HEAD(&cache->free_pages);
+	atomic_set(&cache->wb_inflight, 0);
+	waitq_init(&cache->io_waitq);
+
+	return cache;
+}
+
+ssize_t
+blk_cache_read(struct blk_cache    * cache,
+	       struct blk_ra_state * ra,
+	       char __user	   * buf,
+	       size_t		     len,
+	       loff_t		     pos)
+{
+	u64 size = cache->nr_dev_pages << PAGE_SHIFT;
+	struct blk_cache_page * page;
+	size_t done = 0, chunk;
+	ssize_t ret = 0;
+	bool ra_started = false;
+	u64 index, first, last;
+	loff_t off;
+
+	if (pos >= size)
+		return 0;
+
+	len = min_t(u64, len, size - pos);
+	if (!len)
+		return 0;
+
+	first = pos >> PAGE_SHIFT;
+	last  = (pos + len - 1) >> PAGE_SHIFT;
+
+	mutex_lock(&cache->lock);
+
+	while (done < len) {
+		index = (pos + done) >> PAGE_SHIFT;
+		page  = radix_tree_lookup(&cache->pages, index);
+
+		if (!page) {
+			ret = __blk_cache_start_read(cache, index, last - index + 1);
+			if ((ret == -ENOMEM) && !__blk_cache_reclaim(cache))
+				continue;
+			if (ret < 0)
+				break;
+			continue;
+		}
+
+		if (test_bit(BLK_PAGE_ERROR, &page->flags)) {
+			/* Let the next attempt read it again */
+			__blk_cache_drop(cache, page);
+			ret = -EIO;
+			break;
+		}
+
+		if (!test_bit(BLK_PAGE_UPTODATE, &page->flags)) {
+			/* Queue readahead behind what we are about to wait for */
+			if (!ra_started) {
+				__blk_cache_readahead(cache, ra, first, last);
+				ra_started = true;
+			}
+			__blk_cache_wait_page(cache, page);
+			continue;
+		}
+
+		off   = (pos + done) & (PAGE_SIZE - 1);
+		chunk = min_t(size_t, PAGE_SIZE - off, len - done);
+
+		if (copy_to_user(buf + done, __va(page->paddr) + off, chunk)) {
+			ret = -EFAULT;
+			break;
+		}
+
+		list_move(&page->lru_link, &cache->lru);
+		done += chunk;
+	}
+
+	if (!ra_started)
+		__blk_cache_readahead(cache, ra, first, last);
+
+	mutex_unlock(&cache->lock);
+
+	return (done) ? done : ret;
+}
+
+ssize_t
+blk_cache_write(struct blk_cache * cache,
+		const char __user * buf,
+		size_t		    len,
+		loff_t		    pos)
+{
+	u64 size = cache->nr_dev_pages << PAGE_SHIFT;
+	struct blk_cache_page * page;
+	size_t done = 0, chunk;
+	ssize_t ret = 0;
+	bool filled = false;
+	u64 index;
+	loff_t off;
+
+	if (pos >= size)
+		return (len) ? -ENOSPC : 0;
+
+	len = min_t(u64, len, size - pos);
+
+	mutex_lock(&cache->lock);
+
+	while (done < len) {
+		index = (pos + done) >> PAGE_SHIFT;
+		off   = (pos + done) & (PAGE_SIZE - 1);
+		chunk = min_t(size_t, PAGE_SIZE - off, len - done);
+		page  = radix_tree_lookup(&cache->pages, index);
+
+		if (page && test_bit(BLK_PAGE_IO, &page->flags)) {
+			__blk_cache_wait_page(cache, page);
+			continue;
+		}
+
+		if (page && test_bit(BLK_PAGE_ERROR, &page->flags)) {
+			/* Retry someone else's failed read once, not our own */
+			__blk_cache_drop(cache, page);
+			if (filled) {
+				ret = -EIO;
+				break;
+			}
+			page = NULL;
+		}
+
+		if (!page) {
+			/* Partial pages have to be read in first */
+			if (chunk < PAGE_SIZE) {
+				ret = __blk_cache_start_read(cache, index, 1);
+				filled = (ret > 0);
+			} else {
+				page = __blk_cache_add(cache, index);
+				ret  = (page) ? 0 : -ENOMEM;
+			}
+
+			if ((ret == -ENOMEM) && !__blk_cache_reclaim(cache))
+				continue;
+			if (ret < 0)
+				break;
+			if (!page)
+				continue;
+		}
+
+		if (copy_from_user(__va(page->paddr) + off, buf + done, chunk)) {
+			if (!test_bit(BLK_PAGE_UPTODATE, &page->flags))
+				__blk_cache_remove(cache, page);
+			ret = -EFAULT;
+			break;
+		}
+
+		set_bit(BLK_PAGE_UPTODATE, &page->flags);
+		if (!test_and_set_bit(BLK_PAGE_DIRTY, &page->flags)) {
+			radix_tree_tag_set(&cache->pages, index, BLK_CACHE_TAG_DIRTY);
+			cache->nr_dirty++;
+		}
+
+		list_move(&page->lru_link, &cache->lru);
+		done  += chunk;
+		filled = false;
+	}
+
+	/* Write behind once half the budget is dirty */
+	if (cache->nr_dirty > cache->max_pages / 2)
+		__blk_cache_start_writeback(cache);
+
+	mutex_unlock(&cache->lock);
+
+	return (done) ? done : ret;
+}
+
+/**
+ * Write back all dirty pages and wait for them. Returns the first write
+ * error since the last sync.
+ */
+int
+blk_cache_sync(struct blk_cache * cache)
+{
+	int status;
+
+	mutex_lock(&cache->lock);
+	__blk_cache_start_writeback(cache);
+	mutex_unlock(&cache->lock);
+
+	wait_event(cache->io_waitq, !atomic_read(&cache->wb_inflight));
+
+	status = cache->wb_error;
+	cache->wb_error = 0;
+
+	return status;
+}
+
+/**
+ * Make the device itself current for [pos, pos + len) and drop those
+ * pages, ahead of I/O that bypasses the cache.
+ */
+int
+blk_cache_invalidate(struct blk_cache * cache,
+		     loff_t		pos,
+		     size_t		len)
+{
+	struct blk_cache_page * page;
+	u64 index, last;
+	int status;
+
+	if (!len)
+		return 0;
+
+	status = blk_cache_sync(cache);
+
+	index = pos >> PAGE_SHIFT;
+	last  = (pos + len - 1) >> PAGE_SHIFT;
+
+	mutex_lock(&cache->lock);
+
+	while (index <= last) {
+		page = radix_tree_lookup(&cache->pages, index);
+
+		if (page && test_bit(BLK_PAGE_IO, &page->flags)) {
+			__blk_cache_wait_page(cache, page);
+			continue;
+		}
+
+		/* Dirtied again since the sync, it has to go out first */
+		if (page && test_bit(BLK_PAGE_DIRTY, &page->flags)) {
+			mutex_unlock(&cache->lock);
+			status = blk_cache_sync(cache);
+			mutex_lock(&cache->lock);
+			continue;
+		}
+
+		if (page)
+			__blk_cache_drop(cache, page);
+
+		index++;
+	}
+
+	mutex_unlock(&cache->lock);
+
+	return status;
+}
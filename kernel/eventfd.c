@@ -0,0 +1,187 @@
+/** \file
+ * eventfd: a 64-bit counter behind a file descriptor.
+ *
+ * write() adds to the counter and read() takes it back, all of it or, with
+ * EFD_SEMAPHORE, one at a time. Readers block while it is zero and writers
+ * while an add would overflow it. Every change wakes the waitq, which also
+ * feeds poll() and epoll.
+ */
+#include <lwk/kernel.h>
+#include <lwk/kmem.h>
+#include <lwk/spinlock.h>
+#include <lwk/sched.h>
+#include <lwk/signal.h>
+#include <lwk/kfs.h>
+#include <lwk/poll.h>
+#include <lwk/eventfd.h>
+#include <arch/uaccess.h>
+
+#define EVENTFD_MAX		(~0ULL - 1)
+
+struct eventfd_ctx {
+	spinlock_t	lock;
+	waitq_t		wq;
+	u64		count;
+	unsigned int	flags;
+};
+
+static bool eventfd_take(struct eventfd_ctx *ctx, u64 *val)
+{
+	unsigned long flags;
+	bool taken = false;
+
+	spin_lock_irqsave(&ctx->lock, flags);
+	if (ctx->count) {
+		*val = (ctx->flags & EFD_SEMAPHORE) ? 1 : ctx->count;
+		ctx->count -= *val;
+		taken = true;
+	}
+	spin_unlock_irqrestore(&ctx->lock, flags);
+
+	return taken;
+}
+
+static bool eventfd_add(struct eventfd_ctx *ctx, u64 val)
+{
+	unsigned long flags;
+	bool added = false;
+
+	spin_lock_irqsave(&ctx->lock, flags);
+	if (EVENTFD_MAX - ctx->count >= val) {
+		ctx->count += val;
+		added = true;
+	}
+	spin_unlock_irqrestore(&ctx->lock, flags);
+
+	return added;
+}
+
+static ssize_t eventfd_read(struct file *file, char __user *buf, size_t len,
+			    loff_t *off)
+{
+	struct eventfd_ctx *ctx = file->private_data;
+	u64 val;
+	int ret;
+
+	if (len < sizeof(val))
+		return -EINVAL;
+
+	while (!eventfd_take(ctx, &val)) {
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		ret = wait_event_interruptible(ctx->wq, ctx->count != 0);
+		if (ret)
+			return ret;
+	}
+
+	/* A writer may be waiting for room */
+	waitq_wakeup(&ctx->wq);
+
+	if (copy_to_user(buf, &val, sizeof(val)))
+		return -EFAULT;
+
+	return sizeof(val);
+}
+
+static ssize_t eventfd_write(struct file *file, const char __user *buf,
+			     size_t len, loff_t *off)
+{
+	struct eventfd_ctx *ctx = file->private_data;
+	u64 val;
+	int ret;
+
+	if (len < sizeof(val))
+		return -EINVAL;
+	if (copy_from_user(&val, buf, sizeof(val)))
+		return -EFAULT;
+	if (val == ~0ULL)
+		return -EINVAL;
+
+	while (!eventfd_add(ctx, val)) {
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		ret = wait_event_interruptible(ctx->wq,
+					       EVENTFD_MAX - ctx->count >= val);
+		if (ret)
+			return ret;
+	}
+
+	if (val)
+		waitq_wakeup(&ctx->wq);
+
+	return sizeof(val);
+}
+
+static unsigned int eventfd_poll(struct file *file, poll_table *wait)
+{
+	struct eventfd_ctx *ctx = file->private_data;
+	unsigned int mask = 0;
+	u64 count;
+
+	poll_wait(file, &ctx->wq, wait);
+
+	count = ACCESS_ONCE(ctx->count);
+	if (count)
+		mask |= POLLIN | POLLRDNORM;
+	if (count < EVENTFD_MAX)
+		mask |= POLLOUT | POLLWRNORM;
+
+	return mask;
+}
+
+static int eventfd_close(struct file *file)
+{
+	kmem_free(file->private_data);
+	return 0;
+}
+
+static int eventfd_release(struct inode *inode, struct file *file)
+{
+	kmem_free(file->private_data);
+	return 0;
+}
+
+static struct kfs_fops eventfd_fops = {
+	.read = eventfd_read,
+	.write = eventfd_write,
+	.poll = eventfd_poll,
+	.close = eventfd_close,
+	.release = eventfd_release,
+};
+
+int eventfd_create(unsigned int count, int flags)
+{
+	struct eventfd_ctx *ctx;
+	struct file *file;
+	int fd;
+
+	/* There is no exec, so EFD_CLOEXEC has nothing to do */
+	if (flags & ~EFD_FLAGS_SET)
+		return -EINVAL;
+
+	ctx = kmem_alloc(sizeof(struct eventfd_ctx));
+	if (!ctx)
+		return -ENOMEM;
+
+	spin_lock_init(&ctx->lock);
+	waitq_init(&ctx->wq);
+	ctx->count = count;
+	ctx->flags = flags;
+
+	fd = kfs_open_anon(&eventfd_fops, ctx);
+	if (fd < 0) {
+		kmem_free(ctx);
+		return fd;
+	}
+
+	/* Another thread may have closed it already */
+	file = fdTableGetFile(current->fdTable, fd);
+	if (file) {
+		file->f_flags = O_RDWR | (flags & EFD_NONBLOCK);
+		kfs_put_file(file);
+	}
+
+	return fd;
+}
@@ -0,0 +1,637 @@
+/** \file
+ * epoll: readiness notification driven by wakeups.
+ *
+ * Every watched file gets an epitem with a waitq entry on each waitq its
+ * ->poll op registers. When one of those waitqs is woken the entry's
+ * callback puts the epitem on the epoll set's ready list and wakes the
+ * waiters, so epoll_wait() only ever polls files that were woken since
+ * it last looked, not the whole interest set.
+ *
+ * Level-triggered items go back on the ready list after being reported,
+ * and drop off the first time a re-poll finds them idle. Edge-triggered
+ * items are reported once per wakeup. One-shot items are disarmed after
+ * being reported until EPOLL_CTL_MOD re-arms them.
+ *
+ * Locking, outermost first:
+ *   ep_files_lock  global mutex; epoll_ctl(), set teardown and file
+ *                  release, protects the interest trees and
+ *                  file->f_ep_links
+ *   ep->items_lock mutex held while items are polled or torn down, so a
+ *                  file can't go away under epoll_wait()
+ *   (waitq locks)  wakeup callbacks run under the woken waitq's lock
+ *   ep->lock       irq-safe, the ready list and item event masks
+ *
+ * ->poll ops may sleep, so they only ever run under the two mutexes.
+ * epoll_wait() copies events out with no lock held at all.
+ */
+#include <lwk/kernel.h>
+#include <lwk/kmem.h>
+#include <lwk/list.h>
+#include <lwk/spinlock.h>
+#include <lwk/mutex.h>
+#include <lwk/radix-tree.h>
+#include <lwk/sched.h>
+#include <lwk/signal.h>
+#include <lwk/time.h>
+#include <lwk/kfs.h>
+#include <lwk/poll.h>
+#include <lwk/eventpoll.h>
+#include <arch/uaccess.h>
+#include <arch-generic/fcntl.h>
+
+struct eventpoll {
+	spinlock_t		lock;
+	struct list_head	rdllist;	/* epitems that may be ready */
+	waitq_t			wq;		/* tasks in epoll_wait() */
+	waitq_t			poll_wait;	/* poll() on the epoll fd */
+
+	struct mutex		items_lock;
+	struct radix_tree_root	items;		/* fd -> epitem */
+	struct list_head	items_list;
+};
+
+struct epitem {
+	struct list_head	rdllink;	/* on ep->rdllist */
+	struct list_head	itemlink;	/* on ep->items_list */
+	struct list_head	fllink;		/* on file->f_ep_links */
+	struct list_head	pwqlist;	/* struct ep_pwq */
+
+	struct eventpoll *	ep;
+	struct file *		file;
+	int			fd;
+	int			nwait;		/* -1 if registering failed */
+	struct epoll_event	event;
+};
+
+/* A waitq entry of an epitem, one per waitq the file's ->poll uses */
+struct ep_pwq {
+	waitq_entry_t		wait;
+	waitq_t *		whead;
+	struct epitem *		epi;
+	struct list_head	link;
+};
+
+struct ep_pqueue {
+	poll_table		pt;
+	struct epitem *		epi;
+};
+
+/* Events gathered per pass of epoll_wait(), copied out unlocked */
+#define EP_SEND_BATCH		32
+
+static DEFINE_MUTEX(ep_files_lock);
+
+static struct kfs_fops eventpoll_fops;
+
+
+static inline bool is_file_epoll(struct file *file)
+{
+	return file->f_op == &eventpoll_fops;
+}
+
+/* Queue epi if it isn't already, called with ep->lock held */
+static void __ep_ready(struct eventpoll *ep, struct epitem *epi)
+{
+	if (!list_empty(&epi->rdllink))
+		return;
+
+	list_add_tail(&epi->rdllink, &ep->rdllist);
+
+	waitq_wakeup(&ep->wq);
+	waitq_wakeup(&ep->poll_wait);
+}
+
+static int ep_poll_callback(waitq_entry_t *wait, unsigned mode, int sync,
+			    void *key)
+{
+	struct epitem *epi = container_of(wait, struct ep_pwq, wait)->epi;
+	struct eventpoll *ep = epi->ep;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ep->lock, flags);
+
+	/* Disarmed one-shot item, or the wakeup is for events not asked for */
+	if (!(epi->event.events & ~EP_PRIVATE_BITS))
+		goto out;
+	if (key && !((unsigned long)key & epi->event.events))
+		goto out;
+
+	__ep_ready(ep, epi);
+out:
+	spin_unlock_irqrestore(&ep->lock, flags);
+	return 1;
+}
+
+static void ep_ptable_queue_proc(struct file *file, waitq_t *whead,
+				 poll_table *pt)
+{
+	struct epitem *epi = container_of(pt, struct ep_pqueue, pt)->epi;
+	struct ep_pwq *pwq;
+
+	if (epi->nwait < 0)
+		return;
+
+	pwq = kmem_alloc(sizeof(struct ep_pwq));
+	if (!pwq) {
+		epi->nwait = -1;
+		return;
+	}
+
+	list_head_init(&pwq->wait.link);
+	pwq->wait.private = epi;
+	pwq->wait.flags   = 0;
+	pwq->wait.func    = ep_poll_callback;
+	pwq->whead        = whead;
+	pwq->epi          = epi;
+
+	waitq_add_entry(whead, &pwq->wait);
+	list_add_tail(&pwq->link, &epi->pwqlist);
+	epi->nwait++;
+}
+
+static unsigned int ep_item_poll(struct epitem *epi, poll_table *pt)
+{
+	struct file *file = epi->file;
+
+	if (pt)
+		pt->key = epi->event.events | POLLERR | POLLHUP;
+
+	return file->f_op->poll(file, pt) & epi->event.events;
+}
+
+/*
+ * Unhook epi from everything and free it. Called with ep_files_lock and
+ * ep->items_lock held; once the waitq entries are gone no callback can
+ * queue it again.
+ */
+static void ep_remove(struct eventpoll *ep, struct epitem *epi)
+{
+	struct ep_pwq *pwq, *tmp;
+	unsigned long flags;
+
+	list_for_each_entry_safe(pwq, tmp, &epi->pwqlist, link) {
+		waitq_remove_entry(pwq->whead, &pwq->wait);
+		list_del(&pwq->link);
+		kmem_free(pwq);
+	}
+
+	spin_lock_irqsave(&ep->lock, flags);
+	if (!list_empty(&epi->rdllink))
+		list_del_init(&epi->rdllink);
+	spin_unlock_irqrestore(&ep->lock, flags);
+
+	list_del(&epi->fllink);
+	list_del(&epi->itemlink);
+	radix_tree_delete(&ep->items, epi->fd);
+
+	kmem_free(epi);
+}
+
+static int ep_insert(struct eventpoll *ep, struct epoll_event *event,
+		     struct file *file, int fd)
+{
+	struct ep_pqueue epq;
+	struct epitem *epi;
+	unsigned int revents;
+	unsigned long flags;
+	int status;
+
+	epi = kmem_alloc(sizeof(struct epitem));
+	if (!epi)
+		return -ENOMEM;
+
+	list_head_init(&epi->rdllink);
+	list_head_init(&epi->pwqlist);
+	epi->ep    = ep;
+	epi->file  = file;
+	epi->fd    = fd;
+	epi->nwait = 0;
+	epi->event = *event;
+
+	status = radix_tree_insert(&ep->items, fd, epi);
+	if (status) {
+		kmem_free(epi);
+		return status;
+	}
+
+	mutex_lock(&ep->items_lock);
+
+	list_add_tail(&epi->itemlink, &ep->items_list);
+	list_add_tail(&epi->fllink, &file->f_ep_links);
+
+	/* Hook into the file's waitqs and pick up whatever is already ready */
+	init_poll_funcptr(&epq.pt, ep_ptable_queue_proc);
+	epq.epi = epi;
+	revents = ep_item_poll(epi, &epq.pt);
+
+	if (epi->nwait < 0) {
+		ep_remove(ep, epi);
+		mutex_unlock(&ep->items_lock);
+		return -ENOMEM;
+	}
+
+	if (revents) {
+		spin_lock_irqsave(&ep->lock, flags);
+		__ep_ready(ep, epi);
+		spin_unlock_irqrestore(&ep->lock, flags);
+	}
+
+	mutex_unlock(&ep->items_lock);
+	return 0;
+}
+
+static int ep_modify(struct eventpoll *ep, struct epitem *epi,
+		     struct epoll_event *event)
+{
+	unsigned int revents;
+	unsigned long flags;
+
+	mutex_lock(&ep->items_lock);
+
+	spin_lock_irqsave(&ep->lock, flags);
+	epi->event = *event;
+	spin_unlock_irqrestore(&ep->lock, flags);
+
+	/* A wakeup may have been missed while the item was disarmed */
+	revents = ep_item_poll(epi, NULL);
+	if (revents) {
+		spin_lock_irqsave(&ep->lock, flags);
+		__ep_ready(ep, epi);
+		spin_unlock_irqrestore(&ep->lock, flags);
+	}
+
+	mutex_unlock(&ep->items_lock);
+	return 0;
+}
+
+/*
+ * Poll queued items until max ready ones are found and gather their
+ * events. Level-triggered items move to *requeue rather than straight
+ * back on the ready list, so one epoll_wait() doesn't report them twice.
+ * Items that turn out to be idle drop off until their next wakeup.
+ */
+static int ep_gather_events(struct eventpoll *ep, struct list_head *requeue,
+			    struct epoll_event *batch, int *fds, int max)
+{
+	struct epitem *epi;
+	unsigned int revents;
+	unsigned long flags;
+	LIST_HEAD(txlist);
+	int nr = 0;
+
+	mutex_lock(&ep->items_lock);
+
+	spin_lock_irqsave(&ep->lock, flags);
+	list_splice_init(&ep->rdllist, &txlist);
+	spin_unlock_irqrestore(&ep->lock, flags);
+
+	while ((nr < max) && !list_empty(&txlist)) {
+		epi = list_first_entry(&txlist, struct epitem, rdllink);
+
+		spin_lock_irqsave(&ep->lock, flags);
+		list_del_init(&epi->rdllink);
+		spin_unlock_irqrestore(&ep->lock, flags);
+
+		revents = ep_item_poll(epi, NULL);
+		if (!revents)
+			continue;
+
+		batch[nr].events = revents;
+		batch[nr].data   = epi->event.data;
+		fds[nr]          = epi->fd;
+		nr++;
+
+		spin_lock_irqsave(&ep->lock, flags);
+		if (epi->event.events & EPOLLONESHOT)
+			epi->event.events &= EP_PRIVATE_BITS;
+		else if (!(epi->event.events & EPOLLET) &&
+			 list_empty(&epi->rdllink))
+			list_add_tail(&epi->rdllink, requeue);
+		spin_unlock_irqrestore(&ep->lock, flags);
+	}
+
+	/* Whatever wasn't looked at stays queued, ahead of new arrivals */
+	spin_lock_irqsave(&ep->lock, flags);
+	list_splice(&txlist, &ep->rdllist);
+	spin_unlock_irqrestore(&ep->lock, flags);
+
+	mutex_unlock(&ep->items_lock);
+	return nr;
+}
+
+/* Queue the items of events that could not be copied out again */
+static void ep_requeue_fds(struct eventpoll *ep, int *fds, int nr)
+{
+	struct epitem *epi;
+	unsigned long flags;
+	int i;
+
+	mutex_lock(&ep_files_lock);
+	for (i = 0; i < nr; i++) {
+		/* Gone meanwhile, or a new item for a reused fd: harmless */
+		epi = radix_tree_lookup(&ep->items, fds[i]);
+		if (!epi)
+			continue;
+
+		spin_lock_irqsave(&ep->lock, flags);
+		__ep_ready(ep, epi);
+		spin_unlock_irqrestore(&ep->lock, flags);
+	}
+	mutex_unlock(&ep_files_lock);
+}
+
+/*
+ * Report up to maxevents ready items. Events are gathered a batch at a
+ * time with the items locked and copied to user space without the lock.
+ */
+static int ep_send_events(struct eventpoll *ep,
+			  struct epoll_event __user *events, int maxevents)
+{
+	struct epoll_event batch[EP_SEND_BATCH];
+	int fds[EP_SEND_BATCH];
+	unsigned long flags;
+	LIST_HEAD(requeue);
+	int count = 0;
+	int want, nr, i;
+
+	while (count < maxevents) {
+		want = min(maxevents - count, EP_SEND_BATCH);
+		nr   = ep_gather_events(ep, &requeue, batch, fds, want);
+
+		for (i = 0; i < nr; i++) {
+			if (__put_user(batch[i].events, &events[count].events) ||
+			    __put_user(batch[i].data, &events[count].data)) {
+				ep_requeue_fds(ep, &fds[i], nr - i);
+				if (!count)
+					count = -EFAULT;
+				goto out;
+			}
+			count++;
+		}
+
+		if (nr < want)
+			break;
+	}
+
+out:
+	/* Level-triggered items stay ready until a poll finds them idle */
+	spin_lock_irqsave(&ep->lock, flags);
+	while (!list_empty(&requeue)) {
+		struct epitem *epi = list_first_entry(&requeue, struct epitem,
+						      rdllink);
+
+		list_del_init(&epi->rdllink);
+		__ep_ready(ep, epi);
+	}
+	spin_unlock_irqrestore(&ep->lock, flags);
+
+	return count;
+}
+
+static bool ep_events_available(struct eventpoll *ep)
+{
+	unsigned long flags;
+	bool avail;
+
+	spin_lock_irqsave(&ep->lock, flags);
+	avail = !list_empty(&ep->rdllist);
+	spin_unlock_irqrestore(&ep->lock, flags);
+
+	return avail;
+}
+
+static int ep_poll(struct eventpoll *ep, struct epoll_event __user *events,
+		   int maxevents, int timeout)
+{
+	DECLARE_WAITQ_ENTRY(wait, current);
+	ktime_t deadline = 0, now;
+	int count;
+
+	if (timeout > 0)
+		deadline = get_time() + (ktime_t)timeout * NSEC_PER_MSEC;
+
+	for (;;) {
+		if (ep_events_available(ep)) {
+			count = ep_send_events(ep, events, maxevents);
+			if (count)
+				return count;
+		}
+
+		if (timeout == 0)
+			return 0;
+		if (signal_pending(current))
+			return -EINTR;
+
+		waitq_prepare_to_wait(&ep->wq, &wait, TASK_INTERRUPTIBLE);
+		if (!ep_events_available(ep) && !signal_pending(current)) {
+			if (timeout < 0) {
+				schedule();
+			} else {
+				now = get_time();
+				if (now < deadline)
+					schedule_timeout(deadline - now);
+			}
+		}
+		waitq_finish_wait(&ep->wq, &wait);
+
+		if ((timeout > 0) && (get_time() >= deadline) &&
+		    !ep_events_available(ep))
+			return 0;
+	}
+}
+
+static unsigned int ep_eventpoll_poll(struct file *file, poll_table *wait)
+{
+	struct eventpoll *ep = file->private_data;
+
+	poll_wait(file, &ep->poll_wait, wait);
+
+	/* Queued items are only likely to be ready, this may be spurious */
+	return ep_events_available(ep) ? (POLLIN | POLLRDNORM) : 0;
+}
+
+static void ep_free(struct eventpoll *ep)
+{
+	struct epitem *epi, *tmp;
+
+	mutex_lock(&ep_files_lock);
+	mutex_lock(&ep->items_lock);
+	list_for_each_entry_safe(epi, tmp, &ep->items_list, itemlink)
+		ep_remove(ep, epi);
+	mutex_unlock(&ep->items_lock);
+	mutex_unlock(&ep_files_lock);
+
+	kmem_free(ep);
+}
+
+static int ep_close(struct file *file)
+{
+	ep_free(file->private_data);
+	return 0;
+}
+
+static int ep_release(struct inode *inode, struct file *file)
+{
+	ep_free(file->private_data);
+	return 0;
+}
+
+static struct kfs_fops eventpoll_fops = {
+	.poll = ep_eventpoll_poll,
+	.close = ep_close,
+	.release = ep_release,
+};
+
+void eventpoll_release_file(struct file *file)
+{
+	struct epitem *epi;
+	struct eventpoll *ep;
+
+	mutex_lock(&ep_files_lock);
+	while (!list_empty(&file->f_ep_links)) {
+		epi = list_first_entry(&file->f_ep_links, struct epitem, fllink);
+		ep  = epi->ep;
+
+		mutex_lock(&ep->items_lock);
+		ep_remove(ep, epi);
+		mutex_unlock(&ep->items_lock);
+	}
+	mutex_unlock(&ep_files_lock);
+}
+
+int eventpoll_create(int flags)
+{
+	struct eventpoll *ep;
+	struct file *file;
+	int fd;
+
+	/* There is no exec, so EPOLL_CLOEXEC has nothing to do */
+	if (flags & ~EPOLL_CLOEXEC)
+		return -EINVAL;
+
+	ep = kmem_alloc(sizeof(struct eventpoll));
+	if (!ep)
+		return -ENOMEM;
+
+	spin_lock_init(&ep->lock);
+	list_head_init(&ep->rdllist);
+	waitq_init(&ep->wq);
+	waitq_init(&ep->poll_wait);
+	mutex_init(&ep->items_lock);
+	INIT_RADIX_TREE(&ep->items, 0);
+	list_head_init(&ep->items_list);
+
+	fd = kfs_open_anon(&eventpoll_fops, ep);
+	if (fd < 0) {
+		kmem_free(ep);
+		return fd;
+	}
+
+	/* Another thread may have closed it already */
+	file = fdTableGetFile(current->fdTable, fd);
+	if (file) {
+		file->f_flags = O_RDWR;
+		kfs_put_file(file);
+	}
+
+	return fd;
+}
+
+int eventpoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+	struct file *file, *tfile;
+	struct eventpoll *ep;
+	struct epitem *epi;
+	int status;
+
+	file = fdTableGetFile(current->fdTable, epfd);
+	if (!file)
+		return -EBADF;
+
+	tfile = fdTableGetFile(current->fdTable, fd);
+	if (!tfile) {
+		kfs_put_file(file);
+		return -EBADF;
+	}
+
+	status = -EINVAL;
+	if (!is_file_epoll(file) || (file == tfile))
+		goto out;
+
+	/* Nested sets would need loop detection on every wakeup */
+	if (is_file_epoll(tfile))
+		goto out;
+
+	status = -EPERM;
+	if (!tfile->f_op || !tfile->f_op->poll)
+		goto out;
+
+	/* Errors and hangups are always reported */
+	if (event)
+		event->events |= POLLERR | POLLHUP;
+
+	ep = file->private_data;
+
+	mutex_lock(&ep_files_lock);
+
+	/* fd was closed and reused while a dup() kept the old file alive */
+	epi = radix_tree_lookup(&ep->items, fd);
+	if (epi && (epi->file != tfile)) {
+		status = (op == EPOLL_CTL_ADD) ? -EEXIST : -ENOENT;
+		goto out_unlock;
+	}
+
+	switch (op) {
+	case EPOLL_CTL_ADD:
+		status = epi ? -EEXIST : ep_insert(ep, event, tfile, fd);
+		break;
+	case EPOLL_CTL_DEL:
+		status = -ENOENT;
+		if (epi) {
+			mutex_lock(&ep->items_lock);
+			ep_remove(ep, epi);
+			mutex_unlock(&ep->items_lock);
+			status = 0;
+		}
+		break;
+	case EPOLL_CTL_MOD:
+		status = epi ? ep_modify(ep, epi, event) : -ENOENT;
+		break;
+	default:
+		status = -EINVAL;
+	}
+
+out_unlock:
+	mutex_unlock(&ep_files_lock);
+out:
+	kfs_put_file(tfile);
+	kfs_put_file(file);
+	return status;
+}
+
+int eventpoll_wait(int epfd, struct epoll_event __user *events,
+		   int maxevents, int timeout)
+{
+	struct file *file;
+	int status;
+
+	if ((maxevents <= 0) || (maxevents > EP_MAX_EVENTS))
+		return -EINVAL;
+
+	/* Events are stored with __put_user() */
+	if (!access_ok(VERIFY_WRITE, events,
+		       maxevents * sizeof(struct epoll_event)))
+		return -EFAULT;
+
+	file = fdTableGetFile(current->fdTable, epfd);
+	if (!file)
+		return -EBADF;
+
+	if (is_file_epoll(file))
+		status = ep_poll(file->private_data, events, maxevents, timeout);
+	else
+		status = -EINVAL;
+
+	kfs_put_file(file);
+	return status;
+}
@@ -1,29 +1,286 @@
 #include <lwk/kfs.h>
+#include <lwk/eventpoll.h>
+#include <lwk/bitops.h>
+#include <lwk/log2.h>
 
 //#define dbg _KDBG
 #define dbg(fmt,args...)
 
-void fdTableClose( struct fdTable* tbl )
+static struct fdArray* fdArrayAlloc( unsigned int max_fds )
+{
+	struct fdArray* fds;
+
+	/* kmem_alloc() returns zeroed memory, so every fd starts out free */
+	fds = kmem_alloc( sizeof( struct fdArray ) +
+			  max_fds * sizeof( struct file* ) +
+			  BITS_TO_LONGS( max_fds ) * sizeof( unsigned long ) );
+	if ( !fds )
+		return NULL;
+
+	fds->max_fds  = max_fds;
+	fds->files    = (struct file**)( fds + 1 );
+	fds->open_fds = (unsigned long*)( fds->files + max_fds );
+	return fds;
+}
+
+struct fdTable* fdTableAlloc( void )
+{
+	struct fdTable* tbl = kmem_alloc( sizeof( struct fdTable ) );
+
+	if ( !tbl )
+		return NULL;
+
+	tbl->fds_init.max_fds  = NR_OPEN_DEFAULT;
+	tbl->fds_init.files    = tbl->files_init;
+	tbl->fds_init.open_fds = tbl->open_fds_init;
+	tbl->fds = &tbl->fds_init;
+
+	tbl->ref_count = 1;
+	spin_lock_init( &tbl->lock );
+	return tbl;
+}
+
+void fdTableFree( struct fdTable* tbl )
 {
+	struct fdArray *fds, *retired;
+	int ref_count;
+
 	spin_lock( &tbl->lock );
-	dbg("\n");
-	int i;
-	for ( i = 0; i < MAX_FILES; i++ ) {
-		struct file* file =  tbl->files[i];
+	ref_count = --tbl->ref_count;
+	//_KDBG("ref_count=%d\n",tbl->ref_count);
+	spin_unlock( &tbl->lock );
+
+	if ( ref_count )
+		return;
+
+	/* The last user is gone, nobody can still be looking at old arrays */
+	for ( fds = tbl->fds; fds != &tbl->fds_init; fds = retired ) {
+		retired = fds->retired;
+		kmem_free( fds );
+	}
+	kmem_free( tbl );
+}
+
+/*
+ * Make room for `fd` in the table. Called and returns with tbl->lock held,
+ * but drops it around the allocation. Returns 0 if fd already fit, 1 if
+ * tbl->fds changed and the caller has to look again, or a negative errno.
+ */
+static int fdTableExpand( struct fdTable* tbl, unsigned int fd )
+{
+	struct fdArray *old = tbl->fds, *new;
+
+	if ( fd < old->max_fds )
+		return 0;
+	if ( fd >= MAX_FILES )
+		return -EMFILE;
+
+	spin_unlock( &tbl->lock );
+	new = fdArrayAlloc( roundup_pow_of_two( fd + 1 ) );
+	spin_lock( &tbl->lock );
+
+	if ( !new )
+		return -ENOMEM;
+
+	/* Somebody else grew the table while the lock was dropped */
+	if ( tbl->fds != old ) {
+		kmem_free( new );
+		return 1;
+	}
+
+	dbg("max_fds %u -> %u\n", old->max_fds, new->max_fds);
+
+	memcpy( new->files, old->files,
+		old->max_fds * sizeof( struct file* ) );
+	memcpy( new->open_fds, old->open_fds,
+		BITS_TO_LONGS( old->max_fds ) * sizeof( unsigned long ) );
+
+	/*
+	 * Lock-free readers may still be using the old array, and without
+	 * RCU there is no way to tell when they are done. Keep it until the
+	 * table is freed; the doubling bounds the waste by the current size.
+	 */
+	new->retired = old;
+
+	/* The copy must be visible before the array is */
+	smp_wmb();
+	tbl->fds = new;
+	return 1;
+}
+
+static void __fdTableClearFd( struct fdTable* tbl, struct fdArray* fds, int fd )
+{
+	fds->files[ fd ] = NULL;
+	__clear_bit( fd, fds->open_fds );
+	if ( fd < tbl->next_fd )
+		tbl->next_fd = fd;
+}
+
+/*
+ * Reserve the lowest free fd. The slot reads as empty until
+ * fdTableInstallFd() fills it in or releases it with a NULL file.
+ */
+int fdTableGetUnused( struct fdTable* tbl )
+{
+	struct fdArray* fds;
+	unsigned int fd;
+	int err;
+
+	spin_lock( &tbl->lock );
+	do {
+		fds = tbl->fds;
+		fd  = find_next_zero_bit( fds->open_fds, fds->max_fds,
+					  tbl->next_fd );
+	} while ( ( err = fdTableExpand( tbl, fd ) ) > 0 );
+
+	if ( err == 0 ) {
+		__set_bit( fd, fds->open_fds );
+		tbl->next_fd = fd + 1;
+	}
+	//_KDBG("fd=%d\n", fd );
+	spin_unlock( &tbl->lock );
+
+	return err ? err : fd;
+}
+
+void fdTableInstallFd( struct fdTable* tbl, int fd, struct file* file )
+{
+	struct fdArray* fds;
+
+	spin_lock( &tbl->lock );
+	fds = tbl->fds;
+	//_KDBG("fd=%d new=%p old=%p\n",fd,file,fds->files[fd]);
+	if ( fd >= 0 && fd < fds->max_fds ) {
 		if ( file ) {
-			dbg("fd=%d file=%p f_count=%d\n", i, file, 
-				atomic_read( &file->f_count) );
-
-	        	if ( atomic_dec_and_test( &file->f_count ) ) {
-                		if ( file->f_op->release ) {
-                        		dbg( "release %p\n",
-							file->f_op->release );
-                        		file->f_op->release( file->inode, file);
-				}
-                	}
+			__set_bit( fd, fds->open_fds );
+
+			/* Publish the file only once it is fully set up */
+			smp_wmb();
+			fds->files[ fd ] = file;
+		} else {
+			__fdTableClearFd( tbl, fds, fd );
+		}
+	}
+	spin_unlock( &tbl->lock );
+}
+
+/*
+ * Put `file` in slot `fd`, growing the table if needed. The file that was
+ * there, if any, is handed back in *old with the table's reference.
+ */
+int fdTableReplaceFd( struct fdTable* tbl, int fd, struct file* file,
+		      struct file** old )
+{
+	struct fdArray* fds;
+	int err;
+
+	if ( fd < 0 || fd >= MAX_FILES )
+		return -EBADF;
+
+	spin_lock( &tbl->lock );
+	while ( ( err = fdTableExpand( tbl, fd ) ) > 0 )
+		;
+
+	if ( err == 0 ) {
+		fds  = tbl->fds;
+		*old = fds->files[ fd ];
+
+		/* Reserved by an open that has not installed its file yet */
+		if ( !*old && test_bit( fd, fds->open_fds ) ) {
+			err = -EBUSY;
+		} else {
+			__set_bit( fd, fds->open_fds );
+			smp_wmb();
+			fds->files[ fd ] = file;
+		}
+	}
+	spin_unlock( &tbl->lock );
+
+	return err;
+}
+
+/*
+ * Detach the file in slot `fd` and hand back the table's reference to it.
+ * A reserved but not yet installed fd is left alone.
+ */
+struct file* fdTableRemoveFd( struct fdTable* tbl, int fd )
+{
+	struct fdArray* fds;
+	struct file* file = NULL;
+
+	spin_lock( &tbl->lock );
+	fds = tbl->fds;
+	if ( fd >= 0 && fd < fds->max_fds && ( file = fds->files[ fd ] ) )
+		__fdTableClearFd( tbl, fds, fd );
+	spin_unlock( &tbl->lock );
+
+	return file;
+}
+
+/*
+ * Lock-free lookup that takes a reference, so the file stays usable even
+ * if another task sharing the table closes `fd` meanwhile. Drop it with
+ * kfs_put_file().
+ *
+ * struct files are never returned to kmem (see kfs_alloc_file()), so
+ * bumping f_count on one that is being freed is harmless; it fails once
+ * the count has hit zero, and a file recycled into a different slot is
+ * caught by checking that `fd` still maps to it.
+ */
+struct file* fdTableGetFile( struct fdTable* tbl, int fd )
+{
+	struct file* file;
+
+	while ( ( file = fdTableFile( tbl, fd ) ) ) {
+		if ( !atomic_inc_not_zero( &file->f_count ) )
+			continue;
+
+		if ( file == fdTableFile( tbl, fd ) )
+			return file;
+
+		kfs_put_file( file );
+	}
+
+	return NULL;
+}
+
+void fdTableClose( struct fdTable* tbl )
+{
+	struct fdArray* fds;
+	struct file* file;
+	int i = 0;
+
+	dbg("\n");
+	while ( 1 ) {
+		spin_lock( &tbl->lock );
+		fds = tbl->fds;
+		while ( i < fds->max_fds && !fds->files[ i ] )
+			i++;
+		if ( i >= fds->max_fds ) {
+			spin_unlock( &tbl->lock );
+			break;
+		}
+
+		file = fds->files[ i ];
+		dbg("fd=%d file=%p f_count=%d\n", i, file,
+			atomic_read( &file->f_count) );
+
+		__fdTableClearFd( tbl, fds, i );
+		spin_unlock( &tbl->lock );
+
+		/*
+		 * Release may sleep (block device write-back, sockets and
+		 * FIFOs waking their peers), so it runs without the lock.
+		 * Files shared through dup() are only torn down once.
+		 */
+		if ( atomic_dec_and_test( &file->f_count ) ) {
+			eventpoll_release( file );
+			if ( file->f_op && file->f_op->release ) {
+				dbg( "release %p\n", file->f_op->release );
+				file->f_op->release( file->inode, file);
+			}
 			kfs_close( file );
-        	}
+		}
 	}
 	dbg("\n");
-	spin_unlock( &tbl->lock );
 }
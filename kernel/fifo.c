@@ -1,4 +1,3 @@
-
 #include <lwk/kernel.h>
 #include <lwk/poll.h>
 #include <arch/uaccess.h>
@@ -6,204 +5,645 @@
 #include <lwk/sched.h>
 #include <arch/unistd.h>
 #include <lwk/spinlock.h>
-
-#define FIFO_SIZE               PAGE_SIZE
+#include <lwk/mutex.h>
+#include <lwk/log2.h>
+#include <lwk/aspace.h>
+#include <lwk/fifo.h>
+#include <lwk/uio.h>
+#include <arch-generic/fcntl.h>
 
 //#define dbg _KDBG
 #define dbg(fmt,args...)
 
-struct fifo_buffer {
-	unsigned char *buf;
-	unsigned int rIndex, wIndex, avail, length;
-	spinlock_t	lock;
+/*
+ * FIFOs and pipes are a power-of-two ring with free-running head/tail
+ * indices. Only writers advance head and only readers advance tail, so
+ * the two sides never share a lock on the data path: writers are
+ * serialized among themselves by write_mutex, readers by read_mutex, and
+ * each transfer is at most two contiguous copies.
+ *
+ * A reader that blocks on an empty FIFO posts its buffer as a direct
+ * read. The next writer copies straight into that buffer instead of
+ * going through the ring, so large transfers cost one copy instead of two.
+ */
+
+struct fifo_direct {
+	id_t		aspace_id;	/* reader's address space */
+	uaddr_t		ubuf;
+	size_t		len;
+	size_t		done;		/* bytes delivered by the writer */
+	bool		claimed;	/* writer is copying into ubuf */
+	bool		complete;	/* writer is finished with ubuf */
 };
 
 struct fifo_file {
 	waitq_t	poll_wait;
 	struct fifo_file*	other;
-	struct fifo_buffer*	buffer;
+	struct fifo*		fifo;
 };
 
-struct fifo_inode_priv {
-	struct fifo_buffer*	buffer;
-	struct fifo_file*	read;
-	struct fifo_file*	write;
+struct fifo {
+	unsigned char *		buf;
+	unsigned int		size;		/* power of 2, multiple of PAGE_SIZE */
+	volatile unsigned int	head;		/* advanced by writers only */
+	volatile unsigned int	tail;		/* advanced by readers only */
+
+	struct mutex		write_mutex;
+	struct mutex		read_mutex;
+
+	/* Protects the fields below, never held across a copy */
+	spinlock_t		lock;
+	int			readers, writers;
+	int			r_counter, w_counter;	/* total opens of each end */
+	bool			anon;		/* pipe(), freed when both ends close */
+	struct fifo_direct *	direct;		/* reader waiting for a direct write */
+
+	struct fifo_file	read;
+	struct fifo_file	write;
 };
 
-static int buf_write( struct fifo_buffer* pbuf,
-				const char __user *ubuf, size_t size )
+static inline unsigned int fifo_used( struct fifo* fifo )
 {
-	spin_lock( &pbuf->lock );
-	int num = size > ( pbuf->length - pbuf->avail ) ? 
-			( pbuf->length - pbuf->avail ) : size; 
-	int i = 0;
+	return fifo->head - fifo->tail;
+}
 
-	while ( i++ < num ) {
-       		if ( copy_from_user( pbuf->buf + pbuf->wIndex++, ubuf++, 1 ) ) {
-			spin_unlock( &pbuf->lock );
-               		return -EFAULT;
-		}
-		if ( pbuf->wIndex == pbuf->length ) {
-			pbuf->wIndex = 0;
-		} 
-	}
-	pbuf->avail += num;
-	spin_unlock( &pbuf->lock );
+static inline bool fifo_eof( struct fifo* fifo )
+{
+	return ( fifo->writers == 0 ) && ( fifo->w_counter > 0 );
+}
+
+static inline bool fifo_broken( struct fifo* fifo )
+{
+	return ( fifo->readers == 0 ) && ( fifo->r_counter > 0 );
+}
+
+static unsigned char* fifo_alloc_ring( unsigned int size )
+{
+	return kmem_get_pages( ilog2( size >> PAGE_SHIFT ) );
+}
+
+static void fifo_free_ring( unsigned char* buf, unsigned int size )
+{
+	kmem_free_pages( buf, ilog2( size >> PAGE_SHIFT ) );
+}
+
+static int buf_write( struct fifo* fifo,
+				const char __user *ubuf, size_t size )
+{
+	unsigned int head = fifo->head;
+	unsigned int offset, first;
+	size_t num;
+
+	/* Pairs with the barrier after the reader's copy out */
+	smp_mb();
+	num = min( size, (size_t)( fifo->size - ( head - fifo->tail ) ) );
+	if ( num == 0 )
+		return 0;
+
+	offset = head & ( fifo->size - 1 );
+	first  = min( num, (size_t)( fifo->size - offset ) );
+
+	if ( copy_from_user( fifo->buf + offset, ubuf, first ) )
+		return -EFAULT;
+	if ( ( num > first ) &&
+	     copy_from_user( fifo->buf, ubuf + first, num - first ) )
+		return -EFAULT;
+
+	/* Publish the data before the new head */
+	smp_wmb();
+	fifo->head = head + num;
 	return num;
 }
 
-static int buf_read( struct fifo_buffer* pbuf, char __user *ubuf, size_t size )
+static int buf_read( struct fifo* fifo, char __user *ubuf, size_t size )
 {
-	spin_lock( &pbuf->lock );
-	int num = size > pbuf->avail ? pbuf->avail : size; 
-	int i = 0;
+	unsigned int tail = fifo->tail;
+	unsigned int offset, first;
+	size_t num;
 
-	while ( i++ < num ) {
-       		if ( copy_to_user( ubuf++, pbuf->buf + pbuf->rIndex++, 1 ) ) {
-			spin_unlock( &pbuf->lock );
-               		return -EFAULT;
-		}
-		if ( pbuf->rIndex == pbuf->length ) {
-			pbuf->rIndex = 0;
-		} 
-	}
-	pbuf->avail -= num;
-	spin_unlock( &pbuf->lock );
+	num = min( size, (size_t)( fifo->head - tail ) );
+	if ( num == 0 )
+		return 0;
+
+	/* Read the data only after seeing the head that covers it */
+	smp_rmb();
+
+	offset = tail & ( fifo->size - 1 );
+	first  = min( num, (size_t)( fifo->size - offset ) );
+
+	if ( copy_to_user( ubuf, fifo->buf + offset, first ) )
+		return -EFAULT;
+	if ( ( num > first ) &&
+	     copy_to_user( ubuf + first, fifo->buf, num - first ) )
+		return -EFAULT;
+
+	/* Finish reading before the writer may reuse the space */
+	smp_mb();
+	fifo->tail = tail + num;
 	return num;
 }
 
-static struct fifo_buffer* alloc_fifo_buffer( int length ) 
+/*
+ * Direct writes: the reader's buffer lives in another address space, so
+ * translate it to physical extents and copy into those through the
+ * kernel's mapping of physical memory. Reader buffers are pinned in the
+ * sense that matters here: the reader is blocked in read() until the
+ * writer marks the request complete.
+ */
+#define FIFO_DIRECT_EXTENTS	16
+
+struct fifo_extents {
+	unsigned int	nr;
+	size_t		bytes;
+	struct {
+		paddr_t	paddr;
+		size_t	size;
+	} ext[FIFO_DIRECT_EXTENTS];
+};
+
+static int fifo_add_extent( paddr_t paddr, size_t size, void* priv )
+{
+	struct fifo_extents* exts = priv;
+
+	if ( exts->nr == FIFO_DIRECT_EXTENTS )
+		return 1;
+
+	exts->ext[exts->nr].paddr = paddr;
+	exts->ext[exts->nr].size  = size;
+	exts->nr++;
+	exts->bytes += size;
+	return 0;
+}
+
+static ssize_t direct_write( struct fifo_direct* d,
+				const char __user *ubuf, size_t size )
 {
-	struct fifo_buffer* pbuf = kmem_alloc(sizeof(struct fifo_buffer));
+	struct fifo_extents exts;
+	size_t done = 0;
+	unsigned int i;
+	int status;
+
+	size = min( size, d->len );
+
+	while ( done < size ) {
+		exts.nr    = 0;
+		exts.bytes = 0;
+
+		/* A positive status only means the extent array filled up.
+		 * A buffer the reader may not write to is left to the ring,
+		 * whose copy_to_user() faults in the reader's context. */
+		status = aspace_virt_to_phys_range_flags( d->aspace_id,
+				d->ubuf + done, size - done, VM_WRITE,
+				fifo_add_extent, &exts );
+		if ( status < 0 )
+			break;
+
+		for ( i = 0; i < exts.nr; i++ ) {
+			if ( copy_from_user( __va( exts.ext[i].paddr ), ubuf + done,
+					     exts.ext[i].size ) )
+				return done ? done : -EFAULT;
+			done += exts.ext[i].size;
+		}
+	}
 
-	if ( ! pbuf ) return NULL;
+	return done;
+}
 
-	spin_lock_init(&pbuf->lock);
-	pbuf->rIndex = 0;
-	pbuf->wIndex = 0;
-	pbuf->avail = 0;
-	pbuf->length = length;
+/* Hands a blocked reader's buffer to this writer, if the ring is empty */
+static struct fifo_direct* claim_direct( struct fifo* fifo )
+{
+	struct fifo_direct* d = NULL;
+	unsigned long flags;
 
-	if ( ( pbuf->buf = kmem_alloc( length ) ) == NULL ) {
-		kmem_free(pbuf);       
+	if ( ( fifo->direct == NULL ) || fifo_used( fifo ) )
 		return NULL;
+
+	spin_lock_irqsave( &fifo->lock, flags );
+	if ( fifo->direct && !fifo_used( fifo ) ) {
+		d = fifo->direct;
+		d->claimed = true;
+		fifo->direct = NULL;
 	}
-	return pbuf;
+	spin_unlock_irqrestore( &fifo->lock, flags );
+
+	return d;
 }
 
-static void free_fifo_buffer( struct fifo_buffer* buf ) 
+static void complete_direct( struct fifo* fifo, struct fifo_direct* d,
+				size_t done )
 {
-	kmem_free( buf->buf );	
-	kmem_free( buf );
+	unsigned long flags;
+
+	spin_lock_irqsave( &fifo->lock, flags );
+	d->done = done;
+	d->complete = true;
+	spin_unlock_irqrestore( &fifo->lock, flags );
+
+	// several readers may be asleep, make sure the owner of d wakes
+	waitq_wakeup( &fifo->read.poll_wait );
+}
+
+/*
+ * Withdraws a direct read. Returns the bytes a writer delivered into it,
+ * waiting for the writer to finish if it already claimed the buffer.
+ */
+static size_t cancel_direct( struct fifo* fifo, struct fifo_direct* d )
+{
+	unsigned long flags;
+	bool claimed;
+
+	spin_lock_irqsave( &fifo->lock, flags );
+	if ( fifo->direct == d )
+		fifo->direct = NULL;
+	claimed = d->claimed;
+	spin_unlock_irqrestore( &fifo->lock, flags );
+
+	if ( claimed )
+		wait_event( fifo->read.poll_wait, d->complete );
+
+	return d->done;
 }
 
 static ssize_t
 read(struct file *filep, char __user *ubuf, size_t size, loff_t* off )
 {
 	struct fifo_file *file = filep->private_data;
-	struct fifo_buffer* pbuf = file->buffer;   
-	int num_read = 0;
+	struct fifo* fifo = file->fifo;
+	struct fifo_direct d;
+	unsigned long flags;
+	ssize_t num_read = 0;
+	int ret;
 
 	//dbg("id=%d size=%ld\n",current->id,size);
 
+	if ( size == 0 )
+		return 0;
+
+	if ( !access_ok( VERIFY_WRITE, ubuf, size ) )
+		return -EFAULT;
+
+	mutex_lock( &fifo->read_mutex );
+
 	while(1) {
-		int ret = buf_read( pbuf, ubuf, size );
+		ret = buf_read( fifo, ubuf + num_read, size - num_read );
 
-		if ( ret < 0 ) return ret;
+		if ( ret < 0 ) {
+			if ( num_read == 0 ) num_read = ret;
+			break;
+		}
 
 		num_read += ret;
-		size -= ret;
 
 		// we just freed up buffer space, wake the writer
-		waitq_wake_nr( &file->other->poll_wait, 1 );
+		if ( ret )
+			waitq_wake_nr( &file->other->poll_wait, 1 );
+
+		/* Like a pipe, return whatever is there once we have something */
+		if ( num_read ) break;
+
+		if ( fifo_eof( fifo ) ) break;
+
+		if ( filep->f_flags & O_NONBLOCK ) {
+			num_read = -EAGAIN;
+			break;
+		}
+
+		/* Nothing buffered: offer our buffer to the next writer,
+		 * unless another reader already has */
+		memset( &d, 0, sizeof( d ) );
+		d.aspace_id = current->aspace->id;
+		d.ubuf      = (uaddr_t)ubuf;
+		d.len       = size;
+
+		spin_lock_irqsave( &fifo->lock, flags );
+		if ( fifo->direct == NULL )
+			fifo->direct = &d;
+		spin_unlock_irqrestore( &fifo->lock, flags );
+
+		/* Don't hold off other readers or a resize while asleep */
+		mutex_unlock( &fifo->read_mutex );
+
+		ret = wait_event_interruptible( file->poll_wait,
+				d.complete || fifo_used( fifo ) || fifo_eof( fifo ) );
+
+		num_read = cancel_direct( fifo, &d );
+
+		mutex_lock( &fifo->read_mutex );
+
+		if ( num_read ) {
+			waitq_wake_nr( &file->other->poll_wait, 1 );
+			break;
+		}
+
+		if ( ret ) {
+			num_read = -EINTR;
+			break;
+		}
+	}
+
+	mutex_unlock( &fifo->read_mutex );
+	return num_read;
+}
+
+/*
+ * Writes one buffer with write_mutex held. Ring writes only note in *wake
+ * that the reader needs waking, which happens before this sleeps and
+ * otherwise once the caller is done, so a writev() wakes it just once.
+ */
+static ssize_t
+write_locked(struct file *filep, const char __user *ubuf, size_t size,
+		bool *wake )
+{
+	struct fifo_file *file = filep->private_data;
+	struct fifo* fifo = file->fifo;
+	struct fifo_direct* d;
+	ssize_t num_wrote = 0;
+	ssize_t ret;
+
+	while( num_wrote < size ) {
+		if ( fifo_broken( fifo ) ) {
+			if ( num_wrote == 0 ) num_wrote = -EPIPE;
+			break;
+		}
+
+		ret = 0;
+		if ( ( d = claim_direct( fifo ) ) != NULL ) {
+			ret = direct_write( d, ubuf + num_wrote, size - num_wrote );
+			complete_direct( fifo, d, ( ret > 0 ) ? ret : 0 );
+		}
+
+		/* No reader waiting, or its buffer could not be translated */
+		if ( ret == 0 ) {
+			ret = buf_write( fifo, ubuf + num_wrote, size - num_wrote );
+
+			if ( ret > 0 )
+				*wake = true;
+		}
+
+		if ( ret < 0 ) {
+			if ( num_wrote == 0 ) num_wrote = ret;
+			break;
+		}
+
+		num_wrote += ret;
+
+		if ( ( ret > 0 ) || ( num_wrote == size ) )
+			continue;
+
+		if ( filep->f_flags & O_NONBLOCK ) {
+			if ( num_wrote == 0 ) num_wrote = -EAGAIN;
+			break;
+		}
+
+		// the reader has to drain the ring before we can go on
+		if ( *wake ) {
+			waitq_wake_nr( &file->other->poll_wait, 1 );
+			*wake = false;
+		}
 
-		if ( size == 0 ) return num_read;
-		
 		if ( wait_event_interruptible( file->poll_wait,
-							pbuf->avail ) ) {
-			if ( num_read ) return num_read;
-			return -EINTR;
-		} 
+				( fifo_used( fifo ) != fifo->size ) ||
+				fifo->direct || fifo_broken( fifo ) ) ) {
+			if ( num_wrote == 0 ) num_wrote = -EINTR;
+			break;
+		}
 	}
 
+	return num_wrote;
 }
 
 static ssize_t
 write(struct file *filep, const char __user *ubuf, size_t size, loff_t* off )
 {
 	struct fifo_file *file = filep->private_data;
-	struct fifo_buffer* pbuf = file->buffer;   
-	int num_wrote = 0;
+	struct fifo* fifo = file->fifo;
+	bool wake = false;
+	ssize_t num_wrote;
 
 	//dbg("id=%d size=%ld\n",current->id, size);
 
-	while(1) {
-		int ret = buf_write( pbuf, ubuf, size );
+	mutex_lock( &fifo->write_mutex );
+	num_wrote = write_locked( filep, ubuf, size, &wake );
+	mutex_unlock( &fifo->write_mutex );
 
-		if ( ret < 0 ) return ret;
+	// we just wrote to buffer space, wake the reader
+	if ( wake )
+		waitq_wake_nr( &file->other->poll_wait, 1 );
+
+	return num_wrote;
+}
+
+/* All segments go in under one hold of write_mutex, like a single write */
+static ssize_t
+write_iter(struct file *filep, const struct iovec *iov, unsigned long nr,
+		loff_t* off )
+{
+	struct fifo_file *file = filep->private_data;
+	struct fifo* fifo = file->fifo;
+	bool wake = false;
+	ssize_t num_wrote = 0;
+	ssize_t ret;
+	unsigned long i;
+
+	mutex_lock( &fifo->write_mutex );
+
+	for ( i = 0; i < nr; i++ ) {
+		if ( iov[i].iov_len == 0 )
+			continue;
+
+		ret = write_locked( filep, iov[i].iov_base, iov[i].iov_len,
+				    &wake );
+		if ( ret < 0 ) {
+			if ( num_wrote == 0 ) num_wrote = ret;
+			break;
+		}
 
 		num_wrote += ret;
-		size -= ret;
+		if ( ret < iov[i].iov_len )
+			break;
+	}
 
-		// we just wrote to buffer space, wake the reader 
+	mutex_unlock( &fifo->write_mutex );
+
+	if ( wake )
 		waitq_wake_nr( &file->other->poll_wait, 1 );
 
-		if ( size == 0 ) return num_wrote;
-		
-		if ( wait_event_interruptible( file->poll_wait,
-					pbuf->avail != pbuf->length ) ) {
-			if ( num_wrote ) return num_wrote;
-			return -EINTR;
-		} 
+	return num_wrote;
+}
+
+/*
+ * Gathers whatever is buffered into the segments under one hold of
+ * read_mutex. Only if the ring is empty does it block, the way read()
+ * does, on the first non-empty segment.
+ */
+static ssize_t
+read_iter(struct file *filep, const struct iovec *iov, unsigned long nr,
+		loff_t* off )
+{
+	struct fifo_file *file = filep->private_data;
+	struct fifo* fifo = file->fifo;
+	ssize_t num_read = 0;
+	ssize_t ret;
+	unsigned long i;
+
+	mutex_lock( &fifo->read_mutex );
+
+	for ( i = 0; i < nr; i++ ) {
+		ret = buf_read( fifo, iov[i].iov_base, iov[i].iov_len );
+		if ( ret < 0 ) {
+			if ( num_read == 0 ) num_read = ret;
+			break;
+		}
+
+		num_read += ret;
+		if ( ret < iov[i].iov_len )
+			break;
+	}
+
+	mutex_unlock( &fifo->read_mutex );
+
+	if ( num_read > 0 ) {
+		// we just freed up buffer space, wake the writer
+		waitq_wake_nr( &file->other->poll_wait, 1 );
+		return num_read;
 	}
+
+	if ( num_read < 0 )
+		return num_read;
+
+	for ( i = 0; ( i < nr ) && ( iov[i].iov_len == 0 ); i++ )
+		;
+
+	return ( i < nr ) ? read( filep, iov[i].iov_base, iov[i].iov_len, off )
+			  : 0;
 }
 
 static unsigned int poll(struct file *filep, struct poll_table_struct *table)
 {
 	struct fifo_file *pfile = filep->private_data;
+	struct fifo* fifo = pfile->fifo;
 	unsigned int mask = 0;
 
-	//unsigned int key = 0;
-	//if ( table ) key = table->key;
-	//dbg("wait table=%p %d %d want events %#x\n",  table,
-	//	pfile->buffer->avail, pfile->buffer->length, key );
-	
 	poll_wait(filep, &pfile->poll_wait, table);
 
-	if ( pfile->buffer->avail )  {
-		mask |= POLLIN; 
-		mask |= POLLRDNORM; 
+	if ( fifo_used( fifo ) )  {
+		mask |= POLLIN;
+		mask |= POLLRDNORM;
 	}
 
-	if ( pfile->buffer->length - pfile->buffer->avail  )  {
-		mask |= POLLOUT; 
-		mask |= POLLWRNORM; 
+	if ( fifo_used( fifo ) != fifo->size )  {
+		mask |= POLLOUT;
+		mask |= POLLWRNORM;
 	}
 
+	if ( ( pfile == &fifo->read ) && fifo_eof( fifo ) )
+		mask |= POLLHUP;
+
+	if ( ( pfile == &fifo->write ) && fifo_broken( fifo ) )
+		mask |= POLLERR;
+
 //	dbg("mask=%#x\n",mask);
 	return mask;
 }
 
-#define O_RDONLY             00
-#define O_WRONLY             01
+static void fifo_free( struct fifo* fifo )
+{
+	fifo_free_ring( fifo->buf, fifo->size );
+	kmem_free( fifo );
+}
+
+static struct fifo* fifo_alloc( void )
+{
+	struct fifo* fifo = kmem_alloc( sizeof( *fifo ) );
+
+	if ( ! fifo ) return NULL;
+
+	fifo->size = FIFO_SIZE;
+	if ( ( fifo->buf = fifo_alloc_ring( fifo->size ) ) == NULL ) {
+		kmem_free( fifo );
+		return NULL;
+	}
+
+	mutex_init( &fifo->write_mutex );
+	mutex_init( &fifo->read_mutex );
+	spin_lock_init( &fifo->lock );
+
+	fifo->read.fifo = fifo;
+	fifo->write.fifo = fifo;
+	fifo->read.other = &fifo->write;
+	fifo->write.other = &fifo->read;
+
+	waitq_init( &fifo->write.poll_wait );
+	waitq_init( &fifo->read.poll_wait );
+
+	return fifo;
+}
+
+static void fifo_get_end( struct fifo_file* file )
+{
+	struct fifo* fifo = file->fifo;
+	unsigned long flags;
+
+	spin_lock_irqsave( &fifo->lock, flags );
+	if ( file == &fifo->read ) {
+		fifo->readers++;
+		fifo->r_counter++;
+	} else {
+		fifo->writers++;
+		fifo->w_counter++;
+	}
+	spin_unlock_irqrestore( &fifo->lock, flags );
+}
+
+static void fifo_put_end( struct fifo_file* file )
+{
+	struct fifo* fifo = file->fifo;
+	unsigned long flags;
+	bool free;
+
+	spin_lock_irqsave( &fifo->lock, flags );
+	if ( file == &fifo->read )
+		fifo->readers--;
+	else
+		fifo->writers--;
+	free = fifo->anon && !fifo->readers && !fifo->writers;
+	spin_unlock_irqrestore( &fifo->lock, flags );
+
+	if ( free ) {
+		fifo_free( fifo );
+		return;
+	}
+
+	// the other end may be waiting for EOF or EPIPE
+	waitq_wakeup( &file->other->poll_wait );
+}
 
 static int open(struct inode * inodep, struct file * filep)
 {
 	dbg("flags %#x\n",filep->f_flags);
-	struct fifo_inode_priv* priv = inodep->i_private;
-	if ( filep->f_flags == O_RDONLY  ) {
-		filep->private_data = priv->read;
-	} else if ( filep->f_flags == O_WRONLY  ) {
-		filep->private_data = priv->write;
+	struct fifo* fifo = inodep->i_private;
+	if ( ( filep->f_flags & O_ACCMODE ) == O_RDONLY  ) {
+		filep->private_data = &fifo->read;
+	} else if ( ( filep->f_flags & O_ACCMODE ) == O_WRONLY  ) {
+		filep->private_data = &fifo->write;
 	} else {
 		return -EINVAL;
 	}
+	fifo_get_end( filep->private_data );
 	return 0;
 }
 
 static int close(struct file *filep)
 {
 	dbg("\n");
+	fifo_put_end( filep->private_data );
+	return 0;
+}
+
+static int release(struct inode *inodep, struct file *filep)
+{
+	dbg("\n");
+	fifo_put_end( filep->private_data );
 	return 0;
 }
 
@@ -211,49 +651,124 @@ static struct kfs_fops fifo_fops = {
 	.open = open,
 	.write = write,
 	.read = read,
+	.write_iter = write_iter,
+	.read_iter = read_iter,
 	.poll = poll,
 	.close = close,
+	.release = release,
 };
 
+static long fifo_set_size( struct fifo* fifo, unsigned long arg )
+{
+	unsigned char *buf, *old_buf;
+	unsigned int size, old_size, used, offset, first;
+
+	if ( arg > FIFO_MAX_SIZE )
+		return -EPERM;
 
-static int create(struct inode *inode, int mode )
+	size = roundup_pow_of_two( max( arg, (unsigned long)PAGE_SIZE ) );
+
+	if ( ( buf = fifo_alloc_ring( size ) ) == NULL )
+		return -ENOMEM;
+
+	mutex_lock( &fifo->write_mutex );
+	mutex_lock( &fifo->read_mutex );
+
+	used = fifo_used( fifo );
+	if ( used > size ) {
+		mutex_unlock( &fifo->read_mutex );
+		mutex_unlock( &fifo->write_mutex );
+		fifo_free_ring( buf, size );
+		return -EBUSY;
+	}
+
+	/* Move the pending data to the start of the new ring */
+	offset = fifo->tail & ( fifo->size - 1 );
+	first  = min( used, fifo->size - offset );
+	memcpy( buf, fifo->buf + offset, first );
+	memcpy( buf + first, fifo->buf, used - first );
+
+	old_buf  = fifo->buf;
+	old_size = fifo->size;
+
+	fifo->buf  = buf;
+	fifo->size = size;
+	fifo->tail = 0;
+	fifo->head = used;
+
+	mutex_unlock( &fifo->read_mutex );
+	mutex_unlock( &fifo->write_mutex );
+
+	fifo_free_ring( old_buf, old_size );
+
+	// a bigger ring may unblock the writer
+	waitq_wakeup( &fifo->write.poll_wait );
+	return size;
+}
+
+long fifo_fcntl( struct file *filep, unsigned int cmd, unsigned long arg )
 {
-	struct fifo_inode_priv* priv = kmem_alloc( sizeof( *priv ) ); 
-	if ( ! priv ) { 
-		return -1;
+	struct fifo_file *file = filep->private_data;
+
+	if ( filep->f_op != &fifo_fops )
+		return -EBADF;
+
+	switch ( cmd ) {
+	case F_SETPIPE_SZ:
+		return fifo_set_size( file->fifo, arg );
+	case F_GETPIPE_SZ:
+		return file->fifo->size;
+	default:
+		return -EINVAL;
 	}
+}
 
-	dbg("\n");
-	priv->read = kmem_alloc(sizeof(struct fifo_file));
-	if ( ! priv->read  ) return -1;
+int fifo_pipe( int fds[2], int flags )
+{
+	struct fifo* fifo = fifo_alloc();
+	struct file* file;
 
-	priv->write = kmem_alloc(sizeof(struct fifo_file));
-	if ( ! priv->write  ) return -1;
+	if ( ! fifo ) return -ENOMEM;
 
-	priv->write->buffer = alloc_fifo_buffer( FIFO_SIZE );
-	if ( ! priv->write->buffer ) return -1;
+	fifo->anon = true;
+	fifo_get_end( &fifo->read );
+	fifo_get_end( &fifo->write );
 
-	priv->read->buffer = priv->write->buffer; 
+	if ( ( fds[0] = kfs_open_anon( &fifo_fops, &fifo->read ) ) < 0 ) {
+		fifo_free( fifo );
+		return fds[0];
+	}
 
-	priv->read->other = priv->write;
-	priv->write->other = priv->read;
+	if ( ( fds[1] = kfs_open_anon( &fifo_fops, &fifo->write ) ) < 0 ) {
+		fifo_put_end( &fifo->write );
+		file = fdTableRemoveFd( current->fdTable, fds[0] );
+		if ( file )
+			kfs_put_file( file );
+		return fds[1];
+	}
 
-	waitq_init(&priv->write->poll_wait);
-	waitq_init(&priv->read->poll_wait);
+	get_current_file( fds[0] )->f_flags = O_RDONLY | ( flags & O_NONBLOCK );
+	get_current_file( fds[1] )->f_flags = O_WRONLY | ( flags & O_NONBLOCK );
 
-	inode->i_private = priv;
+	return 0;
+}
+
+
+static int create(struct inode *inode, int mode )
+{
+	struct fifo* fifo = fifo_alloc();
+
+	dbg("\n");
+	if ( ! fifo ) return -1;
+
+	inode->i_private = fifo;
         return 0;
 }
 
 static int unlink(struct inode *inode )
 {
         dbg("\n");
-	struct fifo_inode_priv* priv = inode->i_private;
-	free_fifo_buffer( priv->write->buffer );
-
-	kmem_free(priv->write);
-	kmem_free(priv->read);
-	kmem_free(priv);
+	fifo_free( inode->i_private );
         return 0;
 }
 
@@ -268,7 +783,7 @@ int mkfifo( const char* name, mode_t mode )
 	dbg("\n");
 	if ( ! kfs_create( name, &fifo_iops, &fifo_fops, mode, NULL, 0 ) )
 		 return -ENOMEM;
-	
+
 	return 0;
 }
 
@@ -278,6 +793,6 @@ int mkfifo_at(struct inode * root_inode, const char* name, mode_t mode )
 	dbg("\n");
 	if ( ! kfs_create_at(root_inode, name, &fifo_iops, &fifo_fops, mode, NULL, 0 ) )
 		 return -ENOMEM;
-	
+
 	return 0;
 }
@@ -17,8 +17,6 @@
 
 extern struct hio_implementation hio_impl;
 
-static atomic_t hio_calls_pending = ATOMIC_INIT(0);
-
 typedef enum {
 	HIO_IDLE,
 	HIO_PENDING,
@@ -36,9 +34,15 @@ typedef struct {
 	hio_syscall_request_t entries[MAX_OUTSTANDING_SYSCALLS];
 	spinlock_t            lock;
 	uint32_t	      offset;
+	atomic_t	      pending;
 } hio_syscalls_t;
 
-static hio_syscalls_t syscall_ring;
+/* One ring per forwarding channel. A syscall's uniq_id encodes both the
+ * channel and the slot, so returns from the forwarding side find their ring. */
+static hio_syscalls_t syscall_rings[CONFIG_HIO_SYSCALL_CHANNELS];
+
+#define uniq_id_channel(id)	((id) / MAX_OUTSTANDING_SYSCALLS)
+#define uniq_id_slot(id)	((id) % MAX_OUTSTANDING_SYSCALLS)
 
 
 static inline uint32_t
@@ -53,57 +57,71 @@ prev_offset(uint32_t off)
 	return (off == 0) ? MAX_OUTSTANDING_SYSCALLS - 1 : off - 1;
 }
 
+static hio_syscall_request_t *
+syscall_entry(hio_syscall_t    * syscall,
+	      hio_syscalls_t  ** ring)
+{
+	BUG_ON(uniq_id_channel(syscall->uniq_id) >= CONFIG_HIO_SYSCALL_CHANNELS);
+
+	*ring = &(syscall_rings[uniq_id_channel(syscall->uniq_id)]);
+	return &((*ring)->entries[uniq_id_slot(syscall->uniq_id)]);
+}
+
 static int
-enqueue_syscall(hio_syscall_t * syscall)
+enqueue_syscall(uint32_t        channel,
+		hio_syscall_t * syscall)
 {
+	hio_syscalls_t * ring = &(syscall_rings[channel]);
 	unsigned long flags = 0;
 	int start, ret = -EBUSY;
 
-	spin_lock_irqsave(&(syscall_ring.lock), flags);
+	spin_lock_irqsave(&(ring->lock), flags);
 
-	start = syscall_ring.offset;
+	start = ring->offset;
 	do {
-		hio_syscall_request_t * entry = &(syscall_ring.entries[syscall_ring.offset]);
+		hio_syscall_request_t * entry = &(ring->entries[ring->offset]);
 
 		if (entry->state == HIO_IDLE) {
 			entry->state     = HIO_PENDING;
 			entry->syscall   = syscall;
-			syscall->uniq_id = syscall_ring.offset;
+			syscall->uniq_id = (channel * MAX_OUTSTANDING_SYSCALLS) + ring->offset;
 			ret              = 0;
-			atomic_inc(&hio_calls_pending);
+			atomic_inc(&(ring->pending));
 			break;
 		}
 
-		syscall_ring.offset = next_offset(syscall_ring.offset);
-	} while (syscall_ring.offset != start);
+		ring->offset = next_offset(ring->offset);
+	} while (ring->offset != start);
 
-	spin_unlock_irqrestore(&(syscall_ring.lock), flags);
+	spin_unlock_irqrestore(&(ring->lock), flags);
 
 	return ret;
 }
 
 static int
-dequeue_syscall(hio_syscall_t ** syscall)
+dequeue_syscall(uint32_t         channel,
+		hio_syscall_t ** syscall)
 {
+	hio_syscalls_t * ring = &(syscall_rings[channel]);
 	unsigned long flags = 0;
 	int start, ret = -ENOENT;
 
-	spin_lock_irqsave(&(syscall_ring.lock), flags);
+	spin_lock_irqsave(&(ring->lock), flags);
 
-	start = syscall_ring.offset;
+	start = ring->offset;
 	do {
-		hio_syscall_request_t * entry = &(syscall_ring.entries[syscall_ring.offset]);
+		hio_syscall_request_t * entry = &(ring->entries[ring->offset]);
 		if (entry->state == HIO_PENDING) {
 			entry->state   = HIO_PROCESSING;
 			*syscall       = entry->syscall;
 			ret            = 0;
-			atomic_dec(&hio_calls_pending);
+			atomic_dec(&(ring->pending));
 			break;
 		}
-		syscall_ring.offset = prev_offset(syscall_ring.offset);
-	} while (syscall_ring.offset != start);
+		ring->offset = prev_offset(ring->offset);
+	} while (ring->offset != start);
 
-	spin_unlock_irqrestore(&(syscall_ring.lock), flags);
+	spin_unlock_irqrestore(&(ring->lock), flags);
 	
 	return ret;
 }
@@ -112,33 +130,61 @@ void
 hio_cancel_syscall(hio_syscall_t * syscall)
 {
 	unsigned long flags;
+	hio_syscalls_t        * ring;
 	hio_syscall_request_t * entry;
 
-	BUG_ON((syscall->uniq_id < 0) || (syscall->uniq_id > MAX_OUTSTANDING_SYSCALLS));
+	entry = syscall_entry(syscall, &ring);
 
-	spin_lock_irqsave(&(syscall_ring.lock), flags);
+	spin_lock_irqsave(&(ring->lock), flags);
 
-	entry = &(syscall_ring.entries[syscall->uniq_id]);
+	if (entry->state == HIO_PENDING)
+		atomic_dec(&(ring->pending));
 	entry->state = HIO_IDLE;
 
-	spin_unlock_irqrestore(&(syscall_ring.lock), flags);
+	spin_unlock_irqrestore(&(ring->lock), flags);
+}
+
+int
+hio_requeue_syscall(hio_syscall_t * syscall)
+{
+	unsigned long flags;
+	hio_syscalls_t        * ring;
+	hio_syscall_request_t * entry;
+	int status = -EINVAL;
+
+	entry = syscall_entry(syscall, &ring);
+
+	spin_lock_irqsave(&(ring->lock), flags);
+
+	/* Only if the issuer is still waiting on it */
+	if (entry->state == HIO_PROCESSING) {
+		entry->state = HIO_PENDING;
+		atomic_inc(&(ring->pending));
+		status = 0;
+	}
+
+	spin_unlock_irqrestore(&(ring->lock), flags);
+
+	if (status == 0)
+		status = hio_impl.notify_new_syscall(uniq_id_channel(syscall->uniq_id));
+
+	return status;
 }
 
 void
 hio_return_syscall(hio_syscall_t * syscall)
 {
 	unsigned long flags;
+	hio_syscalls_t        * ring;
 	hio_syscall_request_t * entry;
 
-	BUG_ON((syscall->uniq_id < 0) || (syscall->uniq_id > MAX_OUTSTANDING_SYSCALLS));
+	entry = syscall_entry(syscall, &ring);
 
-	spin_lock_irqsave(&(syscall_ring.lock), flags);
-
-	entry = &(syscall_ring.entries[syscall->uniq_id]);
+	spin_lock_irqsave(&(ring->lock), flags);
 
 	/* It could have been canceled by the issuer (e.g, they took a signal) */
 	if (entry->state != HIO_PROCESSING) {
-	    spin_unlock_irqrestore(&(syscall_ring.lock), flags);
+	    spin_unlock_irqrestore(&(ring->lock), flags);
 	    return;
 	}
 
@@ -148,7 +194,7 @@ hio_return_syscall(hio_syscall_t * syscall)
 	entry->syscall->ret_val = syscall->ret_val;
 	entry->state            = HIO_COMPLETE;
 
-	spin_unlock_irqrestore(&(syscall_ring.lock), flags);
+	spin_unlock_irqrestore(&(ring->lock), flags);
 
 	mb();
 	waitq_wakeup(&(entry->waitq));
@@ -158,12 +204,11 @@ static int
 hio_wait_syscall(hio_syscall_t * syscall,
 		 uintptr_t     * ret_val)
 {
+	hio_syscalls_t        * ring;
 	hio_syscall_request_t * entry;
 	int status;
 
-	BUG_ON((syscall->uniq_id < 0) || (syscall->uniq_id > MAX_OUTSTANDING_SYSCALLS));
-
-	entry = &(syscall_ring.entries[syscall->uniq_id]);
+	entry = syscall_entry(syscall, &ring);
 	
 	status = wait_event_interruptible(
 		entry->waitq,
@@ -180,23 +225,37 @@ hio_wait_syscall(hio_syscall_t * syscall,
 	return status;
 }
 
+/* Channel an aspace forwards on: explicit assignment, else spread by rank */
+static uint32_t
+hio_aspace_channel(struct aspace * aspace)
+{
+	if (aspace->hio_channel == HIO_CHANNEL_BY_RANK)
+		return (uint32_t)aspace->rank % HIO_NUM_CHANNELS;
+
+	/* Checked by aspace_update_hio_channel() */
+	return (uint32_t)aspace->hio_channel;
+}
 
 int
-hio_issue_syscall(hio_syscall_t * syscall)
+hio_issue_syscall(uint32_t        channel,
+		  hio_syscall_t * syscall)
 {
 	int status;
 
+	if (channel >= CONFIG_HIO_SYSCALL_CHANNELS)
+		return -EINVAL;
+
 	/* Enqueue the call */
-	status = enqueue_syscall(syscall);
+	status = enqueue_syscall(channel, syscall);
 	if (status != 0) {
-		printk(KERN_ERR "Failed to enqueue HIO syscall (err:%d)\n", status);
+		printk(KERN_ERR "Failed to enqueue HIO syscall on channel %u (err:%d)\n", channel, status);
 		return status;
 	}
 
 	/* Send the notification */
-	status = hio_impl.notify_new_syscall();
+	status = hio_impl.notify_new_syscall(channel);
 	if (status != 0) {
-		printk(KERN_ERR "Failed to issue HIO syscall notification (err:%d)\n", status);
+		printk(KERN_ERR "Failed to issue HIO syscall notification on channel %u (err:%d)\n", channel, status);
 		hio_cancel_syscall(syscall);
 		return status;
 	}
@@ -237,7 +296,7 @@ hio_format_and_exec_syscall(uint32_t syscall_nr,
 	va_end(argp);
 
 	/* Send syscall */
-	status = hio_issue_syscall(syscall);
+	status = hio_issue_syscall(hio_aspace_channel(current->aspace), syscall);
 	if (status) {
 		kmem_free(syscall);
 		return status;
@@ -308,15 +367,22 @@ out:
 }
 
 uint32_t
-hio_get_num_pending_syscalls(void)
+hio_get_num_pending_syscalls(uint32_t channel)
 {
-	return atomic_read(&hio_calls_pending);
+	if (channel >= CONFIG_HIO_SYSCALL_CHANNELS)
+		return 0;
+
+	return atomic_read(&(syscall_rings[channel].pending));
 }
 
 int
-hio_get_pending_syscall(hio_syscall_t ** pending_syscall)
+hio_get_pending_syscall(uint32_t         channel,
+			hio_syscall_t ** pending_syscall)
 {
-	return dequeue_syscall(pending_syscall);
+	if (channel >= CONFIG_HIO_SYSCALL_CHANNELS)
+		return -EINVAL;
+
+	return dequeue_syscall(channel, pending_syscall);
 }
 
 static void
@@ -329,14 +395,19 @@ init_syscall_ring_entry(hio_syscall_request_t * entry)
 static int
 syscall_init(void)
 {
-	uint32_t i;
+	uint32_t i, j;
 
-	memset(&(syscall_ring.entries), 0, sizeof(hio_syscall_request_t) * MAX_OUTSTANDING_SYSCALLS);
-	spin_lock_init(&(syscall_ring.lock));
-	syscall_ring.offset = 0;
+	for (i = 0; i < CONFIG_HIO_SYSCALL_CHANNELS; i++) {
+		hio_syscalls_t * ring = &(syscall_rings[i]);
 
-	for (i = 0; i < MAX_OUTSTANDING_SYSCALLS; i++)
-		init_syscall_ring_entry(&(syscall_ring.entries[i]));
+		memset(&(ring->entries), 0, sizeof(hio_syscall_request_t) * MAX_OUTSTANDING_SYSCALLS);
+		spin_lock_init(&(ring->lock));
+		ring->offset = 0;
+		atomic_set(&(ring->pending), 0);
+
+		for (j = 0; j < MAX_OUTSTANDING_SYSCALLS; j++)
+			init_syscall_ring_entry(&(ring->entries[j]));
+	}
 
 	return 0;
 }
@@ -0,0 +1,412 @@
+/* Per-aspace cache of forwarded HIO metadata results.
+ *
+ * Loaders and interpreters issue huge numbers of stat/access/readlink calls
+ * on the same paths at startup. When an aspace opts in via
+ * aspace_update_hio_cache_policy(), the results of those calls are kept here
+ * and answered locally until they expire (hio_cache_ttl) or a forwarded call
+ * that may change file metadata invalidates them.
+ */
+#include <lwk/kernel.h>
+#include <lwk/task.h>
+#include <lwk/kmem.h>
+#include <lwk/list.h>
+#include <lwk/hash.h>
+#include <lwk/string.h>
+#include <lwk/spinlock.h>
+#include <lwk/time.h>
+#include <lwk/aspace.h>
+#include <lwk/hio.h>
+
+#include <arch/uaccess.h>
+#include <arch/bitops.h>
+#include <arch-generic/fcntl.h>
+
+#define HIO_CACHE_HASH_BITS	10
+#define HIO_CACHE_MAX_ENTRIES	4096
+#define HIO_CACHE_MAX_FD	1024	/* writes to fds above this always invalidate */
+
+struct hio_cache_entry {
+	struct hlist_node	hash_link;
+	struct list_head	lru_link;
+	int			refcnt;		/* lookups copying out of this entry */
+	bool			stale;		/* removed, free when refcnt drops to 0 */
+
+	unsigned long		hash;
+	uint32_t		syscall_nr;
+	int			fd;
+	uintptr_t		arg;
+	char *			path;
+
+	ktime_t			expires;	/* 0 = until invalidated */
+	long			ret_val;
+	size_t			len;
+	char			data[0];	/* len bytes of result, then path */
+};
+
+struct hio_cache {
+	spinlock_t		lock;
+	uint64_t		generation;	/* bumped by every invalidation */
+	unsigned int		nr_entries;
+	struct list_head	lru_list;	/* most recently used first */
+	struct hlist_head	buckets[1 << HIO_CACHE_HASH_BITS];
+	DECLARE_BITMAP(write_fds, HIO_CACHE_MAX_FD);	/* fds opened for writing */
+};
+
+
+static struct hio_cache *
+current_cache(void)
+{
+	return current->aspace->hio_cache;
+}
+
+static struct hio_cache *
+current_cache_enabled(void)
+{
+	if (!(current->aspace->hio_cache_flags & HIO_CACHE_METADATA))
+		return NULL;
+
+	return current->aspace->hio_cache;
+}
+
+static unsigned long
+key_hash(const struct hio_cache_key * key)
+{
+	unsigned long hash = key->syscall_nr;
+	const char * c;
+
+	hash = hash * 31 + (unsigned long)key->fd;
+	hash = hash * 31 + key->arg;
+
+	if (key->path) {
+		for (c = key->path; *c != '\0'; c++)
+			hash = hash * 31 + (unsigned char)*c;
+	}
+
+	return hash;
+}
+
+static struct hlist_head *
+key_bucket(struct hio_cache * cache,
+	   unsigned long      hash)
+{
+	return &(cache->buckets[hash_long(hash, HIO_CACHE_HASH_BITS)]);
+}
+
+static bool
+key_matches(const struct hio_cache_entry * entry,
+	    const struct hio_cache_key   * key,
+	    unsigned long                  hash)
+{
+	if ((entry->hash       != hash)            ||
+	    (entry->syscall_nr != key->syscall_nr) ||
+	    (entry->fd         != key->fd)         ||
+	    (entry->arg        != key->arg))
+		return false;
+
+	if ((entry->path == NULL) || (key->path == NULL))
+		return (entry->path == key->path);
+
+	return (strcmp(entry->path, key->path) == 0);
+}
+
+static struct hio_cache_entry *
+__find_entry(struct hio_cache           * cache,
+	     const struct hio_cache_key * key,
+	     unsigned long                hash)
+{
+	struct hio_cache_entry * entry;
+	struct hlist_node      * pos;
+
+	hlist_for_each_entry(entry, pos, key_bucket(cache, hash), hash_link) {
+		if (key_matches(entry, key, hash))
+			return entry;
+	}
+
+	return NULL;
+}
+
+static void
+__remove_entry(struct hio_cache       * cache,
+	       struct hio_cache_entry * entry)
+{
+	hlist_del(&(entry->hash_link));
+	list_del(&(entry->lru_link));
+	cache->nr_entries--;
+
+	if (entry->refcnt == 0)
+		kmem_free(entry);
+	else
+		entry->stale = true;
+}
+
+static void
+__flush(struct hio_cache * cache)
+{
+	struct hio_cache_entry * entry, * tmp;
+
+	list_for_each_entry_safe(entry, tmp, &(cache->lru_list), lru_link)
+		__remove_entry(cache, entry);
+
+	cache->generation++;
+}
+
+static bool
+__is_write_fd(struct hio_cache * cache,
+	      int                fd)
+{
+	return (fd >= HIO_CACHE_MAX_FD) || test_bit(fd, cache->write_fds);
+}
+
+
+int
+hio_cache_lookup(struct hio_cache_key * key,
+		 void __user          * buf,
+		 size_t                 len,
+		 long                 * ret_val)
+{
+	struct hio_cache       * cache = current_cache_enabled();
+	struct hio_cache_entry * entry;
+	unsigned long            hash, flags;
+	long                     status;
+
+	if (cache == NULL)
+		return -ENOENT;
+
+	hash = key_hash(key);
+
+	spin_lock_irqsave(&(cache->lock), flags);
+
+	key->generation = cache->generation;
+
+	entry = __find_entry(cache, key, hash);
+	if ((entry != NULL) && (entry->expires != 0) && (get_time() > entry->expires)) {
+		__remove_entry(cache, entry);
+		entry = NULL;
+	}
+
+	if (entry != NULL) {
+		entry->refcnt++;
+		list_move(&(entry->lru_link), &(cache->lru_list));
+	}
+
+	spin_unlock_irqrestore(&(cache->lock), flags);
+
+	if (entry == NULL)
+		return -ENOENT;
+
+	/* Copy out without the lock held, the entry is pinned by refcnt */
+	status = entry->ret_val;
+	len    = min(len, entry->len);
+	if ((len > 0) && copy_to_user(buf, entry->data, len))
+		status = -EFAULT;
+
+	spin_lock_irqsave(&(cache->lock), flags);
+	if ((--entry->refcnt == 0) && entry->stale)
+		kmem_free(entry);
+	spin_unlock_irqrestore(&(cache->lock), flags);
+
+	*ret_val = status;
+	return 0;
+}
+
+void
+hio_cache_insert(struct hio_cache_key * key,
+		 const void __user    * buf,
+		 size_t                 len,
+		 long                   ret_val)
+{
+	struct hio_cache       * cache = current_cache_enabled();
+	struct hio_cache_entry * entry, * old;
+	ktime_t                  ttl;
+	size_t                   path_len;
+	unsigned long            flags;
+
+	if (cache == NULL)
+		return;
+
+	/* Only successes and stable lookup failures are worth remembering */
+	if ((ret_val < 0) && (ret_val != -ENOENT) && (ret_val != -ENOTDIR) && (ret_val != -EACCES))
+		return;
+
+	if (ret_val < 0)
+		len = 0;
+
+	path_len = (key->path) ? strlen(key->path) + 1 : 0;
+
+	entry = kmem_alloc(sizeof(struct hio_cache_entry) + len + path_len);
+	if (entry == NULL)
+		return;
+
+	if ((len > 0) && copy_from_user(entry->data, buf, len)) {
+		kmem_free(entry);
+		return;
+	}
+
+	if (path_len > 0) {
+		entry->path = entry->data + len;
+		memcpy(entry->path, key->path, path_len);
+	}
+
+	entry->hash       = key_hash(key);
+	entry->syscall_nr = key->syscall_nr;
+	entry->fd         = key->fd;
+	entry->arg        = key->arg;
+	entry->ret_val    = ret_val;
+	entry->len        = len;
+
+	ttl = current->aspace->hio_cache_ttl;
+	entry->expires = (ttl) ? get_time() + ttl : 0;
+
+	spin_lock_irqsave(&(cache->lock), flags);
+
+	/* Something was invalidated while the call was being forwarded */
+	if (key->generation != cache->generation) {
+		spin_unlock_irqrestore(&(cache->lock), flags);
+		kmem_free(entry);
+		return;
+	}
+
+	old = __find_entry(cache, key, entry->hash);
+	if (old != NULL)
+		__remove_entry(cache, old);
+
+	if (cache->nr_entries >= HIO_CACHE_MAX_ENTRIES) {
+		old = list_entry(cache->lru_list.prev, struct hio_cache_entry, lru_link);
+		__remove_entry(cache, old);
+	}
+
+	hlist_add_head(&(entry->hash_link), key_bucket(cache, entry->hash));
+	list_add(&(entry->lru_link), &(cache->lru_list));
+	cache->nr_entries++;
+
+	spin_unlock_irqrestore(&(cache->lock), flags);
+}
+
+void
+hio_cache_invalidate(void)
+{
+	struct hio_cache * cache = current_cache();
+	unsigned long      flags;
+
+	if (cache == NULL)
+		return;
+
+	spin_lock_irqsave(&(cache->lock), flags);
+	__flush(cache);
+	spin_unlock_irqrestore(&(cache->lock), flags);
+}
+
+void
+hio_cache_note_open(long fd,
+		    int  open_flags)
+{
+	struct hio_cache * cache = current_cache();
+	unsigned long      flags;
+
+	if ((cache == NULL) || (fd < 0))
+		return;
+
+	if (!(open_flags & (O_WRONLY | O_RDWR | O_CREAT | O_TRUNC)))
+		return;
+
+	spin_lock_irqsave(&(cache->lock), flags);
+	if (fd < HIO_CACHE_MAX_FD)
+		set_bit(fd, cache->write_fds);
+	__flush(cache);
+	spin_unlock_irqrestore(&(cache->lock), flags);
+}
+
+void
+hio_cache_note_dup(int  old_fd,
+		   long new_fd)
+{
+	struct hio_cache * cache = current_cache();
+	unsigned long      flags;
+
+	if ((cache == NULL) || (old_fd < 0) || (new_fd < 0) || (new_fd >= HIO_CACHE_MAX_FD))
+		return;
+
+	spin_lock_irqsave(&(cache->lock), flags);
+	if (__is_write_fd(cache, old_fd))
+		set_bit(new_fd, cache->write_fds);
+	spin_unlock_irqrestore(&(cache->lock), flags);
+}
+
+void
+hio_cache_note_write(int fd)
+{
+	struct hio_cache * cache = current_cache();
+	unsigned long      flags;
+
+	if ((cache == NULL) || (fd < 0))
+		return;
+
+	spin_lock_irqsave(&(cache->lock), flags);
+	if (__is_write_fd(cache, fd))
+		__flush(cache);
+	spin_unlock_irqrestore(&(cache->lock), flags);
+}
+
+void
+hio_cache_note_close(int fd)
+{
+	struct hio_cache       * cache = current_cache();
+	struct hio_cache_entry * entry, * tmp;
+	unsigned long            flags;
+
+	if ((cache == NULL) || (fd < 0))
+		return;
+
+	spin_lock_irqsave(&(cache->lock), flags);
+
+	if (fd < HIO_CACHE_MAX_FD)
+		clear_bit(fd, cache->write_fds);
+
+	/* The fd number will be reused, forget everything keyed by it */
+	list_for_each_entry_safe(entry, tmp, &(cache->lru_list), lru_link) {
+		if (entry->fd == fd)
+			__remove_entry(cache, entry);
+	}
+	cache->generation++;
+
+	spin_unlock_irqrestore(&(cache->lock), flags);
+}
+
+struct hio_cache *
+hio_cache_create(void)
+{
+	struct hio_cache * cache;
+
+	/* kmem_alloc() returns zeroed memory, so buckets and write_fds start empty */
+	cache = kmem_alloc(sizeof(struct hio_cache));
+	if (cache == NULL)
+		return NULL;
+
+	spin_lock_init(&(cache->lock));
+	list_head_init(&(cache->lru_list));
+
+	return cache;
+}
+
+void
+hio_cache_flush(struct hio_cache * cache)
+{
+	unsigned long flags;
+
+	if (cache == NULL)
+		return;
+
+	spin_lock_irqsave(&(cache->lock), flags);
+	__flush(cache);
+	spin_unlock_irqrestore(&(cache->lock), flags);
+}
+
+void
+hio_cache_destroy(struct hio_cache * cache)
+{
+	if (cache == NULL)
+		return;
+
+	hio_cache_flush(cache);
+	kmem_free(cache);
+}
@@ -6,11 +6,16 @@
 #include <lwk/hio.h>
 #include <lwk/aspace.h>
 
+extern long
+sys_bind(int sockfd, struct sockaddr __user *addr, int addrlen);
+
 long
 hio_bind(int sockfd, struct sockaddr __user *addr, int addrlen)
 {
-	if ((!syscall_isset(__NR_bind, current->aspace->hio_syscall_mask)))
-		return -ENOSYS;
+	if ( (!syscall_isset(__NR_bind, current->aspace->hio_syscall_mask)) ||
+	     (fdTableFile(current->fdTable, sockfd))
+	   )
+		return sys_bind(sockfd, addr, addrlen);
 
 	return hio_format_and_exec_syscall(__NR_bind, 3, sockfd, addr, addrlen);
 }
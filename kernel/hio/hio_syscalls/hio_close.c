@@ -12,10 +12,15 @@ sys_close(unsigned int fd);
 long
 hio_close(unsigned int fd)
 {
+	long ret;
+
 	if ( (!syscall_isset(__NR_close, current->aspace->hio_syscall_mask)) ||
 	     (fdTableFile(current->fdTable, fd))
 	   )
 		return sys_close(fd);
 
-	return hio_format_and_exec_syscall(__NR_close, 1, fd);
+	ret = hio_format_and_exec_syscall(__NR_close, 1, fd);
+	hio_cache_note_close(fd);
+
+	return ret;
 }
@@ -6,11 +6,16 @@
 #include <lwk/hio.h>
 #include <lwk/aspace.h>
 
+extern long
+sys_connect(int sockfd, struct sockaddr __user *addr, int addrlen);
+
 long
 hio_connect(int sockfd, struct sockaddr __user * addr, int addrlen)
 {
-	if (!syscall_isset(__NR_connect, current->aspace->hio_syscall_mask))
-		return -ENOSYS;
+	if ( (!syscall_isset(__NR_connect, current->aspace->hio_syscall_mask)) ||
+	     (fdTableFile(current->fdTable, sockfd))
+	   )
+		return sys_connect(sockfd, addr, addrlen);
 
 	return hio_format_and_exec_syscall(__NR_connect, 3, sockfd, addr, addrlen);
 }
@@ -9,8 +9,25 @@
 long
 hio_faccessat(int dfd, const char __user *filename, int mode)
 {
+	char pathname[MAX_PATHLEN];
+	struct hio_cache_key key = { __NR_faccessat, -1, mode, pathname };
+	long ret;
+
 	if (!syscall_isset(__NR_faccessat, current->aspace->hio_syscall_mask))
 		return -ENOSYS;
 
-	return hio_format_and_exec_syscall(__NR_faccessat, 3, dfd, filename, mode);
+	if (strncpy_from_user(pathname, (void *)filename, sizeof(pathname)) < 0)
+		return -EFAULT;
+
+	/* Relative lookups depend on the directory fd */
+	if ((pathname[0] != '/') && (dfd != AT_FDCWD))
+		key.fd = dfd;
+
+	if (hio_cache_lookup(&key, NULL, 0, &ret) == 0)
+		return ret;
+
+	ret = hio_format_and_exec_syscall(__NR_faccessat, 3, dfd, filename, mode);
+	hio_cache_insert(&key, NULL, 0, ret);
+
+	return ret;
 }
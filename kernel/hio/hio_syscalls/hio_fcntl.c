@@ -11,10 +11,16 @@ extern long sys_fcntl(unsigned int fd, unsigned int cmd, unsigned long arg);
 long
 hio_fcntl(unsigned int fd, unsigned int cmd, unsigned long arg)
 {
+	long ret;
+
 	if ( (!syscall_isset(__NR_fcntl, current->aspace->hio_syscall_mask)) ||
 	     (fdTableFile(current->fdTable, fd))
 	   )
 		return sys_fcntl(fd, cmd, arg);
 
-	return hio_format_and_exec_syscall(__NR_fcntl, 3, fd, cmd, arg);
+	ret = hio_format_and_exec_syscall(__NR_fcntl, 3, fd, cmd, arg);
+	if ((cmd == F_DUPFD) || (cmd == F_DUPFD_CLOEXEC))
+		hio_cache_note_dup(fd, ret);
+
+	return ret;
 }
@@ -5,17 +5,27 @@
 #include <lwk/kfs.h>
 #include <lwk/hio.h>
 #include <lwk/aspace.h>
+#include <lwk/stat.h>
 
 extern long sys_fstat(unsigned int fd, struct __old_kernel_stat __user *statbuf);
 
 long
 hio_fstat(unsigned int fd, struct __old_kernel_stat __user *statbuf)
 {
+	struct hio_cache_key key = { __NR_fstat, fd, 0, NULL };
+	long ret;
+
 	if ((!syscall_isset(__NR_fstat, current->aspace->hio_syscall_mask)) ||
 	     (fdTableFile(current->fdTable, fd))
 	   ) {
 		return sys_fstat(fd, statbuf);
 	}
 
-	return hio_format_and_exec_syscall(__NR_fstat, 2, fd, statbuf);
+	if (hio_cache_lookup(&key, statbuf, sizeof(struct stat), &ret) == 0)
+		return ret;
+
+	ret = hio_format_and_exec_syscall(__NR_fstat, 2, fd, statbuf);
+	hio_cache_insert(&key, statbuf, sizeof(struct stat), ret);
+
+	return ret;
 }
@@ -11,6 +11,8 @@
 long
 hio_ftruncate( unsigned int fd, unsigned long length)
 {
+	long ret;
+
 	if ( (!syscall_isset(__NR_ftruncate, current->aspace->hio_syscall_mask)) ||
 	     (fdTableFile(current->fdTable, fd))
 	   ) {
@@ -18,5 +20,8 @@ hio_ftruncate( unsigned int fd, unsigned long length)
 		//return sys_ftruncate(fd, offset, whence);
 	}
 
-	return hio_format_and_exec_syscall(__NR_ftruncate, 2, fd, length);
+	ret = hio_format_and_exec_syscall(__NR_ftruncate, 2, fd, length);
+	hio_cache_note_write(fd);
+
+	return ret;
 }
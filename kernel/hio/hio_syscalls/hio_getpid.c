@@ -11,7 +11,9 @@ extern long sys_getpid(void);
 long
 hio_getpid(void)
 {
-	if (!syscall_isset(__NR_getpid, current->aspace->hio_syscall_mask))
+	if ( (!syscall_isset(__NR_getpid, current->aspace->hio_syscall_mask)) ||
+	     (current->aspace->hio_cache_flags & HIO_CACHE_LOCAL_IDS)
+	   )
 		return sys_getpid();
 
 	return hio_format_and_exec_syscall(__NR_getpid, 0);
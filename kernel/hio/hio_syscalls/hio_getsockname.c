@@ -6,11 +6,16 @@
 #include <lwk/hio.h>
 #include <lwk/aspace.h>
 
+extern long
+sys_getsockname(int fd, struct sockaddr __user *addr, int __user *addrlen);
+
 long
 hio_getsockname(int fd, struct sockaddr __user *addr, int __user *addrlen)
 {
-	if (!syscall_isset(__NR_getsockname, current->aspace->hio_syscall_mask))
-		return -ENOSYS;
+	if ( (!syscall_isset(__NR_getsockname, current->aspace->hio_syscall_mask)) ||
+	     (fdTableFile(current->fdTable, fd))
+	   )
+		return sys_getsockname(fd, addr, addrlen);
 
 	return hio_format_and_exec_syscall(__NR_getsockname, 3, fd, addr, addrlen);
 }
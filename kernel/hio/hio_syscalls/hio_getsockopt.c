@@ -6,11 +6,16 @@
 #include <lwk/hio.h>
 #include <lwk/aspace.h>
 
+extern long
+sys_getsockopt(int fd, int level, int optname, char __user *optval, int __user *optlen);
+
 long
 hio_getsockopt(int fd, int level, int optname, char __user *optval, int __user *optlen)
 {
-	if (!syscall_isset(__NR_getsockopt, current->aspace->hio_syscall_mask))
-		return -ENOSYS;
+	if ( (!syscall_isset(__NR_getsockopt, current->aspace->hio_syscall_mask)) ||
+	     (fdTableFile(current->fdTable, fd))
+	   )
+		return sys_getsockopt(fd, level, optname, optval, optlen);
 
 	return hio_format_and_exec_syscall(__NR_getsockopt, 5, fd, level, optname, optval, optlen);
 }
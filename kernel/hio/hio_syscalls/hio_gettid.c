@@ -11,7 +11,9 @@ extern long sys_gettid(void);
 long
 hio_gettid(void)
 {
-	if (!syscall_isset(__NR_gettid, current->aspace->hio_syscall_mask))
+	if ( (!syscall_isset(__NR_gettid, current->aspace->hio_syscall_mask)) ||
+	     (current->aspace->hio_cache_flags & HIO_CACHE_LOCAL_IDS)
+	   )
 		return sys_gettid();
 
 	return hio_format_and_exec_syscall(__NR_gettid, 0);
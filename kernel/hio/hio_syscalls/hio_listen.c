@@ -6,12 +6,17 @@
 #include <lwk/hio.h>
 #include <lwk/aspace.h>
 
+extern long
+sys_listen(int sockfd, int backlog);
+
 long
 hio_listen(int sockfd,
 	   int backlog)
 {
-	if ((!syscall_isset(__NR_listen, current->aspace->hio_syscall_mask)))
-		return -ENOSYS;
+	if ( (!syscall_isset(__NR_listen, current->aspace->hio_syscall_mask)) ||
+	     (fdTableFile(current->fdTable, sockfd))
+	   )
+		return sys_listen(sockfd, backlog);
 
 	return hio_format_and_exec_syscall(__NR_listen, 2, sockfd, backlog);
 }
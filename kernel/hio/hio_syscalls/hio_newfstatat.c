@@ -5,9 +5,27 @@
 #include <lwk/kfs.h>
 #include <lwk/hio.h>
 #include <lwk/aspace.h>
+#include <lwk/stat.h>
 
 long
 hio_newfstatat(int dfd, const char __user *filename, struct stat __user *statbuf, int flag)
 {
-	return hio_format_and_exec_syscall(__NR_newfstatat, 4, dfd, filename, statbuf, flag); 
+	char pathname[MAX_PATHLEN];
+	struct hio_cache_key key = { __NR_newfstatat, -1, flag, pathname };
+	long ret;
+
+	if (strncpy_from_user(pathname, (void *)filename, sizeof(pathname)) < 0)
+		return -EFAULT;
+
+	/* Relative lookups depend on the directory fd */
+	if ((pathname[0] != '/') && (dfd != AT_FDCWD))
+		key.fd = dfd;
+
+	if (hio_cache_lookup(&key, statbuf, sizeof(struct stat), &ret) == 0)
+		return ret;
+
+	ret = hio_format_and_exec_syscall(__NR_newfstatat, 4, dfd, filename, statbuf, flag); 
+	hio_cache_insert(&key, statbuf, sizeof(struct stat), ret);
+
+	return ret;
 }
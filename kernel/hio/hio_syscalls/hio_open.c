@@ -28,6 +28,8 @@ long
 hio_open(const char __user *filename, int flags, int mode)
 {
 	char pathname[MAX_PATHLEN];
+	struct hio_cache_key key = { __NR_open, -1, 0, pathname };
+	long ret;
 
 	if (strncpy_from_user(pathname, (void *)filename, sizeof(pathname)) < 0)
 		return -EFAULT;
@@ -44,5 +46,15 @@ hio_open(const char __user *filename, int flags, int mode)
 		return sys_open(filename, flags, mode);
 	}
 
-	return hio_format_and_exec_syscall(__NR_open, 3, filename, flags, mode); 
+	/* Known-missing paths, e.g. from library search path probing */
+	if (!(flags & O_CREAT) && (hio_cache_lookup(&key, NULL, 0, &ret) == 0))
+		return ret;
+
+	ret = hio_format_and_exec_syscall(__NR_open, 3, filename, flags, mode); 
+	hio_cache_note_open(ret, flags);
+
+	if (!(flags & O_CREAT) && (ret == -ENOENT))
+		hio_cache_insert(&key, NULL, 0, ret);
+
+	return ret;
 }
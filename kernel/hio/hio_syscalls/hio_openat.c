@@ -30,6 +30,8 @@ long
 hio_openat(int dfd, const char __user *filename, int flags, int mode)
 {
 	char pathname[MAX_PATHLEN];
+	struct hio_cache_key key = { __NR_openat, dfd, 0, pathname };
+	long ret;
 
 	if (strncpy_from_user(pathname, (void *)filename, sizeof(pathname)) < 0)
 		return -EFAULT;
@@ -41,5 +43,15 @@ hio_openat(int dfd, const char __user *filename, int flags, int mode)
 	   )
 		return sys_openat(dfd, filename, flags, mode);
 
-	return hio_format_and_exec_syscall(__NR_openat, 4, dfd, filename, flags, mode); 
+	/* Known-missing paths, e.g. from library search path probing */
+	if (hio_cache_lookup(&key, NULL, 0, &ret) == 0)
+		return ret;
+
+	ret = hio_format_and_exec_syscall(__NR_openat, 4, dfd, filename, flags, mode); 
+	hio_cache_note_open(ret, flags);
+
+	if (ret == -ENOENT)
+		hio_cache_insert(&key, NULL, 0, ret);
+
+	return ret;
 }
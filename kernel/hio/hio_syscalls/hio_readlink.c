@@ -11,8 +11,28 @@ extern long sys_readlink(const char __user *path, char __user *buf, int bufsiz);
 long
 hio_readlink(const char __user *path, char __user *buf, int bufsiz)
 {
+	char pathname[MAX_PATHLEN];
+	struct hio_cache_key key = { __NR_readlink, -1, 0, pathname };
+	long ret;
+
 	if (!syscall_isset(__NR_readlink, current->aspace->hio_syscall_mask))
 		return sys_readlink(path, buf, bufsiz);
 
-	return hio_format_and_exec_syscall(__NR_readlink, 3, path, buf, bufsiz);
+	if (bufsiz <= 0)
+		return -EINVAL;
+
+	if (strncpy_from_user(pathname, (void *)path, sizeof(pathname)) < 0)
+		return -EFAULT;
+
+	/* A hit returns the full target length, readlink() silently truncates */
+	if (hio_cache_lookup(&key, buf, bufsiz, &ret) == 0)
+		return (ret > bufsiz) ? bufsiz : ret;
+
+	ret = hio_format_and_exec_syscall(__NR_readlink, 3, path, buf, bufsiz);
+
+	/* Only complete targets are cached, a full buffer may have been truncated */
+	if (ret < bufsiz)
+		hio_cache_insert(&key, buf, (ret > 0) ? ret : 0, ret);
+
+	return ret;
 }
@@ -6,11 +6,16 @@
 #include <lwk/hio.h>
 #include <lwk/aspace.h>
 
+extern long
+sys_recvfrom(int fd, void __user *buf, size_t len, unsigned flags, struct sockaddr __user *src_addr, int __user *addrlen);
+
 long
 hio_recvfrom(int fd, void __user *buf, size_t len, unsigned flags, struct sockaddr __user *src_addr, int __user *addrlen)
 {
-	if (!syscall_isset(__NR_recvfrom, current->aspace->hio_syscall_mask))
-		return -ENOSYS;
+	if ( (!syscall_isset(__NR_recvfrom, current->aspace->hio_syscall_mask)) ||
+	     (fdTableFile(current->fdTable, fd))
+	   )
+		return sys_recvfrom(fd, buf, len, flags, src_addr, addrlen);
 
 	return hio_format_and_exec_syscall(__NR_recvfrom, 6, fd, buf, len, flags, src_addr, addrlen);
 }
@@ -6,11 +6,16 @@
 #include <lwk/hio.h>
 #include <lwk/aspace.h>
 
+extern long
+sys_recvmsg(int fd, struct msghdr __user *msg, unsigned flags);
+
 long
 hio_recvmsg(int fd, struct msghdr __user *msg, unsigned flags)
 {
-	if (!syscall_isset(__NR_recvmsg, current->aspace->hio_syscall_mask))
-		return -ENOSYS;
+	if ( (!syscall_isset(__NR_recvmsg, current->aspace->hio_syscall_mask)) ||
+	     (fdTableFile(current->fdTable, fd))
+	   )
+		return sys_recvmsg(fd, msg, flags);
 
 	return hio_format_and_exec_syscall(__NR_recvmsg, 3, fd, msg, flags);
 }
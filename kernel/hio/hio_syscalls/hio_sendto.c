@@ -6,11 +6,16 @@
 #include <lwk/hio.h>
 #include <lwk/aspace.h>
 
+extern long
+sys_sendto(int fd, void __user *buf, size_t len, unsigned flags, struct sockaddr __user *dest_addr, int addrlen);
+
 long
 hio_sendto(int fd, void __user *buf, size_t len, unsigned flags, struct sockaddr __user *dest_addr, int addrlen)
 {
-	if (!syscall_isset(__NR_sendto, current->aspace->hio_syscall_mask))
-		return -ENOSYS;
+	if ( (!syscall_isset(__NR_sendto, current->aspace->hio_syscall_mask)) ||
+	     (fdTableFile(current->fdTable, fd))
+	   )
+		return sys_sendto(fd, buf, len, flags, dest_addr, addrlen);
 
 	return hio_format_and_exec_syscall(__NR_sendto, 6, fd, buf, len, flags, dest_addr, addrlen);
 }
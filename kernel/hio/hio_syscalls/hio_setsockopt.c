@@ -6,11 +6,16 @@
 #include <lwk/hio.h>
 #include <lwk/aspace.h>
 
+extern long
+sys_setsockopt(int fd, int level, int optname, char __user *optval, int optlen);
+
 long
 hio_setsockopt(int fd, int level, int optname, char __user *optval, int optlen)
 {
-	if (!syscall_isset(__NR_setsockopt, current->aspace->hio_syscall_mask))
-		return -ENOSYS;
+	if ( (!syscall_isset(__NR_setsockopt, current->aspace->hio_syscall_mask)) ||
+	     (fdTableFile(current->fdTable, fd))
+	   )
+		return sys_setsockopt(fd, level, optname, optval, optlen);
 
 	return hio_format_and_exec_syscall(__NR_setsockopt, 5, fd, level, optname, optval, optlen);
 }
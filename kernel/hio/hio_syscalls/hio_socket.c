@@ -5,6 +5,7 @@
 #include <lwk/kfs.h>
 #include <lwk/hio.h>
 #include <lwk/aspace.h>
+#include <lwk/unix_socket.h>
 
 extern long
 sys_socket(int, int, int);
@@ -14,7 +15,10 @@ hio_socket(int domain,
 	   int type, 
 	   int protocol)
 {
-	if ( (!syscall_isset(__NR_socket, current->aspace->hio_syscall_mask)) )
+	/* AF_UNIX sockets are always local, the kernel implements them */
+	if ( (!syscall_isset(__NR_socket, current->aspace->hio_syscall_mask)) ||
+	     (domain == AF_UNIX)
+	   )
 		return sys_socket(domain, type, protocol);
 
 	return hio_format_and_exec_syscall(__NR_socket, 3, domain, type, protocol);
@@ -5,6 +5,7 @@
 #include <lwk/kfs.h>
 #include <lwk/hio.h>
 #include <lwk/aspace.h>
+#include <lwk/stat.h>
 
 extern long
 sys_stat(const char __user *filename, struct __old_kernel_stat __user *statbuf);
@@ -28,6 +29,8 @@ long
 hio_stat(const char __user *filename, struct __old_kernel_stat __user *statbuf)
 {
 	char pathname[MAX_PATHLEN];
+	struct hio_cache_key key = { __NR_stat, -1, 0, pathname };
+	long ret;
 
 	if (strncpy_from_user(pathname, (void *)filename, sizeof(pathname)) < 0)
 		return -EFAULT;
@@ -37,5 +40,11 @@ hio_stat(const char __user *filename, struct __old_kernel_stat __user *statbuf)
 	   )
 		return sys_stat(filename, statbuf);
 
-	return hio_format_and_exec_syscall(__NR_stat, 2, filename, statbuf); 
+	if (hio_cache_lookup(&key, statbuf, sizeof(struct stat), &ret) == 0)
+		return ret;
+
+	ret = hio_format_and_exec_syscall(__NR_stat, 2, filename, statbuf); 
+	hio_cache_insert(&key, statbuf, sizeof(struct stat), ret);
+
+	return ret;
 }
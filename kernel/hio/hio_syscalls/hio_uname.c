@@ -11,7 +11,9 @@ extern long sys_uname(struct old_utsname __user *name);
 long
 hio_uname(struct old_utsname __user *name)
 {
-	if (!syscall_isset(__NR_uname, current->aspace->hio_syscall_mask))
+	if ( (!syscall_isset(__NR_uname, current->aspace->hio_syscall_mask)) ||
+	     (current->aspace->hio_cache_flags & HIO_CACHE_LOCAL_IDS)
+	   )
 		return sys_uname(name);
 
 	return hio_format_and_exec_syscall(__NR_uname, 1, name);
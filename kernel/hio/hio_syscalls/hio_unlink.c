@@ -11,8 +11,13 @@ extern long sys_unlink(const char __user *pathname);
 long
 hio_unlink(const char __user *pathname)
 {
+	long ret;
+
 	if (!syscall_isset(__NR_unlink, current->aspace->hio_syscall_mask))
 		return sys_unlink(pathname);
 
-	return hio_format_and_exec_syscall(__NR_unlink, 1, pathname);
+	ret = hio_format_and_exec_syscall(__NR_unlink, 1, pathname);
+	hio_cache_invalidate();
+
+	return ret;
 }
@@ -12,10 +12,15 @@ sys_write(unsigned int fd, const char __user *buf, size_t count);
 long
 hio_write(unsigned int fd, const char __user *buf, size_t count)
 {
+	long ret;
+
 	if ( (!syscall_isset(__NR_write, current->aspace->hio_syscall_mask)) ||
 	     (fdTableFile(current->fdTable, fd))
 	   )
 		return sys_write(fd, buf, count);
 
-	return hio_format_and_exec_syscall(__NR_write, 3, fd, buf, count);
+	ret = hio_format_and_exec_syscall(__NR_write, 3, fd, buf, count);
+	hio_cache_note_write(fd);
+
+	return ret;
 }
@@ -8,10 +8,15 @@ extern long sys_writev(unsigned long fd, const struct iovec __user *vec, unsigne
 long
 hio_writev(unsigned long fd, const struct iovec __user *vec, unsigned long vlen)
 {
+	long ret;
+
 	if ( (!syscall_isset(__NR_writev, current->aspace->hio_syscall_mask)) ||
 	     (fdTableFile(current->fdTable, fd))
 	   )
 		return sys_writev(fd, vec, vlen);
 
-	return hio_format_and_exec_syscall(__NR_writev, 3, fd, vec, vlen);
+	ret = hio_format_and_exec_syscall(__NR_writev, 3, fd, vec, vlen);
+	hio_cache_note_write(fd);
+
+	return ret;
 }
@@ -10,7 +10,13 @@
 #include <arch/atomic.h>
 
 
-static waitq_t user_waitq;
+/* One /dev/hio device per forwarding channel, each served by its own proxy */
+struct hio_user_channel {
+	uint32_t id;
+	waitq_t  waitq;
+};
+
+static struct hio_user_channel user_channels[CONFIG_HIO_SYSCALL_CHANNELS];
 
 static int
 hio_open_fop(struct inode * inodep,
@@ -39,6 +45,7 @@ hio_read_fop(struct file * filp,
 	     size_t        length,
 	     loff_t      * offset)
 {
+	struct hio_user_channel * channel = filp->private_data;
 	hio_syscall_t * k_syscall;
 	int status;
 
@@ -47,13 +54,13 @@ hio_read_fop(struct file * filp,
 
 retry:
 	status = wait_event_interruptible(
-		user_waitq,
-		(hio_get_num_pending_syscalls() > 0)
+		channel->waitq,
+		(hio_get_num_pending_syscalls(channel->id) > 0)
 	);
 	if (status)
 		return status;
 
-	status = hio_get_pending_syscall(&k_syscall);
+	status = hio_get_pending_syscall(channel->id, &k_syscall);
 	if (status != 0) {
 		if (status == -ENOENT)
 			goto retry;
@@ -62,9 +69,8 @@ retry:
 	}
 
 	if (copy_to_user(buffer, k_syscall, sizeof(hio_syscall_t))) {
-		/* Cancel it, then re-issue */
-		hio_cancel_syscall(k_syscall);
-		hio_issue_syscall(k_syscall);
+		/* Put it back on its channel for the next reader */
+		hio_requeue_syscall(k_syscall);
 		return -EFAULT;
 	}
 
@@ -99,11 +105,12 @@ static unsigned int
 hio_poll_fop(struct file	      * filp,
 	     struct poll_table_struct * poll)
 {
+	struct hio_user_channel * channel = filp->private_data;
 	unsigned int mask = POLLOUT | POLLWRNORM;
 
-	poll_wait(filp, &user_waitq, poll);
+	poll_wait(filp, &(channel->waitq), poll);
 
-	if (hio_get_num_pending_syscalls() > 0)
+	if (hio_get_num_pending_syscalls(channel->id) > 0)
 		mask |= POLLIN | POLLRDNORM;
 
 	return mask;
@@ -124,21 +131,36 @@ hio_fops = {
 static int
 init(void)
 {
-	waitq_init(&user_waitq);
+	char name[32];
+	uint32_t i;
+
+	for (i = 0; i < CONFIG_HIO_SYSCALL_CHANNELS; i++) {
+		user_channels[i].id = i;
+		waitq_init(&(user_channels[i].waitq));
+
+		/* Channel 0 keeps the original device name */
+		if (i == 0)
+			strlcpy(name, "/dev/hio", sizeof(name));
+		else
+			snprintf(name, sizeof(name), "/dev/hio%u", i);
+
+		if (kfs_create(name,
+			NULL,
+			&hio_fops,
+			0777,
+			&(user_channels[i]), sizeof(struct hio_user_channel)) == NULL)
+			return -1;
+	}
 
-	return (kfs_create("/dev/hio",
-		NULL,
-		&hio_fops,
-		0777,
-		NULL, 0) == NULL) ? -1 : 0;
+	return 0;
 }
 
 static int
-notify_new_syscall(void)
+notify_new_syscall(uint32_t channel)
 {
 	/* Wake up poller */
 	mb();
-	waitq_wakeup(&user_waitq);
+	waitq_wakeup(&(user_channels[channel].waitq));
 	
 	return 0;
 }
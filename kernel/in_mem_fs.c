@@ -1,66 +1,73 @@
 #include <lwk/kfs.h>
 #include <lwk/list.h>
 #include <lwk/pmem.h>
+#include <lwk/aspace.h>
+#include <lwk/radix-tree.h>
+#include <lwk/linux_compat.h>
+#include <lwk/uio.h>
 #include <arch/uaccess.h>
 
-struct in_mem_data_block {
-	uintptr_t blk_paddr;
+/*
+ * File data lives in physically contiguous extents. Extents double in
+ * size as the file grows, up to a large page, and are naturally aligned
+ * both physically and within the file so that mmap() can map them with
+ * large pages. A radix tree maps every page of the file to its extent.
+ */
+struct in_mem_extent {
+	loff_t		offset;		/* within the file */
+	size_t		size;
+	paddr_t		paddr;
 	struct list_head node;
 };
 
 struct in_mem_priv_data {
-	struct list_head block_list;
-	u32 num_blocks;
-	struct mutex fop_mutex; /* We probably want this... */
+	struct list_head extent_list;	/* in file offset order */
+	struct radix_tree_root pages;	/* page index -> extent */
+	loff_t alloc_size;		/* bytes covered by extents */
+	atomic_t refs;			/* the name, open files and mappings */
+	struct mutex fop_mutex;
 };
 
 #define dbg(fmt,args...)
 //#define dbg _KDBG
 
 #define PRIV_DATA(x) ((struct in_mem_priv_data*) x)
-#define DATA_BLK_SIZE (PAGE_SIZE)
-#define MAX_FILE_SIZE (64 * 1024 * 1024)   /* 64MB for now... */
+#define EXTENT_MAX_SIZE (VM_PAGE_2MB)
 
-static inline struct in_mem_data_block *
-get_block_from_offset(
-	struct in_mem_priv_data * priv, 
+static inline struct in_mem_extent *
+get_extent_from_offset(
+	struct in_mem_priv_data * priv,
 	loff_t                    offset)
 {
-	struct in_mem_data_block * data_blk = NULL;
-	u64 target_block = offset / DATA_BLK_SIZE;
-	int i = 0;
-
-	if (target_block > priv->num_blocks) {
+	if (offset >= priv->alloc_size)
 		return NULL;
-	}
-
-
-	list_for_each_entry(data_blk, &(priv->block_list), node) {
-		if (i == target_block) return data_blk;
-		i++;
-	}
 
-	return NULL;
+	return radix_tree_lookup(&(priv->pages), offset >> PAGE_SHIFT);
 }
 
-static uintptr_t 
-alloc_data_page( void )
+/*
+ * Size of the next extent when `need` more bytes are wanted. It never
+ * exceeds the alignment of its file offset, so doubling from a page
+ * keeps every extent naturally aligned.
+ */
+static size_t
+next_extent_size(
+	struct in_mem_priv_data * priv,
+	u64                       need)
 {
-	struct pmem_region result;
-	int status;
+	size_t size = EXTENT_MAX_SIZE;
 
-	status = pmem_alloc_umem(PAGE_SIZE, 0, &result);
-	if (status) return 0;
+	if (priv->alloc_size)
+		size = min_t(size_t, size, priv->alloc_size & -priv->alloc_size);
 
-	status = pmem_zero(&result);
-	if (status) return 0;
+	while ((size > PAGE_SIZE) && ((size / 2) >= need))
+		size /= 2;
 
-	return result.start;
+	return size;
 }
 
-
-static void 
-free_data_page(uintptr_t page_paddr)
+static void
+free_extent_pmem(paddr_t paddr, size_t size)
 {
 	struct pmem_region query;
 	struct pmem_region result;
@@ -68,73 +75,246 @@ free_data_page(uintptr_t page_paddr)
 
 	pmem_region_unset_all(&query);
 
-	query.start            = page_paddr;
-	query.end              = page_paddr + PAGE_SIZE;
+	query.start            = paddr;
+	query.end              = paddr + size;
 	query.allocated        = true;
 	query.allocated_is_set = true;
 
 	status = pmem_query(&query, &result);
 	if (status) {
-		panic("Freeing page %p failed! query status=%d\n", 
-		      (void *)page_paddr, status);
+		panic("Freeing extent %p failed! query status=%d\n",
+		      (void *)paddr, status);
 	}
 
 	result.allocated = false;
 	status = pmem_update(&result);
 	if (status) {
-		panic("Failed to free page %p! (status=%d)",
-		      (void *)page_paddr, status);
+		panic("Failed to free extent %p! (status=%d)",
+		      (void *)paddr, status);
+	}
+}
+
+static int
+add_extent(
+	struct in_mem_priv_data * priv,
+	u64                       need)
+{
+	struct in_mem_extent * ext;
+	struct pmem_region result;
+	size_t size = next_extent_size(priv, need);
+	unsigned long idx;
+	int status;
+
+	/* Fall back to smaller extents when memory is fragmented */
+	while ((status = pmem_alloc_umem(size, size, &result)) != 0) {
+		if (size == PAGE_SIZE)
+			return -ENOMEM;
+		size /= 2;
+	}
+
+	status = pmem_zero(&result);
+	if (status)
+		goto out_free_pmem;
+
+	ext = kmem_alloc(sizeof(struct in_mem_extent));
+	if (!ext) {
+		status = -ENOMEM;
+		goto out_free_pmem;
+	}
+
+	ext->offset = priv->alloc_size;
+	ext->size   = size;
+	ext->paddr  = result.start;
+
+	for (idx = 0; idx < (size >> PAGE_SHIFT); idx++) {
+		status = radix_tree_insert(&(priv->pages),
+				(ext->offset >> PAGE_SHIFT) + idx, ext);
+		if (status)
+			goto out_delete;
+	}
+
+	list_add_tail(&(ext->node), &(priv->extent_list));
+	priv->alloc_size += size;
+
+	dbg("offset=%lld size=%lu paddr=%p\n",
+	    ext->offset, size, (void *)ext->paddr);
+	return 0;
+
+out_delete:
+	while (idx-- > 0)
+		radix_tree_delete(&(priv->pages), (ext->offset >> PAGE_SHIFT) + idx);
+	kmem_free(ext);
+out_free_pmem:
+	free_extent_pmem(result.start, size);
+	return status;
+}
+
+/*
+ * Drops a reference. The last one, whichever of unlink(), close or the
+ * end of a mapping it is, frees the file's memory.
+ */
+static void
+in_mem_put(struct in_mem_priv_data * priv)
+{
+	struct in_mem_extent * tmp = NULL;
+	struct in_mem_extent * ext = NULL;
+	unsigned long idx;
+
+	if (!atomic_dec_and_test(&(priv->refs)))
+		return;
+
+	dbg("\n");
+	list_for_each_entry_safe(ext, tmp, &(priv->extent_list), node)
+	{
+		list_del( &(ext->node) );
+
+		for (idx = 0; idx < (ext->size >> PAGE_SHIFT); idx++)
+			radix_tree_delete(&(priv->pages),
+					  (ext->offset >> PAGE_SHIFT) + idx);
+
+		free_extent_pmem( ext->paddr, ext->size );
+		kmem_free( ext );
 	}
+
+	kmem_free( priv );
 }
 
+/* Called with the mapping's aspace locked, in_mem_put() doesn't sleep */
+static void
+in_mem_unmap(void * priv)
+{
+	in_mem_put(PRIV_DATA(priv));
+}
 
 static int in_mem_open(struct inode * inode, struct file * file)
 {
+	struct in_mem_priv_data * priv = PRIV_DATA(inode->i_private);
+
+	atomic_inc(&(priv->refs));
 	file->pos = 0;
-	file->private_data = inode->i_private;
+	file->private_data = priv;
+	return 0;
+}
+
+static int in_mem_close(struct file * file)
+{
+	in_mem_put(PRIV_DATA(file->private_data));
 	return 0;
 }
 
+static int in_mem_release(struct inode * inode, struct file * file)
+{
+	return in_mem_close(file);
+}
+
+/* Copies out from file->pos, up to the end of the file; fop_mutex held */
 static ssize_t
-in_mem_read(
+__in_mem_read(
         struct file *	file,
         char *		buf,
-        size_t          len,
-        loff_t *        off
+        size_t          len
 )
 {
 	struct in_mem_priv_data* priv = file->private_data;
+	size_t bytes_copied = 0;
+
+	if (file->pos >= file->inode->size)
+		len = 0;
+	else if (len > file->inode->size - file->pos)
+		len = file->inode->size - file->pos;
+
+	/* One copy per extent, not per page */
+	while (bytes_copied < len) {
+		struct in_mem_extent * ext = get_extent_from_offset(priv, file->pos);
+		loff_t ext_off = file->pos - ext->offset;
+		size_t bytes_in_ext = min_t(size_t, ext->size - ext_off,
+					    len - bytes_copied);
+
+		if ( copy_to_user( buf + bytes_copied,
+				   __va(ext->paddr) + ext_off,
+				   bytes_in_ext) )
+			return bytes_copied ? bytes_copied : -EFAULT;
+
+		file->pos    += bytes_in_ext;
+		bytes_copied += bytes_in_ext;
+	}
 
-	len = file->pos + len > file->inode->size ?
-			file->inode->size - file->pos : len;
+	return len;
+}
 
-	{
-		size_t bytes_to_copy = len;
-		size_t bytes_copied  = 0;
-
-		while (bytes_to_copy > 0) {
-			struct in_mem_data_block * blk = get_block_from_offset(priv, file->pos);
-			size_t bytes_in_block = DATA_BLK_SIZE - (file->pos % DATA_BLK_SIZE);
-			
-			if (bytes_in_block > bytes_to_copy) {
-				bytes_in_block = bytes_to_copy;
-			}
-
-			if ( copy_to_user(  buf + bytes_copied,
-					    __va(blk->blk_paddr) + (file->pos % DATA_BLK_SIZE), 
-					     bytes_in_block) ) {
-				return -EFAULT;
-			}
-			
-			file->pos     += bytes_in_block;
-			bytes_copied  += bytes_in_block;
-			bytes_to_copy -= bytes_in_block;
-		}
+/* Grows the file's memory to cover [0, end); fop_mutex held */
+static int
+in_mem_expand(
+	struct in_mem_priv_data * priv,
+	loff_t			  end
+)
+{
+	int status;
+
+	while (end > priv->alloc_size) {
+		status = add_extent(priv, end - priv->alloc_size);
+		if (status)
+			return status;
+	}
+
+	return 0;
+}
+
+/* Copies in at file->pos, the memory is already there; fop_mutex held */
+static ssize_t
+__in_mem_write(
+        struct file *   file,
+        const char *    buf,
+        size_t          len
+)
+{
+	struct in_mem_priv_data* priv = file->private_data;
+	size_t bytes_copied = 0;
+
+	while (bytes_copied < len) {
+		struct in_mem_extent * ext = get_extent_from_offset(priv, file->pos);
+		loff_t ext_off = file->pos - ext->offset;
+		size_t bytes_in_ext = min_t(size_t, ext->size - ext_off,
+					    len - bytes_copied);
+
+		if ( copy_from_user( __va(ext->paddr) + ext_off,
+				     buf + bytes_copied,
+				     bytes_in_ext) )
+			break;
+
+		file->pos    += bytes_in_ext;
+		bytes_copied += bytes_in_ext;
 	}
 
+	if ( file->pos > file->inode->size ) {
+		file->inode->size = file->pos;
+	}
+
+	/* What got in before a fault stays written, pos already says so */
+	if ( bytes_copied < len )
+		return bytes_copied ? bytes_copied : -EFAULT;
+
 	return len;
 }
 
+static ssize_t
+in_mem_read(
+        struct file *	file,
+        char *		buf,
+        size_t          len,
+        loff_t *        off
+)
+{
+	struct in_mem_priv_data* priv = file->private_data;
+	ssize_t ret;
+
+	mutex_lock(&(priv->fop_mutex));
+	ret = __in_mem_read(file, buf, len);
+	mutex_unlock(&(priv->fop_mutex));
+
+	return ret;
+}
+
 static ssize_t
 in_mem_write(
         struct file *   file,
@@ -144,62 +324,85 @@ in_mem_write(
 )
 {
 	struct in_mem_priv_data* priv = file->private_data;
+	ssize_t ret;
+
+	mutex_lock(&(priv->fop_mutex));
+
+	ret = in_mem_expand(priv, file->pos + len);
+	if (!ret)
+		ret = __in_mem_write(file, buf, len);
 
-	if ( file->pos + len > MAX_FILE_SIZE ) 
-		return -EFBIG;
-
-	if ((file->pos + len) > (priv->num_blocks * DATA_BLK_SIZE)) {
-		/* Expand memory */
-		u64 bytes_to_add = (file->pos + len) - (priv->num_blocks * DATA_BLK_SIZE);
-		u64 blks_to_add  = (bytes_to_add + (PAGE_SIZE - 1)) / PAGE_SIZE;
-		int i;
-		
-		for (i = 0; i < blks_to_add; i++) {
-			struct in_mem_data_block * new_blk = NULL;
-			uintptr_t blk_paddr = 0; 
-
-			blk_paddr = alloc_data_page();
-			if (blk_paddr == 0) {
-				return -ENOMEM;
-			}
-
-			new_blk = kmem_alloc(sizeof(struct in_mem_data_block));
-			memset(new_blk, 0, sizeof(struct in_mem_data_block));
-
-			new_blk->blk_paddr = blk_paddr;
-			list_add_tail(&(new_blk->node), &(priv->block_list));
-			priv->num_blocks++;
+	mutex_unlock(&(priv->fop_mutex));
+	return ret;
+}
+
+static ssize_t
+in_mem_read_iter(
+        struct file *		file,
+        const struct iovec *	iov,
+        unsigned long		nr,
+        loff_t *		off
+)
+{
+	struct in_mem_priv_data* priv = file->private_data;
+	ssize_t total = 0, ret;
+	unsigned long i;
+
+	mutex_lock(&(priv->fop_mutex));
+
+	for (i = 0; i < nr; i++) {
+		ret = __in_mem_read(file, iov[i].iov_base, iov[i].iov_len);
+		if (ret < 0) {
+			if (!total)
+				total = ret;
+			break;
 		}
+
+		total += ret;
+		if (ret < iov[i].iov_len)
+			break;
 	}
-	
-	{
-		size_t bytes_to_copy = len;
-		size_t bytes_copied  = 0;
-
-		while (bytes_to_copy > 0) {
-			struct in_mem_data_block * blk = get_block_from_offset(priv, file->pos);
-			size_t bytes_in_block = DATA_BLK_SIZE - (file->pos % DATA_BLK_SIZE);
-			
-			if (bytes_in_block > bytes_to_copy) {
-				bytes_in_block = bytes_to_copy;
-			}
-
-			if ( copy_from_user( __va(blk->blk_paddr) + (file->pos % DATA_BLK_SIZE), 
-					     buf + bytes_copied, 
-					     bytes_in_block) ) {
-				return -EFAULT;
-			}
-			
-			file->pos     += bytes_in_block;
-			bytes_copied  += bytes_in_block;
-			bytes_to_copy -= bytes_in_block;
-		}
+
+	mutex_unlock(&(priv->fop_mutex));
+	return total;
+}
+
+/* Grows the file once for the whole vector, then copies each segment */
+static ssize_t
+in_mem_write_iter(
+        struct file *		file,
+        const struct iovec *	iov,
+        unsigned long		nr,
+        loff_t *		off
+)
+{
+	struct in_mem_priv_data* priv = file->private_data;
+	ssize_t total = 0, ret;
+	unsigned long i;
+
+	mutex_lock(&(priv->fop_mutex));
+
+	ret = in_mem_expand(priv, file->pos + kfs_iov_length(iov, nr));
+	if (ret) {
+		mutex_unlock(&(priv->fop_mutex));
+		return ret;
 	}
 
-	if ( file->pos > file->inode->size ) {
-		file->inode->size = file->pos;	
+	for (i = 0; i < nr; i++) {
+		ret = __in_mem_write(file, iov[i].iov_base, iov[i].iov_len);
+		if (ret < 0) {
+			if (!total)
+				total = ret;
+			break;
+		}
+
+		total += ret;
+		if (ret < iov[i].iov_len)
+			break;
 	}
-	return len;
+
+	mutex_unlock(&(priv->fop_mutex));
+	return total;
 }
 
 static ssize_t
@@ -209,78 +412,138 @@ in_mem_lseek(
 	int		whence
 )
 {
+	loff_t pos;
+
 	switch ( whence ) {
 	    case 0: /* SEEK_SET */
-		if ( offset > MAX_FILE_SIZE ) 
-			return -EINVAL; 
-		file->pos = offset;
+		pos = offset;
 		break;
 
 	     case 1: /*  SEEK_CUR */
-		if ( file->pos + offset > MAX_FILE_SIZE ) 
-			return -EINVAL; 
-		file->pos += offset;
+		pos = file->pos + offset;
 		break;
 
 	     case 2: /* SEEK_END */
-		file->pos = file->inode->size;
+		pos = file->inode->size + offset;
 		break;
 
 	     default:
 		return -EINVAL;
 	}
+
+	if ( pos < 0 )
+		return -EINVAL;
+
+	file->pos = pos;
 	return file->pos;
 }
 
-static int 
+static int
 in_mem_ioctl(
         struct file *   file,
 	int		request,
-	uaddr_t		addr	
+	uaddr_t		addr
 )
 {
 	return -EINVAL;
 }
 
+/*
+ * Map the file's extents straight into the caller's region, no copy.
+ * Both sides share the data from then on; the mapping holds a reference
+ * that the region drops when it goes away, so the memory outlives an
+ * unlink() for as long as it is mapped.
+ */
+static int
+in_mem_mmap(
+	struct file *		file,
+	struct vm_area_struct *	vma
+)
+{
+	struct in_mem_priv_data* priv = file->private_data;
+	loff_t off   = (loff_t)vma->vm_pgoff << PAGE_SHIFT;
+	vaddr_t addr = vma->vm_start;
+	int status   = 0;
+
+	mutex_lock(&(priv->fop_mutex));
+
+	if (off + (vma->vm_end - vma->vm_start) > priv->alloc_size) {
+		mutex_unlock(&(priv->fop_mutex));
+		return -ENXIO;
+	}
+
+	/* Taken before mapping anything; the region drops it either way */
+	atomic_inc(&(priv->refs));
+	status = aspace_set_region_unmap(current->aspace->id, vma->vm_start,
+					 in_mem_unmap, priv);
+	if (status) {
+		atomic_dec(&(priv->refs));
+		mutex_unlock(&(priv->fop_mutex));
+		return status;
+	}
+
+	while (addr < vma->vm_end) {
+		struct in_mem_extent * ext = get_extent_from_offset(priv, off);
+		loff_t ext_off = off - ext->offset;
+		size_t extent  = min_t(size_t, ext->size - ext_off,
+				       vma->vm_end - addr);
+
+		status = aspace_map_pmem(current->aspace->id,
+					 ext->paddr + ext_off, addr, extent);
+		if (status)
+			break;
+
+		addr += extent;
+		off  += extent;
+	}
+
+	mutex_unlock(&(priv->fop_mutex));
+	return status;
+}
+
 static int create(struct inode *inode, int mode )
 {
+	struct in_mem_priv_data * priv;
+
 	dbg("\n");
-	inode->i_private = kmem_alloc( sizeof( struct in_mem_priv_data ) );
-	INIT_LIST_HEAD(&(PRIV_DATA(inode->i_private)->block_list));
+	priv = kmem_alloc( sizeof( struct in_mem_priv_data ) );
+	if (!priv)
+		return -ENOMEM;
+
+	INIT_LIST_HEAD(&(priv->extent_list));
+	INIT_RADIX_TREE(&(priv->pages), 0);
+	mutex_init(&(priv->fop_mutex));
+	atomic_set(&(priv->refs), 1);
+
+	inode->i_private = priv;
 	inode->size = 0;
 
-	return 0;	
+	return 0;
 }
 
+/* Open files and mappings keep the data until they are done with it */
 static int unlink(struct inode *inode )
 {
-	struct in_mem_priv_data  * file_state = PRIV_DATA(inode->i_private);
-	struct in_mem_data_block * tmp        = NULL;
-	struct in_mem_data_block * blk        = NULL;
-
 	dbg("\n");
-	list_for_each_entry_safe(blk, tmp, &(file_state->block_list), node) 
-	{
-		list_del( &(blk->node) );
-		file_state->num_blocks--;
-
-		free_data_page( blk->blk_paddr );
-		kmem_free( blk );
-	}
-
-	kmem_free( inode->i_private );
-	return 0;	
+	in_mem_put( PRIV_DATA(inode->i_private) );
+	inode->i_private = NULL;
+	return 0;
 }
 
 struct inode_operations in_mem_iops = {
-	.create = create,	
+	.create = create,
 	.unlink = unlink,
 };
 
 struct kfs_fops in_mem_fops = {
 	.open = in_mem_open,
+	.close = in_mem_close,
+	.release = in_mem_release,
 	.read = in_mem_read,
 	.lseek = in_mem_lseek,
 	.write = in_mem_write,
+	.read_iter = in_mem_read_iter,
+	.write_iter = in_mem_write_iter,
 	.ioctl = in_mem_ioctl,
+	.mmap = in_mem_mmap,
 };
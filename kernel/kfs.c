@@ -6,8 +6,10 @@
 #include <lwk/print.h>
 #include <lwk/htable.h>
 #include <lwk/kfs.h>
+#include <lwk/eventpoll.h>
 #include <lwk/stat.h>
 #include <lwk/aspace.h>
+#include <lwk/hash.h>
 
 struct inode *kfs_root;
 spinlock_t _lock;
@@ -29,15 +31,18 @@ struct dirent64 {
 	char d_name [1];            /* filename (null-terminated) */
 };
 
-/** Generate a hash from a filename.
- *
- * \todo Actually perform a hash function!
- */
+/** Generate a hash from a filename, up to the / character. */
 static uint64_t
 kfs_hash_filename(const void * name,
 		  size_t       bits)
 {
-	return 0;
+	const char * c = name;
+	uint64_t hash = 0;
+
+	for (; *c != '\0' && *c != '/'; c++)
+		hash = hash * 31 + (unsigned char)*c;
+
+	return hash_64(hash, bits);
 }
 
 /** Look for a filename up to the / character in the search term.
@@ -407,8 +412,10 @@ kfs_mkdirent(struct inode *          parent,
 		inode->name[offset] = '\0';
 	}
 
-	if( parent && new_entry )
+	if( parent && new_entry ) {
 		htable_add( parent->files, inode );
+		kfs_dcache_note_create();
+	}
 
 	return inode;
 }
@@ -419,6 +426,10 @@ kfs_destroy(struct inode *inode)
 	// Should we check ref counts?
 	/* TODO: yes, we should. but not right now. */
 	//_KDBG("%p %d\n",inode,atomic_read(&inode->i_count));
+
+	/* callers have just taken it out of its parent's table */
+	kfs_dcache_note_remove();
+
 	if ( atomic_read(&inode->i_count ) == 0 ) {
 		if ( inode->files )
 			htable_destroy( inode->files );
@@ -426,17 +437,11 @@ kfs_destroy(struct inode *inode)
 	}
 }
 
-struct inode *
-kfs_lookup(struct inode *       root,
-	   const char *		dirname,
-	   unsigned		create_mode)
+static struct inode *
+__kfs_lookup(struct inode *     root,
+	     const char *	dirname,
+	     unsigned		create_mode)
 {
-	dbg("name=`%s`\n", dirname );
-
-	// Special case -- use the root if root is null.
-	if( !root )
-		root = kfs_root;
-
 	while(1)
 	{
 		/* resolve possible link */
@@ -504,6 +509,33 @@ kfs_lookup(struct inode *       root,
 	}
 }
 
+struct inode *
+kfs_lookup(struct inode *       root,
+	   const char *		dirname,
+	   unsigned		create_mode)
+{
+	struct kfs_dcache_cookie cookie;
+	struct inode * inode;
+
+	dbg("name=`%s`\n", dirname );
+
+	// Special case -- use the root if root is null.
+	if( !root )
+		root = kfs_root;
+
+	// Creating lookups modify the tree, only plain ones are cached
+	if( create_mode )
+		return __kfs_lookup( root, dirname, create_mode );
+
+	if( kfs_dcache_lookup( root, dirname, &inode, &cookie ) == 0 )
+		return inode;
+
+	inode = __kfs_lookup( root, dirname, 0 );
+	kfs_dcache_insert( root, dirname, inode, &cookie );
+
+	return inode;
+}
+
 
 struct inode *
 kfs_create_at(struct inode                  * root_inode,
@@ -644,25 +676,56 @@ kfs_link(struct inode *target, struct inode *parent, const char *name)
 
 	link->parent = parent;
 	htable_add(parent->files, link);
+	kfs_dcache_note_create();
 
 	return link;
 }
 
+/*
+ * struct file memory is never handed back to kmem. fdTableGetFile() may
+ * bump f_count on a file that is concurrently being closed, so a closed
+ * file has to stay a struct file, with f_count at zero, until it is reused.
+ */
+static struct file *file_cache;
+static DEFINE_SPINLOCK(file_cache_lock);
+
+struct file *
+kfs_alloc_file(void)
+{
+	struct file *file;
+	unsigned long flags;
+
+	spin_lock_irqsave(&file_cache_lock, flags);
+	file = file_cache;
+	if (file)
+		file_cache = file->f_next_free;
+	spin_unlock_irqrestore(&file_cache_lock, flags);
+
+	if (NULL == file)
+		file = kmem_alloc(sizeof(struct file));
+	if (NULL == file)
+		return NULL;
+
+	memset(file, 0x00, sizeof(struct file));
+	list_head_init(&file->f_ep_links);
+	smp_wmb();
+	atomic_set(&file->f_count, 1);
+
+	return file;
+}
+
 static struct file *
 kfs_open(struct inode *inode, int flags, mode_t mode)
 {
-	struct file *file = kmem_alloc(sizeof(struct file));
+	struct file *file = kfs_alloc_file();
 
 	if(NULL == file)
 		return NULL;
 
-	memset(file, 0x00, sizeof(struct file));
-
 	file->f_flags = flags;
 	file->f_mode = mode;
 	file->f_op = inode->i_fop;
 	file->inode = inode;
-	atomic_set(&file->f_count,1);
 	atomic_inc(&inode->i_count);
 
 	return file;
@@ -671,6 +734,8 @@ kfs_open(struct inode *inode, int flags, mode_t mode)
 void
 kfs_close(struct file *file)
 {
+	unsigned long flags;
+
 	// if this file was allocated with alloc_file it will not have
 	// an inode
 	if ( file->inode ) {
@@ -678,7 +743,34 @@ kfs_close(struct file *file)
         	dbg("name=`%s`\n", get_full_path( file->inode, buff) );
 		atomic_dec(&file->inode->i_count);
 	}
-	kmem_free(file);
+
+	atomic_set(&file->f_count, 0);
+
+	spin_lock_irqsave(&file_cache_lock, flags);
+	file->f_next_free = file_cache;
+	file_cache = file;
+	spin_unlock_irqrestore(&file_cache_lock, flags);
+}
+
+/*
+ * Drop a reference held by an fd slot, fdTableGetFile() or fget(). The
+ * last one closes the file and returns the result of its close op.
+ */
+int
+kfs_put_file(struct file *file)
+{
+	int ret = 0;
+
+	if (!atomic_dec_and_test(&file->f_count))
+		return 0;
+
+	eventpoll_release(file);
+
+	if (file->f_op && file->f_op->close)
+		ret = file->f_op->close(file);
+
+	kfs_close(file);
+	return ret;
 }
 
 
@@ -727,24 +819,21 @@ kfs_open_path(const char *pathname, int flags, mode_t mode, struct file **rv)
 int
 kfs_open_anon(const struct kfs_fops * fops, void * priv_data)
 {
-    struct file * file = kmem_alloc(sizeof(struct file));
+    struct file * file = kfs_alloc_file();
     int fd = 0;
 
     if (NULL == file)
 	return -ENOMEM;
 
-    memset(file, 0x00, sizeof(struct file));
-
     file->f_op = fops;
     file->private_data = priv_data;
-    atomic_set(&file->f_count, 1);
 
-    __lock(&_lock);
-    {
-	if ((fd = fdTableGetUnused( current->fdTable )) > 0)
-	    fdTableInstallFd( current->fdTable, fd, file );
+    if ((fd = fdTableGetUnused( current->fdTable )) < 0) {
+	kfs_close(file);
+	return fd;
     }
-    __unlock(&_lock);
+
+    fdTableInstallFd( current->fdTable, fd, file );
 
     return fd;
 }
@@ -759,16 +848,14 @@ void kfs_init_stdio(struct task_struct *task)
 	//printk("kfs_init_stdio(): task_id=%d, user_id=%d\n", task->id, task->uid);
 
 	dbg("\n");
-	struct file * console;
-        if(kfs_open_path("/dev/console", 0, 0, &console ))
-                panic( "Unable to open /dev/console?" );
-        tbl->files[ 0 ] = console;
-        if(kfs_open_path("/dev/console", 0, 0, &console ))
-                panic( "Unable to open /dev/console?" );
-        tbl->files[ 1 ] = console;
-        if(kfs_open_path("/dev/console", 0, 0, &console ))
-                panic( "Unable to open /dev/console?" );
-        tbl->files[ 2 ] = console;
+	struct file * console, * old;
+	int fd;
+	for ( fd = 0; fd < 3; fd++ ) {
+		if(kfs_open_path("/dev/console", 0, 0, &console ))
+			panic( "Unable to open /dev/console?" );
+		if ( fdTableReplaceFd( tbl, fd, console, &old ) || old )
+			panic( "Unable to install /dev/console as fd %d?", fd );
+	}
 
 	/* the process's pipes are stored here */
 	// TODO - the permissions are probably wrong
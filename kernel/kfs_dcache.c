@@ -0,0 +1,230 @@
+/** \file
+ * Path lookup cache for the kernel VFS.
+ *
+ * kfs_lookup() walks the tree one component at a time from its starting
+ * inode. The results of plain (non-creating) lookups, misses included,
+ * are remembered here keyed by starting inode and path, so the same opens
+ * and stats repeated over and over, or a loader probing every directory
+ * on its library path, skip the walk.
+ *
+ * Every entry records the generation it was looked up under. Adding a name
+ * to the tree bumps the negative generation and removing one bumps the
+ * positive generation, which retires all entries of that kind at once.
+ */
+#include <lwk/kernel.h>
+#include <lwk/kmem.h>
+#include <lwk/list.h>
+#include <lwk/hash.h>
+#include <lwk/string.h>
+#include <lwk/spinlock.h>
+#include <lwk/kfs.h>
+
+#define KFS_DCACHE_HASH_BITS	10
+#define KFS_DCACHE_MAX_ENTRIES	4096
+
+struct kfs_dentry {
+	struct hlist_node	hash_link;
+	struct list_head	lru_link;
+
+	unsigned long		hash;
+	struct inode *		root;
+	struct inode *		inode;		/* NULL for a known-missing path */
+	unsigned long		generation;
+	char			path[0];
+};
+
+static struct hlist_head	dcache_buckets[1 << KFS_DCACHE_HASH_BITS];
+static LIST_HEAD(dcache_lru);			/* most recently used first */
+static unsigned int		dcache_nr_entries;
+static DEFINE_SPINLOCK(dcache_lock);
+
+static unsigned long		dcache_pos_generation;
+static unsigned long		dcache_neg_generation;
+
+
+static const char *
+skip_slashes(const char * path)
+{
+	while (*path == '/')
+		path++;
+	return path;
+}
+
+static unsigned long
+path_hash(struct inode * root,
+	  const char   * path)
+{
+	unsigned long hash = (unsigned long)root;
+
+	for (; *path != '\0'; path++)
+		hash = hash * 31 + (unsigned char)*path;
+
+	return hash;
+}
+
+static struct hlist_head *
+path_bucket(unsigned long hash)
+{
+	return &dcache_buckets[hash_long(hash, KFS_DCACHE_HASH_BITS)];
+}
+
+static bool
+__dentry_valid(struct kfs_dentry * dentry)
+{
+	if (dentry->inode)
+		return dentry->generation == dcache_pos_generation;
+
+	return dentry->generation == dcache_neg_generation;
+}
+
+static void
+__dentry_remove(struct kfs_dentry * dentry)
+{
+	hlist_del(&dentry->hash_link);
+	list_del(&dentry->lru_link);
+	dcache_nr_entries--;
+	kmem_free(dentry);
+}
+
+static struct kfs_dentry *
+__dentry_find(struct inode  * root,
+	      const char    * path,
+	      unsigned long   hash)
+{
+	struct kfs_dentry * dentry;
+	struct hlist_node * pos;
+
+	hlist_for_each_entry(dentry, pos, path_bucket(hash), hash_link) {
+		if ((dentry->hash == hash) && (dentry->root == root) &&
+		    (strcmp(dentry->path, path) == 0))
+			return dentry;
+	}
+
+	return NULL;
+}
+
+
+/**
+ * Look up a cached result for (root, path).
+ *
+ * \returns 0 with the cached inode, possibly NULL for a known miss, in
+ * *inode; or -ENOENT if the cache can't answer. In that case *cookie
+ * records the current generations and must be handed to
+ * kfs_dcache_insert() along with the result of the real walk.
+ */
+int
+kfs_dcache_lookup(struct inode             * root,
+		  const char               * path,
+		  struct inode            ** inode,
+		  struct kfs_dcache_cookie * cookie)
+{
+	struct kfs_dentry * dentry;
+	unsigned long       hash;
+	int                 status = -ENOENT;
+
+	path = skip_slashes(path);
+	hash = path_hash(root, path);
+
+	spin_lock(&dcache_lock);
+
+	cookie->pos_generation = dcache_pos_generation;
+	cookie->neg_generation = dcache_neg_generation;
+
+	dentry = __dentry_find(root, path, hash);
+	if (dentry && !__dentry_valid(dentry)) {
+		__dentry_remove(dentry);
+		dentry = NULL;
+	}
+
+	if (dentry) {
+		list_move(&dentry->lru_link, &dcache_lru);
+		*inode = dentry->inode;
+		status = 0;
+	}
+
+	spin_unlock(&dcache_lock);
+
+	return status;
+}
+
+/**
+ * Remember the result of walking (root, path). Dropped if the tree changed
+ * in a way that matters to it since the cookie was taken.
+ */
+void
+kfs_dcache_insert(struct inode             * root,
+		  const char               * path,
+		  struct inode             * inode,
+		  struct kfs_dcache_cookie * cookie)
+{
+	struct kfs_dentry * dentry, * old;
+	size_t              path_len;
+
+	path     = skip_slashes(path);
+	path_len = strlen(path) + 1;
+
+	dentry = kmem_alloc(sizeof(struct kfs_dentry) + path_len);
+	if (!dentry)
+		return;
+
+	memcpy(dentry->path, path, path_len);
+	dentry->hash       = path_hash(root, path);
+	dentry->root       = root;
+	dentry->inode      = inode;
+	dentry->generation = (inode) ? cookie->pos_generation
+				     : cookie->neg_generation;
+
+	spin_lock(&dcache_lock);
+
+	if (!__dentry_valid(dentry)) {
+		spin_unlock(&dcache_lock);
+		kmem_free(dentry);
+		return;
+	}
+
+	old = __dentry_find(root, dentry->path, dentry->hash);
+	if (old)
+		__dentry_remove(old);
+
+	if (dcache_nr_entries >= KFS_DCACHE_MAX_ENTRIES) {
+		old = list_entry(dcache_lru.prev, struct kfs_dentry, lru_link);
+		__dentry_remove(old);
+	}
+
+	hlist_add_head(&dentry->hash_link, path_bucket(dentry->hash));
+	list_add(&dentry->lru_link, &dcache_lru);
+	dcache_nr_entries++;
+
+	spin_unlock(&dcache_lock);
+}
+
+/** A name was added to the tree: known misses may now exist. */
+void
+kfs_dcache_note_create(void)
+{
+	spin_lock(&dcache_lock);
+	dcache_neg_generation++;
+	spin_unlock(&dcache_lock);
+}
+
+/** A name was removed from the tree: cached inodes may be gone. */
+void
+kfs_dcache_note_remove(void)
+{
+	spin_lock(&dcache_lock);
+	dcache_pos_generation++;
+	spin_unlock(&dcache_lock);
+}
+
+/**
+ * Forget everything. For mounted filesystems whose i_op->lookup results
+ * change behind kfs' back.
+ */
+void
+kfs_dcache_invalidate(void)
+{
+	spin_lock(&dcache_lock);
+	dcache_pos_generation++;
+	dcache_neg_generation++;
+	spin_unlock(&dcache_lock);
+}
@@ -0,0 +1,158 @@
+/** \file
+ * Vectored reads and writes for kfs files.
+ *
+ * readv() and writev() copy the user's iovec array in with a single copy
+ * and hand it to the file's read_iter/write_iter, which can then take its
+ * locks and wake its waiters once for the whole call instead of once per
+ * segment. Files that don't implement them get one read()/write() per
+ * segment, stopping at the first short transfer as a single call would.
+ */
+#include <lwk/kernel.h>
+#include <lwk/kmem.h>
+#include <lwk/kfs.h>
+#include <lwk/uio.h>
+#include <arch/uaccess.h>
+
+/**
+ * Copies in and validates nr iovecs from user space. Small arrays land in
+ * fast, larger ones in a kmem allocation that the caller frees when
+ * *iovp != fast. Returns the total length or a negative error.
+ */
+ssize_t
+kfs_import_iovec(const struct iovec __user * uvec,
+		 unsigned long nr,
+		 struct iovec * fast,
+		 struct iovec ** iovp)
+{
+	struct iovec * iov = fast;
+	ssize_t total = 0;
+	ssize_t ret;
+	unsigned long i;
+
+	if (nr > KFS_IOV_MAX)
+		return -EINVAL;
+
+	if (nr > KFS_IOV_FAST) {
+		iov = kmem_alloc(nr * sizeof(struct iovec));
+		if (!iov)
+			return -ENOMEM;
+	}
+
+	if (copy_from_user(iov, uvec, nr * sizeof(struct iovec))) {
+		ret = -EFAULT;
+		goto err;
+	}
+
+	for (i = 0; i < nr; i++) {
+		/* The total has to fit the return value */
+		if (iov[i].iov_len > (size_t)(LONG_MAX - total)) {
+			ret = -EINVAL;
+			goto err;
+		}
+		total += iov[i].iov_len;
+	}
+
+	*iovp = iov;
+	return total;
+
+err:
+	if (iov != fast)
+		kmem_free(iov);
+	return ret;
+}
+
+size_t
+kfs_iov_length(const struct iovec * iov, unsigned long nr)
+{
+	size_t total = 0;
+
+	while (nr--)
+		total += (iov++)->iov_len;
+
+	return total;
+}
+
+static ssize_t
+kfs_rw_segments(struct file * file,
+		const struct iovec * iov,
+		unsigned long nr,
+		int write)
+{
+	ssize_t ret = 0, tret;
+	unsigned long i;
+
+	for (i = 0; i < nr; i++) {
+		if (!iov[i].iov_len)
+			continue;
+
+		if (write)
+			tret = file->f_op->write(file, iov[i].iov_base,
+						 iov[i].iov_len, NULL);
+		else
+			tret = file->f_op->read(file, iov[i].iov_base,
+						iov[i].iov_len, NULL);
+
+		if (tret < 0) {
+			if (!ret)
+				ret = tret;
+			break;
+		}
+
+		ret += tret;
+		if (tret < iov[i].iov_len)
+			break;
+	}
+
+	return ret;
+}
+
+static ssize_t
+kfs_rw_iov(struct file * file,
+	   const struct iovec __user * uvec,
+	   unsigned long nr,
+	   int write)
+{
+	struct iovec fast[KFS_IOV_FAST], * iov;
+	ssize_t ret;
+
+	ret = kfs_import_iovec(uvec, nr, fast, &iov);
+	if (ret < 0)
+		return ret;
+
+	/* An empty vector has nothing to move and nothing to block for */
+	if (ret > 0) {
+		if (write && file->f_op->write_iter)
+			ret = file->f_op->write_iter(file, iov, nr, NULL);
+		else if (!write && file->f_op->read_iter)
+			ret = file->f_op->read_iter(file, iov, nr, NULL);
+		else
+			ret = kfs_rw_segments(file, iov, nr, write);
+	}
+
+	if (iov != fast)
+		kmem_free(iov);
+
+	return ret;
+}
+
+ssize_t
+kfs_readv(struct file * file,
+	  const struct iovec __user * uvec,
+	  unsigned long nr)
+{
+	if (!file->f_op->read_iter && !file->f_op->read)
+		return -EINVAL;
+
+	return kfs_rw_iov(file, uvec, nr, 0);
+}
+
+ssize_t
+kfs_writev(struct file * file,
+	   const struct iovec __user * uvec,
+	   unsigned long nr)
+{
+	if (!file->f_op->write_iter && !file->f_op->write)
+		return -EINVAL;
+
+	return kfs_rw_iov(file, uvec, nr, 1);
+}
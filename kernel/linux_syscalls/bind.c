@@ -0,0 +1,21 @@
+#include <lwk/kernel.h>
+#include <lwk/kfs.h>
+#include <lwk/unix_socket.h>
+
+int
+sys_bind(int sockfd, const void __user *addr, int addrlen)
+{
+	struct file *file = fdTableGetFile(current->fdTable, sockfd);
+	int ret;
+
+	if (!file)
+		return -EBADF;
+
+	if (is_unix_socket(file))
+		ret = unix_bind(file, addr, addrlen);
+	else
+		ret = -ENOTSOCK;
+
+	kfs_put_file(file);
+	return ret;
+}
@@ -1,12 +1,18 @@
-/* TODO: This is stubbed out to make libevent happy. */
-
 #include <lwk/kernel.h>
-
-typedef uint32_t socklen_t;
-struct sockaddr {};
+#include <lwk/kfs.h>
+#include <lwk/unix_socket.h>
 
 int
-sys_connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
+sys_connect(int sockfd, const void __user *addr, int addrlen)
 {
-	return 0;
+	struct file *file = fdTableGetFile(current->fdTable, sockfd);
+	int ret = 0;
+
+	/* TODO: Other sockets are stubbed out to make libevent happy. */
+	if (file && is_unix_socket(file))
+		ret = unix_connect(file, addr, addrlen);
+
+	if (file)
+		kfs_put_file(file);
+	return ret;
 }
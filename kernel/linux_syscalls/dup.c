@@ -1,19 +1,25 @@
 #include <lwk/kernel.h>
 #include <lwk/task.h>
-#include <lwk/fdTable.h>
+#include <lwk/kfs.h>
 
 int
 sys_dup(
 	unsigned int 		filedes
 )
 {
-	int ret = -EBADF;
-	unsigned int newfd;
-	struct file *file = fdTableFile( current->fdTable, filedes );
+	int newfd;
+	struct file *file = fdTableGetFile( current->fdTable, filedes );
 
+	if( !file )
+		return -EBADF;
+
+	// the reference taken above becomes the new fd's
 	newfd = fdTableGetUnused( current->fdTable );
-	fdTableInstallFd( current->fdTable, newfd, file );
+	if( newfd < 0 ) {
+		kfs_put_file( file );
+		return newfd;
+	}
 
-	ret = newfd;
-	return ret;
+	fdTableInstallFd( current->fdTable, newfd, file );
+	return newfd;
 }
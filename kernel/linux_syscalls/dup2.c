@@ -4,23 +4,29 @@ int
 sys_dup2(int oldfd,
 	 int newfd)
 {
-	int ret = -EBADF;
-	struct file * const oldfile = get_current_file( oldfd );
+	int ret;
+	struct file * old_newfile;
+	struct file * const oldfile = fdTableGetFile( current->fdTable, oldfd );
 
 //	dbg("oldfd=%d newfd=%d\n",oldfd,newfd);
 	if( !oldfile )
-		goto out;
+		return -EBADF;
 
-	if( newfd < 0 || newfd > MAX_FILES )
-		goto out;
+	if( oldfd == newfd ) {
+		kfs_put_file( oldfile );
+		return newfd;
+	}
 
-//	sys_close( newfd );
+	// the reference taken above becomes newfd's
+	ret = fdTableReplaceFd( current->fdTable, newfd, oldfile, &old_newfile );
+	if( ret ) {
+		kfs_put_file( oldfile );
+		return ret;
+	}
 
-//	atomic_inc( &oldfile->f_count );
+	// silently close whatever newfd referred to before
+	if( old_newfile )
+		kfs_put_file( old_newfile );
 
-	fdTableInstallFd( current->fdTable, newfd, oldfile );
-out:
-	return ret;
+	return newfd;
 }
-
-
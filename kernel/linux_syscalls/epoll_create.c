@@ -0,0 +1,12 @@
+#include <lwk/kernel.h>
+#include <lwk/eventpoll.h>
+
+int
+sys_epoll_create(int size)
+{
+	/* size is only a hint, but it must be positive */
+	if (size <= 0)
+		return -EINVAL;
+
+	return eventpoll_create(0);
+}
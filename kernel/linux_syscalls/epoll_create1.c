@@ -0,0 +1,8 @@
+#include <lwk/kernel.h>
+#include <lwk/eventpoll.h>
+
+int
+sys_epoll_create1(int flags)
+{
+	return eventpoll_create(flags);
+}
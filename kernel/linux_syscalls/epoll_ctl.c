@@ -0,0 +1,17 @@
+#include <lwk/kernel.h>
+#include <lwk/eventpoll.h>
+#include <arch/uaccess.h>
+
+int
+sys_epoll_ctl(int epfd, int op, int fd, struct epoll_event __user *event)
+{
+	struct epoll_event epds;
+
+	if (op == EPOLL_CTL_DEL)
+		return eventpoll_ctl(epfd, op, fd, NULL);
+
+	if (copy_from_user(&epds, event, sizeof(epds)))
+		return -EFAULT;
+
+	return eventpoll_ctl(epfd, op, fd, &epds);
+}
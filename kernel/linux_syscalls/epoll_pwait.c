@@ -0,0 +1,41 @@
+#include <lwk/kernel.h>
+#include <lwk/task.h>
+#include <lwk/signal.h>
+#include <lwk/eventpoll.h>
+#include <arch/uaccess.h>
+
+int
+sys_epoll_pwait(int epfd, struct epoll_event __user *events,
+		int maxevents, int timeout,
+		const sigset_t __user *sigmask, size_t sigsetsize)
+{
+	sigset_t ksigmask, sigsaved;
+	int ret;
+
+	if (sigmask) {
+		if (sigsetsize != sizeof(sigset_t))
+			return -EINVAL;
+		if (copy_from_user(&ksigmask, sigmask, sizeof(ksigmask)))
+			return -EFAULT;
+		sigset_del(&ksigmask, SIGKILL);
+		sigset_del(&ksigmask, SIGSTOP);
+		sigprocmask(SIG_SETMASK, &ksigmask, &sigsaved);
+	}
+
+	ret = eventpoll_wait(epfd, events, maxevents, timeout);
+
+	if (sigmask) {
+		/*
+		 * Leave the caller's mask for do_signal() to restore once the
+		 * signal that interrupted us has been delivered.
+		 */
+		if (ret == -EINTR) {
+			memcpy(&current->saved_sigmask, &sigsaved,
+			       sizeof(sigsaved));
+			ret = -ERESTARTNOHAND;
+		} else
+			sigprocmask(SIG_SETMASK, &sigsaved, NULL);
+	}
+
+	return ret;
+}
@@ -0,0 +1,9 @@
+#include <lwk/kernel.h>
+#include <lwk/eventpoll.h>
+
+int
+sys_epoll_wait(int epfd, struct epoll_event __user *events,
+	       int maxevents, int timeout)
+{
+	return eventpoll_wait(epfd, events, maxevents, timeout);
+}
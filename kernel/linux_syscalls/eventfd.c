@@ -0,0 +1,8 @@
+#include <lwk/kernel.h>
+#include <lwk/eventfd.h>
+
+int
+sys_eventfd(unsigned int initval)
+{
+	return eventfd_create(initval, 0);
+}
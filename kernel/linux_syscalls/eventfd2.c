@@ -1,7 +1,8 @@
-/* TODO: This is stubbed out to make libevent happy. */
+#include <lwk/kernel.h>
+#include <lwk/eventfd.h>
 
 int
 sys_eventfd2(unsigned int initval, int flags)
 {
-	return 0;
+	return eventfd_create(initval, flags);
 }
@@ -1,4 +1,5 @@
 #include <lwk/kfs.h>
+#include <lwk/fifo.h>
 #include <lwip/sockets.h>
 
 
@@ -46,6 +47,12 @@ sys_fcntl(int fd, int cmd, long arg)
             }
             ret = lwip_fcntl(lwip_from_fd(fd), cmd, arg);
             break;
+        case F_SETPIPE_SZ:
+        case F_GETPIPE_SZ:
+            if (get_current_file(fd) == NULL)
+                return -EBADF;
+            ret = fifo_fcntl(get_current_file(fd), cmd, arg);
+            break;
         default:
             ret = -EINVAL;
             break;
@@ -81,6 +88,10 @@ sys_fcntl(unsigned int fd, unsigned int cmd, unsigned long arg)
 		   though */
 		ret = 0;
 		break;
+	case F_SETPIPE_SZ:
+	case F_GETPIPE_SZ:
+		ret = fifo_fcntl(file, cmd, arg);
+		break;
 	default:
 		ret = -EINVAL;
 		break;
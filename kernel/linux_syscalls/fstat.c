@@ -4,9 +4,9 @@ int
 sys_fstat(int fd, uaddr_t buf)
 {
 	int ret = -EBADF;
-	struct file * const file = get_current_file( fd );
+	struct file * const file = fdTableGetFile( current->fdTable, fd );
 	if( !file )
-		goto out;
+		return ret;
 
 __lock(&_lock);
 	if(file->inode)
@@ -14,7 +14,8 @@ __lock(&_lock);
 	else
 		printk(KERN_WARNING
 		"Attempting fstat() on fd %d with no backing inode.\n", fd);
-out:
 __unlock(&_lock);
+
+	kfs_put_file( file );
 	return ret;
 }
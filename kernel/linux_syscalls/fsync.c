@@ -0,0 +1,30 @@
+#include <lwk/kernel.h>
+#include <lwk/task.h>
+#include <lwk/kfs.h>
+
+int
+sys_fsync(
+	unsigned int		fd
+)
+{
+	struct file *file = fdTableGetFile( current->fdTable, fd );
+	int ret = 0;
+
+	if( !file )
+		return -EBADF;
+
+	// files without an fsync op have nothing cached on their behalf
+	if( file->f_op && file->f_op->fsync )
+		ret = file->f_op->fsync( file );
+
+	kfs_put_file( file );
+	return ret;
+}
+
+int
+sys_fdatasync(
+	unsigned int		fd
+)
+{
+	return sys_fsync( fd );
+}
@@ -0,0 +1,21 @@
+#include <lwk/kernel.h>
+#include <lwk/kfs.h>
+#include <lwk/unix_socket.h>
+
+int
+sys_getpeername(int sockfd, void __user *addr, int __user *addrlen)
+{
+	struct file *file = fdTableGetFile(current->fdTable, sockfd);
+	int ret;
+
+	if (!file)
+		return -EBADF;
+
+	if (is_unix_socket(file))
+		ret = unix_getname(file, addr, addrlen, true);
+	else
+		ret = -ENOTSOCK;
+
+	kfs_put_file(file);
+	return ret;
+}
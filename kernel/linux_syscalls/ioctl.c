@@ -6,7 +6,7 @@ sys_ioctl(unsigned int  fd,
 	  unsigned long arg)
 {
 	int ret = -EBADF;
-	struct file * const file = get_current_file( fd );
+	struct file * const file = fdTableGetFile( current->fdTable, fd );
 	if( !file )
 		goto out;
 
@@ -20,6 +20,8 @@ sys_ioctl(unsigned int  fd,
 		printk("sys_ioctl %s : no ioctl!\n",file->inode->name);
 		ret = -ENOTTY;
 	}
+
+	kfs_put_file( file );
 out:
 	return ret;
 }
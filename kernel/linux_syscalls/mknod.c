@@ -1,4 +1,5 @@
 #include <lwk/kfs.h>
+#include <lwk/fifo.h>
 #include <arch/uaccess.h>
 
 int
@@ -11,8 +12,6 @@ sys_mknod(uaddr_t u_pathname, mode_t  mode, dev_t dev)
 
 	dbg( "name='%s' \n", pathname);
 
-	extern int mkfifo( const char*, mode_t );
-
 __lock(&_lock);
 	int ret = mkfifo( pathname, 0777 );
 __unlock(&_lock);
@@ -1,4 +1,5 @@
 #include <lwk/kfs.h>
+#include <lwk/fifo.h>
 #include <arch/uaccess.h>
 #include <arch-generic/fcntl.h>
 
@@ -28,8 +29,6 @@ sys_mknodat(int dirfd, uaddr_t u_pathname, mode_t  mode, dev_t dev)
 	    root_inode = root_file->inode;
 	}
 
-	extern int mkfifo_at( struct inode *, const char*, mode_t );
-
 __lock(&_lock);
 	int ret = mkfifo_at( root_inode, pathname, 0777 );
 __unlock(&_lock);
@@ -18,6 +18,9 @@ sys_mmap(
 	struct file *file;
 	struct vm_area_struct vma;
 	unsigned long mmap_brk;
+	vmflags_t vmflags;
+	vmpagesize_t pagesz;
+	size_t align;
 	int rv;
 
 	/* printk("[%s] SYS_MMAP: fd=%lu, addr=%lx, len=%lu\n", current->name, fd, addr, len); */
@@ -25,11 +28,13 @@ sys_mmap(
 	if (len != round_up(len, PAGE_SIZE))
 		return -EINVAL;
 
-	/* we only support anonymous private mapping; file-backed
-	   private mapping has copy-on-write semantics, which we don't
-	   want due to complete lack of any pagefaulting resolution */
+	/* we only support anonymous private mapping and read-only
+	   file-backed private mappings; a writable one has copy-on-write
+	   semantics, which we don't want due to complete lack of any
+	   pagefaulting resolution */
 
-	if((flags & MAP_PRIVATE) && !(flags & MAP_ANONYMOUS))
+	if((flags & MAP_PRIVATE) && !(flags & MAP_ANONYMOUS) &&
+	   (prot & PROT_WRITE))
 		return -EINVAL;
 
 	/* anonymous mappings (not backed by a file) are handled specially */
@@ -78,15 +83,29 @@ sys_mmap(
 	   NULL == file->f_op->mmap)
 		return -ENODEV;
 
+	if (off & (PAGE_SIZE - 1))
+		return -EINVAL;
+
+	vmflags = VM_READ|VM_USER;
+	if (prot & PROT_WRITE)
+		vmflags |= VM_WRITE;
+
+	/* let the driver use large pages when the mapping is big enough */
+	align  = PAGE_SIZE;
+	pagesz = VM_PAGE_4KB;
+	if (len >= VM_PAGE_2MB) {
+		align   = VM_PAGE_2MB;
+		pagesz |= VM_PAGE_2MB;
+	}
+
 	spin_lock(&as->lock);
-	if ((rv = __aspace_find_hole(as, addr, len, PAGE_SIZE, &addr))) {
+	if ((rv = __aspace_find_hole(as, addr, len, align, &addr))) {
 		spin_unlock(&as->lock);
 		return -ENOMEM;
 	}
 
-	if ((rv = __aspace_add_region(as, addr, len,
-				      VM_READ|VM_WRITE|VM_USER,
-				      PAGE_SIZE, "mmap"))) {
+	if ((rv = __aspace_add_region(as, addr, len, vmflags,
+				      pagesz, "mmap"))) {
 		/* assuming there is no race between find_hole and
 		   add_region, as we're holding the as->lock, this
 		   failure can't be due to someone adding our region
@@ -99,8 +118,8 @@ sys_mmap(
 	/* fill the vm_area_struct to keep compatible with linux layer */
 	vma.vm_start = addr;
 	vma.vm_end = addr + len;
-	vma.vm_page_prot = __pgprot(VM_READ|VM_WRITE);
-	vma.vm_pgoff = 0;
+	vma.vm_page_prot = __pgprot(vmflags & (VM_READ|VM_WRITE));
+	vma.vm_pgoff = off >> PAGE_SHIFT;
 
 	rv = file->f_op->mmap(file, &vma);
 	if(rv) {
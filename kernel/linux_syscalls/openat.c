@@ -62,6 +62,10 @@ __lock(&_lock);
 		goto out;
 	}
 	fd = fdTableGetUnused( current->fdTable );
+	if( fd < 0 ) {
+		kfs_put_file( file );
+		goto out;
+	}
 	fdTableInstallFd( current->fdTable, fd, file );
 
 	// TODO XXX - check to see if the file's path identifies it as a pipe, and set the pipe stuff
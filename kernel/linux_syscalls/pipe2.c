@@ -1,18 +1,32 @@
 #include <lwk/kfs.h>
+#include <lwk/fifo.h>
+#include <arch/uaccess.h>
 #include <arch-generic/fcntl.h>
 
+extern ssize_t
+sys_close(int fd);
+
 int
-sys_pipe2(int fd[2], int flags)
+sys_pipe2(int __user fd[2], int flags)
 {
-	int ret = -EFAULT;
-	int fd_read, fd_write;
+	int fds[2];
+	int ret;
 
-	if (flags == 0) {
-		return sys_pipe(fd);
-	} else {
+	/* There is no exec, so O_CLOEXEC has nothing to do */
+	if (flags & ~(O_NONBLOCK | O_CLOEXEC)) {
 		printk("Unimplemented pipe2 flags (%x)\n", flags);
 		return -EINVAL;
 	}
 
-}
+	ret = fifo_pipe(fds, flags);
+	if (ret)
+		return ret;
 
+	if (copy_to_user(fd, fds, sizeof(fds))) {
+		sys_close(fds[0]);
+		sys_close(fds[1]);
+		return -EFAULT;
+	}
+
+	return 0;
+}
@@ -0,0 +1,22 @@
+#include <lwk/kernel.h>
+#include <lwk/kfs.h>
+#include <lwk/unix_socket.h>
+
+ssize_t
+sys_recvfrom(int sockfd, void __user *buf, size_t len, int flags,
+	     void __user *src_addr, int __user *addrlen)
+{
+	struct file *file = fdTableGetFile(current->fdTable, sockfd);
+	ssize_t ret;
+
+	if (!file)
+		return -EBADF;
+
+	if (is_unix_socket(file))
+		ret = unix_recvfrom(file, buf, len, flags, src_addr, addrlen);
+	else
+		ret = -ENOTSOCK;
+
+	kfs_put_file(file);
+	return ret;
+}
@@ -0,0 +1,21 @@
+#include <lwk/kernel.h>
+#include <lwk/kfs.h>
+#include <lwk/unix_socket.h>
+
+ssize_t
+sys_sendmsg(int sockfd, const struct user_msghdr __user *msg, int flags)
+{
+	struct file *file = fdTableGetFile(current->fdTable, sockfd);
+	ssize_t ret;
+
+	if (!file)
+		return -EBADF;
+
+	if (is_unix_socket(file))
+		ret = unix_sendmsg(file, msg, flags);
+	else
+		ret = -ENOTSOCK;
+
+	kfs_put_file(file);
+	return ret;
+}
@@ -1,17 +1,25 @@
-/* TODO: This is stubbed out to make libevent happy. */
-
 #include <lwk/kernel.h>
+#include <lwk/kfs.h>
+#include <lwk/unix_socket.h>
 #include <arch/unistd.h>
 
-typedef uint32_t socklen_t;
-struct sockaddr {};
-
 extern ssize_t sys_write(int fd, uaddr_t buf, size_t len);
 
 ssize_t
 sys_sendto(int sockfd, uaddr_t buf, size_t len, int flags,
-           const struct sockaddr *dest_addr, socklen_t addrlen)
+           const void __user *dest_addr, int addrlen)
 {
-	printk("%s: sendtoing sockfd %d len %lu\n", __func__, sockfd, (unsigned long)len);
-	return sys_write(sockfd, buf, len);
+	struct file *file = fdTableGetFile(current->fdTable, sockfd);
+	ssize_t ret;
+
+	/* TODO: Other sockets are stubbed out to make libevent happy. */
+	if (file && is_unix_socket(file))
+		ret = unix_sendto(file, (void __user *)buf, len, flags,
+				  dest_addr, addrlen);
+	else
+		ret = sys_write(sockfd, buf, len);
+
+	if (file)
+		kfs_put_file(file);
+	return ret;
 }
@@ -1,7 +1,12 @@
-/* TODO: This is stubbed out to make libevent happy.  */
+#include <lwk/kernel.h>
+#include <lwk/unix_socket.h>
 
 int
 sys_socket(int domain, int type, int protocol)
 {
+	if (domain == AF_UNIX)
+		return unix_socket(type, protocol);
+
+	/* TODO: Other families are stubbed out to make libevent happy. */
 	return 1;  /* make any output go to stdout */
 }
@@ -1,16 +1,27 @@
-/* TODO: This is stubbed out to make libevent happy. */
-
+#include <lwk/kernel.h>
+#include <lwk/unix_socket.h>
 #include <arch/uaccess.h>
 
+extern ssize_t
+sys_close(int fd);
+
 int
-sys_socketpair(int family, int type, int protocol, int * usockvec)
+sys_socketpair(int family, int type, int protocol, int __user *usockvec)
 {
 	int fds[2];
-	fds[0] = 0;
-	fds[1] = 1;
+	int ret;
+
+	if (family != AF_UNIX)
+		return -EAFNOSUPPORT;
+
+	ret = unix_socketpair(type, protocol, fds);
+	if (ret)
+		return ret;
 
 	if (copy_to_user(usockvec, fds, sizeof(fds))) {
-		printk("%s: couldn't copy socket vector\n", __func__);
+		sys_close(fds[0]);
+		sys_close(fds[1]);
+		return -EFAULT;
 	}
 
 	return 0;
@@ -22,3 +22,28 @@ sys_aspace_update_user_hio_syscall_mask(
 
 	return aspace_update_hio_syscall_mask(id, &syscall_mask);
 }
+
+int
+sys_aspace_update_hio_cache_policy(
+	id_t			     id,
+	unsigned long		     flags,
+	unsigned long		     ttl_ms
+)
+{
+	if (id == MY_ID)
+		aspace_get_myid(&id);
+
+	return aspace_update_hio_cache_policy(id, flags, ttl_ms);
+}
+
+int
+sys_aspace_update_hio_channel(
+	id_t			     id,
+	int			     channel
+)
+{
+	if (id == MY_ID)
+		aspace_get_myid(&id);
+
+	return aspace_update_hio_channel(id, channel);
+}
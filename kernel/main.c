@@ -26,7 +26,9 @@
 #include <lwk/device.h>
 #include <lwk/random.h>
 #include <lwk/linux_compat.h>
+#include <lwk/radix-tree.h>
 #include <lwk/workq.h>
+#include <lwk/memops.h>
 #include <lwk/hio.h>
 #include <arch/mce.h>
 
@@ -126,6 +128,9 @@ start_kernel()
  	 */
 	core_timer_init(0);
 
+	/* Radix trees index in-memory file data */
+	radix_tree_init();
+
 	/* Start the kernel filesystems */
 	kfs_init();
 
@@ -161,6 +166,11 @@ start_kernel()
 
 	workq_init();
 
+	/*
+	 * Time the memcpy() and checksum variants and pick the fastest.
+	 */
+	memops_init();
+
 	/*
 	 * Initialize the device layer and PCI subsystem.
 	 */
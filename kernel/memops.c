@@ -0,0 +1,339 @@
+/** \file
+ * Boot-time selection of the memcpy() and Internet checksum variants.
+ *
+ * Each architecture lists the variants it has, from the plain one that
+ * runs anywhere to the ones that need string instruction or vector unit
+ * support. memops_init() first checks every usable variant against the
+ * plain one on odd sizes and alignments, then times it on a typical size
+ * of each size class and points the class at the fastest. memcpy() and
+ * memops_csum() jump through those per-class pointers.
+ *
+ * With memops_bench=0 there is no timing, and each class takes the last
+ * usable variant in the architecture's list.
+ */
+#include <lwk/kernel.h>
+#include <lwk/kmem.h>
+#include <lwk/params.h>
+#include <lwk/memops.h>
+#include <arch/tsc.h>
+
+static bool memops_bench = true;
+param(memops_bench, bool);
+
+/* Bytes copied or summed per timing run, and the best of how many runs */
+#define MEMOPS_BENCH_BYTES	(4 * 1024 * 1024)
+#define MEMOPS_BENCH_RUNS	3
+
+/*
+ * The source and destination halves of the benchmark buffer. A large
+ * copy walks through a whole half, so it isn't timed on a hot cache.
+ */
+#define MEMOPS_BENCH_HALF	(2 * 1024 * 1024 - 4096)
+
+static const size_t memcpy_bench_size[MEMCPY_CLASSES] = {
+	64, 1500, 32768, 512 * 1024
+};
+
+static const int csum_bench_size[CSUM_CLASSES] = {
+	20, 256, 1480
+};
+
+static const char * const memcpy_class_name[MEMCPY_CLASSES] = {
+	"<256", "<4K", "<256K", ">=256K"
+};
+
+static const char * const csum_class_name[CSUM_CLASSES] = {
+	"<64", "<512", ">=512"
+};
+
+static u16 (*csum_class[CSUM_CLASSES])(const void *, int) = {
+	[0 ... CSUM_CLASSES - 1] = csum_generic,
+};
+
+
+/**
+ * The portable checksum: 32-bit words into a 64-bit accumulator, which
+ * can't overflow for any length that fits an int, so the inner loop has
+ * no carries to add back and takes 32 bytes at a time. An odd start is
+ * summed from the next even address and the result byte swapped.
+ */
+u16
+csum_generic(const void *buf, int len)
+{
+	const u8 *p = buf;
+	const u32 *pl;
+	u64 sum = 0;
+	u16 t = 0;
+	int odd = (unsigned long)p & 1;
+
+	if (odd && len > 0) {
+		((u8 *)&t)[1] = *p++;
+		len--;
+	}
+
+	if (((unsigned long)p & 3) && len > 1) {
+		sum += *(const u16 *)p;
+		p += 2;
+		len -= 2;
+	}
+
+	pl = (const u32 *)p;
+	while (len > 31) {
+		sum += (u64)pl[0] + pl[1] + pl[2] + pl[3] +
+		       (u64)pl[4] + pl[5] + pl[6] + pl[7];
+		pl += 8;
+		len -= 32;
+	}
+
+	while (len > 3) {
+		sum += *pl++;
+		len -= 4;
+	}
+
+	p = (const u8 *)pl;
+	if (len > 1) {
+		sum += *(const u16 *)p;
+		p += 2;
+		len -= 2;
+	}
+
+	if (len > 0)
+		((u8 *)&t)[0] = *p;
+
+	sum = csum_fold64(sum + t);
+
+	if (odd)
+		sum = ((sum & 0xff) << 8) | ((sum >> 8) & 0xff);
+
+	return (u16)sum;
+}
+
+
+u16
+memops_csum(const void *buf, int len)
+{
+	return csum_class[csum_size_class(len)](buf, len);
+}
+
+
+/*
+ * Copies a few sizes at odd offsets and makes sure the copy is exact and
+ * stops where it should.
+ */
+static bool
+memcpy_check(const struct memcpy_impl *impl, u8 *src, u8 *dst)
+{
+	static const size_t sizes[] = { 1, 7, 63, 255, 1500, 4099, 300007 };
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		size_t len = sizes[i];
+
+		if (memcpy_size_class(len) < impl->min_class)
+			continue;
+
+		memset(dst, 0xa5, len + 8);
+		if (impl->copy(dst + 3, src + 1, len) != dst + 3)
+			return false;
+		if (memcmp(dst + 3, src + 1, len) || dst[2] != 0xa5 ||
+		    dst[len + 3] != 0xa5)
+			return false;
+	}
+
+	return true;
+}
+
+static bool
+csum_check(const struct csum_impl *impl, const u8 *buf)
+{
+	static const int sizes[] = { 0, 1, 2, 3, 20, 33, 63, 64, 255, 1480, 4001 };
+	unsigned int i, off;
+
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		if (csum_size_class(sizes[i]) < impl->min_class)
+			continue;
+
+		for (off = 0; off < 4; off++) {
+			if (impl->sum(buf + off, sizes[i]) !=
+			    csum_generic(buf + off, sizes[i]))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * Best-of-runs cycles for a benchmark's worth of len byte copies, moving
+ * through the buffer halves so that large copies aren't all cache hits.
+ */
+static cycles_t
+memcpy_time(const struct memcpy_impl *impl, u8 *src, u8 *dst, size_t len)
+{
+	unsigned long n = max(MEMOPS_BENCH_BYTES / len, 16UL);
+	unsigned long slots = MEMOPS_BENCH_HALF / len;
+	cycles_t best = ~(cycles_t)0, start, t;
+	unsigned long flags;
+	unsigned int run;
+	unsigned long i;
+
+	for (run = 0; run < MEMOPS_BENCH_RUNS; run++) {
+		local_irq_save(flags);
+		start = get_cycles();
+		for (i = 0; i < n; i++) {
+			size_t off = (i % slots) * len;
+
+			impl->copy(dst + off, src + off, len);
+		}
+		t = get_cycles() - start;
+		local_irq_restore(flags);
+
+		best = min(best, t);
+	}
+
+	return best;
+}
+
+static cycles_t
+csum_time(const struct csum_impl *impl, const u8 *buf, int len)
+{
+	unsigned long n = MEMOPS_BENCH_BYTES / len;
+	cycles_t best = ~(cycles_t)0, start, t;
+	volatile u16 sink = 0;
+	unsigned long flags;
+	unsigned int run;
+	unsigned long i;
+
+	for (run = 0; run < MEMOPS_BENCH_RUNS; run++) {
+		local_irq_save(flags);
+		start = get_cycles();
+		for (i = 0; i < n; i++)
+			sink += impl->sum(buf, len);
+		t = get_cycles() - start;
+		local_irq_restore(flags);
+
+		best = min(best, t);
+	}
+
+	return best;
+}
+
+
+static void
+memcpy_select(u8 *src, u8 *dst)
+{
+	const struct memcpy_impl *pick[MEMCPY_CLASSES];
+	cycles_t best[MEMCPY_CLASSES];
+	unsigned int i, class;
+
+	for (class = 0; class < MEMCPY_CLASSES; class++) {
+		pick[class] = &arch_memcpy_impls[0];
+		best[class] = ~(cycles_t)0;
+	}
+
+	for (i = 0; i < arch_memcpy_nr; i++) {
+		const struct memcpy_impl *impl = &arch_memcpy_impls[i];
+
+		if (impl->usable && !impl->usable())
+			continue;
+
+		if (!memcpy_check(impl, src, dst)) {
+			printk(KERN_WARNING "memops: memcpy %s copies wrong, "
+			       "not using it\n", impl->name);
+			continue;
+		}
+
+		for (class = impl->min_class; class < MEMCPY_CLASSES; class++) {
+			cycles_t t = 0;
+
+			if (memops_bench)
+				t = memcpy_time(impl, src, dst,
+						memcpy_bench_size[class]);
+
+			if (!memops_bench || t < best[class]) {
+				pick[class] = impl;
+				best[class] = t;
+			}
+		}
+	}
+
+	for (class = 0; class < MEMCPY_CLASSES; class++) {
+		memcpy_class[class] = pick[class]->copy;
+		printk(KERN_INFO "memops: memcpy %-7s %s\n",
+		       memcpy_class_name[class], pick[class]->name);
+	}
+}
+
+static void
+csum_select(const u8 *buf)
+{
+	const struct csum_impl *pick[CSUM_CLASSES];
+	cycles_t best[CSUM_CLASSES];
+	unsigned int i, class;
+
+	for (class = 0; class < CSUM_CLASSES; class++) {
+		pick[class] = &arch_csum_impls[0];
+		best[class] = ~(cycles_t)0;
+	}
+
+	for (i = 0; i < arch_csum_nr; i++) {
+		const struct csum_impl *impl = &arch_csum_impls[i];
+
+		if (impl->usable && !impl->usable())
+			continue;
+
+		if (!csum_check(impl, buf)) {
+			printk(KERN_WARNING "memops: checksum %s sums wrong, "
+			       "not using it\n", impl->name);
+			continue;
+		}
+
+		for (class = impl->min_class; class < CSUM_CLASSES; class++) {
+			cycles_t t = 0;
+
+			if (memops_bench)
+				t = csum_time(impl, buf, csum_bench_size[class]);
+
+			if (!memops_bench || t < best[class]) {
+				pick[class] = impl;
+				best[class] = t;
+			}
+		}
+	}
+
+	for (class = 0; class < CSUM_CLASSES; class++) {
+		csum_class[class] = pick[class]->sum;
+		printk(KERN_INFO "memops: checksum %-7s %s\n",
+		       csum_class_name[class], pick[class]->name);
+	}
+}
+
+
+/**
+ * Picks the variants, called once at boot after the CPU features are known.
+ * Until then memcpy() and memops_csum() use the plain variants.
+ */
+void __init
+memops_init(void)
+{
+	u8 *buf, *src, *dst;
+	size_t i;
+
+	buf = kmem_alloc(2 * MEMOPS_BENCH_HALF);
+	if (!buf) {
+		printk(KERN_WARNING "memops: no memory to test with, "
+		       "keeping the plain variants\n");
+		return;
+	}
+
+	src = buf;
+	dst = buf + MEMOPS_BENCH_HALF;
+	for (i = 0; i < MEMOPS_BENCH_HALF; i++)
+		src[i] = (u8)(i * 7 + (i >> 9));
+
+	memcpy_select(src, dst);
+	csum_select(src);
+
+	kmem_free(buf);
+}
@@ -12,6 +12,7 @@
 #include <lwk/tlbflush.h>
 #include <lwk/waitq.h>
 #include <lwk/sched.h>
+#include <arch/atomic.h>
 
 /**
  * Hash table used to lookup address space structures by ID.
@@ -24,6 +25,13 @@ static DEFINE_SPINLOCK(htable_lock);
  */
 static id_t aspace_next_id = UASPACE_MIN_ID;
 
+/**
+ * Source of aspace->map_generation values. Drawing them from one counter
+ * keeps a new address space that reuses an old ID from matching the old
+ * one's generation.
+ */
+static atomic_t aspace_map_generation_seq;
+
 /**
  * Memory region structure. A memory region represents a contiguous region 
  * [start, end) of valid memory addresses in an address space.
@@ -39,9 +47,12 @@ struct region
 	vaddr_t          start;    /**< Starting address of the region */
 	vaddr_t          end;      /**< 1st byte after end of the region */
 	vmflags_t        flags;    /**< Permissions, caching, etc. */
-	vmpagesize_t     pagesz;   /**< Allowed page sizes... 2^bit */
+	vmpagesize_t     pagesz;   /**< Allowed page sizes... 2^bit, the
+	                              largest that fits is used when mapping */
 	id_t             smartmap; /**< If (flags & VM_SMARTMAP), ID of the
 	                              aspace this region is mapped to */
+	aspace_unmap_fn_t unmap;   /**< Called once the region is gone */
+	void *           unmap_priv;
 	char             name[16]; /**< Human-readable name of the region */
 };
 
@@ -61,6 +72,16 @@ calc_end(vaddr_t start, size_t extent)
 	return end;
 }
 
+/**
+ * Called whenever pages are unmapped from the address space, so that
+ * anyone caching its virtual to physical translations can tell.
+ */
+static void
+aspace_bump_map_generation(struct aspace *aspace)
+{
+	aspace->map_generation = atomic_inc_return(&aspace_map_generation_seq);
+}
+
 /**
  * Locates the region covering the specified address.
  */
@@ -279,6 +300,7 @@ aspace_create(id_t id_request, const char *name, id_t *id)
 	spin_lock_init(&aspace->lock);
 	list_head_init(&aspace->region_list);
 	hlist_node_init(&aspace->ht_link);
+	aspace_bump_map_generation(aspace);
 	sema_init(&aspace->mmap_sem, 1);
 	if (name)
 		strlcpy(aspace->name, name, sizeof(aspace->name));
@@ -290,6 +312,7 @@ aspace_create(id_t id_request, const char *name, id_t *id)
 	aspace->next_cpu_id = first_cpu(aspace->cpu_mask);
 
 	syscalls_clear(aspace->hio_syscall_mask);
+	aspace->hio_channel = HIO_CHANNEL_BY_RANK;
 
 	list_head_init(&aspace->sigpending.list);
 
@@ -393,8 +416,11 @@ aspace_destroy(id_t id)
 			spin_unlock_irqrestore(&htable_lock, irqstate);
 		}
 		list_del(&rgn->link);
+		if (rgn->unmap)
+			rgn->unmap(rgn->unmap_priv);
 		kmem_free(rgn);
 	}
+	hio_cache_destroy(aspace->hio_cache);
 	arch_aspace_destroy(aspace);
 	kmem_free(aspace);
 	return 0;
@@ -508,6 +534,7 @@ __aspace_add_region(struct aspace *aspace,
 	struct region *rgn;
 	struct region *cur;
 	struct list_head *pos;
+	vmpagesize_t min_pagesz;
 	vaddr_t end = calc_end(start, extent);
 
 	if (!aspace || !start)
@@ -536,16 +563,9 @@ __aspace_add_region(struct aspace *aspace,
 	}
 	pagesz &= cpu_info[0].pagesz_mask;
 
-	/* Only one page size may be specified */
-	if (!is_power_of_2(pagesz)) {
-		printk(KERN_WARNING
-		       "More than one page size specified (pagesz=0x%lx).\n",
-		       pagesz);
-		return -EINVAL;
-	}
-
-	/* Region must be aligned to at least the specified page size */
-	if ((start & (pagesz-1)) || ((end!=ULONG_MAX) && (end & (pagesz-1)))) {
+	/* Region must be aligned to at least the smallest page size allowed */
+	min_pagesz = pagesz & ~(pagesz - 1);
+	if ((start & (min_pagesz-1)) || ((end!=ULONG_MAX) && (end & (min_pagesz-1)))) {
 		printk(KERN_WARNING
 		       "Region is misaligned (start=0x%lx, end=0x%lx).\n",
 		       start, end);
@@ -635,10 +655,45 @@ __aspace_del_region(struct aspace *aspace, vaddr_t start, size_t extent)
 
 	/* Remove the region from the address space */
 	list_del(&rgn->link);
+	if (rgn->unmap)
+		rgn->unmap(rgn->unmap_priv);
 	kmem_free(rgn);
 	return 0;
 }
 
+/**
+ * Has fn(priv) called when the region starting at start goes away, by
+ * munmap() or with the address space. It runs with the aspace locked, so
+ * it must not sleep. Used by file systems that map their own memory into
+ * a region and may only free it once nothing maps it any more.
+ */
+int
+aspace_set_region_unmap(id_t id, vaddr_t start,
+                        aspace_unmap_fn_t fn, void *priv)
+{
+	struct aspace *aspace;
+	struct region *rgn;
+	unsigned long irqstate;
+	int status = -EINVAL;
+
+	if (id == MY_ID)
+		id = current->aspace->id;
+
+	local_irq_save(irqstate);
+	if ((aspace = lookup_and_lock(id)) != NULL) {
+		rgn = find_region(aspace, start);
+		if (rgn && (rgn->start == start) && !rgn->unmap) {
+			rgn->unmap      = fn;
+			rgn->unmap_priv = priv;
+			status = 0;
+		}
+		spin_unlock(&aspace->lock);
+	}
+	local_irq_restore(irqstate);
+
+	return status;
+}
+
 int
 aspace_del_region(id_t id, vaddr_t start, size_t extent)
 {
@@ -655,12 +710,36 @@ aspace_del_region(id_t id, vaddr_t start, size_t extent)
 	return status;
 }
 
+/**
+ * Returns the largest page size allowed by pagesz_mask that can map
+ * [start, start+extent) to pmem starting at start, or 0 if none can.
+ */
+vmpagesize_t
+aspace_pick_pagesz(vmpagesize_t pagesz_mask,
+                   vaddr_t start, paddr_t pmem, size_t extent)
+{
+	vmpagesize_t pagesz;
+
+	while (pagesz_mask) {
+		pagesz = 1UL << __fls(pagesz_mask);
+
+		if (!(start & (pagesz-1)) && !(pmem & (pagesz-1)) &&
+		    (extent >= pagesz))
+			return pagesz;
+
+		pagesz_mask &= ~pagesz;
+	}
+
+	return 0;
+}
+
 int
 __aspace_map_pmem(struct aspace *aspace,
                   paddr_t pmem, vaddr_t start, size_t extent)
 {
 	int status;
 	struct region *rgn;
+	vmpagesize_t pagesz;
 
 	if (!aspace)
 		return -EINVAL;
@@ -687,32 +766,40 @@ __aspace_map_pmem(struct aspace *aspace,
 			return -EINVAL;
 		}
 
-		/* addresses must be aligned to region's page size */
-		if ((start & (rgn->pagesz-1)) || (pmem & (rgn->pagesz-1))) {
-			printk(KERN_WARNING
-				"Misalignment "
-				"(start=0x%lx, pmem=0x%lx, pagesz=0x%lx).\n",
-				start, pmem, rgn->pagesz);
-			return -EINVAL;
-		}
-
-		/* Map until full extent mapped or end of region is reached */
+		/* Map until full extent mapped or end of region is reached,
+		 * using the largest allowed page size at each step */
 		while (extent && (start < rgn->end)) {
 
+			pagesz = aspace_pick_pagesz(
+				rgn->pagesz,
+				start,
+				pmem,
+				min(extent, (size_t)(rgn->end - start))
+			);
+
+			/* addresses must be aligned to a region page size */
+			if (!pagesz) {
+				printk(KERN_WARNING
+					"Misalignment "
+					"(start=0x%lx, pmem=0x%lx, pagesz=0x%lx).\n",
+					start, pmem, rgn->pagesz);
+				return -EINVAL;
+			}
+
 			status = 
 			arch_aspace_map_page(
 				aspace,
 				start,
 				pmem,
 				rgn->flags,
-				rgn->pagesz
+				pagesz
 			);
 			if (status)
 				return status;
 
-			extent -= rgn->pagesz;
-			start  += rgn->pagesz;
-			pmem   += rgn->pagesz;
+			extent -= pagesz;
+			start  += pagesz;
+			pmem   += pagesz;
 		}
 	}
 
@@ -738,10 +825,13 @@ int
 __aspace_unmap_pmem(struct aspace *aspace, vaddr_t start, size_t extent)
 {
 	struct region *rgn;
+	vmpagesize_t min_pagesz, pagesz;
 
 	if (!aspace)
 		return -EINVAL;
 
+	aspace_bump_map_generation(aspace);
+
 	while (extent) {
 		/* Find region covering the address */
 		rgn = find_region(aspace, start);
@@ -759,8 +849,10 @@ __aspace_unmap_pmem(struct aspace *aspace, vaddr_t start, size_t extent)
 			return -EINVAL;
 		}
 
+		min_pagesz = rgn->pagesz & ~(rgn->pagesz - 1);
+
 		/* start address must be aligned to region's page size */
-		if (start & (rgn->pagesz-1)) {
+		if (start & (min_pagesz-1)) {
 			printk(KERN_WARNING
 				"Start address misalignment (start=0x%lx, extent=0x%lx, pagesz=0x%lx).\n",
 				start, extent, rgn->pagesz);
@@ -768,7 +860,7 @@ __aspace_unmap_pmem(struct aspace *aspace, vaddr_t start, size_t extent)
 		}
 
 		/* extent must be a multiple of region's page size */
-		if (extent & (rgn->pagesz-1)) {
+		if (extent & (min_pagesz-1)) {
 			printk(KERN_WARNING
 				"Extent misalignment (start=0x%lx, extent=0x%lx, pagesz=0x%lx).\n",
 				start, extent, rgn->pagesz);
@@ -778,14 +870,28 @@ __aspace_unmap_pmem(struct aspace *aspace, vaddr_t start, size_t extent)
 		/* Unmap until full extent unmapped or end of region is reached */
 		while (extent && (start < rgn->end)) {
 
+			/* Regions allowing several page sizes may mix them,
+			 * unmap whatever size is actually mapped here */
+			pagesz = min_pagesz;
+			if ((rgn->pagesz != min_pagesz) &&
+			    (arch_aspace_lookup_page(aspace, start, NULL, &pagesz) != 0))
+				pagesz = min_pagesz;
+
+			if ((pagesz > extent) || (start & (pagesz-1))) {
+				printk(KERN_WARNING
+					"Unmap splits a large page (start=0x%lx, extent=0x%lx, pagesz=0x%lx).\n",
+					start, extent, pagesz);
+				return -EINVAL;
+			}
+
 			arch_aspace_unmap_page(
 				aspace,
 				start,
-				rgn->pagesz
+				pagesz
 			);
 
-			extent -= rgn->pagesz;
-			start  += rgn->pagesz;
+			extent -= pagesz;
+			start  += pagesz;
 		}
 	}
 
@@ -885,6 +991,7 @@ __aspace_unsmartmap(struct aspace *src, struct aspace *dst)
 
 	/* Do architecture-specific SMARTMAP unmapping */
 	BUG_ON(arch_aspace_unsmartmap(src, dst, rgn->start, extent));
+	aspace_bump_map_generation(dst);
 
 	/* Delete the SMARTMAP region and release our reference on the source */
 	BUG_ON(__aspace_del_region(dst, rgn->start, extent));
@@ -946,6 +1053,122 @@ aspace_virt_to_phys(id_t id, vaddr_t vaddr, paddr_t *paddr)
 }
 
 
+/**
+ * Translates the virtual range [start, start+extent) in one pass, reporting
+ * each maximal physically contiguous run to fn(). Large pages are consumed
+ * whole rather than one base page at a time.
+ */
+int
+__aspace_virt_to_phys_range(struct aspace *aspace, vaddr_t start, size_t extent,
+                            aspace_extent_fn_t fn, void *priv)
+{
+	vaddr_t vaddr = start;
+	vaddr_t end = start + extent;
+	paddr_t paddr, run_paddr = 0;
+	size_t run_size = 0, len;
+	vmpagesize_t pagesz;
+	int status;
+
+	if (!aspace)
+		return -EINVAL;
+
+	if (end < start)
+		return -EINVAL;
+
+	while (vaddr < end) {
+		status = arch_aspace_lookup_page(aspace, vaddr, &paddr, &pagesz);
+		if (status)
+			return status;
+
+		/* The rest of the page containing vaddr, clipped to the range */
+		len = pagesz - (vaddr & (pagesz - 1));
+		if (len > end - vaddr)
+			len = end - vaddr;
+
+		if (run_size && (run_paddr + run_size == paddr)) {
+			run_size += len;
+		} else {
+			if (run_size && (status = fn(run_paddr, run_size, priv)))
+				return status;
+			run_paddr = paddr;
+			run_size  = len;
+		}
+
+		vaddr += len;
+	}
+
+	if (run_size)
+		return fn(run_paddr, run_size, priv);
+
+	return 0;
+}
+
+int
+aspace_virt_to_phys_range(id_t id, vaddr_t start, size_t extent,
+                          aspace_extent_fn_t fn, void *priv)
+{
+	int status;
+	struct aspace *aspace;
+	unsigned long irqstate;
+
+	if (id == MY_ID)
+		id = current->aspace->id;
+
+	local_irq_save(irqstate);
+	aspace = lookup_and_lock(id);
+	status = __aspace_virt_to_phys_range(aspace, start, extent, fn, priv);
+	if (aspace) spin_unlock(&aspace->lock);
+	local_irq_restore(irqstate);
+
+	return status;
+}
+
+/**
+ * Like aspace_virt_to_phys_range(), but only translates the range if all
+ * of it lies in regions with every flag in vmflags, e.g. VM_WRITE for a
+ * buffer the caller is going to write through the physical mapping.
+ * Returns -EFAULT if it does not.
+ */
+int
+aspace_virt_to_phys_range_flags(id_t id, vaddr_t start, size_t extent,
+                                vmflags_t vmflags,
+                                aspace_extent_fn_t fn, void *priv)
+{
+	int status = 0;
+	struct aspace *aspace;
+	struct region *rgn;
+	vaddr_t vaddr = start;
+	unsigned long irqstate;
+
+	if (id == MY_ID)
+		id = current->aspace->id;
+
+	local_irq_save(irqstate);
+	aspace = lookup_and_lock(id);
+	if (!aspace) {
+		local_irq_restore(irqstate);
+		return -EINVAL;
+	}
+
+	while (vaddr < start + extent) {
+		rgn = find_region(aspace, vaddr);
+		if (!rgn || ((rgn->flags & vmflags) != vmflags)) {
+			status = -EFAULT;
+			break;
+		}
+		vaddr = rgn->end;
+	}
+
+	if (!status)
+		status = __aspace_virt_to_phys_range(aspace, start, extent, fn, priv);
+
+	spin_unlock(&aspace->lock);
+	local_irq_restore(irqstate);
+
+	return status;
+}
+
+
 int 
 __aspace_lookup_mapping(struct aspace *aspace, vaddr_t vaddr, aspace_mapping_t *mapping)
 {
@@ -1189,3 +1412,72 @@ aspace_update_hio_syscall_mask(id_t		id,
 	local_irq_restore(irqstate);
 	return 0;
 }
+
+int
+aspace_update_hio_channel(id_t	id,
+			  int	channel)
+{
+	struct aspace *aspace;
+	unsigned long irqstate;
+
+	if ((channel < 0) && (channel != HIO_CHANNEL_BY_RANK))
+		return -EINVAL;
+
+	if (channel >= HIO_NUM_CHANNELS)
+		return -EINVAL;
+
+	local_irq_save(irqstate);
+	if ((aspace = lookup_and_lock(id)) == NULL) {
+		local_irq_restore(irqstate);
+		return -EINVAL;
+	}
+
+	aspace->hio_channel = channel;
+
+	spin_unlock(&aspace->lock);
+	local_irq_restore(irqstate);
+	return 0;
+}
+
+int
+aspace_update_hio_cache_policy(id_t		id,
+			       unsigned long	flags,
+			       unsigned long	ttl_ms)
+{
+	struct aspace *aspace;
+	struct hio_cache *cache = NULL;
+	unsigned long irqstate;
+
+	if (flags & ~(HIO_CACHE_LOCAL_IDS | HIO_CACHE_METADATA))
+		return -EINVAL;
+
+	/* Allocate before taking the aspace lock */
+	if (flags & HIO_CACHE_METADATA) {
+		if ((cache = hio_cache_create()) == NULL)
+			return -ENOMEM;
+	}
+
+	local_irq_save(irqstate);
+	if ((aspace = lookup_and_lock(id)) == NULL) {
+		local_irq_restore(irqstate);
+		hio_cache_destroy(cache);
+		return -EINVAL;
+	}
+
+	aspace->hio_cache_flags = flags;
+	aspace->hio_cache_ttl   = (ktime_t)ttl_ms * NSEC_PER_MSEC;
+
+	/* Results cached under the old policy are dropped, never reused */
+	if (aspace->hio_cache == NULL) {
+		aspace->hio_cache = cache;
+		cache = NULL;
+	} else {
+		hio_cache_flush(aspace->hio_cache);
+	}
+
+	spin_unlock(&aspace->lock);
+	local_irq_restore(irqstate);
+
+	hio_cache_destroy(cache);
+	return 0;
+}
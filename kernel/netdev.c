@@ -9,6 +9,7 @@
 #include <arch/vsyscall.h>
 #include <lwk/kfs.h>
 #include <lwk/fdTable.h>
+#include <lwk/unix_socket.h>
 
 /**
  * Holds a comma separated list of network devices to configure.
@@ -16,6 +17,10 @@
 static char netdev_str[128];
 param_string(net, netdev_str, sizeof(netdev_str));
 
+#ifdef CONFIG_NETWORK
+#include <lwip/stats.h>
+#endif
+
 #ifdef CONFIG_LWIP_SOCKET
 
 #include <lwip/init.h>
@@ -27,6 +32,15 @@ param_string(net, netdev_str, sizeof(netdev_str));
 #include <lwip/stats.h>
 #include <lwip/if.h>
 
+/* lwIP's BSD ioctl encoding would clash with the kernel's from arch/ioctl.h */
+#undef IOC_OUT
+#undef IOC_IN
+#undef IOC_INOUT
+#undef _IO
+#undef _IOR
+#undef _IOW
+#include <lwk/aspace.h>
+
 
 /** Return a LWIP connection number from a user fd */
 static inline int
@@ -43,15 +57,93 @@ lwip_from_fd(
 	int			fd
 )
 {
-	struct file *		file = get_current_file( fd );
+	struct file *		file = fdTableGetFile( current->fdTable, fd );
+	int			conn;
+
 	if( !file )
 		return -1;
 	//if( file->fops != &kfs_socket_fops )
 		//return -1;
-	return lwip_connection( file );
+	conn = lwip_connection( file );
+	kfs_put_file( file );
+	return conn;
+}
+
+
+/** Physically contiguous pieces of a user buffer, at most this many per walk */
+#define SOCKET_EXTENTS		16
+
+struct socket_extents {
+	unsigned int		nr;
+	size_t			bytes;
+	struct {
+		paddr_t		paddr;
+		size_t		size;
+	} ext[ SOCKET_EXTENTS ];
+};
+
+
+static int
+socket_add_extent(
+	paddr_t			paddr,
+	size_t			size,
+	void *			priv
+)
+{
+	struct socket_extents *	exts = priv;
+
+	if( exts->nr == SOCKET_EXTENTS )
+		return 1;
+
+	exts->ext[ exts->nr ].paddr = paddr;
+	exts->ext[ exts->nr ].size = size;
+	exts->nr++;
+	exts->bytes += size;
+	return 0;
 }
 
 
+/** Largest datagram lwIP will send */
+#define SOCKET_DGRAM_MAX	0xffff
+
+
+/** Sends a datagram whose pages aren't contiguous in one lwIP call */
+static ssize_t
+socket_write_dgram(
+	int			s,
+	const char *		buf,
+	size_t			len
+)
+{
+	void *			kbuf;
+	int			ret;
+
+	if( len > SOCKET_DGRAM_MAX )
+		return -EMSGSIZE;
+
+	kbuf = kmem_alloc( len );
+	if( !kbuf )
+		return -ENOMEM;
+
+	if( copy_from_user( kbuf, (void*) buf, len ) ) {
+		kmem_free( kbuf );
+		return -EFAULT;
+	}
+
+	ret = lwip_send( s, kbuf, len, 0 );
+	kmem_free( kbuf );
+
+	return ( ret < 0 ) ? -lwip_lasterr( s ) : ret;
+}
+
+
+/**
+ * lwIP copies the data into its segments from the tcpip thread, which
+ * can't see user addresses, so the buffer is handed over through the
+ * kernel's mapping of its physical pages rather than copied in first.
+ * Each physically contiguous run goes to lwIP in one call, which cuts it
+ * into full-sized segments; MSG_MORE holds back the PSH until the last.
+ */
 static ssize_t
 socket_write(
 	struct file *		file,
@@ -60,18 +152,58 @@ socket_write(
 	loff_t *		off
 )
 {
-	char			kbuf[ 512 ];
-	size_t			klen = len;
-	if( klen > sizeof(kbuf)-1 )
-		klen = sizeof(kbuf)-1;
+	struct socket_extents	exts;
+	int			s = lwip_connection(file);
+	size_t			total = 0;
+	unsigned int		i;
+	int			status;
+
+	if( len > INT_MAX )
+		len = INT_MAX;
+
+	while( total < len ) {
+		exts.nr = 0;
+		exts.bytes = 0;
+
+		/* A positive status only means the extent array filled up */
+		status = aspace_virt_to_phys_range( MY_ID, (vaddr_t) buf + total,
+				len - total, socket_add_extent, &exts );
+		if( status < 0 || exts.bytes == 0 )
+			return total ? total : -EFAULT;
+
+		/* A datagram has to leave in one piece */
+		if( total == 0 && ( exts.nr > 1 || exts.bytes < len ) ) {
+			int type = 0;
+			socklen_t optlen = sizeof(type);
+
+			lwip_getsockopt( s, SOL_SOCKET, SO_TYPE, &type, &optlen );
+			if( type != SOCK_STREAM )
+				return socket_write_dgram( s, buf, len );
+		}
 
-	if( copy_from_user( kbuf, (void*) buf, klen ) )
-		return -EFAULT;
+		for( i = 0; i < exts.nr; i++ ) {
+			size_t size = exts.ext[i].size;
+			int more = ( total + size < len ) ? MSG_MORE : 0;
+			int ret;
+
+			ret = lwip_send( s, __va( exts.ext[i].paddr ), size, more );
+			if( ret < 0 )
+				return total ? total : -lwip_lasterr( s );
 
-	return lwip_write( lwip_connection(file), kbuf, klen );
+			total += ret;
+			if( ret < size )
+				return total;
+		}
+	}
+
+	return total;
 }
 
 
+/**
+ * lwIP copies out of its pbufs in the caller's context, so the user
+ * buffer is used as is. It counts in an int, bound the length to match.
+ */
 static ssize_t
 socket_read(
 	struct file *		file,
@@ -80,17 +212,46 @@ socket_read(
 	loff_t *		off
 )
 {
-	return lwip_read( lwip_connection(file), (void*) buf, count );
+	int			s = lwip_connection(file);
+	int			ret;
+
+	if( count > INT_MAX )
+		count = INT_MAX;
+
+	if( !access_ok( VERIFY_WRITE, buf, count ) )
+		return -EFAULT;
+
+	ret = lwip_read( s, (void*) buf, count );
+
+	return ( ret < 0 ) ? -lwip_lasterr( s ) : ret;
 }
 
 
+/*
+ * The socket calls below hold a reference to the file for as long as they
+ * use it, so that a close() from a thread sharing the fd table can't free
+ * it, or the lwIP connection it stands for, underneath them. AF_UNIX
+ * sockets, which lwIP can't handle, go to unix_socket.c.
+ */
 static int
 sys_listen(
 	int			fd,
 	int			backlog
 )
 {
-	return lwip_listen( lwip_from_fd(fd), backlog );
+	struct file *		file = fdTableGetFile( current->fdTable, fd );
+	int			ret;
+
+	if( !file )
+		return -EBADF;
+
+	if( is_unix_socket( file ) )
+		ret = unix_listen( file, backlog );
+	else
+		ret = lwip_listen( lwip_connection( file ), backlog );
+
+	kfs_put_file( file );
+	return ret;
 }
 
 
@@ -130,14 +291,16 @@ static int
 socket_allocate( void )
 {
 	int fd = fdTableGetUnused(current->fdTable);
+	if( fd < 0 )
+		return fd;
 
-	struct file * file = kmem_alloc( sizeof(*file));
-	if( !file )
+	struct file * file = kfs_alloc_file();
+	if( !file ) {
+		fdTableInstallFd( current->fdTable, fd, NULL );
 		return -EMFILE;
+	}
 
-	memset(file,0,sizeof(*file));
 	file->f_op = &kfs_socket_fops;
-	atomic_set(&file->f_count,1);
 
 	fdTableInstallFd( current->fdTable, fd, file );
 
@@ -154,6 +317,9 @@ sys_socket(
 	int			protocol
 )
 {
+	if( domain == AF_UNIX )
+		return unix_socket( type, protocol );
+
 	// Allocate a fd for this one
 	int fd = socket_allocate();
 	struct file * file = get_current_file( fd );
@@ -165,8 +331,8 @@ sys_socket(
 	int conn = lwip_socket( domain, type, protocol );
 	if( conn < 0 )
 	{
-		fdTableInstallFd( current->fdTable, fd, 0 );
-		kmem_free( file );
+		fdTableRemoveFd( current->fdTable, fd );
+		kfs_close( file );
 		return conn;
 	}
 
@@ -225,17 +391,14 @@ translate_sockaddr_to_linux(
 	return 0;
 }
 
-static unsigned long
-sys_bind(
-	int			sock,
+static int
+socket_bind(
+	int			conn,
 	uaddr_t			addr,
 	size_t			len
 )
 {
 	int ret;
-	const int conn = lwip_from_fd( sock );
-	if( sock < 0 )
-		return -EBADF;
 
 	if( len > 128 )
 		return -ENAMETOOLONG;
@@ -262,17 +425,37 @@ sys_bind(
 
 
 static unsigned long
-sys_connect(
+sys_bind(
 	int			sock,
 	uaddr_t			addr,
 	size_t			len
 )
 {
-	int ret;
-	const int conn = lwip_from_fd( sock );
-	if( sock < 0 )
+	struct file *		file = fdTableGetFile( current->fdTable, sock );
+	long			ret;
+
+	if( !file )
 		return -EBADF;
 
+	if( is_unix_socket( file ) )
+		ret = unix_bind( file, (void*) addr, len );
+	else
+		ret = socket_bind( lwip_connection( file ), addr, len );
+
+	kfs_put_file( file );
+	return ret;
+}
+
+
+static int
+socket_connect(
+	int			conn,
+	uaddr_t			addr,
+	size_t			len
+)
+{
+	int ret;
+
 	if( len > 128 )
 		return -ENAMETOOLONG;
 
@@ -296,9 +479,32 @@ sys_connect(
 	return ret;
 }
 
+
+static unsigned long
+sys_connect(
+	int			sock,
+	uaddr_t			addr,
+	size_t			len
+)
+{
+	struct file *		file = fdTableGetFile( current->fdTable, sock );
+	long			ret;
+
+	if( !file )
+		return -EBADF;
+
+	if( is_unix_socket( file ) )
+		ret = unix_connect( file, (void*) addr, len );
+	else
+		ret = socket_connect( lwip_connection( file ), addr, len );
+
+	kfs_put_file( file );
+	return ret;
+}
+
 static int
-sys_accept(
-	int			fd,
+socket_accept(
+	int			conn_fd,
 	struct sockaddr *	addr,
 	socklen_t *		addrlen
 )
@@ -309,11 +515,11 @@ sys_accept(
 		return -EMFILE;
 
  
-	int conn = lwip_accept( lwip_from_fd(fd), addr, addrlen );
+	int conn = lwip_accept( conn_fd, addr, addrlen );
 	if( conn < 0 )
 	{
-		fdTableInstallFd( current->fdTable, new_fd, 0 );
-		kmem_free( new_file );
+		fdTableRemoveFd( current->fdTable, new_fd );
+		kfs_close( new_file );
 		return conn;
 	}
 
@@ -322,6 +528,29 @@ sys_accept(
 }
 
 
+static int
+sys_accept(
+	int			fd,
+	struct sockaddr *	addr,
+	socklen_t *		addrlen
+)
+{
+	struct file *		file = fdTableGetFile( current->fdTable, fd );
+	int			ret;
+
+	if( !file )
+		return -EBADF;
+
+	if( is_unix_socket( file ) )
+		ret = unix_accept( file, addr, (int*) addrlen, 0 );
+	else
+		ret = socket_accept( lwip_connection( file ), addr, addrlen );
+
+	kfs_put_file( file );
+	return ret;
+}
+
+
 static int
 translate_in_fdset(
 	int			n,
@@ -434,8 +663,8 @@ sys_select(
 }
 
 static int
-sys_setsockopt(
-	int				sockfd, 
+socket_setsockopt(
+	int				conn,
 	int				level,
 	int				optname,
 	const void *	optval,
@@ -444,10 +673,6 @@ sys_setsockopt(
 {
 	char			kbuf[ optlen + 1 ];
 
-	const int conn = lwip_from_fd( sockfd );
-	if( sockfd < 0 )
-		return -EBADF;
-
 	if( copy_from_user( kbuf, optval, optlen ) )
 		return -EFAULT;
 
@@ -456,10 +681,35 @@ sys_setsockopt(
 }
 
 static int
-sys_getsockopt(
+sys_setsockopt(
 	int				sockfd, 
 	int				level,
 	int				optname,
+	const void *	optval,
+	socklen_t		optlen
+)
+{
+	struct file *		file = fdTableGetFile( current->fdTable, sockfd );
+	int			ret;
+
+	if( !file )
+		return -EBADF;
+
+	if( is_unix_socket( file ) )
+		ret = unix_setsockopt( file, level, optname, optval, optlen );
+	else
+		ret = socket_setsockopt( lwip_connection( file ), level, optname,
+					 optval, optlen );
+
+	kfs_put_file( file );
+	return ret;
+}
+
+static int
+socket_getsockopt(
+	int				conn,
+	int				level,
+	int				optname,
 	void *			optval,
 	socklen_t *		optlen
 )
@@ -467,10 +717,6 @@ sys_getsockopt(
 	int	kint;
 	int ret;
 
-	const int conn = lwip_from_fd( sockfd );
-	if( sockfd < 0 )
-		return -EBADF;
-
 	/* printk( KERN_INFO "%s: Inside sys_getsockopt level=%d, optname=%d, optval=%s, optlen=%d\n", __func__, level, optname, (char *)optval, optlen); */
 	ret = getsockopt(conn, level, optname, &kint, optlen);
 
@@ -481,10 +727,35 @@ sys_getsockopt(
 	return(ret);
 }
 
+static int
+sys_getsockopt(
+	int				sockfd, 
+	int				level,
+	int				optname,
+	void *			optval,
+	socklen_t *		optlen
+)
+{
+	struct file *		file = fdTableGetFile( current->fdTable, sockfd );
+	int			ret;
+
+	if( !file )
+		return -EBADF;
+
+	if( is_unix_socket( file ) )
+		ret = unix_getsockopt( file, level, optname, optval, (int*) optlen );
+	else
+		ret = socket_getsockopt( lwip_connection( file ), level, optname,
+					 optval, optlen );
+
+	kfs_put_file( file );
+	return ret;
+}
+
 /* BJK: The rest of the functions defined here are to support Portals on UDP */
 static ssize_t
-sys_sendto(
-    int sockfd,
+socket_sendto(
+    int conn,
     const void * buf,
     size_t len,
     int flags,
@@ -510,18 +781,44 @@ sys_sendto(
 		return -EFAULT;
 	}
 
-    int ret = lwip_sendto(lwip_from_fd(sockfd), (void *)databuf, len, flags, 
+    int ret = lwip_sendto(conn, (void *)databuf, len, flags, 
 			(struct sockaddr *)kname, addrlen);
     if (ret == -1) {
-        ret = -lwip_lasterr(lwip_from_fd(sockfd));
+        ret = -lwip_lasterr(conn);
     }
     
     return ret;
 }
 
 static ssize_t
-sys_sendmsg(
-	int sockfd,
+sys_sendto(
+    int sockfd,
+    const void * buf,
+    size_t len,
+    int flags,
+    struct sockaddr * dest_addr,
+    socklen_t addrlen
+)
+{
+	struct file *		file = fdTableGetFile( current->fdTable, sockfd );
+	ssize_t			ret;
+
+	if( !file )
+		return -EBADF;
+
+	if( is_unix_socket( file ) )
+		ret = unix_sendto( file, buf, len, flags, dest_addr, addrlen );
+	else
+		ret = socket_sendto( lwip_connection( file ), buf, len, flags,
+				     dest_addr, addrlen );
+
+	kfs_put_file( file );
+	return ret;
+}
+
+static ssize_t
+socket_sendmsg(
+	int conn,
 	const struct msghdr * msg,
 	int flags
 )
@@ -565,13 +862,13 @@ sys_sendmsg(
 
 		databuf = kmem_alloc(kvec.iov_len);
 		memcpy(databuf, kvec.iov_base, kvec.iov_len);
-		written = lwip_sendto(lwip_from_fd(sockfd), databuf, kvec.iov_len, flags,
+		written = lwip_sendto(conn, databuf, kvec.iov_len, flags,
 				(struct sockaddr *)kname, kmsg.msg_namelen);
 		kmem_free(databuf);
 
 		switch (written) {
 			case -1:
-				total = -lwip_lasterr(lwip_from_fd(sockfd));
+				total = -lwip_lasterr(conn);
 				goto out;
 			case 0:
 				goto out;
@@ -586,9 +883,31 @@ out:
 	return total;
 }
 
+static ssize_t
+sys_sendmsg(
+	int sockfd,
+	const struct msghdr * msg,
+	int flags
+)
+{
+	struct file *		file = fdTableGetFile( current->fdTable, sockfd );
+	ssize_t			ret;
+
+	if( !file )
+		return -EBADF;
+
+	if( is_unix_socket( file ) )
+		ret = unix_sendmsg( file, (void*) msg, flags );
+	else
+		ret = socket_sendmsg( lwip_connection( file ), msg, flags );
+
+	kfs_put_file( file );
+	return ret;
+}
+
 static ssize_t 
-sys_recvfrom(
-    int sockfd,
+socket_recvfrom(
+    int conn,
     void * buf,
     size_t len,
     int flags,
@@ -610,10 +929,10 @@ sys_recvfrom(
 		return -EFAULT;
 	}
 
-    int ret = lwip_recvfrom(lwip_from_fd(sockfd), databuf, len, flags, 
+    int ret = lwip_recvfrom(conn, databuf, len, flags, 
 			(struct sockaddr *)kname, &klen);
     if (ret == -1) {
-        ret = -lwip_lasterr(lwip_from_fd(sockfd));
+        ret = -lwip_lasterr(conn);
     } else {
 		if (copy_to_user(buf, databuf, len)) {
 			printk("%s: bad user address %p\n", __func__, (void*) buf);
@@ -640,8 +959,34 @@ sys_recvfrom(
 }
 
 static ssize_t
-sys_recvmsg(
-	int sockfd,
+sys_recvfrom(
+    int sockfd,
+    void * buf,
+    size_t len,
+    int flags,
+    struct sockaddr * src_addr,
+    socklen_t * addrlen
+)
+{
+	struct file *		file = fdTableGetFile( current->fdTable, sockfd );
+	ssize_t			ret;
+
+	if( !file )
+		return -EBADF;
+
+	if( is_unix_socket( file ) )
+		ret = unix_recvfrom( file, buf, len, flags, src_addr, (int*) addrlen );
+	else
+		ret = socket_recvfrom( lwip_connection( file ), buf, len, flags,
+				       src_addr, addrlen );
+
+	kfs_put_file( file );
+	return ret;
+}
+
+static ssize_t
+socket_recvmsg(
+	int conn,
 	struct msghdr * msg,
 	int flags
 )
@@ -668,12 +1013,12 @@ sys_recvmsg(
 		}
 
 		databuf = kmem_alloc(kvec.iov_len);
-		read = lwip_recvfrom(lwip_from_fd(sockfd), databuf, kvec.iov_len, flags,
+		read = lwip_recvfrom(conn, databuf, kvec.iov_len, flags,
 				(struct sockaddr *)kname, &(kmsg.msg_namelen));
 
 		switch (read) {
 			case -1:
-				total = -lwip_lasterr(lwip_from_fd(sockfd));
+				total = -lwip_lasterr(conn);
 				break;
 			case 0:
 				break;
@@ -709,6 +1054,28 @@ sys_recvmsg(
 
     return total;
 }
+
+static ssize_t
+sys_recvmsg(
+	int sockfd,
+	struct msghdr * msg,
+	int flags
+)
+{
+	struct file *		file = fdTableGetFile( current->fdTable, sockfd );
+	ssize_t			ret;
+
+	if( !file )
+		return -EBADF;
+
+	if( is_unix_socket( file ) )
+		ret = unix_recvmsg( file, (void*) msg, flags );
+	else
+		ret = socket_recvmsg( lwip_connection( file ), msg, flags );
+
+	kfs_put_file( file );
+	return ret;
+}
 #endif // CONFIG_SOCKET
 
 	
@@ -748,5 +1115,10 @@ netdev_init(void)
 	// No sockets enabled, just bring up the LWIP library
 	lwip_init();
 #endif
+
+#ifdef CONFIG_NETWORK
+	// Protocol counters and memory pool usage
+	stats_proc_init();
+#endif
 }
 
@@ -521,6 +521,7 @@ pci_msix_setup(pci_dev_t         * dev,
 
     int i = 0;
     int j = 0;
+    int last_entry = 0;
 
     /* check MSI-X capability */
     if (hdr->msix.valid == 0) {
@@ -544,6 +545,12 @@ pci_msix_setup(pci_dev_t         * dev,
         if (entries[i].entry >= max_entries) {
             return -1;
         }
+        if (entries[i].cpu >= NR_CPUS || !cpu_isset(entries[i].cpu, cpu_online_map)) {
+            return -1;
+        }
+        if (entries[i].entry > last_entry) {
+            last_entry = entries[i].entry;
+        }
         for (j = i + 1; j < num_entries; j++) {
             if (entries[i].entry == entries[j].entry) {
                 return -1;
@@ -564,7 +571,7 @@ pci_msix_setup(pci_dev_t         * dev,
         u64 table_addr   = 0;
         u8  table_bir    = hdr->msix.msix_table_bar;
         u64 table_offset = hdr->msix.msix_table_offset;
-        u64 table_size   = num_entries * PCI_MSIX_ENTRY_SIZE;
+        u64 table_size   = (last_entry + 1) * PCI_MSIX_ENTRY_SIZE;
 
         /* table addr */
         u32 bar_low      = hdr->bar[table_bir];
@@ -632,18 +639,17 @@ pci_msix_setup(pci_dev_t         * dev,
         void __iomem * base = NULL;
 	int dest = 0;
 
-        /* use boot cpu as the destination */
-#ifdef CONFIG_X86_64
-        dest = cpu_info[0].arch.apic_id;
-#elif defined(CONFIG_ARM64)
+#ifdef CONFIG_ARM64
    	panic("MSI not yet supported on ARM");
 #endif
-    
 
         for (i = 0; i < num_entries; i++) {
+#ifdef CONFIG_X86_64
+            dest = cpu_info[entries[i].cpu].arch.apic_id;
+#endif
             compose_msi_msg(&msg, dest, entries[i].vector);
 
-            base = msix_table_base + (i * PCI_MSIX_ENTRY_SIZE);
+            base = msix_table_base + (entries[i].entry * PCI_MSIX_ENTRY_SIZE);
 
             writel(msg.address_lo, base + PCI_MSIX_ENTRY_LOWER_ADDR_OFFSET);
             writel(msg.address_hi, base + PCI_MSIX_ENTRY_UPPER_ADDR_OFFSET);
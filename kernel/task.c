@@ -289,13 +289,15 @@ task_exit(
 			siginfo.si_code   = CLD_EXITED;
 			siginfo.si_status = current->aspace->exit_status >> 8;
 		}
-
-		if ( current->fdTable )
-			fdTableClose( current->fdTable );	
 	}
 
 	// End critical section
 	spin_unlock_irqrestore(&current->aspace->lock, irqstate);
+
+	// Closing files may sleep, so it is done outside the critical
+	// section, before the parent hears about the exit.
+	if (is_last_task && current->fdTable)
+		fdTableClose( current->fdTable );
 	
 	// If this was the last task in its address space,
 	// we need to notify the parent address space of this fact.
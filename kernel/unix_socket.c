@@ -0,0 +1,1680 @@
+/** \file
+ * AF_UNIX stream and datagram sockets.
+ *
+ * Sockets for processes on the same node, so co-located runtime pieces
+ * can talk without going through lwIP. A bound socket is a kfs node:
+ * bind() creates it, connect() and sendto() look it up, unlink() drops
+ * the binding.
+ *
+ * Every socket has a queue of messages to receive. Small sends are copied
+ * into a kernel buffer that is queued on the receiver. A blocking send too
+ * big for the space left in the receiver's buffer queues a descriptor of
+ * the sender's own iovec instead and sleeps until it has been consumed;
+ * the receiver copies straight out of the sender's physical pages, so bulk
+ * transfers cost one copy instead of two. Memory is never paged out and
+ * the sender stays blocked in send() for as long as the receiver may be
+ * reading its pages, as with direct FIFO reads.
+ */
+#include <lwk/kernel.h>
+#include <lwk/kmem.h>
+#include <lwk/list.h>
+#include <lwk/spinlock.h>
+#include <lwk/mutex.h>
+#include <lwk/sched.h>
+#include <lwk/signal.h>
+#include <lwk/aspace.h>
+#include <lwk/kfs.h>
+#include <lwk/fdTable.h>
+#include <lwk/poll.h>
+#include <lwk/stat.h>
+#include <lwk/uio.h>
+#include <lwk/unix_socket.h>
+#include <arch/uaccess.h>
+#include <arch-generic/fcntl.h>
+
+#define UNIX_RCVBUF		(256 * 1024)	/* bytes buffered per receiver */
+#define UNIX_CHUNK_MAX		(64 * 1024)	/* largest buffered stream chunk */
+#define UNIX_DIRECT_MIN		(64 * 1024)	/* smallest direct send */
+#define UNIX_DIRECT_EXTENTS	16
+#define UNIX_BACKLOG_MAX	4096
+
+/* Socket options, Linux numbering */
+#define UNIX_SOL_SOCKET		1
+#define UNIX_SO_TYPE		3
+#define UNIX_SO_ERROR		4
+#define UNIX_SO_SNDBUF		7
+#define UNIX_SO_RCVBUF		8
+
+/* sk->shutdown bits */
+#define UNIX_RCV_SHUTDOWN	1
+#define UNIX_SEND_SHUTDOWN	2
+#define UNIX_SHUTDOWN_MASK	3
+
+enum {
+	UNIX_UNCONNECTED,
+	UNIX_LISTENING,
+	UNIX_CONNECTED,
+};
+
+struct unix_address {
+	atomic_t		refs;
+	int			len;
+	struct sockaddr_un	name;
+};
+
+/* Position in an iovec array that lives in kernel memory */
+struct unix_iov {
+	const struct iovec *	iov;
+	unsigned long		nr;
+	size_t			skip;		/* bytes used of iov[0] */
+	size_t			count;		/* bytes left overall */
+};
+
+struct unix_msg {
+	struct list_head	link;
+	size_t			len;
+	size_t			off;		/* bytes consumed so far */
+	struct unix_address *	src;		/* sender's name, datagrams only */
+
+	/*
+	 * A direct message sits on the sender's stack and points at its
+	 * buffer. The receiver sets claimed while copying out of it and
+	 * complete once it is off the queue, after which the sender owns
+	 * it again.
+	 */
+	bool			direct;
+	bool			claimed;
+	bool			complete;
+	id_t			aspace_id;
+	struct unix_iov		from;
+
+	char			data[0];
+};
+
+struct unix_sock {
+	/* Protects everything but recv_mutex, never held across a copy */
+	spinlock_t		lock;
+	atomic_t		refs;
+	int			type;
+	int			state;
+	unsigned int		shutdown;
+	bool			dead;		/* the file is gone */
+	struct unix_sock *	peer;		/* holds a reference */
+	struct unix_address *	addr;
+	struct inode *		inode;		/* under unix_bind_lock */
+
+	struct list_head	recvq;
+	size_t			rcv_bytes;	/* buffered, not counting direct */
+	struct mutex		recv_mutex;	/* one reader at a time */
+
+	/* Readers, blocked senders, accept(), connect() and poll() */
+	waitq_t			wait;
+
+	/* Listening sockets */
+	struct list_head	accq;		/* connections for accept() */
+	int			acc_len;
+	int			backlog;
+	struct list_head	acc_link;
+};
+
+/* Ties bound sockets to their kfs nodes, taken inside kfs's _lock */
+static DEFINE_SPINLOCK(unix_bind_lock);
+
+static struct kfs_fops unix_sock_fops;
+static struct kfs_fops unix_node_fops;
+static struct inode_operations unix_node_iops;
+
+static void unix_release(struct unix_sock *sk);
+
+static struct unix_address *unix_addr_get(struct unix_address *addr)
+{
+	if (addr)
+		atomic_inc(&addr->refs);
+	return addr;
+}
+
+static void unix_addr_put(struct unix_address *addr)
+{
+	if (addr && atomic_dec_and_test(&addr->refs))
+		kmem_free(addr);
+}
+
+static void unix_sock_get(struct unix_sock *sk)
+{
+	atomic_inc(&sk->refs);
+}
+
+static void unix_sock_put(struct unix_sock *sk)
+{
+	if (!atomic_dec_and_test(&sk->refs))
+		return;
+
+	unix_addr_put(sk->addr);
+	kmem_free(sk);
+}
+
+static struct unix_sock *unix_sock_alloc(int type)
+{
+	struct unix_sock *sk = kmem_alloc(sizeof(struct unix_sock));
+
+	if (!sk)
+		return NULL;
+
+	spin_lock_init(&sk->lock);
+	atomic_set(&sk->refs, 1);
+	sk->type = type;
+	sk->state = UNIX_UNCONNECTED;
+	list_head_init(&sk->recvq);
+	mutex_init(&sk->recv_mutex);
+	waitq_init(&sk->wait);
+	list_head_init(&sk->accq);
+	list_head_init(&sk->acc_link);
+
+	return sk;
+}
+
+/* Gives sk's initial reference to a new file */
+static int unix_sock_install(struct unix_sock *sk, int flags)
+{
+	int fd = kfs_open_anon(&unix_sock_fops, sk);
+	struct file *file;
+
+	if (fd < 0)
+		return fd;
+
+	/* Another thread may have closed it already */
+	file = fdTableGetFile(current->fdTable, fd);
+	if (file) {
+		file->f_flags = O_RDWR | (flags & SOCK_NONBLOCK);
+		kfs_put_file(file);
+	}
+
+	return fd;
+}
+
+static void unix_close_fd(int fd)
+{
+	struct file *file = fdTableRemoveFd(current->fdTable, fd);
+
+	if (file)
+		kfs_put_file(file);
+}
+
+static inline size_t unix_rcv_space(struct unix_sock *sk)
+{
+	size_t used = ACCESS_ONCE(sk->rcv_bytes);
+
+	return (used < UNIX_RCVBUF) ? UNIX_RCVBUF - used : 0;
+}
+
+/* The connected peer with a reference held, or NULL */
+static struct unix_sock *unix_peer_get(struct unix_sock *sk)
+{
+	struct unix_sock *peer;
+	unsigned long flags;
+
+	spin_lock_irqsave(&sk->lock, flags);
+	peer = sk->peer;
+	if (peer)
+		unix_sock_get(peer);
+	spin_unlock_irqrestore(&sk->lock, flags);
+
+	return peer;
+}
+
+/*
+ * Names
+ */
+
+/* Copies in a sockaddr_un; abstract names (leading NUL) aren't supported */
+static int unix_addr_from_user(const void __user *uaddr, int addrlen,
+			       struct unix_address **addrp)
+{
+	struct unix_address *addr;
+	int path_max = addrlen - (int)offsetof(struct sockaddr_un, sun_path);
+	int len;
+
+	if (path_max <= 0 || addrlen > sizeof(struct sockaddr_un))
+		return -EINVAL;
+
+	addr = kmem_alloc(sizeof(struct unix_address));
+	if (!addr)
+		return -ENOMEM;
+
+	if (copy_from_user(&addr->name, uaddr, addrlen)) {
+		kmem_free(addr);
+		return -EFAULT;
+	}
+
+	len = strnlen(addr->name.sun_path, path_max);
+	if (addr->name.sun_family != AF_UNIX || len == 0 ||
+	    len == UNIX_PATH_MAX) {
+		kmem_free(addr);
+		return -EINVAL;
+	}
+
+	atomic_set(&addr->refs, 1);
+	addr->len = offsetof(struct sockaddr_un, sun_path) + len + 1;
+	*addrp = addr;
+	return 0;
+}
+
+static int unix_addr_to_user(struct unix_address *addr, void __user *uaddr,
+			     int __user *uaddrlen)
+{
+	struct sockaddr_un unnamed = { .sun_family = AF_UNIX };
+	const void *name = addr ? (void *)&addr->name : (void *)&unnamed;
+	int len = addr ? addr->len : sizeof(unnamed.sun_family);
+	int ulen;
+
+	if (copy_from_user(&ulen, uaddrlen, sizeof(ulen)))
+		return -EFAULT;
+	if (ulen < 0)
+		return -EINVAL;
+
+	/* Like Linux, report the full length even if the name was cut */
+	if (copy_to_user(uaddr, name, min(ulen, len)) ||
+	    copy_to_user(uaddrlen, &len, sizeof(len)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/*
+ * Relative names resolve from the working directory, as for
+ * openat(AT_FDCWD). There is no chdir() yet, so that is the root.
+ */
+static inline struct inode *unix_cwd(void)
+{
+	return kfs_root;
+}
+
+/* The socket bound to addr, with a reference held */
+static int unix_find(struct unix_address *addr, struct unix_sock **skp)
+{
+	struct inode *inode;
+	unsigned long flags;
+	int ret = 0;
+
+	__lock(&_lock);
+	inode = kfs_lookup(unix_cwd(), addr->name.sun_path, 0);
+
+	spin_lock_irqsave(&unix_bind_lock, flags);
+	if (!inode)
+		ret = -ENOENT;
+	else if (inode->i_fop != &unix_node_fops || !inode->i_private)
+		ret = -ECONNREFUSED;
+	else {
+		*skp = inode->i_private;
+		unix_sock_get(*skp);
+	}
+	spin_unlock_irqrestore(&unix_bind_lock, flags);
+	__unlock(&_lock);
+
+	return ret;
+}
+
+/* Nodes are only names, there is nothing to open */
+static int unix_node_open(struct inode *inode, struct file *file)
+{
+	return -ENXIO;
+}
+
+static int unix_node_unlink(struct inode *inode)
+{
+	struct unix_sock *sk;
+	unsigned long flags;
+
+	spin_lock_irqsave(&unix_bind_lock, flags);
+	sk = inode->i_private;
+	if (sk) {
+		sk->inode = NULL;
+		inode->i_private = NULL;
+	}
+	spin_unlock_irqrestore(&unix_bind_lock, flags);
+
+	return 0;
+}
+
+static struct kfs_fops unix_node_fops = {
+	.open = unix_node_open,
+};
+
+static struct inode_operations unix_node_iops = {
+	.unlink = unix_node_unlink,
+};
+
+/*
+ * Copies
+ */
+
+static void unix_iov_init(struct unix_iov *it, const struct iovec *iov,
+			  unsigned long nr, size_t count)
+{
+	it->iov = iov;
+	it->nr = nr;
+	it->skip = 0;
+	it->count = count;
+
+	/* Step over empty leading entries */
+	while (it->nr && it->iov->iov_len == 0) {
+		it->iov++;
+		it->nr--;
+	}
+}
+
+static void unix_iov_advance(struct unix_iov *it, size_t n)
+{
+	it->count -= n;
+	it->skip += n;
+
+	while (it->nr && it->skip == it->iov->iov_len) {
+		it->iov++;
+		it->nr--;
+		it->skip = 0;
+	}
+}
+
+static int unix_iov_copy_from(char *kbuf, struct unix_iov *from, size_t n)
+{
+	while (n) {
+		size_t len = min(n, from->iov->iov_len - from->skip);
+
+		if (copy_from_user(kbuf, from->iov->iov_base + from->skip, len))
+			return -EFAULT;
+
+		unix_iov_advance(from, len);
+		kbuf += len;
+		n -= len;
+	}
+
+	return 0;
+}
+
+static int unix_iov_copy_to(struct unix_iov *to, const char *kbuf, size_t n)
+{
+	while (n) {
+		size_t len = min(n, to->iov->iov_len - to->skip);
+
+		if (copy_to_user(to->iov->iov_base + to->skip, kbuf, len))
+			return -EFAULT;
+
+		unix_iov_advance(to, len);
+		kbuf += len;
+		n -= len;
+	}
+
+	return 0;
+}
+
+struct unix_extents {
+	unsigned int	nr;
+	size_t		bytes;
+	struct {
+		paddr_t	paddr;
+		size_t	size;
+	} ext[UNIX_DIRECT_EXTENTS];
+};
+
+static int unix_add_extent(paddr_t paddr, size_t size, void *priv)
+{
+	struct unix_extents *exts = priv;
+
+	if (exts->nr == UNIX_DIRECT_EXTENTS)
+		return 1;
+
+	exts->ext[exts->nr].paddr = paddr;
+	exts->ext[exts->nr].size = size;
+	exts->nr++;
+	exts->bytes += size;
+	return 0;
+}
+
+/*
+ * Copies n bytes of a direct message out of the sender's address space:
+ * translate a piece of its iovec to physical extents and copy those
+ * through the kernel's mapping of physical memory.
+ */
+static int unix_copy_direct(struct unix_iov *to, struct unix_msg *msg,
+			    size_t n)
+{
+	struct unix_iov *from = &msg->from;
+	struct unix_extents exts;
+	unsigned int i;
+	int status;
+
+	while (n) {
+		exts.nr = 0;
+		exts.bytes = 0;
+
+		/* A positive status only means the extent array filled up */
+		status = aspace_virt_to_phys_range(msg->aspace_id,
+				(vaddr_t)from->iov->iov_base + from->skip,
+				min(n, from->iov->iov_len - from->skip),
+				unix_add_extent, &exts);
+		if (status < 0 || exts.bytes == 0)
+			return -EFAULT;
+
+		for (i = 0; i < exts.nr; i++) {
+			if (unix_iov_copy_to(to, __va(exts.ext[i].paddr),
+					     exts.ext[i].size))
+				return -EFAULT;
+		}
+
+		unix_iov_advance(from, exts.bytes);
+		n -= exts.bytes;
+	}
+
+	return 0;
+}
+
+/*
+ * Sending
+ */
+
+/* Whether other can't take any more: it's gone or stopped receiving */
+static inline bool unix_closed(struct unix_sock *other)
+{
+	return other->dead || (other->shutdown & UNIX_RCV_SHUTDOWN);
+}
+
+/* Waits until other has room for need bytes, or is empty */
+static int unix_wait_space(struct unix_sock *other, size_t need,
+			   bool nonblock)
+{
+	if (unix_rcv_space(other) >= need || !other->rcv_bytes)
+		return 0;
+	if (nonblock)
+		return -EAGAIN;
+
+	if (wait_event_interruptible(other->wait, unix_closed(other) ||
+			unix_rcv_space(other) >= need || !other->rcv_bytes))
+		return -EINTR;
+
+	return 0;
+}
+
+/* Queues a buffered message, which other then owns */
+static int unix_queue_msg(struct unix_sock *other, struct unix_msg *msg)
+{
+	unsigned long flags;
+	int ret = 0;
+
+	spin_lock_irqsave(&other->lock, flags);
+	if (unix_closed(other))
+		ret = -EPIPE;
+	else {
+		list_add_tail(&msg->link, &other->recvq);
+		other->rcv_bytes += msg->len;
+	}
+	spin_unlock_irqrestore(&other->lock, flags);
+
+	if (!ret)
+		waitq_wakeup(&other->wait);
+
+	return ret;
+}
+
+/* A buffered message holding the next len bytes of from */
+static struct unix_msg *unix_msg_alloc(struct unix_iov *from, size_t len,
+				       int *err)
+{
+	struct unix_msg *msg = kmem_alloc(sizeof(struct unix_msg) + len);
+
+	if (!msg) {
+		*err = -ENOMEM;
+		return NULL;
+	}
+
+	if (unix_iov_copy_from(msg->data, from, len)) {
+		kmem_free(msg);
+		*err = -EFAULT;
+		return NULL;
+	}
+
+	msg->len = len;
+	return msg;
+}
+
+/*
+ * Withdraws a direct message that the sender gave up waiting on. If a
+ * receiver is copying out of it, wait for that copy to finish first.
+ */
+static void unix_cancel_direct(struct unix_sock *other, struct unix_msg *msg)
+{
+	unsigned long flags;
+	bool done;
+
+	for (;;) {
+		spin_lock_irqsave(&other->lock, flags);
+		if (!msg->complete && !msg->claimed) {
+			list_del(&msg->link);
+			msg->complete = true;
+		}
+		done = msg->complete;
+		spin_unlock_irqrestore(&other->lock, flags);
+
+		if (done)
+			return;
+
+		wait_event(other->wait, !msg->claimed || msg->complete);
+	}
+}
+
+/*
+ * Hands the sender's buffer to other and waits until it has been read.
+ * Returns the bytes consumed, which for a stream may be less than all
+ * of them if the receiver went away or the sender was interrupted.
+ */
+static ssize_t unix_send_direct(struct unix_sock *other, struct unix_iov *from,
+				struct unix_address *src)
+{
+	struct unix_msg msg;
+	unsigned long flags;
+	int ret = 0;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.len = from->count;
+	msg.src = src;
+	msg.direct = true;
+	msg.aspace_id = current->aspace->id;
+	msg.from = *from;
+
+	spin_lock_irqsave(&other->lock, flags);
+	if (unix_closed(other))
+		ret = -EPIPE;
+	else
+		list_add_tail(&msg.link, &other->recvq);
+	spin_unlock_irqrestore(&other->lock, flags);
+
+	if (ret)
+		return ret;
+
+	waitq_wakeup(&other->wait);
+
+	if (wait_event_interruptible(other->wait, msg.complete))
+		ret = -EINTR;
+	unix_cancel_direct(other, &msg);
+
+	/* The receiver advanced our copy of the cursor */
+	*from = msg.from;
+
+	if (msg.off)
+		return msg.off;
+	return ret ? ret : -EPIPE;
+}
+
+static ssize_t unix_stream_send(struct unix_sock *sk, struct unix_iov *from,
+				bool nonblock)
+{
+	struct unix_sock *other;
+	struct unix_msg *msg;
+	size_t total = from->count;
+	size_t len;
+	ssize_t ret = 0;
+	int err;
+
+	if (sk->shutdown & UNIX_SEND_SHUTDOWN)
+		return -EPIPE;
+
+	other = unix_peer_get(sk);
+	if (!other)
+		return (sk->state == UNIX_CONNECTED) ? -EPIPE : -ENOTCONN;
+
+	while (from->count) {
+		if (!nonblock && from->count >= UNIX_DIRECT_MIN &&
+		    from->count > unix_rcv_space(other)) {
+			ret = unix_send_direct(other, from, NULL);
+			if (ret < 0)
+				break;
+			continue;
+		}
+
+		ret = unix_wait_space(other, 1, nonblock);
+		if (ret)
+			break;
+
+		len = min_t(size_t, from->count, UNIX_CHUNK_MAX);
+		len = min(len, max(unix_rcv_space(other), (size_t)1));
+		msg = unix_msg_alloc(from, len, &err);
+		if (!msg) {
+			ret = err;
+			break;
+		}
+		ret = unix_queue_msg(other, msg);
+		if (ret) {
+			kmem_free(msg);
+			break;
+		}
+	}
+
+	unix_sock_put(other);
+
+	/* Report what went out before an error, like a pipe */
+	if (from->count < total)
+		return total - from->count;
+	return ret;
+}
+
+static ssize_t unix_dgram_send(struct unix_sock *sk, struct unix_iov *from,
+			       struct unix_address *addr, bool nonblock)
+{
+	struct unix_sock *other;
+	struct unix_address *src;
+	struct unix_msg *msg;
+	size_t len = from->count;
+	unsigned long flags;
+	ssize_t ret;
+	int err;
+
+	if (sk->shutdown & UNIX_SEND_SHUTDOWN)
+		return -EPIPE;
+
+	if (addr) {
+		ret = unix_find(addr, &other);
+		if (ret)
+			return ret;
+	} else if (!(other = unix_peer_get(sk)))
+		return -ENOTCONN;
+
+	if (other->type != SOCK_DGRAM) {
+		ret = -EPROTOTYPE;
+		goto out;
+	}
+
+	spin_lock_irqsave(&sk->lock, flags);
+	src = unix_addr_get(sk->addr);
+	spin_unlock_irqrestore(&sk->lock, flags);
+
+	if (!nonblock && len >= UNIX_DIRECT_MIN &&
+	    len > unix_rcv_space(other)) {
+		ret = unix_send_direct(other, from, src);
+		unix_addr_put(src);
+		if (ret >= 0)
+			ret = len;
+		goto out;
+	}
+
+	if (len > UNIX_RCVBUF) {
+		unix_addr_put(src);
+		ret = -EMSGSIZE;
+		goto out;
+	}
+
+	msg = unix_msg_alloc(from, len, &err);
+	if (!msg) {
+		unix_addr_put(src);
+		ret = err;
+		goto out;
+	}
+	msg->src = src;
+
+	ret = unix_wait_space(other, len, nonblock);
+	if (!ret)
+		ret = unix_queue_msg(other, msg);
+	if (ret) {
+		unix_addr_put(src);
+		kmem_free(msg);
+		goto out;
+	}
+
+	ret = len;
+out:
+	/* A datagram peer that has gone refuses, it doesn't break a pipe */
+	if (ret == -EPIPE)
+		ret = -ECONNREFUSED;
+	unix_sock_put(other);
+	return ret;
+}
+
+static ssize_t unix_send(struct unix_sock *sk, struct unix_iov *from,
+			 struct unix_address *addr, int flags, bool nonblock)
+{
+	if (flags & MSG_OOB)
+		return -EOPNOTSUPP;
+
+	nonblock |= !!(flags & MSG_DONTWAIT);
+
+	if (sk->type == SOCK_STREAM) {
+		if (addr)
+			return (sk->state == UNIX_CONNECTED) ? -EISCONN :
+							       -EOPNOTSUPP;
+		return unix_stream_send(sk, from, nonblock);
+	}
+
+	return unix_dgram_send(sk, from, addr, nonblock);
+}
+
+/*
+ * Receiving
+ */
+
+/*
+ * Takes data off the queue into to. A stream gathers across messages
+ * until to is full or the queue runs dry, a datagram socket returns one
+ * message and drops what doesn't fit. *srcp, if given, gets a reference
+ * to the datagram sender's name.
+ */
+static ssize_t unix_recv(struct unix_sock *sk, struct unix_iov *to, int flags,
+			 bool nonblock, struct unix_address **srcp,
+			 bool *trunc)
+{
+	bool stream = (sk->type == SOCK_STREAM);
+	size_t want = to->count;
+	size_t copied = 0;
+	struct unix_msg *msg, *done;
+	struct unix_address *src;
+	struct unix_sock *peer;
+	unsigned long iflags;
+	ssize_t ret = 0;
+	size_t n;
+	int err;
+
+	if (flags & (MSG_OOB | MSG_PEEK))
+		return -EOPNOTSUPP;
+	if (stream && sk->state != UNIX_CONNECTED)
+		return -EINVAL;
+	if (!want && stream)
+		return 0;
+
+	nonblock |= !!(flags & MSG_DONTWAIT);
+
+	mutex_lock(&sk->recv_mutex);
+
+	for (;;) {
+		spin_lock_irqsave(&sk->lock, iflags);
+		if (list_empty(&sk->recvq)) {
+			bool eof = sk->shutdown & UNIX_RCV_SHUTDOWN;
+			spin_unlock_irqrestore(&sk->lock, iflags);
+
+			if (eof)
+				break;
+			if (copied && !((flags & MSG_WAITALL) && copied < want))
+				break;
+			if (nonblock) {
+				if (!copied)
+					ret = -EAGAIN;
+				break;
+			}
+
+			/* Don't hold off other readers while asleep */
+			mutex_unlock(&sk->recv_mutex);
+			err = wait_event_interruptible(sk->wait,
+					!list_empty(&sk->recvq) ||
+					(sk->shutdown & UNIX_RCV_SHUTDOWN));
+			mutex_lock(&sk->recv_mutex);
+
+			if (err) {
+				if (!copied)
+					ret = -EINTR;
+				break;
+			}
+			continue;
+		}
+
+		msg = list_first_entry(&sk->recvq, struct unix_msg, link);
+		msg->claimed = true;
+		spin_unlock_irqrestore(&sk->lock, iflags);
+
+		n = min(to->count, msg->len - msg->off);
+		if (msg->direct)
+			err = unix_copy_direct(to, msg, n);
+		else
+			err = unix_iov_copy_to(to, msg->data + msg->off, n);
+
+		done = NULL;
+		src = NULL;
+
+		spin_lock_irqsave(&sk->lock, iflags);
+		msg->claimed = false;
+		if (!err) {
+			msg->off += n;
+			copied += n;
+
+			if (stream) {
+				if (!msg->direct)
+					sk->rcv_bytes -= n;
+			} else {
+				if (!msg->direct)
+					sk->rcv_bytes -= msg->len;
+				if (n < msg->len && trunc)
+					*trunc = true;
+				src = unix_addr_get(msg->src);
+				msg->off = msg->len;
+			}
+
+			if (msg->off == msg->len) {
+				list_del(&msg->link);
+				if (msg->direct)
+					msg->complete = true;
+				else
+					done = msg;
+			}
+		}
+		peer = sk->peer;
+		if (peer)
+			unix_sock_get(peer);
+		spin_unlock_irqrestore(&sk->lock, iflags);
+
+		/* Wake blocked and direct senders, and poll() on the peer */
+		waitq_wakeup(&sk->wait);
+		if (peer) {
+			if (stream)
+				waitq_wakeup(&peer->wait);
+			unix_sock_put(peer);
+		}
+
+		if (done) {
+			unix_addr_put(done->src);
+			kmem_free(done);
+		}
+
+		if (srcp)
+			*srcp = src;
+		else
+			unix_addr_put(src);
+
+		if (err) {
+			if (!copied)
+				ret = err;
+			break;
+		}
+
+		if (!stream || !to->count)
+			break;
+	}
+
+	mutex_unlock(&sk->recv_mutex);
+
+	return copied ? copied : ret;
+}
+
+/*
+ * Connections
+ */
+
+static int unix_stream_connect(struct unix_sock *sk, struct unix_address *addr,
+			       bool nonblock)
+{
+	struct unix_sock *other, *ns;
+	unsigned long flags;
+	int ret;
+
+	if (sk->state != UNIX_UNCONNECTED)
+		return (sk->state == UNIX_CONNECTED) ? -EISCONN : -EINVAL;
+
+	ret = unix_find(addr, &other);
+	if (ret)
+		return ret;
+
+	if (other->type != SOCK_STREAM) {
+		ret = -EPROTOTYPE;
+		goto out;
+	}
+
+	/* The server's end, handed to accept() */
+	ns = unix_sock_alloc(SOCK_STREAM);
+	if (!ns) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	ns->state = UNIX_CONNECTED;
+
+	for (;;) {
+		spin_lock_irqsave(&other->lock, flags);
+		if (other->state != UNIX_LISTENING || other->dead) {
+			spin_unlock_irqrestore(&other->lock, flags);
+			ret = -ECONNREFUSED;
+			break;
+		}
+		if (other->acc_len < other->backlog)
+			break;
+		spin_unlock_irqrestore(&other->lock, flags);
+
+		if (nonblock) {
+			ret = -EAGAIN;
+			break;
+		}
+
+		if (wait_event_interruptible(other->wait,
+				other->acc_len < other->backlog ||
+				other->state != UNIX_LISTENING || other->dead)) {
+			ret = -EINTR;
+			break;
+		}
+	}
+
+	if (ret) {
+		unix_sock_put(ns);
+		goto out;
+	}
+
+	/* The listener's lock is held, nest ours inside it */
+	spin_lock(&sk->lock);
+	if (sk->state != UNIX_UNCONNECTED) {
+		ret = (sk->state == UNIX_CONNECTED) ? -EISCONN : -EINVAL;
+	} else {
+		unix_sock_get(sk);
+		ns->peer = sk;
+		unix_sock_get(ns);
+		sk->peer = ns;
+		sk->state = UNIX_CONNECTED;
+		ns->addr = unix_addr_get(other->addr);
+	}
+	spin_unlock(&sk->lock);
+
+	if (!ret) {
+		/* The accept queue owns ns's first reference */
+		list_add_tail(&ns->acc_link, &other->accq);
+		other->acc_len++;
+	}
+	spin_unlock_irqrestore(&other->lock, flags);
+
+	if (ret)
+		unix_sock_put(ns);
+	else
+		waitq_wakeup(&other->wait);
+out:
+	unix_sock_put(other);
+	return ret;
+}
+
+/* Datagram connect() only sets the default destination */
+static int unix_dgram_connect(struct unix_sock *sk, struct unix_address *addr)
+{
+	struct unix_sock *other, *old;
+	unsigned long flags;
+	int ret;
+
+	ret = unix_find(addr, &other);
+	if (ret)
+		return ret;
+
+	if (other->type != SOCK_DGRAM) {
+		unix_sock_put(other);
+		return -EPROTOTYPE;
+	}
+
+	spin_lock_irqsave(&sk->lock, flags);
+	old = sk->peer;
+	sk->peer = other;
+	sk->state = UNIX_CONNECTED;
+	spin_unlock_irqrestore(&sk->lock, flags);
+
+	if (old)
+		unix_sock_put(old);
+
+	return 0;
+}
+
+/*
+ * Teardown
+ */
+
+static void unix_release(struct unix_sock *sk)
+{
+	struct unix_sock *peer, *ns, *ntmp;
+	struct unix_msg *msg, *mtmp;
+	unsigned long flags;
+	bool unlinked = false;
+	LIST_HEAD(purge);
+	LIST_HEAD(embryos);
+
+	spin_lock_irqsave(&unix_bind_lock, flags);
+	if (sk->inode) {
+		sk->inode->i_private = NULL;
+		sk->inode = NULL;
+	}
+	spin_unlock_irqrestore(&unix_bind_lock, flags);
+
+	spin_lock_irqsave(&sk->lock, flags);
+	sk->dead = true;
+	sk->shutdown = UNIX_SHUTDOWN_MASK;
+	sk->state = UNIX_UNCONNECTED;
+	peer = sk->peer;
+	sk->peer = NULL;
+
+	list_splice_init(&sk->accq, &embryos);
+	sk->acc_len = 0;
+
+	/* Direct senders get their buffers back, buffered data is dropped */
+	list_for_each_entry_safe(msg, mtmp, &sk->recvq, link) {
+		list_del(&msg->link);
+		if (msg->direct)
+			msg->complete = true;
+		else
+			list_add_tail(&msg->link, &purge);
+	}
+	sk->rcv_bytes = 0;
+	spin_unlock_irqrestore(&sk->lock, flags);
+
+	waitq_wakeup(&sk->wait);
+
+	if (peer) {
+		/* A stream peer sees EOF and EPIPE from here on */
+		spin_lock_irqsave(&peer->lock, flags);
+		if (peer->peer == sk && sk->type == SOCK_STREAM) {
+			peer->peer = NULL;
+			peer->shutdown = UNIX_SHUTDOWN_MASK;
+			unlinked = true;
+		}
+		spin_unlock_irqrestore(&peer->lock, flags);
+
+		waitq_wakeup(&peer->wait);
+		if (unlinked)
+			unix_sock_put(sk);
+		unix_sock_put(peer);
+	}
+
+	list_for_each_entry_safe(msg, mtmp, &purge, link) {
+		unix_addr_put(msg->src);
+		kmem_free(msg);
+	}
+
+	/* Connections nobody accepted are closed as if accepted */
+	list_for_each_entry_safe(ns, ntmp, &embryos, acc_link) {
+		list_del_init(&ns->acc_link);
+		unix_release(ns);
+	}
+
+	unix_sock_put(sk);
+}
+
+/*
+ * File operations
+ */
+
+static ssize_t unix_read(struct file *file, char __user *buf, size_t len,
+			 loff_t *off)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = len };
+	struct unix_iov to;
+
+	unix_iov_init(&to, &iov, 1, len);
+	return unix_recv(file->private_data, &to, 0,
+			 file->f_flags & O_NONBLOCK, NULL, NULL);
+}
+
+static ssize_t unix_write(struct file *file, const char __user *buf,
+			  size_t len, loff_t *off)
+{
+	struct iovec iov = { .iov_base = (void __user *)buf, .iov_len = len };
+	struct unix_iov from;
+
+	unix_iov_init(&from, &iov, 1, len);
+	return unix_send(file->private_data, &from, NULL, 0,
+			 file->f_flags & O_NONBLOCK);
+}
+
+static ssize_t unix_read_iter(struct file *file, const struct iovec *iov,
+			      unsigned long nr, loff_t *off)
+{
+	struct unix_iov to;
+
+	unix_iov_init(&to, iov, nr, kfs_iov_length(iov, nr));
+	return unix_recv(file->private_data, &to, 0,
+			 file->f_flags & O_NONBLOCK, NULL, NULL);
+}
+
+static ssize_t unix_write_iter(struct file *file, const struct iovec *iov,
+			       unsigned long nr, loff_t *off)
+{
+	struct unix_iov from;
+
+	unix_iov_init(&from, iov, nr, kfs_iov_length(iov, nr));
+	return unix_send(file->private_data, &from, NULL, 0,
+			 file->f_flags & O_NONBLOCK);
+}
+
+/* Datagram sockets always poll writable, a send blocks at most briefly */
+static unsigned int unix_poll(struct file *file, struct poll_table_struct *wait)
+{
+	struct unix_sock *sk = file->private_data;
+	unsigned int mask = 0;
+	unsigned long flags;
+	bool writable;
+
+	poll_wait(file, &sk->wait, wait);
+
+	if (sk->state == UNIX_LISTENING)
+		return list_empty(&sk->accq) ? 0 : POLLIN | POLLRDNORM;
+
+	if (!list_empty(&sk->recvq))
+		mask |= POLLIN | POLLRDNORM;
+	if (sk->shutdown & UNIX_RCV_SHUTDOWN)
+		mask |= POLLIN | POLLRDNORM | POLLRDHUP;
+	if (sk->shutdown == UNIX_SHUTDOWN_MASK)
+		mask |= POLLHUP;
+
+	if (sk->type == SOCK_DGRAM)
+		writable = true;
+	else {
+		spin_lock_irqsave(&sk->lock, flags);
+		writable = (sk->shutdown & UNIX_SEND_SHUTDOWN) ||
+			   (sk->peer && unix_rcv_space(sk->peer));
+		spin_unlock_irqrestore(&sk->lock, flags);
+	}
+
+	if (writable)
+		mask |= POLLOUT | POLLWRNORM;
+
+	return mask;
+}
+
+static int unix_close(struct file *file)
+{
+	unix_release(file->private_data);
+	return 0;
+}
+
+static int unix_file_release(struct inode *inode, struct file *file)
+{
+	unix_release(file->private_data);
+	return 0;
+}
+
+static struct kfs_fops unix_sock_fops = {
+	.read = unix_read,
+	.write = unix_write,
+	.read_iter = unix_read_iter,
+	.write_iter = unix_write_iter,
+	.poll = unix_poll,
+	.close = unix_close,
+	.release = unix_file_release,
+};
+
+bool is_unix_socket(struct file *file)
+{
+	return file->f_op == &unix_sock_fops;
+}
+
+/*
+ * Socket calls
+ */
+
+static int unix_check_type(int *type, int protocol, int *flags)
+{
+	*flags = *type & ~SOCK_TYPE_MASK;
+	*type &= SOCK_TYPE_MASK;
+
+	/* There is no exec, so SOCK_CLOEXEC has nothing to do */
+	if (*flags & ~(SOCK_NONBLOCK | SOCK_CLOEXEC))
+		return -EINVAL;
+	if (*type != SOCK_STREAM && *type != SOCK_DGRAM)
+		return -ESOCKTNOSUPPORT;
+	if (protocol && protocol != PF_UNIX)
+		return -EPROTONOSUPPORT;
+
+	return 0;
+}
+
+int unix_socket(int type, int protocol)
+{
+	struct unix_sock *sk;
+	int flags, fd;
+
+	fd = unix_check_type(&type, protocol, &flags);
+	if (fd)
+		return fd;
+
+	sk = unix_sock_alloc(type);
+	if (!sk)
+		return -ENOMEM;
+
+	fd = unix_sock_install(sk, flags);
+	if (fd < 0)
+		unix_sock_put(sk);
+
+	return fd;
+}
+
+int unix_socketpair(int type, int protocol, int fds[2])
+{
+	struct unix_sock *a, *b;
+	int flags, ret;
+
+	ret = unix_check_type(&type, protocol, &flags);
+	if (ret)
+		return ret;
+
+	a = unix_sock_alloc(type);
+	b = unix_sock_alloc(type);
+	if (!a || !b) {
+		if (a)
+			unix_sock_put(a);
+		if (b)
+			unix_sock_put(b);
+		return -ENOMEM;
+	}
+
+	unix_sock_get(b);
+	a->peer = b;
+	unix_sock_get(a);
+	b->peer = a;
+	a->state = b->state = UNIX_CONNECTED;
+
+	if ((fds[0] = unix_sock_install(a, flags)) < 0) {
+		unix_release(a);
+		unix_release(b);
+		return fds[0];
+	}
+
+	if ((fds[1] = unix_sock_install(b, flags)) < 0) {
+		unix_release(b);
+		unix_close_fd(fds[0]);
+		return fds[1];
+	}
+
+	return 0;
+}
+
+int unix_bind(struct file *file, const void __user *uaddr, int addrlen)
+{
+	struct unix_sock *sk = file->private_data;
+	struct unix_address *addr;
+	const char *path;
+	struct inode *inode;
+	unsigned long flags;
+	int ret;
+
+	ret = unix_addr_from_user(uaddr, addrlen, &addr);
+	if (ret)
+		return ret;
+
+	path = addr->name.sun_path;
+
+	/* Binds are serialized by _lock, so sk->addr can't change under us */
+	__lock(&_lock);
+	if (sk->addr)
+		ret = -EINVAL;
+	else if (kfs_lookup(unix_cwd(), path, 0))
+		ret = -EADDRINUSE;
+	else if (!(inode = kfs_create_at(unix_cwd(), path, &unix_node_iops,
+					 &unix_node_fops, S_IFSOCK | 0777,
+					 NULL, 0)))
+		ret = -ENOENT;
+	else {
+		spin_lock_irqsave(&unix_bind_lock, flags);
+		inode->i_private = sk;
+		sk->inode = inode;
+		spin_unlock_irqrestore(&unix_bind_lock, flags);
+
+		spin_lock_irqsave(&sk->lock, flags);
+		sk->addr = addr;
+		spin_unlock_irqrestore(&sk->lock, flags);
+	}
+	__unlock(&_lock);
+
+	if (ret)
+		unix_addr_put(addr);
+
+	return ret;
+}
+
+int unix_connect(struct file *file, const void __user *uaddr, int addrlen)
+{
+	struct unix_sock *sk = file->private_data;
+	struct unix_address *addr;
+	int ret;
+
+	ret = unix_addr_from_user(uaddr, addrlen, &addr);
+	if (ret)
+		return ret;
+
+	if (sk->type == SOCK_STREAM)
+		ret = unix_stream_connect(sk, addr, file->f_flags & O_NONBLOCK);
+	else
+		ret = unix_dgram_connect(sk, addr);
+
+	unix_addr_put(addr);
+	return ret;
+}
+
+int unix_listen(struct file *file, int backlog)
+{
+	struct unix_sock *sk = file->private_data;
+	unsigned long flags;
+	int ret = 0;
+
+	if (sk->type != SOCK_STREAM)
+		return -EOPNOTSUPP;
+
+	spin_lock_irqsave(&sk->lock, flags);
+	if (sk->state == UNIX_CONNECTED || !sk->addr)
+		ret = -EINVAL;
+	else {
+		sk->state = UNIX_LISTENING;
+		sk->backlog = min(max(backlog, 1), UNIX_BACKLOG_MAX);
+	}
+	spin_unlock_irqrestore(&sk->lock, flags);
+
+	/* A bigger backlog may let blocked connect()s in */
+	waitq_wakeup(&sk->wait);
+
+	return ret;
+}
+
+int unix_accept(struct file *file, void __user *uaddr, int __user *uaddrlen,
+		int flags)
+{
+	struct unix_sock *sk = file->private_data;
+	struct unix_sock *ns = NULL;
+	struct unix_address *addr = NULL;
+	unsigned long iflags;
+	int fd;
+
+	if (flags & ~(SOCK_NONBLOCK | SOCK_CLOEXEC))
+		return -EINVAL;
+	if (sk->type != SOCK_STREAM)
+		return -EOPNOTSUPP;
+
+	for (;;) {
+		spin_lock_irqsave(&sk->lock, iflags);
+		if (sk->state != UNIX_LISTENING) {
+			spin_unlock_irqrestore(&sk->lock, iflags);
+			return -EINVAL;
+		}
+		if (!list_empty(&sk->accq)) {
+			ns = list_first_entry(&sk->accq, struct unix_sock,
+					      acc_link);
+			list_del_init(&ns->acc_link);
+			sk->acc_len--;
+		}
+		spin_unlock_irqrestore(&sk->lock, iflags);
+
+		if (ns)
+			break;
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		if (wait_event_interruptible(sk->wait,
+				!list_empty(&sk->accq) ||
+				sk->state != UNIX_LISTENING))
+			return -EINTR;
+	}
+
+	/* A connect() may be waiting for backlog room */
+	waitq_wakeup(&sk->wait);
+
+	fd = unix_sock_install(ns, flags);
+	if (fd < 0) {
+		unix_release(ns);
+		return fd;
+	}
+
+	if (uaddr) {
+		spin_lock_irqsave(&ns->lock, iflags);
+		if (ns->peer)
+			addr = unix_addr_get(ns->peer->addr);
+		spin_unlock_irqrestore(&ns->lock, iflags);
+
+		if (unix_addr_to_user(addr, uaddr, uaddrlen)) {
+			unix_addr_put(addr);
+			unix_close_fd(fd);
+			return -EFAULT;
+		}
+		unix_addr_put(addr);
+	}
+
+	return fd;
+}
+
+int unix_getname(struct file *file, void __user *uaddr, int __user *uaddrlen,
+		 bool peer)
+{
+	struct unix_sock *sk = file->private_data;
+	struct unix_address *addr = NULL;
+	unsigned long flags;
+	int ret = 0;
+
+	spin_lock_irqsave(&sk->lock, flags);
+	if (!peer)
+		addr = unix_addr_get(sk->addr);
+	else if (sk->peer)
+		addr = unix_addr_get(sk->peer->addr);
+	else
+		ret = -ENOTCONN;
+	spin_unlock_irqrestore(&sk->lock, flags);
+
+	if (!ret)
+		ret = unix_addr_to_user(addr, uaddr, uaddrlen);
+
+	unix_addr_put(addr);
+	return ret;
+}
+
+int unix_shutdown(struct file *file, int how)
+{
+	struct unix_sock *sk = file->private_data;
+	struct unix_sock *peer = NULL;
+	unsigned int mode, peer_mode;
+	unsigned long flags;
+
+	if (how < SHUT_RD || how > SHUT_RDWR)
+		return -EINVAL;
+
+	/* SHUT_RD, SHUT_WR and SHUT_RDWR map onto 1, 2 and 3 */
+	mode = how + 1;
+
+	spin_lock_irqsave(&sk->lock, flags);
+	if (sk->state != UNIX_CONNECTED) {
+		spin_unlock_irqrestore(&sk->lock, flags);
+		return -ENOTCONN;
+	}
+	sk->shutdown |= mode;
+	if (sk->type == SOCK_STREAM && sk->peer) {
+		peer = sk->peer;
+		unix_sock_get(peer);
+	}
+	spin_unlock_irqrestore(&sk->lock, flags);
+
+	waitq_wakeup(&sk->wait);
+
+	if (peer) {
+		peer_mode = 0;
+		if (mode & UNIX_RCV_SHUTDOWN)
+			peer_mode |= UNIX_SEND_SHUTDOWN;
+		if (mode & UNIX_SEND_SHUTDOWN)
+			peer_mode |= UNIX_RCV_SHUTDOWN;
+
+		spin_lock_irqsave(&peer->lock, flags);
+		peer->shutdown |= peer_mode;
+		spin_unlock_irqrestore(&peer->lock, flags);
+
+		waitq_wakeup(&peer->wait);
+		unix_sock_put(peer);
+	}
+
+	return 0;
+}
+
+ssize_t unix_sendto(struct file *file, const void __user *buf, size_t len,
+		    int flags, const void __user *uaddr, int addrlen)
+{
+	struct iovec iov = { .iov_base = (void __user *)buf, .iov_len = len };
+	struct unix_address *addr = NULL;
+	struct unix_iov from;
+	ssize_t ret;
+
+	if (uaddr) {
+		ret = unix_addr_from_user(uaddr, addrlen, &addr);
+		if (ret)
+			return ret;
+	}
+
+	unix_iov_init(&from, &iov, 1, len);
+	ret = unix_send(file->private_data, &from, addr, flags,
+			file->f_flags & O_NONBLOCK);
+
+	unix_addr_put(addr);
+	return ret;
+}
+
+/* Reports the sender of a datagram, or an empty name for a stream */
+static int unix_src_to_user(struct unix_address *src, void __user *uaddr,
+			    int __user *uaddrlen)
+{
+	int zero = 0;
+
+	if (src)
+		return unix_addr_to_user(src, uaddr, uaddrlen);
+	if (copy_to_user(uaddrlen, &zero, sizeof(zero)))
+		return -EFAULT;
+	return 0;
+}
+
+ssize_t unix_recvfrom(struct file *file, void __user *buf, size_t len,
+		      int flags, void __user *uaddr, int __user *uaddrlen)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = len };
+	struct unix_address *src = NULL;
+	struct unix_iov to;
+	ssize_t ret;
+
+	unix_iov_init(&to, &iov, 1, len);
+	ret = unix_recv(file->private_data, &to, flags,
+			file->f_flags & O_NONBLOCK, &src, NULL);
+
+	if (ret >= 0 && uaddr && uaddrlen &&
+	    unix_src_to_user(src, uaddr, uaddrlen))
+		ret = -EFAULT;
+
+	unix_addr_put(src);
+	return ret;
+}
+
+/* Copies in msg's iovec, into fast if it is small enough */
+static int unix_import_iovec(struct user_msghdr *msg, struct iovec *fast,
+			     struct iovec **iovp, struct unix_iov *it)
+{
+	ssize_t total;
+
+	if (msg->msg_iovlen > KFS_IOV_MAX)
+		return -EMSGSIZE;
+
+	total = kfs_import_iovec(msg->msg_iov, msg->msg_iovlen, fast, iovp);
+	if (total < 0)
+		return total;
+
+	unix_iov_init(it, *iovp, msg->msg_iovlen, total);
+	return 0;
+}
+
+/* Ancillary data (SCM_RIGHTS and friends) isn't supported */
+ssize_t unix_sendmsg(struct file *file, const struct user_msghdr __user *umsg,
+		     int flags)
+{
+	struct iovec fast[KFS_IOV_FAST], *iov = NULL;
+	struct unix_address *addr = NULL;
+	struct user_msghdr msg;
+	struct unix_iov from;
+	ssize_t ret;
+
+	if (copy_from_user(&msg, umsg, sizeof(msg)))
+		return -EFAULT;
+	if (msg.msg_controllen)
+		return -EOPNOTSUPP;
+
+	if (msg.msg_name && msg.msg_namelen) {
+		ret = unix_addr_from_user(msg.msg_name, msg.msg_namelen, &addr);
+		if (ret)
+			return ret;
+	}
+
+	ret = unix_import_iovec(&msg, fast, &iov, &from);
+	if (!ret)
+		ret = unix_send(file->private_data, &from, addr, flags,
+				file->f_flags & O_NONBLOCK);
+
+	if (iov && iov != fast)
+		kmem_free(iov);
+	unix_addr_put(addr);
+	return ret;
+}
+
+ssize_t unix_recvmsg(struct file *file, struct user_msghdr __user *umsg,
+		     int flags)
+{
+	struct iovec fast[KFS_IOV_FAST], *iov = NULL;
+	struct unix_address *src = NULL;
+	struct user_msghdr msg;
+	struct unix_iov to;
+	bool trunc = false;
+	ssize_t ret;
+
+	if (copy_from_user(&msg, umsg, sizeof(msg)))
+		return -EFAULT;
+
+	ret = unix_import_iovec(&msg, fast, &iov, &to);
+	if (ret)
+		return ret;
+
+	ret = unix_recv(file->private_data, &to, flags,
+			file->f_flags & O_NONBLOCK, &src, &trunc);
+
+	if (ret >= 0) {
+		unsigned int mflags = trunc ? MSG_TRUNC : 0;
+		size_t controllen = 0;
+
+		if ((msg.msg_name &&
+		     unix_src_to_user(src, msg.msg_name, &umsg->msg_namelen)) ||
+		    copy_to_user(&umsg->msg_controllen, &controllen,
+				 sizeof(controllen)) ||
+		    copy_to_user(&umsg->msg_flags, &mflags, sizeof(mflags)))
+			ret = -EFAULT;
+	}
+
+	if (iov != fast)
+		kmem_free(iov);
+	unix_addr_put(src);
+	return ret;
+}
+
+/* Buffers are fixed, so socket-level options are accepted and ignored */
+int unix_setsockopt(struct file *file, int level, int optname,
+		    const void __user *optval, int optlen)
+{
+	if (level != UNIX_SOL_SOCKET)
+		return -ENOPROTOOPT;
+	if (optlen < 0)
+		return -EINVAL;
+
+	return 0;
+}
+
+int unix_getsockopt(struct file *file, int level, int optname,
+		    void __user *optval, int __user *optlen)
+{
+	struct unix_sock *sk = file->private_data;
+	int val, len;
+
+	if (level != UNIX_SOL_SOCKET)
+		return -ENOPROTOOPT;
+
+	switch (optname) {
+	case UNIX_SO_TYPE:
+		val = sk->type;
+		break;
+	case UNIX_SO_ERROR:
+		val = 0;
+		break;
+	case UNIX_SO_SNDBUF:
+	case UNIX_SO_RCVBUF:
+		val = UNIX_RCVBUF;
+		break;
+	default:
+		return -ENOPROTOOPT;
+	}
+
+	if (copy_from_user(&len, optlen, sizeof(len)))
+		return -EFAULT;
+	if (len < 0)
+		return -EINVAL;
+
+	len = min(len, (int)sizeof(val));
+	if (copy_to_user(optval, &val, len) ||
+	    copy_to_user(optlen, &len, sizeof(len)))
+		return -EFAULT;
+
+	return 0;
+}
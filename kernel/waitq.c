@@ -135,6 +135,12 @@ waitq_wake_nr_locked( waitq_t * waitq, int nr )
 	list_for_each_entry(entry, &waitq->waitq, link) {
 		struct task_struct *task = (struct task_struct *) entry->private;
 
+		// poll and epoll callbacks aren't sleepers, they always run
+		if (entry->func != default_wake_function) {
+			entry->func(entry, 0, 0, NULL);
+			continue;
+		}
+
 		// Nothing to do if the task has already been woken up
 		if ((task->state == TASK_STOPPED) && ((task->ptrace >> 1) == TASK_RUNNING))
 			continue;
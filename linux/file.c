@@ -8,16 +8,14 @@
 struct file *alloc_file(struct vfsmount *mnt, struct dentry *dentry,
                 fmode_t mode, const struct file_operations *fop)
 {
-        struct file *file = kmem_alloc( sizeof(*file));
+        struct file *file = kfs_alloc_file();
 
 	dbg("file=%p\n",file);
 	if ( !file)
 		return NULL;
 
-	memset(file,0,sizeof(*file));
 	file->f_mode = mode;
 	file->f_op = fop;
-	atomic_set(&file->f_count,1);
 
         return file;
 }
@@ -37,10 +35,8 @@ void put_unused_fd( unsigned int fd )
 
 struct file *fget( unsigned int fd )
 {
-	struct file* file = fdTableFile( current->fdTable, fd );
-        int __attribute__((unused)) count;
-	count = atomic_add_return( 1, &file->f_count );
-        dbg( "fd=%d file=%p f_count=%d\n", fd, file, count );
+	struct file* file = fdTableGetFile( current->fdTable, fd );
+        dbg( "fd=%d file=%p\n", fd, file );
         return file;
 }
 
@@ -48,16 +44,7 @@ void fput( struct file * filep )
 {
         /* sync an release everything tied to the file */
         dbg( "file=%p\n", filep );
-        if ( atomic_dec_and_test( &filep->f_count ) ) {
-        	dbg( "f_count is 0\n" );
-#if 0
-	        if ( filep->f_op->release ) {
-        		dbg( "release\n" );
-                	filep->f_op->release( filep->inode, filep);
-		}
-#endif
-		//kmem_free( filep );
-	}
+	kfs_put_file( filep );
 }
 
 void fd_install(unsigned int fd, struct file *file)
@@ -26,8 +26,6 @@ extern void mkfifo( char*, mode_t );
 void
 linux_init(void)
 {
-	printk("Initializing Radix Tree\n");
-	radix_tree_init();
 	printk("initializing tasklets\n");
 extern void init_tasklets(void);
 	init_tasklets();
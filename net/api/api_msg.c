@@ -1288,6 +1288,16 @@ lwip_netconn_do_writemore(struct netconn *conn)
       }
     }
     LWIP_ASSERT("lwip_netconn_do_writemore: invalid length!", ((conn->write_offset + len) <= conn->current_msg->msg.w.len));
+#if LWIP_TCP_LOCAL
+    /* the other end is a local socket: deliver to it directly */
+    err = tcp_write_local(conn->pcb.tcp, dataptr, &len);
+    if ((err == ERR_MEM) && dontblock) {
+      len = 0;
+      err = ERR_WOULDBLOCK;
+      goto err_mem;
+    }
+    if (err == ERR_VAL)
+#endif /* LWIP_TCP_LOCAL */
     err = tcp_write(conn->pcb.tcp, dataptr, len, apiflags);
     /* if OK or memory error, check available space */
     if ((err == ERR_OK) || (err == ERR_MEM)) {
@@ -8,11 +8,11 @@
 #include <lwk/sched.h>
 #include <lwk/string.h>
 #include <lwk/kthread.h>
+#include <lwk/time.h>
 #include <lwip/sys.h>
 
 
 /** Semaphore and mailbox implementation for lwip */
-spinlock_t sem_lock;
 spinlock_t mbox_lock;
 
 spinlock_t sys_lock;
@@ -28,10 +28,17 @@ static const int sem_debug = 0;
 /** Rough estiamte of CPU speed in KHz */
 static const uint64_t cpu_hz = 2400000;
 
+/** Milliseconds since boot, for lwIP's timeouts */
+u32_t
+sys_now( void )
+{
+	return get_time() / NSEC_PER_MSEC;
+}
+
+
 void
 sys_init( void )
 {
-	spin_lock_init( &sem_lock );
 	spin_lock_init( &mbox_lock );
 	spin_lock_init( &sys_lock );
 }
@@ -61,15 +68,20 @@ sys_sem_free(
 }
 
 
+/** Semaphores are counted with cmpxchg rather than under a lock, so
+ * threads waiting for the tcpip thread on different CPUs don't all take
+ * one interrupt-disabling spinlock.
+ */
 void
 sys_sem_signal(
 	sys_sem_t *		sem
 )
 {
-	unsigned long irqstate;
-	spin_lock_irqsave( &sem_lock, irqstate );
-	(**sem)++;
-	spin_unlock_irqrestore( &sem_lock, irqstate );
+	int value;
+
+	do {
+		value = **sem;
+	} while( cmpxchg( *sem, value, value + 1 ) != value );
 
 	if( sem_debug >= 3 )
 	printk( "%s: sem %p value %d\n", __func__, *sem, **sem );
@@ -85,12 +97,13 @@ sys_arch_sem_trywait(
 	sys_sem_t *		sem
 )
 {
-	unsigned long irqstate;
-	spin_lock_irqsave( &sem_lock, irqstate );
-	const int value = **sem;
-	if( value )
-		(**sem)--;
-	spin_unlock_irqrestore( &sem_lock, irqstate );
+	int value;
+
+	do {
+		value = **sem;
+		if( !value )
+			return 0;
+	} while( cmpxchg( *sem, value, value - 1 ) != value );
 
 	return value;
 }
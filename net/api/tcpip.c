@@ -51,17 +51,194 @@
 #include "lwip/ppp_oe.h"
 #include "lwip/dhcp.h"
 
+#if LWIP_NETCORE
+#include <lwk/params.h>
+#include <lwk/smp.h>
+#include <lwk/kthread.h>
+#include <lwk/interrupt.h>
+#include <lwk/sched.h>
+#include <lwk/spsc.h>
+#endif /* LWIP_NETCORE */
+
 /* global variables */
 static tcpip_init_done_fn tcpip_init_done;
 static void *tcpip_init_done_arg;
 static sys_mbox_t mbox;
 
+#if LWIP_NETCORE
+/** CPU the tcpip thread is bound to and polls on, -1 for the mailbox */
+int net_core = -1;
+param(net_core, int);
+
+/** Messages taken from each ring, and units of work asked of each poller,
+    per pass of the polling loop */
+#define TCPIP_NETCORE_BUDGET 64
+
+/** Message ring of each CPU, filled by the threads running there */
+static struct spsc_ring *tcpip_ring[NR_CPUS];
+static int tcpip_ring_max;
+/** The polling tcpip_thread, the only consumer of the rings */
+static struct task_struct *tcpip_task;
+static struct tcpip_poller *tcpip_pollers;
+#endif /* LWIP_NETCORE */
+
 #if LWIP_TCPIP_CORE_LOCKING
 /** The global semaphore to lock the stack. */
 sys_mutex_t lock_tcpip_core;
 #endif /* LWIP_TCPIP_CORE_LOCKING */
 
 
+/**
+ * Handle one message taken from the mailbox or, for a polling
+ * tcpip_thread, from one of the per-CPU rings.
+ *
+ * @param msg the message to handle
+ */
+static void
+tcpip_thread_handle_msg(struct tcpip_msg *msg)
+{
+  switch (msg->type) {
+#if LWIP_NETCONN
+  case TCPIP_MSG_API:
+    LWIP_DEBUGF(TCPIP_DEBUG, ("tcpip_thread: API message %p\n", (void *)msg));
+    msg->msg.apimsg->function(&(msg->msg.apimsg->msg));
+    break;
+#endif /* LWIP_NETCONN */
+
+#if !LWIP_TCPIP_CORE_LOCKING_INPUT
+  case TCPIP_MSG_INPKT:
+    LWIP_DEBUGF(TCPIP_DEBUG, ("tcpip_thread: PACKET %p\n", (void *)msg));
+#if LWIP_ETHERNET
+    if (msg->msg.inp.netif->flags & (NETIF_FLAG_ETHARP | NETIF_FLAG_ETHERNET)) {
+      ethernet_input(msg->msg.inp.p, msg->msg.inp.netif);
+    } else
+#endif /* LWIP_ETHERNET */
+#if LWIP_IPV6
+    if ((*((unsigned char *)(msg->msg.inp.p->payload)) & 0xf0) == 0x60) {
+        ip6_input(msg->msg.inp.p, msg->msg.inp.netif);
+    } else
+#endif /* LWIP_IPV6 */
+    {
+      ip_input(msg->msg.inp.p, msg->msg.inp.netif);
+    }
+    memp_free(MEMP_TCPIP_MSG_INPKT, msg);
+    break;
+#endif /* LWIP_TCPIP_CORE_LOCKING_INPUT */
+
+#if LWIP_NETIF_API
+  case TCPIP_MSG_NETIFAPI:
+    LWIP_DEBUGF(TCPIP_DEBUG, ("tcpip_thread: Netif API message %p\n", (void *)msg));
+    msg->msg.netifapimsg->function(&(msg->msg.netifapimsg->msg));
+    break;
+#endif /* LWIP_NETIF_API */
+
+#if LWIP_TCPIP_TIMEOUT
+  case TCPIP_MSG_TIMEOUT:
+    LWIP_DEBUGF(TCPIP_DEBUG, ("tcpip_thread: TIMEOUT %p\n", (void *)msg));
+    sys_timeout(msg->msg.tmo.msecs, msg->msg.tmo.h, msg->msg.tmo.arg);
+    memp_free(MEMP_TCPIP_MSG_API, msg);
+    break;
+  case TCPIP_MSG_UNTIMEOUT:
+    LWIP_DEBUGF(TCPIP_DEBUG, ("tcpip_thread: UNTIMEOUT %p\n", (void *)msg));
+    sys_untimeout(msg->msg.tmo.h, msg->msg.tmo.arg);
+    memp_free(MEMP_TCPIP_MSG_API, msg);
+    break;
+#endif /* LWIP_TCPIP_TIMEOUT */
+
+  case TCPIP_MSG_CALLBACK:
+    LWIP_DEBUGF(TCPIP_DEBUG, ("tcpip_thread: CALLBACK %p\n", (void *)msg));
+    msg->msg.cb.function(msg->msg.cb.ctx);
+    memp_free(MEMP_TCPIP_MSG_API, msg);
+    break;
+
+  case TCPIP_MSG_CALLBACK_STATIC:
+    LWIP_DEBUGF(TCPIP_DEBUG, ("tcpip_thread: CALLBACK_STATIC %p\n", (void *)msg));
+    msg->msg.cb.function(msg->msg.cb.ctx);
+    break;
+
+  default:
+    LWIP_DEBUGF(TCPIP_DEBUG, ("tcpip_thread: invalid message: %d\n", msg->type));
+    LWIP_ASSERT("tcpip_thread: invalid message", 0);
+    break;
+  }
+}
+
+#if LWIP_NETCORE
+/**
+ * The main loop of a polling tcpip_thread, which has its CPU to itself.
+ * Each pass drains the per-CPU rings and the mailbox (still used from
+ * interrupt context) a budget at a time, lets every registered device do
+ * a budget of work and runs the expired timeouts. Only a pass that found
+ * nothing to do gives the CPU to anything else that wants it.
+ */
+static void
+tcpip_netcore_loop(void)
+{
+  struct tcpip_poller *poller;
+  struct tcpip_msg *msg;
+  unsigned int work, n;
+  int cpu;
+
+  tcpip_task = current;
+
+  while (1) {
+    work = 0;
+
+    for (cpu = 0; cpu < tcpip_ring_max; cpu++) {
+      if (tcpip_ring[cpu] == NULL) {
+        continue;
+      }
+      for (n = 0; n < TCPIP_NETCORE_BUDGET; n++) {
+        msg = (struct tcpip_msg *)spsc_ring_pop(tcpip_ring[cpu]);
+        if (msg == NULL) {
+          break;
+        }
+        tcpip_thread_handle_msg(msg);
+      }
+      work += n;
+    }
+
+    for (n = 0; n < TCPIP_NETCORE_BUDGET; n++) {
+      if (sys_arch_mbox_tryfetch(&mbox, (void **)&msg) == SYS_MBOX_EMPTY) {
+        break;
+      }
+      tcpip_thread_handle_msg(msg);
+    }
+    work += n;
+
+    for (poller = ACCESS_ONCE(tcpip_pollers); poller != NULL; poller = poller->next) {
+      work += poller->poll(poller->arg, TCPIP_NETCORE_BUDGET);
+    }
+
+    sys_timeouts_poll();
+    LWIP_TCPIP_THREAD_ALIVE();
+
+    if (!work) {
+      schedule();
+    }
+  }
+}
+
+/**
+ * Register a device for the polling tcpip_thread to service. Drivers call
+ * this instead of enabling their data interrupts when tcpip_polling().
+ * Pollers can't be removed.
+ *
+ * @param poller the device's poll function and its argument
+ */
+void
+tcpip_poller_add(struct tcpip_poller *poller)
+{
+  SYS_ARCH_DECL_PROTECT(lev);
+
+  SYS_ARCH_PROTECT(lev);
+  poller->next = tcpip_pollers;
+  smp_wmb();
+  tcpip_pollers = poller;
+  SYS_ARCH_UNPROTECT(lev);
+}
+#endif /* LWIP_NETCORE */
+
 /**
  * The main lwIP thread. This thread has exclusive access to lwIP core functions
  * (unless access to them is not locked). Other threads communicate with this
@@ -102,6 +279,12 @@ tcpip_thread(void *arg)
     tcpip_init_done(tcpip_init_done_arg);
   }
 
+#if LWIP_NETCORE
+  if (tcpip_polling()) {
+    tcpip_netcore_loop();
+  }
+#endif /* LWIP_NETCORE */
+
   LOCK_TCPIP_CORE();
   while (1) {                          /* MAIN Loop */
     UNLOCK_TCPIP_CORE();
@@ -109,72 +292,69 @@ tcpip_thread(void *arg)
     /* wait for a message, timeouts are processed while waiting */
     sys_timeouts_mbox_fetch(&mbox, (void **)&msg);
     LOCK_TCPIP_CORE();
-    switch (msg->type) {
-#if LWIP_NETCONN
-    case TCPIP_MSG_API:
-      LWIP_DEBUGF(TCPIP_DEBUG, ("tcpip_thread: API message %p\n", (void *)msg));
-      msg->msg.apimsg->function(&(msg->msg.apimsg->msg));
-      break;
-#endif /* LWIP_NETCONN */
+    tcpip_thread_handle_msg(msg);
+  }
+  return;
+}
 
-#if !LWIP_TCPIP_CORE_LOCKING_INPUT
-    case TCPIP_MSG_INPKT:
-      LWIP_DEBUGF(TCPIP_DEBUG, ("tcpip_thread: PACKET %p\n", (void *)msg));
-#if LWIP_ETHERNET
-      if (msg->msg.inp.netif->flags & (NETIF_FLAG_ETHARP | NETIF_FLAG_ETHERNET)) {
-        ethernet_input(msg->msg.inp.p, msg->msg.inp.netif);
-      } else
-#endif /* LWIP_ETHERNET */
-#if LWIP_IPV6
-      if ((*((unsigned char *)(msg->msg.inp.p->payload)) & 0xf0) == 0x60) {
-          ip6_input(msg->msg.inp.p, msg->msg.inp.netif);
-      } else
-#endif /* LWIP_IPV6 */
-      {
-        ip_input(msg->msg.inp.p, msg->msg.inp.netif);
+/**
+ * Post a message to tcpip_thread. When it polls, a caller in thread context
+ * that is bound to one CPU uses that CPU's ring, which nothing else fills
+ * while the caller has interrupts off. Everyone else uses the mailbox:
+ * interrupt handlers, threads that may migrate (their messages could
+ * otherwise be taken from two rings out of order) and tcpip_thread itself,
+ * which would wait forever on a ring only it drains. When the mailbox is
+ * full, tcpip_thread handles a blocking post in place.
+ *
+ * @param msg the message to post
+ * @param block 1 to wait for room, 0 to fail with ERR_MEM instead
+ * @return ERR_OK if the message was posted, another err_t if not
+ */
+static err_t
+tcpip_post(struct tcpip_msg *msg, u8_t block)
+{
+#if LWIP_NETCORE
+  if (tcpip_polling() && !in_interrupt()) {
+    unsigned long flags;
+    int queued = -1;
+
+    if (current == tcpip_task) {
+      if (sys_mbox_trypost(&mbox, msg) == ERR_OK) {
+        return ERR_OK;
       }
-      memp_free(MEMP_TCPIP_MSG_INPKT, msg);
-      break;
-#endif /* LWIP_TCPIP_CORE_LOCKING_INPUT */
-
-#if LWIP_NETIF_API
-    case TCPIP_MSG_NETIFAPI:
-      LWIP_DEBUGF(TCPIP_DEBUG, ("tcpip_thread: Netif API message %p\n", (void *)msg));
-      msg->msg.netifapimsg->function(&(msg->msg.netifapimsg->msg));
-      break;
-#endif /* LWIP_NETIF_API */
-
-#if LWIP_TCPIP_TIMEOUT
-    case TCPIP_MSG_TIMEOUT:
-      LWIP_DEBUGF(TCPIP_DEBUG, ("tcpip_thread: TIMEOUT %p\n", (void *)msg));
-      sys_timeout(msg->msg.tmo.msecs, msg->msg.tmo.h, msg->msg.tmo.arg);
-      memp_free(MEMP_TCPIP_MSG_API, msg);
-      break;
-    case TCPIP_MSG_UNTIMEOUT:
-      LWIP_DEBUGF(TCPIP_DEBUG, ("tcpip_thread: UNTIMEOUT %p\n", (void *)msg));
-      sys_untimeout(msg->msg.tmo.h, msg->msg.tmo.arg);
-      memp_free(MEMP_TCPIP_MSG_API, msg);
-      break;
-#endif /* LWIP_TCPIP_TIMEOUT */
-
-    case TCPIP_MSG_CALLBACK:
-      LWIP_DEBUGF(TCPIP_DEBUG, ("tcpip_thread: CALLBACK %p\n", (void *)msg));
-      msg->msg.cb.function(msg->msg.cb.ctx);
-      memp_free(MEMP_TCPIP_MSG_API, msg);
-      break;
+      if (!block) {
+        return ERR_MEM;
+      }
+      tcpip_thread_handle_msg(msg);
+      return ERR_OK;
+    }
 
-    case TCPIP_MSG_CALLBACK_STATIC:
-      LWIP_DEBUGF(TCPIP_DEBUG, ("tcpip_thread: CALLBACK_STATIC %p\n", (void *)msg));
-      msg->msg.cb.function(msg->msg.cb.ctx);
-      break;
+    while (cpus_weight(current->cpu_mask) == 1) {
+      local_irq_save(flags);
+      if (tcpip_ring[this_cpu] != NULL) {
+        queued = spsc_ring_push(tcpip_ring[this_cpu], msg);
+      }
+      local_irq_restore(flags);
 
-    default:
-      LWIP_DEBUGF(TCPIP_DEBUG, ("tcpip_thread: invalid message: %d\n", msg->type));
-      LWIP_ASSERT("tcpip_thread: invalid message", 0);
-      break;
+      if (queued < 0) {
+        break;                         /* no ring, use the mailbox */
+      }
+      if (queued) {
+        return ERR_OK;
+      }
+      if (!block) {
+        return ERR_MEM;
+      }
+      schedule();
     }
   }
-  return;
+#endif /* LWIP_NETCORE */
+
+  if (block) {
+    sys_mbox_post(&mbox, msg);
+    return ERR_OK;
+  }
+  return sys_mbox_trypost(&mbox, msg);
 }
 
 /**
@@ -249,13 +429,9 @@ tcpip_callback_with_block(tcpip_callback_fn function, void *ctx, u8_t block)
     msg->type = TCPIP_MSG_CALLBACK;
     msg->msg.cb.function = function;
     msg->msg.cb.ctx = ctx;
-    if (block) {
-      sys_mbox_post(&mbox, msg);
-    } else {
-      if (sys_mbox_trypost(&mbox, msg) != ERR_OK) {
-        memp_free(MEMP_TCPIP_MSG_API, msg);
-        return ERR_MEM;
-      }
+    if (tcpip_post(msg, block) != ERR_OK) {
+      memp_free(MEMP_TCPIP_MSG_API, msg);
+      return ERR_MEM;
     }
     return ERR_OK;
   }
@@ -286,7 +462,7 @@ tcpip_timeout(u32_t msecs, sys_timeout_handler h, void *arg)
     msg->msg.tmo.msecs = msecs;
     msg->msg.tmo.h = h;
     msg->msg.tmo.arg = arg;
-    sys_mbox_post(&mbox, msg);
+    tcpip_post(msg, 1);
     return ERR_OK;
   }
   return ERR_VAL;
@@ -314,7 +490,7 @@ tcpip_untimeout(sys_timeout_handler h, void *arg)
     msg->type = TCPIP_MSG_UNTIMEOUT;
     msg->msg.tmo.h = h;
     msg->msg.tmo.arg = arg;
-    sys_mbox_post(&mbox, msg);
+    tcpip_post(msg, 1);
     return ERR_OK;
   }
   return ERR_VAL;
@@ -342,7 +518,7 @@ tcpip_apimsg(struct api_msg *apimsg)
   if (sys_mbox_valid(&mbox)) {
     msg.type = TCPIP_MSG_API;
     msg.msg.apimsg = apimsg;
-    sys_mbox_post(&mbox, &msg);
+    tcpip_post(&msg, 1);
     sys_arch_sem_wait(&apimsg->msg.conn->op_completed, 0);
     return apimsg->msg.err;
   }
@@ -374,7 +550,7 @@ tcpip_netifapi(struct netifapi_msg* netifapimsg)
     
     msg.type = TCPIP_MSG_NETIFAPI;
     msg.msg.netifapimsg = netifapimsg;
-    sys_mbox_post(&mbox, &msg);
+    tcpip_post(&msg, 1);
     sys_sem_wait(&netifapimsg->msg.sem);
     sys_sem_free(&netifapimsg->msg.sem);
     return netifapimsg->msg.err;
@@ -471,6 +647,39 @@ tcpip_init(tcpip_init_done_fn initfunc, void *arg)
   }
 #endif /* LWIP_TCPIP_CORE_LOCKING */
 
+#if LWIP_NETCORE
+  if (tcpip_polling()) {
+    struct task_struct *thread;
+    int cpu;
+
+    /* Drivers have already chosen to be polled, so a bad CPU can't just
+       turn polling off */
+    if (net_core >= NR_CPUS || !cpu_online(net_core)) {
+      printk(KERN_WARNING "tcpip: net_core=%d is not online, polling on CPU 0\n",
+             net_core);
+      net_core = 0;
+    }
+
+    for_each_cpu_mask(cpu, cpu_online_map) {
+      tcpip_ring[cpu] = spsc_ring_alloc(TCPIP_NETCORE_RING_SIZE);
+      if (tcpip_ring[cpu] == NULL) {
+        LWIP_ASSERT("failed to create tcpip_thread rings", 0);
+      }
+      tcpip_ring_max = cpu + 1;
+    }
+
+    thread = kthread_create_on_cpu(net_core, (int (*)(void *))tcpip_thread, NULL,
+                                   "ip:%s", TCPIP_THREAD_NAME);
+    if (thread == NULL) {
+      LWIP_ASSERT("failed to create tcpip_thread", 0);
+      return;
+    }
+    sched_wakeup_task(thread, TASK_STOPPED);
+    printk(KERN_INFO "tcpip: polling on CPU %d\n", net_core);
+    return;
+  }
+#endif /* LWIP_NETCORE */
+
   sys_thread_new(TCPIP_THREAD_NAME, tcpip_thread, NULL, TCPIP_THREAD_STACKSIZE, TCPIP_THREAD_PRIO);
 }
 
@@ -326,6 +326,38 @@ inet_chksum_pseudo(struct pbuf *p, u8_t proto, u16_t proto_len,
 
   return inet_cksum_pseudo_base(p, proto, proto_len, acc);
 }
+
+/**
+ * Calculates just the IPv4 pseudo header part of a TCP or UDP checksum.
+ * Checksum offloading hardware expects it in the checksum field and adds
+ * the sum over the header and data to it.
+ *
+ * @param proto ip protocol
+ * @param proto_len length of the ip data part
+ * @param src source ip address, network byte order
+ * @param dest destination ip address, network byte order
+ * @return folded, non-inverted sum (network order) for the protocol header
+ */
+u16_t
+inet_chksum_pseudo_hdr(u8_t proto, u16_t proto_len,
+       ip_addr_t *src, ip_addr_t *dest)
+{
+  u32_t acc;
+  u32_t addr;
+
+  addr = ip4_addr_get_u32(src);
+  acc = (addr & 0xffffUL);
+  acc += ((addr >> 16) & 0xffffUL);
+  addr = ip4_addr_get_u32(dest);
+  acc += (addr & 0xffffUL);
+  acc += ((addr >> 16) & 0xffffUL);
+  acc += (u32_t)htons((u16_t)proto);
+  acc += (u32_t)htons(proto_len);
+
+  acc = FOLD_U32T(acc);
+  acc = FOLD_U32T(acc);
+  return (u16_t)acc;
+}
 #if LWIP_IPV6
 /**
  * Calculates the checksum with IPv6 pseudo header used by TCP and UDP for a pbuf chain.
@@ -0,0 +1,347 @@
+/** \file
+ * Per-CPU memory pools behind lwIP's mem_malloc() and mem_free().
+ *
+ * With MEM_LIBC_MALLOC and MEMP_MEM_MALLOC every pbuf, segment and PCB is
+ * a mem_malloc(), which would otherwise be a kmem_alloc() under the one
+ * kmem lock. Requests are rounded up to a few fixed size classes instead
+ * and each CPU keeps its own free list per class, touched only with
+ * interrupts off since the NIC drivers free pbufs from their interrupt
+ * handlers. A CPU that runs dry takes a batch of blocks from the class's
+ * shared depot, one that collects too many (frees land on whichever CPU
+ * runs them) gives a batch back. The depot grows a slab at a time from
+ * kmem and never shrinks, so the pools settle at the traffic's high-water
+ * mark.
+ *
+ * Blocks are carved out of kmem, so __pa() works on them and the drivers
+ * can keep DMAing into PBUF_RAM pbufs. Requests larger than the largest
+ * class go straight to kmem_alloc(). Unlike kmem_alloc(), the memory is
+ * not zeroed; lwIP doesn't expect it to be.
+ */
+#include <lwk/kernel.h>
+#include <lwk/kmem.h>
+#include <lwk/spinlock.h>
+#include <lwk/percpu.h>
+#include <lwk/cpumask.h>
+#include <lwk/kfs.h>
+#include <lwk/proc_fs.h>
+#include <lwip/opt.h>
+#include <lwip/mem.h>
+
+#define MEM_POOL_CLASSES	7
+#define MEM_POOL_KMEM		MEM_POOL_CLASSES	/* oversize blocks */
+#define MEM_POOL_SLAB_SIZE	(64 * 1024)
+#define MEM_POOL_BATCH		32	/* blocks moved to or from the depot */
+#define MEM_POOL_HIGH		(2 * MEM_POOL_BATCH)
+#define MEM_POOL_MAGIC		0x6d656d70
+
+/* The largest class holds a 2 KB receive buffer and its struct pbuf */
+static const size_t mem_pool_sizes[MEM_POOL_CLASSES] = {
+	64, 128, 256, 512, 1024, 2048, 2560
+};
+
+/* Sits in front of every block; keeps the payload 16-byte aligned */
+struct mem_pool_hdr {
+	u32			magic;
+	u32			class;
+	struct mem_pool_hdr *	next;	/* free list link */
+};
+
+struct mem_pool_cache {
+	struct mem_pool_hdr *	free;
+	unsigned int		count;
+	u64			allocs;
+	u64			frees;
+};
+
+struct mem_pool_cpu {
+	/* The extra entry only counts the oversize kmem blocks */
+	struct mem_pool_cache	cache[MEM_POOL_CLASSES + 1];
+	u64			failed;
+};
+
+struct mem_pool_depot {
+	spinlock_t		lock;
+	struct mem_pool_hdr *	free;
+	unsigned long		count;
+	unsigned long		slabs;
+};
+
+static DEFINE_PER_CPU(struct mem_pool_cpu, mem_pool_cpu);
+
+/* Statically initialized, the NIC drivers allocate before lwip_init() */
+static struct mem_pool_depot mem_pool_depot[MEM_POOL_CLASSES] = {
+	[0 ... MEM_POOL_CLASSES - 1] = { .lock = SPIN_LOCK_UNLOCKED },
+};
+
+
+static inline unsigned int
+mem_pool_blocks_per_slab(unsigned int class)
+{
+	return MEM_POOL_SLAB_SIZE /
+		(sizeof(struct mem_pool_hdr) + mem_pool_sizes[class]);
+}
+
+static unsigned int
+mem_pool_class(size_t size)
+{
+	unsigned int class;
+
+	for (class = 0; class < MEM_POOL_CLASSES; class++) {
+		if (size <= mem_pool_sizes[class])
+			break;
+	}
+
+	return class;
+}
+
+/**
+ * Carves a new kmem slab into blocks and adds them to the depot.
+ * Called with interrupts off and the depot lock not held.
+ */
+static int
+mem_pool_grow(unsigned int class)
+{
+	struct mem_pool_depot * depot = &mem_pool_depot[class];
+	size_t bsize = sizeof(struct mem_pool_hdr) + mem_pool_sizes[class];
+	unsigned int n = mem_pool_blocks_per_slab(class);
+	struct mem_pool_hdr * head = NULL, * blk;
+	char * slab;
+	unsigned int i;
+
+	slab = kmem_alloc(MEM_POOL_SLAB_SIZE);
+	if (!slab)
+		return -ENOMEM;
+
+	for (i = 0; i < n; i++) {
+		blk = (struct mem_pool_hdr *)(slab + i * bsize);
+		blk->magic = MEM_POOL_MAGIC;
+		blk->class = class;
+		blk->next  = head;
+		head = blk;
+	}
+
+	/* The first block carved is the tail of the list */
+	blk = (struct mem_pool_hdr *)slab;
+
+	spin_lock(&depot->lock);
+	blk->next     = depot->free;
+	depot->free   = head;
+	depot->count += n;
+	depot->slabs++;
+	spin_unlock(&depot->lock);
+
+	return 0;
+}
+
+/**
+ * Moves a batch of blocks from the depot to this CPU's empty cache,
+ * growing the depot first if it has none. Interrupts are off.
+ */
+static int
+mem_pool_refill(unsigned int class, struct mem_pool_cache * cache)
+{
+	struct mem_pool_depot * depot = &mem_pool_depot[class];
+	struct mem_pool_hdr * head, * tail;
+	unsigned int n;
+
+	spin_lock(&depot->lock);
+	while (!depot->count) {
+		spin_unlock(&depot->lock);
+		if (mem_pool_grow(class))
+			return -ENOMEM;
+		spin_lock(&depot->lock);
+	}
+
+	head = tail = depot->free;
+	for (n = 1; n < MEM_POOL_BATCH && tail->next; n++)
+		tail = tail->next;
+
+	depot->free   = tail->next;
+	depot->count -= n;
+	spin_unlock(&depot->lock);
+
+	tail->next   = NULL;
+	cache->free  = head;
+	cache->count = n;
+
+	return 0;
+}
+
+/**
+ * Gives a batch of blocks from this CPU's cache back to the depot.
+ * Interrupts are off.
+ */
+static void
+mem_pool_spill(unsigned int class, struct mem_pool_cache * cache)
+{
+	struct mem_pool_depot * depot = &mem_pool_depot[class];
+	struct mem_pool_hdr * head, * tail;
+	unsigned int n;
+
+	head = tail = cache->free;
+	for (n = 1; n < MEM_POOL_BATCH; n++)
+		tail = tail->next;
+
+	cache->free   = tail->next;
+	cache->count -= n;
+
+	spin_lock(&depot->lock);
+	tail->next    = depot->free;
+	depot->free   = head;
+	depot->count += n;
+	spin_unlock(&depot->lock);
+}
+
+void *
+lwk_mem_malloc(size_t size)
+{
+	unsigned int class = mem_pool_class(size);
+	struct mem_pool_cpu * pcpu;
+	struct mem_pool_cache * cache;
+	struct mem_pool_hdr * blk;
+	unsigned long flags;
+
+	if (class == MEM_POOL_KMEM) {
+		if (size > (size_t)LONG_MAX - sizeof(*blk))
+			return NULL;
+
+		blk = kmem_alloc(sizeof(*blk) + size);
+
+		local_irq_save(flags);
+		pcpu = &__get_cpu_var(mem_pool_cpu);
+		if (blk)
+			pcpu->cache[MEM_POOL_KMEM].allocs++;
+		else
+			pcpu->failed++;
+		local_irq_restore(flags);
+
+		if (!blk)
+			return NULL;
+
+		blk->magic = MEM_POOL_MAGIC;
+		blk->class = MEM_POOL_KMEM;
+		return blk + 1;
+	}
+
+	local_irq_save(flags);
+	pcpu  = &__get_cpu_var(mem_pool_cpu);
+	cache = &pcpu->cache[class];
+
+	if (!cache->free && mem_pool_refill(class, cache)) {
+		pcpu->failed++;
+		local_irq_restore(flags);
+		return NULL;
+	}
+
+	blk = cache->free;
+	cache->free = blk->next;
+	cache->count--;
+	cache->allocs++;
+	local_irq_restore(flags);
+
+	return blk + 1;
+}
+
+void *
+lwk_mem_calloc(size_t count, size_t size)
+{
+	void * mem;
+
+	if (size && count > (size_t)LONG_MAX / size)
+		return NULL;
+
+	mem = lwk_mem_malloc(count * size);
+	if (mem)
+		memset(mem, 0, count * size);
+
+	return mem;
+}
+
+void
+lwk_mem_free(void * mem)
+{
+	struct mem_pool_hdr * blk;
+	struct mem_pool_cpu * pcpu;
+	struct mem_pool_cache * cache;
+	unsigned long flags;
+
+	if (!mem)
+		return;
+
+	blk = (struct mem_pool_hdr *)mem - 1;
+	if (blk->magic != MEM_POOL_MAGIC || blk->class > MEM_POOL_KMEM) {
+		printk(KERN_ERR "%s: %p was not allocated by mem_malloc\n",
+		       __func__, mem);
+		return;
+	}
+
+	local_irq_save(flags);
+	pcpu  = &__get_cpu_var(mem_pool_cpu);
+	cache = &pcpu->cache[blk->class];
+	cache->frees++;
+
+	if (blk->class == MEM_POOL_KMEM) {
+		local_irq_restore(flags);
+		blk->magic = 0;
+		kmem_free(blk);
+		return;
+	}
+
+	blk->next   = cache->free;
+	cache->free = blk;
+	if (++cache->count > MEM_POOL_HIGH)
+		mem_pool_spill(blk->class, cache);
+	local_irq_restore(flags);
+}
+
+/**
+ * Appends the per-class usage to a /proc file. The per-CPU counters are
+ * read without stopping the other CPUs, so the numbers are a snapshot.
+ */
+void
+lwk_mem_proc_stats(struct file * file)
+{
+	struct mem_pool_cpu * pcpu;
+	u64 allocs, frees, failed = 0;
+	unsigned int class;
+	int cpu;
+
+	proc_sprintf(file, "\n%-8s %6s %6s %8s %8s %14s %14s\n",
+		     "MEM", "size", "slabs", "blocks", "in_use",
+		     "allocs", "frees");
+
+	for (class = 0; class <= MEM_POOL_KMEM; class++) {
+		unsigned long slabs = 0, blocks = 0;
+
+		allocs = frees = 0;
+		for_each_online_cpu(cpu) {
+			pcpu = &per_cpu(mem_pool_cpu, cpu);
+			allocs += pcpu->cache[class].allocs;
+			frees  += pcpu->cache[class].frees;
+		}
+
+		if (class == MEM_POOL_KMEM) {
+			proc_sprintf(file, "%-8s %6s %6s %8s %8lld %14llu %14llu\n",
+				     "kmem", "-", "-", "-",
+				     (long long)(allocs - frees),
+				     (unsigned long long)allocs,
+				     (unsigned long long)frees);
+			break;
+		}
+
+		slabs  = ACCESS_ONCE(mem_pool_depot[class].slabs);
+		blocks = slabs * mem_pool_blocks_per_slab(class);
+
+		proc_sprintf(file, "%-8s %6lu %6lu %8lu %8lld %14llu %14llu\n",
+			     "pool", (unsigned long)mem_pool_sizes[class],
+			     slabs, blocks,
+			     (long long)(allocs - frees),
+			     (unsigned long long)allocs,
+			     (unsigned long long)frees);
+	}
+
+	for_each_online_cpu(cpu)
+		failed += per_cpu(mem_pool_cpu, cpu).failed;
+
+	proc_sprintf(file, "%-8s %llu\n", "failed", (unsigned long long)failed);
+}
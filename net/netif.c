@@ -168,6 +168,7 @@ netif_add(struct netif *netif, ip_addr_t *ipaddr, ip_addr_t *netmask,
   netif->output_ip6 = netif_null_output_ip6;
 #endif /* LWIP_IPV6 */
   netif->flags = 0;
+  NETIF_SET_CHECKSUM_CTRL(netif, NETIF_CHECKSUM_ENABLE_ALL);
 #if LWIP_DHCP
   /* netif not under DHCP control by default */
   netif->dhcp = NULL;
@@ -711,6 +712,9 @@ netif_loop_output(struct netif *netif, struct pbuf *p,
     snmp_inc_ifoutdiscards(stats_if);
     return err;
   }
+  /* Nothing on the way can corrupt it, and if netif offloads checksums
+     they were never filled in */
+  r->flags |= PBUF_FLAG_IP_CHKSUM_OK | PBUF_FLAG_L4_CHKSUM_OK;
 
   /* Put the packet on a linked list which gets emptied through calling
      netif_poll(). */
@@ -45,6 +45,8 @@
 #include "lwip/mem.h"
 
 #include <lwk/string.h>
+#include <lwk/kfs.h>
+#include <lwk/proc_fs.h>
 
 struct stats_ lwip_stats;
 
@@ -177,5 +179,85 @@ stats_display(void)
 }
 #endif /* LWIP_STATS_DISPLAY */
 
+/* /proc/net/lwip_stats: the same counters, one row per protocol */
+static void
+stats_proc_proto(struct file *file, const char *name, struct stats_proto *proto)
+{
+  proc_sprintf(file, "%-8s %10"STAT_COUNTER_F" %10"STAT_COUNTER_F" %8"STAT_COUNTER_F
+               " %8"STAT_COUNTER_F" %8"STAT_COUNTER_F" %8"STAT_COUNTER_F
+               " %8"STAT_COUNTER_F" %8"STAT_COUNTER_F" %8"STAT_COUNTER_F
+               " %8"STAT_COUNTER_F" %8"STAT_COUNTER_F" %8"STAT_COUNTER_F"\n",
+               name, proto->xmit, proto->recv, proto->fw, proto->drop,
+               proto->chkerr, proto->lenerr, proto->memerr, proto->rterr,
+               proto->proterr, proto->opterr, proto->err, proto->cachehit);
+}
+
+static int
+stats_proc_show(struct file *file, void *priv)
+{
+  proc_sprintf(file, "%-8s %10s %10s %8s %8s %8s %8s %8s %8s %8s %8s %8s %8s\n",
+               "", "xmit", "recv", "fw", "drop", "chkerr", "lenerr",
+               "memerr", "rterr", "proterr", "opterr", "err", "cachehit");
+#if LINK_STATS
+  stats_proc_proto(file, "LINK", &lwip_stats.link);
+#endif
+#if ETHARP_STATS
+  stats_proc_proto(file, "ETHARP", &lwip_stats.etharp);
+#endif
+#if IPFRAG_STATS
+  stats_proc_proto(file, "IP_FRAG", &lwip_stats.ip_frag);
+#endif
+#if IP_STATS
+  stats_proc_proto(file, "IP", &lwip_stats.ip);
+#endif
+#if ICMP_STATS
+  stats_proc_proto(file, "ICMP", &lwip_stats.icmp);
+#endif
+#if UDP_STATS
+  stats_proc_proto(file, "UDP", &lwip_stats.udp);
+#endif
+#if TCP_STATS
+  stats_proc_proto(file, "TCP", &lwip_stats.tcp);
+#endif
+#if IP6_STATS
+  stats_proc_proto(file, "IP6", &lwip_stats.ip6);
+#endif
+#if ICMP6_STATS
+  stats_proc_proto(file, "ICMP6", &lwip_stats.icmp6);
+#endif
+#if IP6_FRAG_STATS
+  stats_proc_proto(file, "IP6_FRAG", &lwip_stats.ip6_frag);
+#endif
+#if ND6_STATS
+  stats_proc_proto(file, "ND6", &lwip_stats.nd6);
+#endif
+
+#if SYS_STATS
+  proc_sprintf(file, "\n%-8s %10s %10s %8s\n", "SYS", "used", "max", "err");
+  proc_sprintf(file, "%-8s %10"STAT_COUNTER_F" %10"STAT_COUNTER_F" %8"STAT_COUNTER_F"\n",
+               "sem", lwip_stats.sys.sem.used, lwip_stats.sys.sem.max,
+               lwip_stats.sys.sem.err);
+  proc_sprintf(file, "%-8s %10"STAT_COUNTER_F" %10"STAT_COUNTER_F" %8"STAT_COUNTER_F"\n",
+               "mutex", lwip_stats.sys.mutex.used, lwip_stats.sys.mutex.max,
+               lwip_stats.sys.mutex.err);
+  proc_sprintf(file, "%-8s %10"STAT_COUNTER_F" %10"STAT_COUNTER_F" %8"STAT_COUNTER_F"\n",
+               "mbox", lwip_stats.sys.mbox.used, lwip_stats.sys.mbox.max,
+               lwip_stats.sys.mbox.err);
+#endif /* SYS_STATS */
+
+#ifdef CONFIG_LWIP_MEM_POOL
+  lwk_mem_proc_stats(file);
+#endif
+  return 0;
+}
+
+void
+stats_proc_init(void)
+{
+  if (create_proc_file("/proc/net/lwip_stats", stats_proc_show, NULL)) {
+    LWIP_PLATFORM_DIAG(("stats_proc_init: could not create /proc/net/lwip_stats\n"));
+  }
+}
+
 #endif /* LWIP_STATS */
 
@@ -47,6 +47,7 @@
 #include "lwip/def.h"
 #include "lwip/mem.h"
 #include "lwip/memp.h"
+#include "lwip/netif.h"
 #include "lwip/snmp.h"
 #include "lwip/tcp.h"
 #include "lwip/tcp_impl.h"
@@ -669,7 +670,52 @@ tcp_recved(struct tcp_pcb *pcb, u16_t len)
 
   LWIP_DEBUGF(TCP_DEBUG, ("tcp_recved: recveived %"U16_F" bytes, wnd %"U16_F" (%"U16_F").\n",
          len, pcb->rcv_wnd, TCP_WND - pcb->rcv_wnd));
+
+#if LWIP_TCP_LOCAL
+  tcp_local_wake(pcb);
+#endif /* LWIP_TCP_LOCAL */
+}
+
+#if LWIP_TCP_LOCAL
+/**
+ * Find the other end of a connection between two sockets on this host:
+ * the active pcb with the same addresses and ports the other way round.
+ *
+ * @param pcb the tcp_pcb to find the peer of
+ * @return the peer's tcp_pcb, or NULL if the remote end is not local
+ */
+struct tcp_pcb *
+tcp_local_peer(struct tcp_pcb *pcb)
+{
+  struct tcp_pcb *peer;
+  struct netif *netif;
+
+  if (PCB_ISIPV6(pcb)) {
+    return NULL;
+  }
+
+  /* Only walk the pcbs if the remote address is one of ours */
+  for (netif = netif_list; netif != NULL; netif = netif->next) {
+    if (ip_addr_cmp(&netif->ip_addr, ipX_2_ip(&pcb->remote_ip))) {
+      break;
+    }
+  }
+  if (netif == NULL) {
+    return NULL;
+  }
+
+  for (peer = tcp_active_pcbs; peer != NULL; peer = peer->next) {
+    if (peer != pcb && !PCB_ISIPV6(peer) &&
+        peer->local_port == pcb->remote_port &&
+        peer->remote_port == pcb->local_port &&
+        ip_addr_cmp(ipX_2_ip(&peer->local_ip), ipX_2_ip(&pcb->remote_ip)) &&
+        ip_addr_cmp(ipX_2_ip(&peer->remote_ip), ipX_2_ip(&pcb->local_ip))) {
+      return peer;
+    }
+  }
+  return NULL;
 }
+#endif /* LWIP_TCP_LOCAL */
 
 /**
  * Allocate a new local TCP port.
@@ -134,9 +134,12 @@ tcp_input(struct pbuf *p, struct netif *inp)
   }
 
 #if CHECKSUM_CHECK_TCP
-  /* Verify TCP checksum. */
-  chksum = ipX_chksum_pseudo(ip_current_is_v6(), p, IP_PROTO_TCP, p->tot_len,
-                             ipX_current_src_addr(), ipX_current_dest_addr());
+  /* Verify TCP checksum, unless the netif driver already has. */
+  chksum = 0;
+  if (!(p->flags & PBUF_FLAG_L4_CHKSUM_OK)) {
+    chksum = ipX_chksum_pseudo(ip_current_is_v6(), p, IP_PROTO_TCP, p->tot_len,
+                               ipX_current_src_addr(), ipX_current_dest_addr());
+  }
   if (chksum != 0) {
       LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_input: packet discarded due to failing checksum 0x%04"X16_F"\n",
         chksum));
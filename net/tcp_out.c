@@ -711,6 +711,131 @@ memerr:
   return ERR_MEM;
 }
 
+#if LWIP_TCP_LOCAL
+/** Set while tcp_write_local() is in the receiver's recv callback */
+static u8_t tcp_local_delivering;
+
+/**
+ * Write data to a connection whose other end is on this host by handing
+ * it straight to the receiving pcb: no segments, no checksums, no trip
+ * through IP and the loopback queue. Both pcbs account for the data as if
+ * it had been sent, received and acknowledged, so anything that later
+ * goes the normal way (a FIN, window updates, data once the fast path no
+ * longer applies) carries the right sequence numbers.
+ *
+ * Only taken while everything sent before has been acknowledged, so the
+ * data can't overtake segments still on their way. At most the receiver's
+ * window is delivered; when it opens again tcp_recved() on the receiver
+ * calls the sender's sent callback.
+ *
+ * @param pcb Protocol control block of the sending end
+ * @param arg Pointer to the data to be written
+ * @param len Data length in bytes, set to the bytes delivered
+ * @return ERR_OK if (some of) the data was delivered, ERR_MEM if the
+ *         receiver can't take any now, ERR_VAL if the connection doesn't
+ *         qualify and the data has to go through tcp_write()
+ */
+err_t
+tcp_write_local(struct tcp_pcb *pcb, const void *arg, u16_t *len)
+{
+  struct tcp_pcb *peer;
+  struct pbuf *p;
+  u16_t n;
+  err_t err;
+
+  if ((pcb->state != ESTABLISHED && pcb->state != CLOSE_WAIT) ||
+      (pcb->flags & TF_FIN) ||
+      pcb->unsent != NULL || pcb->unacked != NULL) {
+    return ERR_VAL;
+  }
+
+  peer = tcp_local_peer(pcb);
+  if (peer == NULL ||
+      (peer->state != ESTABLISHED && peer->state != FIN_WAIT_1 &&
+       peer->state != FIN_WAIT_2) ||
+      (peer->flags & TF_RXCLOSED) ||
+#if TCP_QUEUE_OOSEQ
+      peer->ooseq != NULL ||
+#endif /* TCP_QUEUE_OOSEQ */
+      peer->rcv_nxt != pcb->snd_nxt) {
+    return ERR_VAL;
+  }
+
+  /* The receiving socket is full, wait for it to be read */
+  if (peer->refused_data != NULL) {
+    return ERR_MEM;
+  }
+
+  n = LWIP_MIN(*len, peer->rcv_wnd);
+  if (n == 0) {
+    return ERR_MEM;
+  }
+  p = pbuf_alloc(PBUF_RAW, n, PBUF_RAM);
+  if (p == NULL) {
+    return ERR_MEM;
+  }
+  MEMCPY(p->payload, arg, n);
+
+  LWIP_DEBUGF(TCP_OUTPUT_DEBUG | LWIP_DBG_TRACE, ("tcp_write_local: %"U16_F" bytes, seqno %"U32_F"\n",
+    n, pcb->snd_nxt));
+
+  /* Receiver side, as tcp_receive() does for an in-sequence segment */
+  peer->rcv_nxt += n;
+  peer->rcv_wnd -= n;
+  tcp_update_rcv_ann_wnd(peer);
+  peer->tmr = tcp_ticks;
+  peer->keep_cnt_sent = 0;
+
+  /* Sender side: sent and acked, the window as the receiver announces it */
+  pcb->snd_lbb += n;
+  pcb->snd_nxt = pcb->snd_lbb;
+  pcb->lastack = pcb->snd_lbb;
+  pcb->snd_wl2 = pcb->lastack;
+  pcb->snd_wnd = peer->rcv_ann_wnd;
+  pcb->tmr = tcp_ticks;
+
+  /* The receiver reading (or discarding) the data calls tcp_recved(),
+     which must not call back into the write this is part of */
+  tcp_local_delivering = 1;
+  TCP_EVENT_RECV(peer, p, ERR_OK, err);
+  tcp_local_delivering = 0;
+  if (err != ERR_OK && err != ERR_ABRT) {
+    /* tcp_fasttmr() offers it again, as for a segment */
+    peer->refused_data = p;
+  }
+
+  *len = n;
+  return ERR_OK;
+}
+
+/**
+ * Called by tcp_recved() when the application has taken data off pcb:
+ * a local sender may be waiting for the window to open, which would
+ * otherwise only reach it with a window update through the loopback
+ * queue, if at all. Not from inside tcp_input() (a recv callback that
+ * discards the data), where the sender would be run and could deliver
+ * into the pcb being processed; its poll callback retries instead.
+ *
+ * @param pcb Protocol control block of the receiving end
+ */
+void
+tcp_local_wake(struct tcp_pcb *pcb)
+{
+  struct tcp_pcb *peer;
+  err_t err;
+
+  if (tcp_local_delivering || tcp_input_pcb != NULL || pcb->rcv_wnd == 0) {
+    return;
+  }
+
+  peer = tcp_local_peer(pcb);
+  if (peer != NULL && peer->unsent == NULL && peer->unacked == NULL) {
+    TCP_EVENT_SENT(peer, 0, err);
+    LWIP_UNUSED_ARG(err);
+  }
+}
+#endif /* LWIP_TCP_LOCAL */
+
 /**
  * Enqueue TCP options for transmission.
  *
@@ -1049,6 +1174,20 @@ tcp_output(struct tcp_pcb *pcb)
   return ERR_OK;
 }
 
+/**
+ * A netif that transmits without copying (e1000) keeps a reference on
+ * seg->p until the frame has left. Its headers must not be rewritten for
+ * a retransmission before then.
+ *
+ * @param seg the tcp_seg to check
+ * @return 1 if the segment is still queued on a netif, 0 otherwise
+ */
+static u8_t
+tcp_output_segment_busy(struct tcp_seg *seg)
+{
+  return (seg->p->ref != 1);
+}
+
 /**
  * Called by tcp_output() to actually send a TCP segment over IP.
  *
@@ -1060,6 +1199,13 @@ tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb)
 {
   u16_t len;
   u32_t *opts;
+  struct netif *netif;
+
+  /* Rexmit functions check this, but the headers are changed below */
+  if (tcp_output_segment_busy(seg)) {
+    LWIP_DEBUGF(TCP_RTO_DEBUG, ("tcp_output_segment: segment busy\n"));
+    return;
+  }
 
   /** @bug Exclude retransmitted segments from this count. */
   snmp_inc_tcpoutsegs();
@@ -1101,13 +1247,15 @@ tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb)
     pcb->rtime = 0;
   }
 
-  /* If we don't have a local IP address, we get one by
-     calling ip_route(). */
+  /* Route once: the netif decides whether we checksum in software, and
+     gives us a local IP address if we don't have one yet. */
+  netif = ipX_route(PCB_ISIPV6(pcb), &pcb->local_ip, &pcb->remote_ip);
+  if (netif == NULL) {
+    return;
+  }
   if (ipX_addr_isany(PCB_ISIPV6(pcb), &pcb->local_ip)) {
-    struct netif *netif;
-    ipX_addr_t *local_ip;
-    ipX_route_get_local_ipX(PCB_ISIPV6(pcb), &pcb->local_ip, &pcb->remote_ip, netif, local_ip);
-    if ((netif == NULL) || (local_ip == NULL)) {
+    ipX_addr_t *local_ip = ipX_netif_get_local_ipX(PCB_ISIPV6(pcb), netif, &pcb->remote_ip);
+    if (local_ip == NULL) {
       return;
     }
     ipX_addr_copy(PCB_ISIPV6(pcb), pcb->local_ip, *local_ip);
@@ -1132,7 +1280,7 @@ tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb)
 
   seg->tcphdr->chksum = 0;
 #if TCP_CHECKSUM_ON_COPY
-  {
+  if (PCB_ISIPV6(pcb) || NETIF_CHECKSUM_ENABLED(netif, NETIF_CHECKSUM_GEN_TCP)) {
     u32_t acc;
 #if TCP_CHECKSUM_ON_COPY_SANITY_CHECK
     u16_t chksum_slow = ipX_chksum_pseudo(PCB_ISIPV6(pcb), seg->p, IP_PROTO_TCP,
@@ -1164,19 +1312,18 @@ tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb)
   }
 #else /* TCP_CHECKSUM_ON_COPY */
 #if CHECKSUM_GEN_TCP
-  seg->tcphdr->chksum = ipX_chksum_pseudo(PCB_ISIPV6(pcb), seg->p, IP_PROTO_TCP,
-    seg->p->tot_len, &pcb->local_ip, &pcb->remote_ip);
+  if (PCB_ISIPV6(pcb) || NETIF_CHECKSUM_ENABLED(netif, NETIF_CHECKSUM_GEN_TCP)) {
+    seg->tcphdr->chksum = ipX_chksum_pseudo(PCB_ISIPV6(pcb), seg->p, IP_PROTO_TCP,
+      seg->p->tot_len, &pcb->local_ip, &pcb->remote_ip);
+  }
 #endif /* CHECKSUM_GEN_TCP */
 #endif /* TCP_CHECKSUM_ON_COPY */
   TCP_STATS_INC(tcp.xmit);
 
-#if LWIP_NETIF_HWADDRHINT
-  ipX_output_hinted(PCB_ISIPV6(pcb), seg->p, &pcb->local_ip, &pcb->remote_ip,
-    pcb->ttl, pcb->tos, IP_PROTO_TCP, &pcb->addr_hint);
-#else /* LWIP_NETIF_HWADDRHINT*/
-  ipX_output(PCB_ISIPV6(pcb), seg->p, &pcb->local_ip, &pcb->remote_ip, pcb->ttl,
-    pcb->tos, IP_PROTO_TCP);
-#endif /* LWIP_NETIF_HWADDRHINT*/
+  NETIF_SET_HWADDRHINT(netif, &pcb->addr_hint);
+  ipX_output_if(PCB_ISIPV6(pcb), seg->p, &pcb->local_ip, &pcb->remote_ip, pcb->ttl,
+    pcb->tos, IP_PROTO_TCP, netif);
+  NETIF_SET_HWADDRHINT(netif, NULL);
 }
 
 /**
@@ -1257,6 +1404,14 @@ tcp_rexmit_rto(struct tcp_pcb *pcb)
     return;
   }
 
+  /* Still queued from the last time, try again on the next timeout */
+  for (seg = pcb->unacked; seg != NULL; seg = seg->next) {
+    if (tcp_output_segment_busy(seg)) {
+      LWIP_DEBUGF(TCP_RTO_DEBUG, ("tcp_rexmit_rto: segment busy\n"));
+      return;
+    }
+  }
+
   /* Move all unacked segments to the head of the unsent queue */
   for (seg = pcb->unacked; seg->next != NULL; seg = seg->next);
   /* concatenate unsent queue after unacked queue */
@@ -1283,15 +1438,22 @@ tcp_rexmit_rto(struct tcp_pcb *pcb)
  * Called by tcp_receive() for fast retramsmit.
  *
  * @param pcb the tcp_pcb for which to retransmit the first unacked segment
+ * @return ERR_VAL if there is nothing to retransmit or the segment is still
+ *         queued on the netif, ERR_OK otherwise
  */
-void
+err_t
 tcp_rexmit(struct tcp_pcb *pcb)
 {
   struct tcp_seg *seg;
   struct tcp_seg **cur_seg;
 
   if (pcb->unacked == NULL) {
-    return;
+    return ERR_VAL;
+  }
+
+  if (tcp_output_segment_busy(pcb->unacked)) {
+    LWIP_DEBUGF(TCP_RTO_DEBUG, ("tcp_rexmit: segment busy\n"));
+    return ERR_VAL;
   }
 
   /* Move the first unacked segment to the unsent queue */
@@ -1322,6 +1484,7 @@ tcp_rexmit(struct tcp_pcb *pcb)
   snmp_inc_tcpretranssegs();
   /* No need to call tcp_output: we are always called from tcp_input()
      and thus tcp_output directly returns. */
+  return ERR_OK;
 }
 
 
@@ -1340,7 +1503,9 @@ tcp_rexmit_fast(struct tcp_pcb *pcb)
                  "), fast retransmit %"U32_F"\n",
                  (u16_t)pcb->dupacks, pcb->lastack,
                  ntohl(pcb->unacked->tcphdr->seqno)));
-    tcp_rexmit(pcb);
+    if (tcp_rexmit(pcb) != ERR_OK) {
+      return;
+    }
 
     /* Set ssthresh to half of the minimum of the current
      * cwnd and the advertised window */
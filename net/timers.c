@@ -64,9 +64,9 @@
 
 /** The one and only timeout list */
 static struct sys_timeo *next_timeout;
-#if NO_SYS
+#if NO_SYS || LWIP_NETCORE
 static u32_t timeouts_last_time;
-#endif /* NO_SYS */
+#endif /* NO_SYS || LWIP_NETCORE */
 
 #if LWIP_TCP
 /** global variable that shows if the tcp timer is currently scheduled or not */
@@ -301,8 +301,8 @@ void sys_timeouts_init(void)
 #endif /* LWIP_IPV6_MLD */
 #endif /* LWIP_IPV6 */
 
-#if NO_SYS
-  /* Initialise timestamp for sys_check_timeouts */
+#if NO_SYS || LWIP_NETCORE
+  /* Initialise timestamp for sys_check_timeouts/sys_timeouts_poll */
   timeouts_last_time = sys_now();
 #endif
 }
@@ -537,6 +537,52 @@ sys_timeouts_mbox_fetch(sys_mbox_t *mbox, void **msg)
 
 #endif /* NO_SYS */
 
+#if LWIP_NETCORE
+/**
+ * Handle timeouts for a tcpip_thread that polls instead of waiting in
+ * sys_timeouts_mbox_fetch(). The time since the last call is charged to
+ * the first timeout, as the fetch charges the time it waited, and every
+ * timeout that runs out is called.
+ *
+ * Must be called from tcpip_thread on every pass of its loop.
+ */
+void
+sys_timeouts_poll(void)
+{
+  struct sys_timeo *tmptimeout;
+  sys_timeout_handler handler;
+  void *arg;
+  u32_t now, diff;
+
+  now = sys_now();
+  diff = now - timeouts_last_time;
+  timeouts_last_time = now;
+
+  while (next_timeout) {
+    if (next_timeout->time > diff) {
+      next_timeout->time -= diff;
+      break;
+    }
+    diff -= next_timeout->time;
+
+    tmptimeout = next_timeout;
+    next_timeout = tmptimeout->next;
+    handler = tmptimeout->h;
+    arg = tmptimeout->arg;
+#if LWIP_DEBUG_TIMERNAMES
+    if (handler != NULL) {
+      LWIP_DEBUGF(TIMERS_DEBUG, ("stp calling h=%s arg=%p\n",
+        tmptimeout->handler_name, arg));
+    }
+#endif /* LWIP_DEBUG_TIMERNAMES */
+    memp_free(MEMP_SYS_TIMEOUT, tmptimeout);
+    if (handler != NULL) {
+      handler(arg);
+    }
+  }
+}
+#endif /* LWIP_NETCORE */
+
 #else /* LWIP_TIMERS */
 /* Satisfy the TCP code which calls this function */
 void
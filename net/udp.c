@@ -339,7 +339,7 @@ udp_input(struct pbuf *p, struct netif *inp)
     } else
 #endif /* LWIP_UDPLITE */
     {
-      if (udphdr->chksum != 0) {
+      if (udphdr->chksum != 0 && !(p->flags & PBUF_FLAG_L4_CHKSUM_OK)) {
         if (ipX_chksum_pseudo(ip_current_is_v6(), p, IP_PROTO_UDP, p->tot_len,
                               ipX_current_src_addr(),
                               ipX_current_dest_addr()) != 0) {
@@ -808,8 +808,12 @@ udp_sendto_if_chksum(struct udp_pcb *pcb, struct pbuf *p, ip_addr_t *dst_ip,
     udphdr->len = htons(q->tot_len);
     /* calculate checksum */
 #if CHECKSUM_GEN_UDP
-    /* Checksum is mandatory over IPv6. */
-    if (PCB_ISIPV6(pcb) || (pcb->flags & UDP_FLAGS_NOCHKSUM) == 0) {
+    /* Checksum is mandatory over IPv6. Left to the netif if it offloads
+       it, unless IP has to fragment the datagram. */
+    if (PCB_ISIPV6(pcb) ||
+        ((pcb->flags & UDP_FLAGS_NOCHKSUM) == 0 &&
+         (NETIF_CHECKSUM_ENABLED(netif, NETIF_CHECKSUM_GEN_UDP) ||
+          (netif->mtu && q->tot_len + IP_HLEN > netif->mtu)))) {
       u16_t udpchksum;
 #if LWIP_CHECKSUM_ON_COPY
       if (have_chksum) {
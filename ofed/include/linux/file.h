@@ -55,13 +55,7 @@
 static inline struct file *
 fget(unsigned int fd)
 {
-	struct file * file = NULL;
-
-	file = fdTableFile( current->fdTable, fd );
-	int __attribute__((unused)) count;
-	count = atomic_add_return( 1, &file->f_count );
-
-	return file;
+	return fdTableGetFile( current->fdTable, fd );
 }
 
 static inline void
@@ -72,12 +66,7 @@ fput(struct file *filp)
 		return;
 	}
 
-
-	if ( atomic_dec_and_test( &filp->f_count ) ) {
-	    //kmem_free(file);
-	    // kfree(filp);
-	}    
-
+	kfs_put_file(filp);
 }
 
 
@@ -220,17 +209,14 @@ _alloc_file(int mode, const struct file_operations *fops)
 {
 	struct file *filp;
 
-	filp = kmem_alloc(sizeof(struct file));	
+	filp = kfs_alloc_file();
 
 	if (filp == NULL) {
 		return (NULL);
 	}
 
-	memset(filp, 0, sizeof(struct file));
-
 	filp->f_op   = fops;
 	filp->f_mode = mode;
-	atomic_set(&filp->f_count, 1);
 
 	return filp;
 }
@@ -38,6 +38,8 @@ SYSCALL2(aspace_update_user_cpumask, id_t, user_cpumask_t *);
 SYSCALL2(aspace_get_rank, id_t, id_t *);
 SYSCALL2(aspace_set_rank, id_t, id_t);
 SYSCALL2(aspace_update_user_hio_syscall_mask, id_t, user_syscall_mask_t *);
+SYSCALL3(aspace_update_hio_cache_policy, id_t, unsigned long, unsigned long);
+SYSCALL2(aspace_update_hio_channel, id_t, int);
 
 /**
  * Task management.